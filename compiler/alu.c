@@ -2,6 +2,7 @@
 #include "emitters.h"
 #include "flags.h"
 #include "interop.h"
+#include "ir.h"
 #include "branches.h"
 
 // helper for reading GB memory during compilation
@@ -50,9 +51,13 @@ static int try_fuse_branch(
 }
 
 // DAA tracking: save old_A and set N flag before ALU ops that affect A
-// These are needed for DAA to compute the half-carry (H) and know add vs sub
+// These are needed for DAA to compute the half-carry (H) and know add vs sub.
+// Skipped when find_daa_state_use found no DAA that can see them
 static void compile_daa_track_add(struct code_block *block)
 {
+    if (block->daa_state) {
+        return;
+    }
     // Save old_A to context for H flag computation
     emit_move_b_dn_disp_an(block, REG_68K_D_A, JIT_CTX_DAA_STATE, REG_68K_A_CTX);
     // Set N=0 (addition)
@@ -62,6 +67,9 @@ static void compile_daa_track_add(struct code_block *block)
 
 static void compile_daa_track_sub(struct code_block *block)
 {
+    if (block->daa_state) {
+        return;
+    }
     // Save old_A to context for H flag computation
     emit_move_b_dn_disp_an(block, REG_68K_D_A, JIT_CTX_DAA_STATE, REG_68K_A_CTX);
     // Set N=1 (subtraction)
@@ -69,84 +77,154 @@ static void compile_daa_track_sub(struct code_block *block)
     emit_move_b_dn_disp_an(block, REG_68K_D_SCRATCH_0, JIT_CTX_DAA_STATE + 1, REG_68K_A_CTX);
 }
 
+// Load old_A into D0. Right after an op in block->daa_state it's worked out
+// from A and the operand, which are still what that op left, instead of
+// loading what compile_daa_track_add/sub saved. imm is that op's operand
+// if it had one
+static void compile_daa_old_a(struct code_block *block, uint8_t imm)
+{
+    if (!block->daa_state) {
+        emit_move_b_disp_an_dn(block, JIT_CTX_DAA_STATE, REG_68K_A_CTX, REG_68K_D_SCRATCH_0);
+        return;
+    }
+
+    emit_move_b_dn_dn(block, REG_68K_D_A, REG_68K_D_SCRATCH_0);
+    switch (block->daa_state) {
+    case 0x3c: // inc a
+        emit_subq_b_dn(block, REG_68K_D_SCRATCH_0, 1);
+        break;
+    case 0x3d: // dec a
+        emit_addq_b_dn(block, REG_68K_D_SCRATCH_0, 1);
+        break;
+    case 0x81: // add a, c
+        emit_sub_b_dn_dn(block, REG_68K_D_BC, REG_68K_D_SCRATCH_0);
+        break;
+    case 0x83: // add a, e
+        emit_sub_b_dn_dn(block, REG_68K_D_DE, REG_68K_D_SCRATCH_0);
+        break;
+    case 0x91: // sub a, c
+        emit_add_b_dn_dn(block, REG_68K_D_BC, REG_68K_D_SCRATCH_0);
+        break;
+    case 0x93: // sub a, e
+        emit_add_b_dn_dn(block, REG_68K_D_DE, REG_68K_D_SCRATCH_0);
+        break;
+    case 0xc6: // add a, #imm
+        emit_subi_b_dn(block, REG_68K_D_SCRATCH_0, imm);
+        break;
+    case 0xd6: // sub a, #imm
+        emit_addi_b_dn(block, REG_68K_D_SCRATCH_0, imm);
+        break;
+    }
+}
+
 // DAA - Decimal Adjust Accumulator
-// Adjusts A for BCD arithmetic based on N, H, C flags from prior ALU op
-static void compile_daa(struct code_block *block)
+// Adjusts A for BCD arithmetic based on N, H, C flags from prior ALU op.
+// When block->daa_state says which op that was, N is known here and only
+// that path gets emitted
+static void compile_daa(struct code_block *block, uint8_t imm)
 {
-    size_t branch_to_sub, branch_add_h_done;
-    size_t branch_to_finish, branch_to_finish2;
+    size_t branch_to_sub = 0, branch_add_h_done = 0;
+    size_t branch_to_finish = 0, branch_to_finish2 = 0;
+    int add = 1, sub = 1;
+
+    switch (block->daa_state) {
+    case 0:
+        break;
+    case 0x3d: case 0x91: case 0x93: case 0xd6:
+        add = 0;
+        break;
+    default:
+        sub = 0;
+        break;
+    }
 
     // Save original A lower nibble into D1 for H computation later
     // (before any DAA adjustments modify A)
     emit_move_b_dn_dn(block, REG_68K_D_A, REG_68K_D_SCRATCH_1);
     emit_andi_b_dn(block, REG_68K_D_SCRATCH_1, 0x0F);  // D1 = original A & 0xF
 
-    // Load N flag into D0 and test it (we'll reload old_A later in each path)
-    emit_move_b_disp_an_dn(block, JIT_CTX_DAA_STATE + 1, REG_68K_A_CTX, REG_68K_D_SCRATCH_0);
-    emit_tst_b_dn(block, REG_68K_D_SCRATCH_0);
-    branch_to_sub = block->length;
-    emit_bne_w(block, 0);  // branch to subtraction path if N=1
-
-    // === Addition path (N=0) ===
-    // First check C || A > 0x99 -> add 0x60
-    emit_btst_imm_dn(block, 0, REG_68K_D_FLAGS);  // test C flag (4 bytes)
-    emit_bne_b(block, 6);  // if C set, skip compare and jump to add 0x60 (2 bytes)
-    emit_cmp_b_imm_dn(block, REG_68K_D_A, 0x99);  // (4 bytes)
-    emit_bls_b(block, 8);  // if A <= 0x99, skip add 0x60 and ori (2 bytes)
-    // add 0x60 and set C
-    emit_addi_b_dn(block, REG_68K_D_A, 0x60);  // (4 bytes)
-    emit_ori_b_dn(block, REG_68K_D_FLAGS, 0x01);  // set C (4 bytes)
-
-    // Now check H || (A & 0x0F) > 9 -> add 0x06
-    // Load old_A into D0 for H computation
-    emit_move_b_disp_an_dn(block, JIT_CTX_DAA_STATE, REG_68K_A_CTX, REG_68K_D_SCRATCH_0);
-    // D0 = old_A, D1 = original A & 0xF
-    // Compute H: D1 < (D0 & 0xF)?
-    emit_andi_b_dn(block, REG_68K_D_SCRATCH_0, 0x0F);  // D0 = old_A & 0xF
-    emit_cmp_b_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_SCRATCH_1);  // cmp D0, D1
-    emit_bcc_s(block, 8);  // if D1 >= D0 (carry clear), H=0, check nibble value
-    // H=1, add 0x06
-    emit_addi_b_dn(block, REG_68K_D_A, 0x06);
-    branch_add_h_done = block->length;
-    emit_bra_w(block, 0);  // skip to finish
-
-    // H=0, check if original (A & 0x0F) > 9 (D1 still has this value)
-    emit_cmp_b_imm_dn(block, REG_68K_D_SCRATCH_1, 0x09);
-    emit_bls_b(block, 4);  // if <= 9, skip
-    emit_addi_b_dn(block, REG_68K_D_A, 0x06);
-
-    branch_to_finish = block->length;
-    emit_bra_w(block, 0);  // jump to finish
-
-    // === Subtraction path (N=1) ===
-    // Patch branch_to_sub
-    block->code[branch_to_sub + 2] = (block->length - branch_to_sub - 2) >> 8;
-    block->code[branch_to_sub + 3] = (block->length - branch_to_sub - 2) & 0xff;
-
-    // Check C -> sub 0x60
-    emit_btst_imm_dn(block, 0, REG_68K_D_FLAGS);
-    emit_beq_b(block, 4);  // if C clear, skip
-    emit_subi_b_dn(block, REG_68K_D_A, 0x60);
+    if (add && sub) {
+        // Load N flag into D0 and test it (we'll reload old_A later in each path)
+        emit_move_b_disp_an_dn(block, JIT_CTX_DAA_STATE + 1, REG_68K_A_CTX, REG_68K_D_SCRATCH_0);
+        emit_tst_b_dn(block, REG_68K_D_SCRATCH_0);
+        branch_to_sub = block->length;
+        emit_bne_w(block, 0);  // branch to subtraction path if N=1
+    }
 
-    // Compute H: D1 > (old_A & 0xF) for subtraction
-    // Load old_A & 0xF into D0
-    emit_move_b_disp_an_dn(block, JIT_CTX_DAA_STATE, REG_68K_A_CTX, REG_68K_D_SCRATCH_0);
-    emit_andi_b_dn(block, REG_68K_D_SCRATCH_0, 0x0F);  // D0 = old_A & 0xF
-    emit_cmp_b_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_SCRATCH_1);  // cmp D0, D1
-    emit_bls_b(block, 4);  // if D1 <= D0 (lower or same), no H, skip
-    emit_subi_b_dn(block, REG_68K_D_A, 0x06);
+    if (add) {
+        // === Addition path (N=0) ===
+        // First check C || A > 0x99 -> add 0x60
+        emit_btst_imm_dn(block, 0, REG_68K_D_FLAGS);  // test C flag (4 bytes)
+        emit_bne_b(block, 6);  // if C set, skip compare and jump to add 0x60 (2 bytes)
+        emit_cmp_b_imm_dn(block, REG_68K_D_A, 0x99);  // (4 bytes)
+        emit_bls_b(block, 8);  // if A <= 0x99, skip add 0x60 and ori (2 bytes)
+        // add 0x60 and set C
+        emit_addi_b_dn(block, REG_68K_D_A, 0x60);  // (4 bytes)
+        emit_ori_b_dn(block, REG_68K_D_FLAGS, 0x01);  // set C (4 bytes)
+
+        // Now check H || (A & 0x0F) > 9 -> add 0x06
+        // Load old_A into D0 for H computation. A may have had 0x60 added
+        // by now, which doesn't change the low nibble of what it works out.
+        // Same for taking 0x60 off in the sub path
+        compile_daa_old_a(block, imm);
+        // D0 = old_A, D1 = original A & 0xF
+        // Compute H: D1 < (D0 & 0xF)?
+        emit_andi_b_dn(block, REG_68K_D_SCRATCH_0, 0x0F);  // D0 = old_A & 0xF
+        emit_cmp_b_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_SCRATCH_1);  // cmp D0, D1
+        emit_bcc_s(block, 8);  // if D1 >= D0 (carry clear), H=0, check nibble value
+        // H=1, add 0x06
+        emit_addi_b_dn(block, REG_68K_D_A, 0x06);
+        branch_add_h_done = block->length;
+        emit_bra_w(block, 0);  // skip to finish
+
+        // H=0, check if original (A & 0x0F) > 9 (D1 still has this value)
+        emit_cmp_b_imm_dn(block, REG_68K_D_SCRATCH_1, 0x09);
+        emit_bls_b(block, 4);  // if <= 9, skip
+        emit_addi_b_dn(block, REG_68K_D_A, 0x06);
+    }
+
+    if (add && sub) {
+        branch_to_finish = block->length;
+        emit_bra_w(block, 0);  // jump to finish
 
-    branch_to_finish2 = block->length;
-    emit_bra_w(block, 0);
+        // Patch branch_to_sub
+        block->code[branch_to_sub + 2] = (block->length - branch_to_sub - 2) >> 8;
+        block->code[branch_to_sub + 3] = (block->length - branch_to_sub - 2) & 0xff;
+    }
+
+    if (sub) {
+        // === Subtraction path (N=1) ===
+        // Check C -> sub 0x60
+        emit_btst_imm_dn(block, 0, REG_68K_D_FLAGS);
+        emit_beq_b(block, 4);  // if C clear, skip
+        emit_subi_b_dn(block, REG_68K_D_A, 0x60);
+
+        // Compute H: D1 > (old_A & 0xF) for subtraction
+        // Load old_A & 0xF into D0
+        compile_daa_old_a(block, imm);
+        emit_andi_b_dn(block, REG_68K_D_SCRATCH_0, 0x0F);  // D0 = old_A & 0xF
+        emit_cmp_b_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_SCRATCH_1);  // cmp D0, D1
+        emit_bls_b(block, 4);  // if D1 <= D0 (lower or same), no H, skip
+        emit_subi_b_dn(block, REG_68K_D_A, 0x06);
+    }
+
+    if (add && sub) {
+        branch_to_finish2 = block->length;
+        emit_bra_w(block, 0);
+    }
 
     // === Finish: set Z flag ===
     // Patch forward branches
-    block->code[branch_add_h_done + 2] = (block->length - branch_add_h_done - 2) >> 8;
-    block->code[branch_add_h_done + 3] = (block->length - branch_add_h_done - 2) & 0xff;
-    block->code[branch_to_finish + 2] = (block->length - branch_to_finish - 2) >> 8;
-    block->code[branch_to_finish + 3] = (block->length - branch_to_finish - 2) & 0xff;
-    block->code[branch_to_finish2 + 2] = (block->length - branch_to_finish2 - 2) >> 8;
-    block->code[branch_to_finish2 + 3] = (block->length - branch_to_finish2 - 2) & 0xff;
+    if (add) {
+        block->code[branch_add_h_done + 2] = (block->length - branch_add_h_done - 2) >> 8;
+        block->code[branch_add_h_done + 3] = (block->length - branch_add_h_done - 2) & 0xff;
+    }
+    if (add && sub) {
+        block->code[branch_to_finish + 2] = (block->length - branch_to_finish - 2) >> 8;
+        block->code[branch_to_finish + 3] = (block->length - branch_to_finish - 2) & 0xff;
+        block->code[branch_to_finish2 + 2] = (block->length - branch_to_finish2 - 2) >> 8;
+        block->code[branch_to_finish2 + 3] = (block->length - branch_to_finish2 - 2) & 0xff;
+    }
 
     // Set Z flag based on A, preserve C
     emit_andi_b_dn(block, REG_68K_D_FLAGS, 0x01);  // keep only C
@@ -180,6 +258,10 @@ static void compile_adc_core(struct code_block *block)
     // Store result: move.b D0, D4
     emit_move_b_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_A);
 
+    if (block->flags_dead) {
+        return;
+    }
+
     // Set flags 
     // Z from 8-bit result, C from bit 8 of 16-bit result
     emit_tst_b_dn(block, REG_68K_D_A);
@@ -217,6 +299,10 @@ static void compile_sbc_core(struct code_block *block)
     // Store result: move.b D0, D4
     emit_move_b_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_A);
 
+    if (block->flags_dead) {
+        return;
+    }
+
     // Set flags
     emit_tst_b_dn(block, REG_68K_D_A);
     emit_move_sr_dn(block, REG_68K_D_FLAGS); // save Z
@@ -318,21 +404,17 @@ int compile_alu_op(
         return 1;
 
     case 0x34: // inc (hl)
-        emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_1);
-        compile_call_dmg_read(block);
+        compile_read_pair(block, ctx, IR_H);
         emit_addq_b_dn(block, 0, 1);
         compile_set_z_flag(block);
-        emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_1);
-        compile_call_dmg_write_d0(block);
+        compile_write_pair(block, ctx, IR_H, REG_68K_D_SCRATCH_0);
         return 1;
 
     case 0x35: // dec (hl)
-        emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_1);
-        compile_call_dmg_read(block);
+        compile_read_pair(block, ctx, IR_H);
         emit_subq_b_dn(block, 0, 1);
         compile_set_z_flag(block);
-        emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_1);
-        compile_call_dmg_write_d0(block);
+        compile_write_pair(block, ctx, IR_H, REG_68K_D_SCRATCH_0);
         return 1;
 
     case 0x3c: // inc a
@@ -351,7 +433,8 @@ int compile_alu_op(
 
     // misc ALU ops
     case 0x27: // daa - decimal adjust accumulator
-        compile_daa(block);
+        // after add/sub #imm, their operand is the byte before this
+        compile_daa(block, block->daa_state ? READ_BYTE(*src_ptr - 2) : 0);
         return 1;
 
     case 0x2f: // cpl - complement A
@@ -412,8 +495,7 @@ int compile_alu_op(
 
     case 0x86: // add a, (hl)
         compile_daa_track_add(block);
-        emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_1);
-        compile_call_dmg_read(block);
+        compile_read_pair(block, ctx, IR_H);
         emit_add_b_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_A);
         compile_set_zc_flags(block);
         return 1;
@@ -461,8 +543,7 @@ int compile_alu_op(
         return 1;
 
     case 0x8e: // adc a, (hl)
-        emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_1);
-        compile_call_dmg_read(block);
+        compile_read_pair(block, ctx, IR_H);
         emit_move_b_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_SCRATCH_1);
         compile_adc_core(block);
         return 1;
@@ -517,8 +598,7 @@ int compile_alu_op(
 
     case 0x96: // sub a, (hl)
         compile_daa_track_sub(block);
-        emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_1);
-        compile_call_dmg_read(block);
+        compile_read_pair(block, ctx, IR_H);
         emit_sub_b_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_A);
         compile_set_zc_flags(block);
         return 1;
@@ -566,8 +646,7 @@ int compile_alu_op(
         return 1;
 
     case 0x9e: // sbc a, (hl)
-        emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_1);
-        compile_call_dmg_read(block);
+        compile_read_pair(block, ctx, IR_H);
         emit_move_b_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_SCRATCH_1);
         compile_sbc_core(block);
         return 1;
@@ -615,8 +694,7 @@ int compile_alu_op(
         return 1;
 
     case 0xa6: // and a, (hl)
-        emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_1);
-        compile_call_dmg_read(block);
+        compile_read_pair(block, ctx, IR_H);
         emit_and_b_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_A);
         compile_set_zc_flags(block);
         return 1;
@@ -665,8 +743,7 @@ int compile_alu_op(
         return 1;
 
     case 0xae: // xor a, (hl)
-        emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_1);
-        compile_call_dmg_read(block);
+        compile_read_pair(block, ctx, IR_H);
         emit_eor_b_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_A);
         compile_set_zc_flags(block);
         return 1;
@@ -714,8 +791,7 @@ int compile_alu_op(
         return 1;
 
     case 0xb6: // or a, (hl)
-        emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_1);
-        compile_call_dmg_read(block);
+        compile_read_pair(block, ctx, IR_H);
         emit_or_b_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_A);
         compile_set_zc_flags(block);
         return 1;
@@ -770,8 +846,7 @@ int compile_alu_op(
         return 1;
 
     case 0xbe: // cp a, (hl)
-        emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_1);
-        compile_call_dmg_read(block);
+        compile_read_pair(block, ctx, IR_H);
         emit_cmp_b_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_A);
         compile_set_zc_flags(block);
         try_fuse_branch(block, ctx, src_ptr, src_address, 1);
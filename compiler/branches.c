@@ -2,6 +2,9 @@
 #include "compiler.h"
 #include "branches.h"
 #include "emitters.h"
+#include "interop.h"
+#include "ir.h"
+#include "timing.h"
 
 // helper for reading GB memory during compilation
 #define READ_BYTE(off) (ctx->read(ctx->dmg, src_address + (off)))
@@ -43,7 +46,129 @@ static int invert_cond(int cond)
     }
 }
 
+// Point the bcc.w or bra.w emitted at skip to where the block is now. For
+// skipping over exits, which are longer into banked ROM
+static void patch_skip(struct code_block *block, size_t skip)
+{
+    block->code[skip + 2] = (block->length - skip - 2) >> 8;
+    block->code[skip + 3] = block->length - skip - 2;
+}
+
+// Back edge of a loop once D2 has gone past the next event. A patchable
+// exit here would only ever take its rts
+static void compile_loop_exit(struct code_block *block, uint16_t target_gb_pc)
+{
+    emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
+    emit_move_w_dn(block, REG_68K_D_NEXT_PC, target_gb_pc);
+    emit_rts(block);
+}
+
+// Push the return address through A3, or through dmg_write16 when the stack
+// isn't native, which includes a stack over a page with compiled RAM code so
+// the write can drop that code. A3 moves either way to stay in step
+static void compile_push_ret_addr(struct code_block *block, uint16_t ret_addr)
+{
+    size_t slow_push, done;
+
+    emit_subq_w_an(block, REG_68K_A_SP, 2);
+    emit_subi_w_disp_an(block, 2, JIT_CTX_GB_SP, REG_68K_A_CTX);
+    emit_move_w_dn(block, REG_68K_D_SCRATCH_1, ret_addr);
+    emit_tst_l_disp_an(block, JIT_CTX_STACK_IN_RAM, REG_68K_A_CTX);
+    slow_push = block->length;
+    emit_beq_w(block, 0);
+
+    emit_move_b_dn_ind_an(block, REG_68K_D_SCRATCH_1, REG_68K_A_SP);
+    emit_rol_w_8(block, REG_68K_D_SCRATCH_1);
+    emit_move_b_dn_disp_an(block, REG_68K_D_SCRATCH_1, 1, REG_68K_A_SP);
+    done = block->length;
+    emit_bra_w(block, 0);
+
+    block->code[slow_push + 2] = (block->length - slow_push - 2) >> 8;
+    block->code[slow_push + 3] = (block->length - slow_push - 2) & 0xff;
+    emit_move_w_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_SCRATCH_0);
+    emit_move_w_disp_an_dn(block, JIT_CTX_GB_SP, REG_68K_A_CTX, REG_68K_D_SCRATCH_1);
+    compile_slow_dmg_write16(block);
+
+    block->code[done + 2] = (block->length - done - 2) >> 8;
+    block->code[done + 3] = (block->length - done - 2) & 0xff;
+}
+
+// Put the return address and the code that picks up there on the shadow
+// return stack, after the GB push. The code isn't emitted yet, so this
+// returns where the lea's displacement goes for compile_return_site
+static size_t compile_push_return(struct code_block *block, uint16_t ret_addr)
+{
+    size_t lea;
+
+    // moveq #0, d0
+    emit_moveq_dn(block, REG_68K_D_SCRATCH_0, 0);
+    // addq.b #8, ret_top(a4)
+    emit_addq_b_disp_an(block, RET_ENTRY_SIZE, JIT_CTX_RET_TOP, REG_68K_A_CTX);
+    // move.b ret_top(a4), d0
+    emit_move_b_disp_an_dn(block, JIT_CTX_RET_TOP, REG_68K_A_CTX, REG_68K_D_SCRATCH_0);
+    // move.w #ret_addr, ret_stack(a4, d0.w)
+    emit_move_w_imm_disp_idx_an(block, ret_addr, JIT_CTX_RET_STACK, REG_68K_A_CTX, REG_68K_D_SCRATCH_0);
+    // lea return_site(pc), a0
+    emit_lea_pc_an(block, 0, REG_68K_A_SCRATCH_1);
+    lea = block->length - 2;
+    // move.l a0, ret_stack+4(a4, d0.w)
+    emit_move_l_an_disp_idx_an(block, REG_68K_A_SCRATCH_1, JIT_CTX_RET_STACK + 4,
+        REG_68K_A_CTX, REG_68K_D_SCRATCH_0);
+    return lea;
+}
+
+// Point the lea compile_push_return left at lea to where the block is now
+static void patch_return(struct code_block *block, size_t lea)
+{
+    block->code[lea] = (block->length - lea) >> 8;
+    block->code[lea + 1] = block->length - lea;
+}
+
+// Where a ret that finds its address on the shadow stack lands, with D3
+// already holding it. Just an exit to the return address, so once it's
+// patched the ret goes straight to the code after the call
+static void compile_return_site(struct code_block *block, size_t lea, uint16_t ret_addr)
+{
+    patch_return(block, lea);
+    emit_patchable_exit(block, ret_addr);
+}
+
+// Pop the return address into D3 and go there. If it's the one the newest
+// shadow entry was pushed with, jump to that entry's code, otherwise the
+// dispatcher looks it up. The entry is popped either way so something that
+// drops a return address, like a jump table popping it into hl, only costs
+// one miss
+static void compile_pop_return(struct code_block *block)
+{
+    // pop return address from stack (A3 = native WRAM pointer)
+    emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
+    emit_move_b_disp_an_dn(block, 1, REG_68K_A_SP, REG_68K_D_NEXT_PC);
+    emit_rol_w_8(block, REG_68K_D_NEXT_PC);
+    emit_move_b_ind_an_dn(block, REG_68K_A_SP, REG_68K_D_NEXT_PC);
+    emit_addq_w_an(block, REG_68K_A_SP, 2);
+    emit_addi_w_disp_an(block, 2, JIT_CTX_GB_SP, REG_68K_A_CTX);
+
+    // moveq #0, d0
+    emit_moveq_dn(block, REG_68K_D_SCRATCH_0, 0);
+    // move.b ret_top(a4), d0
+    emit_move_b_disp_an_dn(block, JIT_CTX_RET_TOP, REG_68K_A_CTX, REG_68K_D_SCRATCH_0);
+    // subq.b #8, ret_top(a4)
+    emit_subq_b_disp_an(block, RET_ENTRY_SIZE, JIT_CTX_RET_TOP, REG_68K_A_CTX);
+    // cmp.w ret_stack(a4, d0.w), d3
+    emit_cmp_w_disp_idx_an_dn(block, JIT_CTX_RET_STACK, REG_68K_A_CTX,
+        REG_68K_D_SCRATCH_0, REG_68K_D_NEXT_PC);
+    // bne.s +6 = over movea.l + jmp to the dispatch
+    emit_bne_b(block, 6);
+    // movea.l ret_stack+4(a4, d0.w), a0
+    emit_movea_l_idx_an_an(block, JIT_CTX_RET_STACK + 4, REG_68K_A_CTX,
+        REG_68K_D_SCRATCH_0, REG_68K_A_SCRATCH_1);
+    // jmp (a0)
+    emit_jmp_ind_an(block, REG_68K_A_SCRATCH_1);
+    emit_dispatch_jump(block);
+}
+
 // returns 1 if jr ended the block, 0 if it's a backward jump within block
+// or the block carries on at the target
 int compile_jr(
     struct code_block *block,
     struct compile_ctx *ctx,
@@ -63,17 +188,15 @@ int compile_jr(
     target_gb_offset = (int16_t) *src_ptr + disp;
 
     // Check if this is a backward jump to a location we've already compiled
-    if (target_gb_offset >= 0 && target_gb_offset < (int16_t) (*src_ptr - 2)) {
+    if (target_gb_offset >= 0 && target_gb_offset < (int16_t) (*src_ptr - 2)
+            && block->m68k_offsets[target_gb_offset] != M68K_OFFSET_SKIPPED) {
         // Backward jump within block
         target_gb_pc = src_address + target_gb_offset;
         target_m68k = block->m68k_offsets[target_gb_offset];
         m68k_disp = (int16_t) target_m68k - (int16_t) (block->length + 2);
 
         // Register mid-block entry point for this branch target
-        if (ctx->cache_store) {
-            void *code_ptr = (void *) (block->code + target_m68k);
-            ctx->cache_store(target_gb_pc, ctx->current_bank, code_ptr);
-        }
+        block_add_entry(block, target_gb_pc, target_m68k);
 
         // Tiny loops (disp >= -3, e.g. "dec a; jr nz") are pure computation
         // (no room for memory access + flag-setting instruction).
@@ -83,33 +206,49 @@ int compile_jr(
             return 0;
         }
 
-        // Larger loop - check cycle count, exit to dispatcher if >= scanline
-        // cmpi.l #cycles_per_exit, d2
-        emit_cmpi_l_imm_dn(block, cycles_per_exit, REG_68K_D_CYCLE_COUNT);
-
-        // bcs.w over exit sequence to bra.w (skip moveq(2) + move.w(4) + patchable_exit(16) = 22, plus 2 = 24)
-        // bcs = branch if carry set = branch if cycles < cycles_per_exit
-        emit_bcs_w(block, 24);
-        // Exit to dispatcher with target PC
-        emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
-        emit_move_w_dn(block, REG_68K_D_NEXT_PC, target_gb_pc);
-        emit_patchable_exit(block);
-
-        // Native branch (cycles < scanline boundary)
-        // Must recompute displacement since block->length changed
-        m68k_disp = (int16_t) target_m68k - (int16_t) (block->length + 2);
-        emit_bra_w(block, m68k_disp);
+        // Larger loop - go round again while D2 hasn't gone past the next
+        // event, otherwise exit to the dispatcher. the subq for the jr
+        // just before set N
+        emit_bcc_opcode_w(block, COND_PL, m68k_disp);
+        compile_loop_exit(block, target_gb_pc);
         return 0;
     }
 
-    // Forward jump or outside block - go through patchable exit
+    // Forward jump or outside block - carry on at the target if it's
+    // close enough, otherwise go through patchable exit
     target_gb_pc = src_address + target_gb_offset;
+    if (block_follow_jump(block, src_ptr, *src_ptr - 2, target_gb_pc)) {
+        return 0;
+    }
     emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
     emit_move_w_dn(block, REG_68K_D_NEXT_PC, target_gb_pc);
-    emit_patchable_exit(block);
+    emit_patchable_exit(block, target_gb_pc);
     return 1;
 }
 
+// Whether the jr at offset is the end of an idle loop. block->ir is the jr
+// itself, or the op before it when the branch is fused
+static int jr_is_idle(struct code_block *block, uint16_t offset)
+{
+    const struct ir_op *op = block->ir;
+
+    if (op && op->offset != offset) {
+        op++;
+    }
+    return op && op->offset == offset && op->idle;
+}
+
+// Back edge of an idle loop: going round again waits for the next event
+// instead, see compile_idle_wait. cond is when the jr is taken
+static void compile_idle_branch(struct code_block *block, int cond, uint16_t target_gb_pc)
+{
+    size_t skip = block->length;
+
+    emit_bcc_opcode_w(block, invert_cond(cond), 0);
+    compile_idle_wait(block, target_gb_pc);
+    patch_skip(block, skip);
+}
+
 // Compile conditional relative jump (jr nz, jr z, jr nc, jr c)
 // flag_bit: which bit in D7 to test (2=Z, 0=C)
 // branch_if_set: if true, branch when flag is set; if false, branch when clear
@@ -125,6 +264,7 @@ void compile_jr_cond(
     int16_t target_gb_offset;
     uint16_t target_m68k, target_gb_pc;
     int16_t m68k_disp;
+    size_t skip;
 
     disp = (int8_t) READ_BYTE(*src_ptr);
     (*src_ptr)++;
@@ -136,16 +276,19 @@ void compile_jr_cond(
     emit_btst_imm_dn(block, flag_bit, REG_68K_D_FLAGS);
 
     // Check if this is a backward jump within block
-    if (target_gb_offset >= 0 && target_gb_offset < (int16_t) (*src_ptr - 2)) {
+    if (target_gb_offset >= 0 && target_gb_offset < (int16_t) (*src_ptr - 2)
+            && block->m68k_offsets[target_gb_offset] != M68K_OFFSET_SKIPPED) {
         // Backward jump - check condition, then maybe interrupt flag
         target_gb_pc = src_address + target_gb_offset;
         target_m68k = block->m68k_offsets[target_gb_offset];
         m68k_disp = (int16_t) target_m68k - (int16_t) (block->length + 2);
 
         // Register mid-block entry point for this branch target
-        if (ctx->cache_store) {
-            void *code_ptr = (void *) (block->code + target_m68k);
-            ctx->cache_store(target_gb_pc, ctx->current_bank, code_ptr);
+        block_add_entry(block, target_gb_pc, target_m68k);
+
+        if (jr_is_idle(block, *src_ptr - 2)) {
+            compile_idle_branch(block, branch_if_set ? COND_NE : COND_EQ, target_gb_pc);
+            return;
         }
 
         // Tiny loops (disp >= -3): skip interrupt check, just branch
@@ -160,47 +303,28 @@ void compile_jr_cond(
             return;
         }
 
-        // Larger loop - check condition, then cycle count
-        // Structure:
+        // Larger loop - check condition, then cycle count. btst leaves N
+        // the way the subq for the jr set it
         //   btst #flag_bit, d7           ; already emitted above
-        //   bne/beq .check_cycles        ; if condition met, check cycles
-        //   bra.w .fall_through          ; condition not met, skip all
-        // .check_cycles:
-        //   cmpi.l #cycles_per_exit, d2
-        //   bcs.w loop_target            ; cycles < cycles_per_exit, do native branch
-        //   moveq #0, d0                 ; cycles >= cycles_per_exit, exit
-        //   move.w #target, d0
-        //   patchable_exit
+        //   beq/bne.w .fall_through      ; condition not met
+        //   bpl.w loop_target            ; next event not due yet
+        //   moveq #0, d3                 ; it is, exit
+        //   move.w #target, d3
+        //   rts
         // .fall_through:
-
-        // Sizes: bne/beq(4) + bra.w(4) + cmpi.l(6) + bcs.w(4) + moveq(2) + move.w(4) + patchable_exit(16) = 40
-        // .check_cycles is at +8 from first branch
-        // .fall_through is at +40 from first branch
-
+        skip = block->length;
         if (branch_if_set) {
-            // Branch if flag is set: btst gives Z=0 when bit=1, so use bne
-            emit_bne_w(block, 6);  // skip to .check_cycles (+8, but PC is at +2)
+            // Branch if flag is set: btst gives Z=0 when bit=1, so skip on beq
+            emit_beq_w(block, 0);
         } else {
-            // Branch if flag is clear: btst gives Z=1 when bit=0, so use beq
-            emit_beq_w(block, 6);
+            // Branch if flag is clear: btst gives Z=1 when bit=0, so skip on bne
+            emit_bne_w(block, 0);
         }
 
-        // bra.w to .fall_through (cmpi.l(6) + bcs.w(4) + moveq(2) + move.w(4) + patchable_exit(16) = 32, plus 2 for PC = 34)
-        emit_bra_w(block, 34);
-
-        // .check_cycles:
-        emit_cmpi_l_imm_dn(block, cycles_per_exit, REG_68K_D_CYCLE_COUNT);
-
-        // bcs.w to native loop target (cycles < cycles_per_exit)
         m68k_disp = (int16_t) target_m68k - (int16_t) (block->length + 2);
-        emit_bcs_w(block, m68k_disp);
-
-        // Exit to dispatcher (cycles >= cycles_per_exit)
-        emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
-        emit_move_w_dn(block, REG_68K_D_NEXT_PC, target_gb_pc);
-        emit_patchable_exit(block);
-
-        // .fall_through: block continues
+        emit_bcc_opcode_w(block, COND_PL, m68k_disp);
+        compile_loop_exit(block, target_gb_pc);
+        patch_skip(block, skip);
         return;
     }
 
@@ -208,17 +332,19 @@ void compile_jr_cond(
     // If condition NOT met, skip the exit sequence
     target_gb_pc = src_address + target_gb_offset;
 
+    skip = block->length;
     if (branch_if_set) {
         // Skip exit if flag is clear (btst Z=1 when bit=0)
-        emit_beq_w(block, 24);  // skip: moveq(2) + move.w(4) + patchable_exit(16) = 22, plus 2 = 24
+        emit_beq_w(block, 0);
     } else {
         // Skip exit if flag is set (btst Z=0 when bit=1)
-        emit_bne_w(block, 24);
+        emit_bne_w(block, 0);
     }
 
     emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
     emit_move_w_dn(block, REG_68K_D_NEXT_PC, target_gb_pc);
-    emit_patchable_exit(block);
+    emit_patchable_exit(block, target_gb_pc);
+    patch_skip(block, skip);
 }
 
 // Compile conditional absolute jump (jp nz, jp z, jp nc, jp c)
@@ -233,26 +359,31 @@ void compile_jp_cond(
     int branch_if_set
 ) {
     uint16_t target = READ_BYTE(*src_ptr) | (READ_BYTE(*src_ptr + 1) << 8);
+    size_t skip;
     *src_ptr += 2;
 
     // Test the flag bit in D7
     emit_btst_imm_dn(block, flag_bit, REG_68K_D_FLAGS);
 
     // If condition NOT met, skip the exit sequence
+    skip = block->length;
     if (branch_if_set) {
         // Skip exit if flag is clear (btst Z=1 when bit=0)
-        emit_beq_w(block, 24);  // skip: moveq(2) + move.w(4) + patchable_exit(16) = 22, plus 2 = 24
+        emit_beq_w(block, 0);
     } else {
         // Skip exit if flag is set (btst Z=0 when bit=1)
-        emit_bne_w(block, 24);
+        emit_bne_w(block, 0);
     }
 
     emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
     emit_move_w_dn(block, REG_68K_D_NEXT_PC, target);
-    emit_patchable_exit(block);
+    emit_patchable_exit(block, target);
+    patch_skip(block, skip);
 }
 
-void compile_call_imm16(
+// Returns 1 if the call ended the block, 0 if the code after it follows
+// in the same block, see compile_block
+int compile_call_imm16(
     struct code_block *block,
     struct compile_ctx *ctx,
     uint16_t *src_ptr,
@@ -260,20 +391,38 @@ void compile_call_imm16(
 ) {
     uint16_t target = READ_BYTE(*src_ptr) | (READ_BYTE(*src_ptr + 1) << 8);
     uint16_t ret_addr = src_address + *src_ptr + 2;  // address after call
+    size_t lea;
     *src_ptr += 2;
 
-    // push return address (A3 = native WRAM pointer)
-    emit_subq_w_an(block, REG_68K_A_SP, 2);
-    emit_subi_w_disp_an(block, 2, JIT_CTX_GB_SP, REG_68K_A_CTX);
-    emit_move_w_dn(block, REG_68K_D_SCRATCH_1, ret_addr);
-    emit_move_b_dn_ind_an(block, REG_68K_D_SCRATCH_1, REG_68K_A_SP);
-    emit_rol_w_8(block, REG_68K_D_SCRATCH_1);
-    emit_move_b_dn_disp_an(block, REG_68K_D_SCRATCH_1, 1, REG_68K_A_SP);
+    compile_push_ret_addr(block, ret_addr);
+    lea = compile_push_return(block, ret_addr);
 
     // jump to target
     emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
     emit_move_w_dn(block, REG_68K_D_NEXT_PC, target);
-    emit_patchable_exit(block);
+    emit_patchable_exit(block, target);
+
+    // the return address is in another part of the memory map, which the
+    // block shouldn't run into
+    if ((ret_addr ^ (ret_addr - 3)) & 0xc000) {
+        compile_return_site(block, lea, ret_addr);
+        return 1;
+    }
+
+    // carry on compiling the code the call returns to, which the
+    // dispatcher can come into as well
+    patch_return(block, lea);
+    if (ret_addr >= 0x4000 && ret_addr < 0x8000) {
+        // the callee could have left another bank in, D3 is still the
+        // return address for the dispatcher
+        // cmpi.b #bank, JIT_CTX_ROM_BANK(a4)
+        emit_cmpi_b_imm_disp_an(block, block->bank, JIT_CTX_ROM_BANK, REG_68K_A_CTX);
+        // beq.s +6 = over the dispatch
+        emit_beq_b(block, 6);
+        emit_dispatch_jump(block);
+    }
+    block_add_entry(block, ret_addr, block->length);
+    return 0;
 }
 
 // Compile conditional call (call nz, call z, call nc, call c)
@@ -289,44 +438,34 @@ void compile_call_cond(
 ) {
     uint16_t target = READ_BYTE(*src_ptr) | (READ_BYTE(*src_ptr + 1) << 8);
     uint16_t ret_addr = src_address + *src_ptr + 2;  // address after call
+    size_t skip, lea;
     *src_ptr += 2;
 
     // Test the flag bit in D7
     emit_btst_imm_dn(block, flag_bit, REG_68K_D_FLAGS);
 
     // If condition NOT met, skip the call sequence
-    // call sequence: subq(2) + subi(6) + move.w(4) + move.b(2) + rol(2) + move.b(4) +
-    //                moveq(2) + move.w(4) + patchable_exit(16) = 42, +2 = 44
+    skip = block->length;
     if (branch_if_set) {
-        emit_beq_w(block, 44);
+        emit_beq_w(block, 0);
     } else {
-        emit_bne_w(block, 44);
+        emit_bne_w(block, 0);
     }
 
-    // Push return address
-    emit_subq_w_an(block, REG_68K_A_SP, 2);
-    emit_subi_w_disp_an(block, 2, JIT_CTX_GB_SP, REG_68K_A_CTX);
-    emit_move_w_dn(block, REG_68K_D_SCRATCH_1, ret_addr);
-    emit_move_b_dn_ind_an(block, REG_68K_D_SCRATCH_1, REG_68K_A_SP);
-    emit_rol_w_8(block, REG_68K_D_SCRATCH_1);
-    emit_move_b_dn_disp_an(block, REG_68K_D_SCRATCH_1, 1, REG_68K_A_SP);
+    compile_push_ret_addr(block, ret_addr);
+    lea = compile_push_return(block, ret_addr);
 
     // Jump to target
     emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
     emit_move_w_dn(block, REG_68K_D_NEXT_PC, target);
-    emit_patchable_exit(block);
+    emit_patchable_exit(block, target);
+    compile_return_site(block, lea, ret_addr);
+    patch_skip(block, skip);
 }
 
 void compile_ret(struct code_block *block)
 {
-    // pop return address from stack (A3 = native WRAM pointer)
-    emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
-    emit_move_b_disp_an_dn(block, 1, REG_68K_A_SP, REG_68K_D_NEXT_PC);
-    emit_rol_w_8(block, REG_68K_D_NEXT_PC);
-    emit_move_b_ind_an_dn(block, REG_68K_A_SP, REG_68K_D_NEXT_PC);
-    emit_addq_w_an(block, REG_68K_A_SP, 2);
-    emit_addi_w_disp_an(block, 2, JIT_CTX_GB_SP, REG_68K_A_CTX);
-    emit_dispatch_jump(block);
+    compile_pop_return(block);
 }
 
 // Compile conditional return (ret nz, ret z, ret nc, ret c)
@@ -334,41 +473,84 @@ void compile_ret(struct code_block *block)
 // branch_if_set: if true, return when flag is set; if false, return when clear
 void compile_ret_cond(struct code_block *block, uint8_t flag_bit, int branch_if_set)
 {
+    size_t skip;
+
     // Test the flag bit in D7
     emit_btst_imm_dn(block, flag_bit, REG_68K_D_FLAGS);
 
     // If condition NOT met, skip the return sequence
-    // ret sequence: moveq(2) + move.b(4) + rol(2) + move.b(2) + addq(2) + addi(6) +
-    //               dispatch_jump(6) = 24, +2 = 26
+    skip = block->length;
     if (branch_if_set) {
-        emit_beq_w(block, 26);
+        emit_beq_w(block, 0);
     } else {
-        emit_bne_w(block, 26);
+        emit_bne_w(block, 0);
     }
 
-    // Pop return address and dispatch
-    emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
-    emit_move_b_disp_an_dn(block, 1, REG_68K_A_SP, REG_68K_D_NEXT_PC);
-    emit_rol_w_8(block, REG_68K_D_NEXT_PC);
-    emit_move_b_ind_an_dn(block, REG_68K_A_SP, REG_68K_D_NEXT_PC);
-    emit_addq_w_an(block, REG_68K_A_SP, 2);
-    emit_addi_w_disp_an(block, 2, JIT_CTX_GB_SP, REG_68K_A_CTX);
-    emit_dispatch_jump(block);
+    compile_pop_return(block);
+    patch_skip(block, skip);
 }
 
 void compile_rst_n(struct code_block *block, uint8_t target, uint16_t ret_addr)
 {
-    // push return address
-    emit_subq_w_an(block, REG_68K_A_SP, 2);
-    emit_subi_w_disp_an(block, 2, JIT_CTX_GB_SP, REG_68K_A_CTX);
-    emit_move_w_dn(block, REG_68K_D_SCRATCH_1, ret_addr);
-    emit_move_b_dn_ind_an(block, REG_68K_D_SCRATCH_1, REG_68K_A_SP);
-    emit_rol_w_8(block, REG_68K_D_SCRATCH_1);
-    emit_move_b_dn_disp_an(block, REG_68K_D_SCRATCH_1, 1, REG_68K_A_SP);
+    size_t lea;
+
+    compile_push_ret_addr(block, ret_addr);
+    lea = compile_push_return(block, ret_addr);
 
     // jump to target (0x00, 0x08, 0x10, 0x18, 0x20, 0x28, 0x30, 0x38)
     emit_moveq_dn(block, REG_68K_D_NEXT_PC, target);
-    emit_patchable_exit(block);
+    emit_patchable_exit(block, target);
+    compile_return_site(block, lea, ret_addr);
+}
+
+// jp (hl) goes through an inline cache of the targets it's seen. Each of
+// the JP_HL_SLOTS slots starts out as a bra.s to the next one, and
+// jp_hl_miss fills one in with block_link_jp_hl when its lookup finds code:
+//   cmpi.w #pc, d3
+//   bne.s next
+//   cmpi.b #bank, 17(a4) / bne.s next, or bra.s over it outside 0x4000-0x7fff
+//   jmp.l target
+// Filled slots are linked like patched exits, so they empty themselves
+// again when the target goes away
+void compile_jp_hl(struct code_block *block)
+{
+    size_t slots;
+    int k;
+
+    emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_NEXT_PC);
+    // addq.l #1, jp_hl_runs(a4)
+    emit_addq_l_disp_an(block, 1, JIT_CTX_JP_HL_RUNS, REG_68K_A_CTX);
+    // the slots skip the dispatcher's check
+    emit_tst_l_dn(block, REG_68K_D_CYCLE_COUNT);
+    emit_bpl_b(block, 2);
+    emit_rts(block);
+
+    slots = block->length;
+    for (k = 0; k < JP_HL_SLOTS; k++) {
+        block_add_exit(block, block->length);
+        // bra.s +18 (2 bytes), then filler
+        emit_bra_b(block, JP_HL_SLOT_SIZE - 2);
+        while (block->length < slots + (k + 1) * JP_HL_SLOT_SIZE) {
+            emit_word(block, 0x4afc);
+        }
+    }
+
+    // none of them matched: jp_hl_miss(slots, d3) finds the code, or
+    // returns NULL for the dispatcher to go back to C. it's C, so the
+    // cycles go through JIT_CTX_READ_CYCLES like any other call
+    emit_move_l_dn_disp_an(block, REG_68K_D_CYCLE_COUNT, JIT_CTX_READ_CYCLES, REG_68K_A_CTX);
+    emit_push_w_dn(block, REG_68K_D_NEXT_PC);
+    emit_pea_pc(block, slots - block->length - 2);
+    emit_movea_l_disp_an_an(block, JIT_CTX_JP_HL_FUNC, REG_68K_A_CTX, REG_68K_A_SCRATCH_1);
+    emit_jsr_ind_an(block, REG_68K_A_SCRATCH_1);
+    emit_addq_l_an(block, 7, 6);
+    emit_move_l_disp_an_dn(block, JIT_CTX_READ_CYCLES, REG_68K_A_CTX, REG_68K_D_CYCLE_COUNT);
+    emit_tst_l_dn(block, REG_68K_D_SCRATCH_0);
+    // beq.s +4 = over movea.l + jmp to the dispatch
+    emit_beq_b(block, 4);
+    emit_movea_l_dn_an(block, REG_68K_D_SCRATCH_0, REG_68K_A_SCRATCH_1);
+    emit_jmp_ind_an(block, REG_68K_A_SCRATCH_1);
+    emit_dispatch_jump(block);
 }
 
 // fused branches start here. all these avoid is a "btst", but it doesn't really
@@ -387,6 +569,7 @@ int compile_jr_cond_fused(
     int16_t target_gb_offset;
     uint16_t target_m68k, target_gb_pc;
     int16_t m68k_disp;
+    size_t skip;
 
     disp = (int8_t) READ_BYTE(*src_ptr);
     (*src_ptr)++;
@@ -394,14 +577,17 @@ int compile_jr_cond_fused(
     target_gb_offset = (int16_t) *src_ptr + disp;
 
     // Check if this is a backward jump within block
-    if (target_gb_offset >= 0 && target_gb_offset < (int16_t) (*src_ptr - 2)) {
+    if (target_gb_offset >= 0 && target_gb_offset < (int16_t) (*src_ptr - 2)
+            && block->m68k_offsets[target_gb_offset] != M68K_OFFSET_SKIPPED) {
         target_gb_pc = src_address + target_gb_offset;
         target_m68k = block->m68k_offsets[target_gb_offset];
 
         // Register mid-block entry point for this branch target
-        if (ctx->cache_store) {
-            void *code_ptr = (void *) (block->code + target_m68k);
-            ctx->cache_store(target_gb_pc, ctx->current_bank, code_ptr);
+        block_add_entry(block, target_gb_pc, target_m68k);
+
+        if (jr_is_idle(block, *src_ptr - 2)) {
+            compile_idle_branch(block, cond, target_gb_pc);
+            return 0;
         }
 
         // Tiny loops: skip cycle check
@@ -411,46 +597,37 @@ int compile_jr_cond_fused(
             return 0;
         }
 
-        // Larger loop - check condition, then cycle count
-        // Structure:
-        //   bcc.w .check_cycles      ; if condition met
-        //   bra.w .fall_through      ; condition not met
-        // .check_cycles:
-        //   cmpi.l #cycles_per_exit, d2
-        //   bcs.w loop_target        ; cycles < cycles_per_exit
-        //   <exit via patchable_exit>
+        // Larger loop - check condition, then cycle count. the CCR has
+        // the GB flags here, so D2 needs testing
+        //   bcc.w .fall_through      ; condition not met
+        //   tst.l d2
+        //   bpl.w loop_target        ; next event not due yet
+        //   moveq #0, d3             ; it is, exit
+        //   move.w #target, d3
+        //   rts
         // .fall_through:
+        skip = block->length;
+        emit_bcc_opcode_w(block, invert_cond(cond), 0);
 
-        // Branch to check_cycles if condition met
-        emit_bcc_opcode_w(block, cond, 6);
-
-        // bra.w to .fall_through (cmpi.l(6) + bcs.w(4) + exit(22) = 32, plus 2 = 34)
-        emit_bra_w(block, 34);
-
-        // .check_cycles:
-        emit_cmpi_l_imm_dn(block, cycles_per_exit, REG_68K_D_CYCLE_COUNT);
-
-        // bcs.w to native loop target (cycles < cycles_per_exit)
+        emit_tst_l_dn(block, REG_68K_D_CYCLE_COUNT);
         m68k_disp = (int16_t) target_m68k - (int16_t) (block->length + 2);
-        emit_bcs_w(block, m68k_disp);
-
-        // Exit via patchable exit (cycles >= cycles_per_exit)
-        emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
-        emit_move_w_dn(block, REG_68K_D_NEXT_PC, target_gb_pc);
-        emit_patchable_exit(block);
-
+        emit_bcc_opcode_w(block, COND_PL, m68k_disp);
+        compile_loop_exit(block, target_gb_pc);
+        patch_skip(block, skip);
         return 0;
     }
 
     // Forward/external jump - conditionally exit via patchable exit
     target_gb_pc = src_address + target_gb_offset;
 
-    // Skip exit if condition NOT met (skip: moveq(2) + move.w(4) + patchable_exit(16) = 22, +2 = 24)
-    emit_bcc_opcode_w(block, invert_cond(cond), 24);
+    // Skip exit if condition NOT met
+    skip = block->length;
+    emit_bcc_opcode_w(block, invert_cond(cond), 0);
 
     emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
     emit_move_w_dn(block, REG_68K_D_NEXT_PC, target_gb_pc);
-    emit_patchable_exit(block);
+    emit_patchable_exit(block, target_gb_pc);
+    patch_skip(block, skip);
     return 0;  // doesn't end block - fall through continues
 }
 
@@ -463,32 +640,30 @@ void compile_jp_cond_fused(
     int cond
 ) {
     uint16_t target = READ_BYTE(*src_ptr) | (READ_BYTE(*src_ptr + 1) << 8);
+    size_t skip;
     *src_ptr += 2;
 
-    // Skip exit if condition NOT met (skip: moveq(2) + move.w(4) + patchable_exit(16) = 22, +2 = 24)
-    emit_bcc_opcode_w(block, invert_cond(cond), 24);
+    // Skip exit if condition NOT met
+    skip = block->length;
+    emit_bcc_opcode_w(block, invert_cond(cond), 0);
 
     emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
     emit_move_w_dn(block, REG_68K_D_NEXT_PC, target);
-    emit_patchable_exit(block);
+    emit_patchable_exit(block, target);
+    patch_skip(block, skip);
 }
 
 // Fused ret cond - uses live CCR flags
 void compile_ret_cond_fused(struct code_block *block, int cond)
 {
+    size_t skip;
+
     // Skip return if condition NOT met
-    // ret sequence: moveq(2) + move.b(4) + rol(2) + move.b(2) + addq(2) + addi(6) +
-    //               dispatch_jump(6) = 24, +2 = 26
-    emit_bcc_opcode_w(block, invert_cond(cond), 26);
+    skip = block->length;
+    emit_bcc_opcode_w(block, invert_cond(cond), 0);
 
-    // Pop return address and dispatch
-    emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
-    emit_move_b_disp_an_dn(block, 1, REG_68K_A_SP, REG_68K_D_NEXT_PC);
-    emit_rol_w_8(block, REG_68K_D_NEXT_PC);
-    emit_move_b_ind_an_dn(block, REG_68K_A_SP, REG_68K_D_NEXT_PC);
-    emit_addq_w_an(block, REG_68K_A_SP, 2);
-    emit_addi_w_disp_an(block, 2, JIT_CTX_GB_SP, REG_68K_A_CTX);
-    emit_dispatch_jump(block);
+    compile_pop_return(block);
+    patch_skip(block, skip);
 }
 
 // Fused call cond - uses live CCR flags
@@ -501,23 +676,20 @@ void compile_call_cond_fused(
 ) {
     uint16_t target = READ_BYTE(*src_ptr) | (READ_BYTE(*src_ptr + 1) << 8);
     uint16_t ret_addr = src_address + *src_ptr + 2;
+    size_t skip, lea;
     *src_ptr += 2;
 
     // Skip call if condition NOT met
-    // call sequence: subq(2) + subi(6) + move.w(4) + move.b(2) + rol(2) + move.b(4) +
-    //                moveq(2) + move.w(4) + patchable_exit(16) = 42, +2 = 44
-    emit_bcc_opcode_w(block, invert_cond(cond), 44);
+    skip = block->length;
+    emit_bcc_opcode_w(block, invert_cond(cond), 0);
 
-    // Push return address
-    emit_subq_w_an(block, REG_68K_A_SP, 2);
-    emit_subi_w_disp_an(block, 2, JIT_CTX_GB_SP, REG_68K_A_CTX);
-    emit_move_w_dn(block, REG_68K_D_SCRATCH_1, ret_addr);
-    emit_move_b_dn_ind_an(block, REG_68K_D_SCRATCH_1, REG_68K_A_SP);
-    emit_rol_w_8(block, REG_68K_D_SCRATCH_1);
-    emit_move_b_dn_disp_an(block, REG_68K_D_SCRATCH_1, 1, REG_68K_A_SP);
+    compile_push_ret_addr(block, ret_addr);
+    lea = compile_push_return(block, ret_addr);
 
     // Jump to target
     emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
     emit_move_w_dn(block, REG_68K_D_NEXT_PC, target);
-    emit_patchable_exit(block);
+    emit_patchable_exit(block, target);
+    compile_return_site(block, lea, ret_addr);
+    patch_skip(block, skip);
 }
\ No newline at end of file
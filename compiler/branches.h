@@ -49,7 +49,7 @@ void compile_jp_cond(
     int branch_if_set
 );
 
-void compile_call_imm16(
+int compile_call_imm16(
     struct code_block *block,
     struct compile_ctx *ctx,
     uint16_t *src_ptr,
@@ -76,5 +76,6 @@ void compile_call_cond_fused(
 void compile_ret(struct code_block *block);
 void compile_ret_cond(struct code_block *block, uint8_t flag_bit, int branch_if_set);
 void compile_rst_n(struct code_block *block, uint8_t target, uint16_t ret_addr);
+void compile_jp_hl(struct code_block *block);
 
 #endif
\ No newline at end of file
@@ -9,13 +9,15 @@
 // todo remove these
 static void compile_shift_flags(struct code_block *block)
 {
-    emit_move_sr_dn(block, REG_68K_D_FLAGS);
+    compile_set_zc_flags(block);
 }
 
 static void compile_swap_flags(struct code_block *block)
 {
-    emit_move_sr_dn(block, REG_68K_D_FLAGS);
-    emit_andi_b_dn(block, REG_68K_D_FLAGS, 0xfe);
+    if (!block->flags_dead) {
+        emit_move_sr_dn(block, REG_68K_D_FLAGS);
+        emit_andi_b_dn(block, REG_68K_D_FLAGS, 0xfe);
+    }
 }
 
 static void compile_bit_flags(struct code_block *block)
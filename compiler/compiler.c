@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "compiler.h"
 #include "emitters.h"
@@ -11,12 +12,24 @@
 #include "alu.h"
 #include "stack.h"
 #include "instructions.h"
+#include "ir.h"
 #include "timing.h"
+#include "idioms.h"
+#include "jump_tables.h"
 
 // helper for reading GB memory during compilation
 #define READ_BYTE(off) (ctx->read(ctx->dmg, src_address + (off)))
 
-int cycles_per_exit;
+// every block is compiled here and copied out once its size is known
+static union {
+    struct code_block block;
+    uint8_t bytes[sizeof(struct code_block) + MAX_BLOCK_CODE];
+} scratch;
+static uint16_t scratch_offsets[MAX_BLOCK_SRC];
+static struct block_entry scratch_entries[MAX_BLOCK_ENTRIES];
+static uint16_t scratch_exits[MAX_BLOCK_EXITS];
+static struct block_reloc scratch_relocs[MAX_BLOCK_RELOCS];
+static struct ir_block scratch_ir;
 
 void compiler_init(void)
 {
@@ -39,32 +52,6 @@ void compile_join_de(struct code_block *block, int dreg)
     emit_move_b_dn_dn(block, REG_68K_D_DE, dreg);  // D1 = 0x0000DDEE
 }
 
-static void compile_ldh_a_u8(struct code_block *block, uint8_t addr)
-{
-    if (addr >= 0x80) {
-        // movea.l (a4), a0
-        emit_movea_l_ind_an_an(block, 4, 0);
-        // move.b addr(a0), d4
-        emit_move_b_disp_an_dn(block, addr - 0x80, 0, 4);
-    } else {
-        // not hram so it has to be I/O, go directly to C
-        emit_move_w_dn(block, REG_68K_D_SCRATCH_1, 0xff00 + addr);
-        compile_slow_dmg_read(block);
-        emit_move_b_dn_dn(block, 0, REG_68K_D_A);
-    }
-}
-
-static void compile_ldh_u8_a(struct code_block *block, uint8_t addr)
-{
-    if (addr >= 0x80) {
-        emit_movea_l_ind_an_an(block, 4, 0);
-        emit_move_b_dn_disp_an(block, 4, addr - 0x80, 0);
-    } else {
-        emit_move_w_dn(block, REG_68K_D_SCRATCH_1, 0xff00 + addr);
-        compile_slow_dmg_write(block, REG_68K_D_A);
-    }
-}
-
 static void compile_ld_imm16_split(
     struct code_block *block,
     uint8_t reg,
@@ -92,12 +79,68 @@ static void compile_ld_imm16_contiguous(
     emit_movea_w_imm16(block, reg, hibyte << 8 | lobyte);
 }
 
+// Cycles the first op of op's run took off D2 for op and the ones after
+// it, 0 if op is the first
+static int run_paid(const struct ir_op *op, const struct ir_op *end)
+{
+    int cycles = 0;
+
+    for (; op < end && !op->charge; op++) {
+        cycles += op->cycles;
+    }
+    return cycles;
+}
+
+// Copy the scratch block into an allocation sized to fit, then register its
+// mid-block entry points now that the code has its final address
+static struct code_block *finish_block(struct code_block *scratch_block, struct compile_ctx *ctx)
+{
+    struct code_block *block;
+    size_t size = block_size(scratch_block);
+    int k;
+
+    if (ctx->alloc) {
+        block = ctx->alloc(size);
+    } else {
+        block = malloc(size);
+    }
+    if (!block) {
+        return NULL;
+    }
+
+    memcpy(block, scratch_block, sizeof(struct code_block) + scratch_block->length);
+    block->entries = (struct block_entry *)
+        (block->code + ((block->length + 3) & ~3));
+    memcpy(block->entries, scratch_block->entries,
+           block->num_entries * sizeof(struct block_entry));
+    block->exits = (uint16_t *) (block->entries + block->num_entries);
+    memcpy(block->exits, scratch_block->exits,
+           block->num_exits * sizeof(uint16_t));
+    block->relocs = (struct block_reloc *) (block->exits + block->num_exits);
+    memcpy(block->relocs, scratch_block->relocs,
+           block->num_relocs * sizeof(struct block_reloc));
+    block->m68k_offsets = NULL;
+    block->next = NULL;
+    block->links = NULL;
+
+    if (ctx->cache_store) {
+        for (k = 0; k < block->num_entries; k++) {
+            ctx->cache_store(block->entries[k].src_address, ctx->current_bank,
+                             block->code + block->entries[k].m68k_offset);
+        }
+    }
+
+    return block;
+}
+
 struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
 {
     struct code_block *block;
+    struct ir_op *ir_op, *ir_end;
+    struct idiom idiom;
     uint16_t src_ptr = 0;
     uint8_t op;
-    int done = 0;
+    int done = 0, bulk, past_call = 0;
     int k;
 
 #ifdef DEBUG_COMPILE
@@ -106,50 +149,104 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
            READ_BYTE(0), READ_BYTE(1), READ_BYTE(2));
 #endif
 
-    if (ctx->alloc) {
-        block = ctx->alloc(sizeof *block);
-    } else {
-        block = malloc(sizeof *block);
-    }
-    if (!block) {
-        return NULL;
-    }
-
+    block = &scratch.block;
     block->length = 0;
     block->count = 0;
     block->src_address = src_address;
     block->error = 0;
     block->failed_opcode = 0;
     block->failed_address = 0;
+    block->num_entries = 0;
+    block->entries = scratch_entries;
+    block->num_exits = 0;
+    block->exits = scratch_exits;
+    block->num_relocs = 0;
+    block->relocs = scratch_relocs;
+    block->m68k_offsets = scratch_offsets;
+    block->bank = ctx->current_bank;
+    block->flags_dead = 0;
+    block->daa_state = 0;
+    block->ir = NULL;
+    block->next = NULL;
+    block->links = NULL;
+
+    // every instruction is followed by an exit in single instruction mode,
+    // so skip the passes. what they leave at 0 is always safe
+    if (ctx->single_instruction) {
+        ir_decode(&scratch_ir, ctx, src_address);
+    } else {
+        ir_build(&scratch_ir, ctx, src_address);
+    }
+    ir_op = scratch_ir.ops;
+    ir_end = scratch_ir.ops + scratch_ir.count;
 
     // set everything to illegal instruction so it's easy to catch weird branches
-    for (k = 0; k < sizeof block->code; k += 2) {
+    for (k = 0; k < MAX_BLOCK_CODE; k += 2) {
       block->code[k] = 0x4a;
       block->code[k + 1] = 0xfc;
     }
 
     while (!done) {
         size_t before = block->length;
+
+        // the IR goes at least as far as this does. fused ops skip past
+        // the ones they took with them
+        while (ir_op + 1 < ir_end && ir_op->offset < src_ptr) {
+            ir_op++;
+        }
+
+        bulk = ir_op->offset == src_ptr && !ctx->single_instruction
+            && idiom_match(ir_op, ir_end, &idiom);
+
         // detect overflow of code block and chain to next block
-        // longest instruction is 178 bytes, exit sequence is 22 bytes
-        // also, a block of all NOPs (Link's Awakening DX has this) overflows
-        // the m68k_offsets array, and i don't want to make it bigger, so
-        // just chain to another block. worst case: 253 nops then a fused compare/branch
-        if (block->length > sizeof(block->code) - 200
-                || block->count > 254) {
+        // longest instruction is 178 bytes, exit sequence is 18 bytes,
+        // and a copy or fill loop needs room for its call as well
+        // also, a block of all NOPs (Link's Awakening DX has this) would
+        // be huge for very little work, so chain to another block. worst
+        // case: 253 nops then a fused compare/branch. the offsets table is
+        // indexed by GB byte, longest (fused) instruction is 5 bytes.
+        // a daa that works out its state from the op before it has to
+        // stay with it, and there's room for one more
+        if ((block->length > MAX_BLOCK_CODE - 200 - (bulk ? MAX_IDIOM_CODE : 0)
+                    || block->count > 254
+                    || src_ptr > MAX_BLOCK_SRC - 8)
+                && !(ir_op->op == 0x27 && ir_op->daa_state)) {
+            // the first op of the run already paid for this one and the
+            // rest, which the next block pays for again
+            if (ir_op->offset == src_ptr) {
+                emit_add_cycles(block, -run_paid(ir_op, ir_end));
+            }
             emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
             emit_move_w_dn(block, REG_68K_D_NEXT_PC, src_address + src_ptr);
-            emit_patchable_exit(block);
+            emit_patchable_exit(block, src_address + src_ptr);
             break;
         }
 
+        if (bulk || (ir_op->offset == src_ptr && ir_op->hl_reload == HL_RELOAD_ENTRY)) {
+            // the loop comes back around to after these, but the
+            // dispatcher has to come in before them
+            block_add_entry(block, src_address + src_ptr, block->length);
+        }
+        if (bulk) {
+            compile_idiom(block, &idiom);
+        }
+        if (ir_op->offset == src_ptr && ir_op->hl_reload) {
+            compile_hl_cache_load(block, ir_op->hl_cache);
+        }
+
         block->m68k_offsets[src_ptr] = block->length;
+        block->flags_dead = ir_op->flags_dead;
+        block->daa_state = ir_op->daa_state;
+        block->ir = ir_op->offset == src_ptr ? ir_op : NULL;
         block->count++;
         op = READ_BYTE(src_ptr);
         src_ptr++;
 
-        if (op != 0xcb) {
-            emit_add_cycles(block, instructions[op].cycles);
+        if (block->ir) {
+            emit_add_cycles(block, ir_op->charge);
+        } else {
+            emit_add_cycles(block, instructions[op == 0xcb
+                    ? 0x100 + READ_BYTE(src_ptr) : op].cycles);
         }
 
         switch (op) {
@@ -158,23 +255,21 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             break;
 
         case 0x02: // ld (bc), a
-            compile_join_bc(block, 1);  // BC -> D1.w
-            compile_call_dmg_write_a(block);  // dmg_write(dmg, D1.w, A)
+            compile_write_pair(block, ctx, IR_B, REG_68K_D_A);
             break;
 
         case 0x0a: // ld a, (bc)
-            compile_join_bc(block, 1);  // BC -> D1.w
-            compile_call_dmg_read_a(block);  // A = dmg_read(dmg, D1.w)
+            compile_read_pair(block, ctx, IR_B);
+            emit_move_b_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_A);
             break;
 
         case 0x12: // ld (de), a
-            compile_join_de(block, 1);  // DE -> D1.w
-            compile_call_dmg_write_a(block);  // dmg_write(dmg, D1.w, A)
+            compile_write_pair(block, ctx, IR_D, REG_68K_D_A);
             break;
 
         case 0x1a: // ld a, (de)
-            compile_join_de(block, 1);  // DE -> D1.w
-            compile_call_dmg_read_a(block);  // A = dmg_read(dmg, D1.w)
+            compile_read_pair(block, ctx, IR_D);
+            emit_move_b_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_A);
             break;
 
         case 0x01: // ld bc, imm16
@@ -191,29 +286,33 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             break;
 
         case 0x32: // ld (hl-), a
-            emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_1); // D1.w = HL
-            compile_call_dmg_write_a(block); // dmg_write(dmg, D1.w, A)
+            compile_write_pair(block, ctx, IR_H, REG_68K_D_A);
             emit_subq_w_an(block, REG_68K_A_HL, 1); // HL--
+            compile_hl_cache_step(block, -1);
             break;
 
         case 0x23: // inc hl
             emit_addq_w_an(block, REG_68K_A_HL, 1);
+            compile_hl_cache_step(block, 1);
             break;
 
         case 0x2a: // ld a, (hl+)
-            emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_1); // D1.w = HL
-            compile_call_dmg_read_a(block); // dmg_read(dmg, D1.w) into A
+            compile_read_pair(block, ctx, IR_H);
+            emit_move_b_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_A);
             emit_addq_w_an(block, REG_68K_A_HL, 1); // HL++
+            compile_hl_cache_step(block, 1);
             break;
 
         case 0x3a: // ld a, (hl-)
-            emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_1); // D1.w = HL
-            compile_call_dmg_read_a(block); // dmg_read(dmg, D1.w) into A
+            compile_read_pair(block, ctx, IR_H);
+            emit_move_b_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_A);
             emit_subq_w_an(block, REG_68K_A_HL, 1); // HL--
+            compile_hl_cache_step(block, -1);
             break;
 
         case 0x2b: // dec hl
             emit_subq_w_an(block, REG_68K_A_HL, 1);
+            compile_hl_cache_step(block, -1);
             break;
 
         case 0x3b: // dec sp
@@ -235,7 +334,7 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
 
         case 0x07: // rlca - rotate A left, old bit 7 to carry and bit 0
             emit_rol_b_imm(block, 1, REG_68K_D_A);
-            emit_move_sr_dn(block, REG_68K_D_FLAGS);
+            compile_set_c_flag(block);
             break;
 
         case 0x0b: // dec bc
@@ -249,7 +348,7 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
 
         case 0x0f: // rrca - rotate A right, old bit 0 to carry and bit 7
             emit_ror_b_imm(block, 1, REG_68K_D_A);
-            emit_move_sr_dn(block, REG_68K_D_FLAGS);
+            compile_set_c_flag(block);
             break;
 
         case 0x13: // inc de
@@ -348,15 +447,14 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             break;
 
         case 0x22: // ld (hl+), a
-            emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_1);
-            compile_call_dmg_write_a(block);
+            compile_write_pair(block, ctx, IR_H, REG_68K_D_A);
             emit_addq_w_an(block, REG_68K_A_HL, 1);
+            compile_hl_cache_step(block, 1);
             break;
 
         case 0xcb: // CB prefix
             {
                 uint8_t cb_op = READ_BYTE(src_ptr++);
-                emit_add_cycles(block, instructions[0x100 + cb_op].cycles);
                 if (!compile_cb_insn(block, cb_op)) {
                     block->error = 1;
                     block->failed_opcode = 0xcb00 | cb_op;
@@ -380,9 +478,12 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             {
                 uint16_t target = READ_BYTE(src_ptr) | (READ_BYTE(src_ptr + 1) << 8);
                 src_ptr += 2;
+                if (block_follow_jump(block, &src_ptr, src_ptr - 3, target)) {
+                    break;
+                }
                 emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
                 emit_move_w_dn(block, REG_68K_D_NEXT_PC, target);
-                emit_patchable_exit(block);
+                emit_patchable_exit(block, target);
                 done = 1;
             }
             break;
@@ -409,8 +510,8 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             break;
 
         case 0xcd: // call imm16
-            compile_call_imm16(block, ctx, &src_ptr, src_address);
-            done = 1;
+            done = compile_call_imm16(block, ctx, &src_ptr, src_address);
+            past_call |= !done;
             break;
 
         case 0xd4: // call nc, imm16
@@ -438,12 +539,11 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             break;
 
         case 0xe0: // ld ($ff00 + u8), a
-            compile_ldh_u8_a(block, READ_BYTE(src_ptr++));
+            compile_write_known(block, ctx, 0xff00 + READ_BYTE(src_ptr++), REG_68K_D_A);
             break;
 
         case 0xe9: // jp (hl)
-            emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_NEXT_PC);
-            emit_dispatch_jump(block);
+            compile_jp_hl(block);
             done = 1;
             break;
 
@@ -456,7 +556,7 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             // Shift left - bit 7 goes to 68k C flag, 0 goes to bit 0
             emit_lsl_b_imm_dn(block, 1, REG_68K_D_A);
 
-            emit_move_sr_dn(block, REG_68K_D_FLAGS);
+            compile_set_c_flag(block);
 
             // OR old carry into bit 0
             emit_or_b_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_A);
@@ -474,7 +574,7 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             // Shift right - bit 0 goes to 68k C flag, 0 goes to bit 7
             emit_lsr_b_imm_dn(block, 1, REG_68K_D_A);
 
-            emit_move_sr_dn(block, REG_68K_D_FLAGS);
+            compile_set_c_flag(block);
 
             // OR old carry into bit 7
             emit_or_b_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_A);
@@ -483,35 +583,17 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
         }
 
         case 0xc7: // rst nn
-            compile_rst_n(block, 0x00, src_address + src_ptr);
-            done = 1;
-            break;
         case 0xcf:
-            compile_rst_n(block, 0x08, src_address + src_ptr);
-            done = 1;
-            break;
         case 0xd7:
-            compile_rst_n(block, 0x10, src_address + src_ptr);
-            done = 1;
-            break;
         case 0xdf:
-            compile_rst_n(block, 0x18, src_address + src_ptr);
-            done = 1;
-            break;
         case 0xe7:
-            compile_rst_n(block, 0x20, src_address + src_ptr);
-            done = 1;
-            break;
         case 0xef:
-            compile_rst_n(block, 0x28, src_address + src_ptr);
-            done = 1;
-            break;
         case 0xf7:
-            compile_rst_n(block, 0x30, src_address + src_ptr);
-            done = 1;
-            break;
         case 0xff:
-            compile_rst_n(block, 0x38, src_address + src_ptr);
+            // vector is 0x00, 0x08, 0x10, 0x18, 0x20, 0x28, 0x30, 0x38
+            if (!compile_jump_table(block, ctx, op & 0x38, src_address + src_ptr)) {
+                compile_rst_n(block, op & 0x38, src_address + src_ptr);
+            }
             done = 1;
             break;
 
@@ -564,7 +646,7 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
                     }
                 }
 
-                compile_ldh_a_u8(block, addr);
+                compile_read_known(block, ctx, 0xff00 + addr, REG_68K_D_A);
             }
             break;
 
@@ -591,8 +673,8 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
         case 0x36: // ld (hl), u8
             {
                 uint8_t val = READ_BYTE(src_ptr++);
-                emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_1);  // D1.w = HL
-                compile_call_dmg_write_imm(block, val);
+                emit_move_b_dn(block, REG_68K_D_NEXT_PC, val);
+                compile_write_pair(block, ctx, IR_H, REG_68K_D_NEXT_PC);
             }
             break;
 
@@ -600,8 +682,7 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             {
                 uint16_t addr = READ_BYTE(src_ptr) | (READ_BYTE(src_ptr + 1) << 8);
                 src_ptr += 2;
-                emit_move_w_dn(block, REG_68K_D_SCRATCH_1, addr);
-                compile_call_dmg_write_a(block);
+                compile_write_known(block, ctx, addr, REG_68K_D_A);
             }
             break;
 
@@ -609,13 +690,7 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             {
                 uint16_t addr = READ_BYTE(src_ptr) | (READ_BYTE(src_ptr + 1) << 8);
                 src_ptr += 2;
-                if (addr < 0x8000) {
-                    uint8_t val = ctx->read(ctx->dmg, addr);
-                    emit_moveq_dn(block, REG_68K_D_A, val);
-                } else {
-                    emit_move_w_dn(block, REG_68K_D_SCRATCH_1, addr);
-                    compile_call_dmg_read_a(block);
-                }
+                compile_read_known(block, ctx, addr, REG_68K_D_A);
             }
             break;
 
@@ -635,10 +710,19 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
             }
             // register loads: 0x40-0x7f (except 0x76 HALT)
             if (op >= 0x40 && op <= 0x7f) {
-                if (compile_reg_load(block, op)) {
+                if (compile_reg_load(block, ctx, op)) {
                     break;
                 }
             }
+            // past a call this could be data the callee reads its
+            // arguments from, so only fail if something goes there
+            if (past_call) {
+                emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
+                emit_move_w_dn(block, REG_68K_D_NEXT_PC, src_address + src_ptr - 1);
+                emit_patchable_exit(block, src_address + src_ptr - 1);
+                done = 1;
+                break;
+            }
             // unknown opcode - set error info and halt
             block->error = 1;
             block->failed_opcode = op;
@@ -657,16 +741,372 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx)
         if (ctx->single_instruction && !done) {
             emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
             emit_move_w_dn(block, REG_68K_D_NEXT_PC, src_address + src_ptr);
-            emit_patchable_exit(block);
+            emit_patchable_exit(block, src_address + src_ptr);
             break;
         }
     }
 
     block->end_address = src_address + src_ptr;
-    return block;
+    block->flags_dead = 0;
+    block->daa_state = 0;
+    block->ir = NULL;
+    return finish_block(block, ctx);
+}
+
+void block_add_entry(struct code_block *block, uint16_t src_address, uint16_t m68k_offset)
+{
+    int k;
+
+    for (k = 0; k < block->num_entries; k++) {
+        if (block->entries[k].src_address == src_address) {
+            return;
+        }
+    }
+
+    // running out just means the dispatcher compiles a new block there
+    if (block->num_entries < MAX_BLOCK_ENTRIES) {
+        block->entries[block->num_entries].src_address = src_address;
+        block->entries[block->num_entries].m68k_offset = m68k_offset;
+        block->num_entries++;
+    }
+}
+
+int block_follow_jump(struct code_block *block, uint16_t *src_ptr, uint16_t offset, uint16_t target)
+{
+    uint16_t k, target_offset = target - block->src_address;
+
+    if (!ir_follows_jump(block->src_address, offset, *src_ptr - offset, target)) {
+        return 0;
+    }
+    for (k = *src_ptr; k < target_offset; k++) {
+        block->m68k_offsets[k] = M68K_OFFSET_SKIPPED;
+    }
+    *src_ptr = target_offset;
+    block_add_entry(block, target, block->length);
+    return 1;
+}
+
+size_t block_size(struct code_block *block)
+{
+    // keep the entry table 4-byte aligned behind the code
+    size_t code_size = (block->length + 3) & ~3;
+    return sizeof(struct code_block) + code_size
+        + block->num_entries * sizeof(struct block_entry)
+        + block->num_exits * sizeof(uint16_t)
+        + block->num_relocs * sizeof(struct block_reloc);
+}
+
+void block_add_exit(struct code_block *block, uint16_t offset)
+{
+    if (block->num_exits < MAX_BLOCK_EXITS) {
+        block->exits[block->num_exits++] = offset;
+    }
+}
+
+void block_add_reloc(struct code_block *block, uint16_t offset, uint16_t kind)
+{
+    if (block->num_relocs < MAX_BLOCK_RELOCS) {
+        block->relocs[block->num_relocs].offset = offset;
+        block->relocs[block->num_relocs].kind = kind;
+        block->num_relocs++;
+    }
+}
+
+uint8_t *block_exit_site(struct code_block *block, int k)
+{
+    return block->code + block->exits[k];
+}
+
+void *block_exit_target(struct code_block *block, int k)
+{
+    uint8_t *p = block_exit_site(block, k);
+
+    // bank guard, JMP.L follows the cmpi.b/bne.s
+    if (p[0] == 0x0c && p[1] == 0x2c) {
+        p += 8;
+    }
+    // filled jp (hl) slot, after the cmpi.w/bne.s and the bank check
+    if (p[0] == 0x0c && p[1] == 0x43) {
+        p += 14;
+    }
+
+    // JMP.L written by patch_helper
+    if (p[0] != 0x4e || p[1] != 0xf9) {
+        return NULL;
+    }
+    return (void *) (uintptr_t) ((uint32_t) p[2] << 24 | (uint32_t) p[3] << 16
+        | (uint32_t) p[4] << 8 | p[5]);
+}
+
+void block_unlink_site(uint8_t *site)
+{
+    int guarded = site[0] == 0x0c && site[1] == 0x2c;
+    int k;
+
+    // jp (hl) slot, bra.s over it to the next one
+    if ((site[0] == 0x0c && site[1] == 0x43) || (site[0] == 0x60 && site[1] == 0x12)) {
+        site[0] = 0x60;
+        site[1] = 0x12;
+        return;
+    }
+
+    // same bytes emit_patchable_exit puts there
+    // movea.l JIT_CTX_PATCH_HELPER(a4), a0
+    site[0] = 0x20;
+    site[1] = 0x6c;
+    site[2] = 0x00;
+    site[3] = JIT_CTX_PATCH_HELPER;
+    // jsr (a0)
+    site[4] = 0x4e;
+    site[5] = 0x90;
+    if (guarded) {
+        // the guard's bne.s went over the rts
+        site[6] = 0x4e;
+        site[7] = 0x75;
+        // and the rest goes back to filler
+        for (k = 8; k < 20; k += 2) {
+            site[k] = 0x4a;
+            site[k + 1] = 0xfc;
+        }
+    }
+}
+
+uint8_t *block_link_jp_hl(uint8_t *slots, uint16_t pc, uint8_t bank, void *target)
+{
+    uint8_t *slot;
+    int k;
+
+    for (k = 0; k < JP_HL_SLOTS; k++) {
+        slot = slots + k * JP_HL_SLOT_SIZE;
+        if (slot[0] != 0x60) {
+            continue;
+        }
+        // cmpi.w #pc, d3
+        slot[0] = 0x0c;
+        slot[1] = 0x43;
+        slot[2] = pc >> 8;
+        slot[3] = pc;
+        // bne.s +14 = next slot
+        slot[4] = 0x66;
+        slot[5] = 0x0e;
+        if (pc >= 0x4000 && pc < 0x8000) {
+            // cmpi.b #bank, 17(a4)
+            slot[6] = 0x0c;
+            slot[7] = 0x2c;
+            slot[8] = 0x00;
+            slot[9] = bank;
+            slot[10] = 0x00;
+            slot[11] = JIT_CTX_ROM_BANK;
+            // bne.s +6 = next slot
+            slot[12] = 0x66;
+            slot[13] = 0x06;
+        } else {
+            // bra.s +6 = over the bank check
+            slot[6] = 0x60;
+            slot[7] = 0x06;
+        }
+        // jmp.l target
+        slot[14] = 0x4e;
+        slot[15] = 0xf9;
+        slot[16] = (uintptr_t) target >> 24;
+        slot[17] = (uintptr_t) target >> 16;
+        slot[18] = (uintptr_t) target >> 8;
+        slot[19] = (uintptr_t) target;
+        return slot;
+    }
+    return NULL;
 }
 
 void block_free(struct code_block *block)
 {
     free(block);
 }
+
+static void put16(uint8_t *p, uint16_t val)
+{
+    p[0] = val >> 8;
+    p[1] = val;
+}
+
+static void put32(uint8_t *p, uint32_t val)
+{
+    put16(p, val >> 16);
+    put16(p + 2, val);
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return (uint32_t) get16(p) << 16 | get16(p + 2);
+}
+
+static uint32_t reloc_base(struct compile_ctx *ctx, uint16_t kind)
+{
+    switch (kind) {
+    case RELOC_WRAM:
+        return (uint32_t) (uintptr_t) ctx->wram_base;
+    case RELOC_HRAM:
+        return (uint32_t) (uintptr_t) ctx->hram_base;
+    case RELOC_VRAM:
+        return (uint32_t) (uintptr_t) ctx->vram_base;
+    default:
+        return 0;
+    }
+}
+
+int block_saved_bank(struct code_block *block, uint8_t *bank)
+{
+    // a block that runs from bank 0 into the banked region depends on which
+    // bank was mapped
+    if (block->error || block->end_address <= block->src_address) {
+        return 0;
+    }
+    if (block->end_address <= 0x4000) {
+        *bank = 0;
+        return 1;
+    }
+    if (block->src_address >= 0x4000 && block->end_address <= 0x8000) {
+        *bank = block->bank;
+        return 1;
+    }
+    return 0;
+}
+
+// Serialized block:
+//   u16 src_address, end_address, count, length
+//   u16 num_entries, num_exits, num_relocs
+//   u8 bank, u8 unused
+//   code[length]
+//   num_entries * { u16 src_address, u16 m68k_offset }
+//   num_exits * u16 offset
+//   num_relocs * { u16 offset, u16 kind }
+size_t block_serialize(struct code_block *block, struct compile_ctx *ctx,
+                       uint8_t *out, size_t out_size)
+{
+    size_t size = 16 + block->length + block->num_entries * 4
+        + block->num_exits * 2 + block->num_relocs * 4;
+    uint8_t *code = out + 16;
+    uint8_t *p;
+    uint32_t base;
+    int k;
+
+    if (size > out_size) {
+        return 0;
+    }
+
+    put16(out, block->src_address);
+    put16(out + 2, block->end_address);
+    put16(out + 4, block->count);
+    put16(out + 6, block->length);
+    put16(out + 8, block->num_entries);
+    put16(out + 10, block->num_exits);
+    put16(out + 12, block->num_relocs);
+    out[14] = block->bank;
+    out[15] = 0;
+
+    // links point at blocks that won't be there next time
+    memcpy(code, block->code, block->length);
+    for (k = 0; k < block->num_exits; k++) {
+        block_unlink_site(code + block->exits[k]);
+    }
+
+    for (k = 0; k < block->num_relocs; k++) {
+        base = reloc_base(ctx, block->relocs[k].kind);
+        if (!base) {
+            return 0;
+        }
+        p = code + block->relocs[k].offset;
+        put32(p, get32(p) - base);
+    }
+
+    p = code + block->length;
+    for (k = 0; k < block->num_entries; k++, p += 4) {
+        put16(p, block->entries[k].src_address);
+        put16(p + 2, block->entries[k].m68k_offset);
+    }
+    for (k = 0; k < block->num_exits; k++, p += 2) {
+        put16(p, block->exits[k]);
+    }
+    for (k = 0; k < block->num_relocs; k++, p += 4) {
+        put16(p, block->relocs[k].offset);
+        put16(p + 2, block->relocs[k].kind);
+    }
+
+    return size;
+}
+
+struct code_block *block_deserialize(const uint8_t *in, size_t in_size,
+                                     struct compile_ctx *ctx)
+{
+    struct code_block *block = &scratch.block;
+    const uint8_t *p;
+    uint8_t *site;
+    uint32_t base;
+    int k;
+
+    if (in_size < 16) {
+        return NULL;
+    }
+
+    block->src_address = get16(in);
+    block->end_address = get16(in + 2);
+    block->count = get16(in + 4);
+    block->length = get16(in + 6);
+    block->num_entries = get16(in + 8);
+    block->num_exits = get16(in + 10);
+    block->num_relocs = get16(in + 12);
+    block->bank = in[14];
+
+    if (block->length > MAX_BLOCK_CODE
+            || block->num_entries > MAX_BLOCK_ENTRIES
+            || block->num_exits > MAX_BLOCK_EXITS
+            || block->num_relocs > MAX_BLOCK_RELOCS
+            || in_size != 16 + block->length + block->num_entries * 4
+                + block->num_exits * 2 + block->num_relocs * 4) {
+        return NULL;
+    }
+
+    block->error = 0;
+    block->failed_opcode = 0;
+    block->failed_address = 0;
+    block->entries = scratch_entries;
+    block->exits = scratch_exits;
+    block->relocs = scratch_relocs;
+    block->m68k_offsets = NULL;
+    block->next = NULL;
+    block->links = NULL;
+    memcpy(block->code, in + 16, block->length);
+
+    p = in + 16 + block->length;
+    for (k = 0; k < block->num_entries; k++, p += 4) {
+        block->entries[k].src_address = get16(p);
+        block->entries[k].m68k_offset = get16(p + 2);
+        block->entries[k].block = NULL;
+        block->entries[k].hash_next = NULL;
+        if (block->entries[k].m68k_offset >= block->length) {
+            return NULL;
+        }
+    }
+    for (k = 0; k < block->num_exits; k++, p += 2) {
+        block->exits[k] = get16(p);
+        if ((size_t) block->exits[k] + 8 > block->length) {
+            return NULL;
+        }
+    }
+    for (k = 0; k < block->num_relocs; k++, p += 4) {
+        block->relocs[k].offset = get16(p);
+        block->relocs[k].kind = get16(p + 2);
+        base = reloc_base(ctx, block->relocs[k].kind);
+        if (!base || (size_t) block->relocs[k].offset + 4 > block->length) {
+            return NULL;
+        }
+        site = block->code + block->relocs[k].offset;
+        put32(site, get32(site) + base);
+    }
+
+    return finish_block(block, ctx);
+}
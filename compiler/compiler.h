@@ -6,7 +6,7 @@
 
 // D0 = scratch/C interop return value
 // D1 = scratch
-// D2 = accumulated cycle count
+// D2 = cycles left before the next event, counts down (see dmg_schedule)
 // D3 = scratch/dispatcher return value (next GB PC)
 // D4 = A (GB accumulator)
 // D5 = BC (split: 0x00BB00CC)
@@ -14,7 +14,7 @@
 // D7 = flags (00000Z0C)
 
 // A0 = scratch
-// A1 = scratch
+// A1 = HL page pointer, see compile_hl_cache_load
 // A2 = HL (contiguous: 0xHHLL)
 // A3 = SP
 // A4 = runtime context pointer
@@ -32,7 +32,7 @@
 #define REG_68K_D_FLAGS 7
 
 #define REG_68K_A_SCRATCH_1 0
-#define REG_68K_A_SCRATCH_2 1
+#define REG_68K_A_HL_PAGE 1
 #define REG_68K_A_HL 2
 #define REG_68K_A_SP 3
 #define REG_68K_A_CTX 4
@@ -43,6 +43,8 @@
 #define COND_CS  5   // carry set (c)
 #define COND_NE  6   // not equal/not zero (nz)
 #define COND_EQ  7   // equal/zero (z)
+#define COND_PL  10  // plus, D2 hasn't gone past the next event
+#define COND_MI  11  // minus, it has
 #define COND_NONE -1 // not a conditional branch
 
 // Runtime context offsets
@@ -61,17 +63,83 @@
 #define JIT_CTX_WRITE16       40  // void (*dmg_write16)(void *_dmg, u16 address, u16 data);
 #define JIT_CTX_CYCLES        44  // u32: accumulated GB cycles
 #define JIT_CTX_PATCH_HELPER  48  // void *patch_helper routine
-#define JIT_CTX_READ_CYCLES   52  // u32: in-flight cycles at dmg_read call
+#define JIT_CTX_READ_CYCLES   52  // u32: D2 at a call into C, D2 comes back from here
 #define JIT_CTX_DAA_STATE     56  // 2 bytes: [0]=old_A, [1]=N flag (for DAA)
 #define JIT_CTX_FRAME_CYCLES_PTR 60  // u32 *frame_cycles_ptr (dmg->frame_cycles)
-#define JIT_CTX_UNUSED_2    64
-#define JIT_CTX_UNUSED_3    68
+#define JIT_CTX_PAGE_USE    64  // u8 *page_use, indexed by GB PC >> 8
+#define JIT_CTX_LINK        68  // void (*cache_link)(u8 *site, u8 *target)
 #define JIT_CTX_GB_SP       72  // u16: GB stack pointer value
 #define JIT_CTX_STACK_IN_RAM 76  // non-zero if A3 points to native WRAM/HRAM
+#define JIT_CTX_COPY        80  // void (*dmg_copy)(void *dmg, u16 dst, u16 src, u16 count)
+#define JIT_CTX_FILL        84  // void (*dmg_fill)(void *dmg, u16 dst, u16 count, u8 data)
+#define JIT_CTX_EVENT_CYCLES 88 // u32: cycles from the last sync to the next event, see dmg_schedule
+#define JIT_CTX_RET_TOP     92  // u8: offset of the newest entry in ret_stack
+// 3 bytes padding
+#define JIT_CTX_RET_STACK   96  // { u16 gb_pc, pad; void *code; } [RET_STACK_SIZE]
+#define JIT_CTX_JP_HL_FUNC  352 // void *(*jp_hl_miss)(u8 *slots, u16 pc)
+#define JIT_CTX_JP_HL_RUNS  356 // u32: jp (hl)s run, for the inline cache hit rate
+#define JIT_CTX_JP_HL_MISSES 360 // u32: how many of those went to jp_hl_miss
+
+// shadow return stack entries, see compile_push_return. the offsets in it
+// are a byte, so it's a ring that wraps on its own
+#define RET_STACK_SIZE 32
+#define RET_ENTRY_SIZE 8
+
+// targets each jp (hl) remembers, see compile_jp_hl. every slot is 20
+// bytes of code whether it's used or not
+#define JP_HL_SLOTS 4
+#define JP_HL_SLOT_SIZE 20
+
+// bump when the generated code changes, blocks saved by another version
+// are thrown away
+#define COMPILER_VERSION 20
+
+// blocks are compiled into a scratch buffer of this size, then copied into an
+// allocation that only holds what was actually emitted
+#define MAX_BLOCK_CODE 1024
+
+// m68k offset of every GB byte compiled so far, only needed while compiling
+#define MAX_BLOCK_SRC 1024
+// m68k_offsets for the bytes a followed jump skipped over, which nothing
+// can branch back to
+#define M68K_OFFSET_SKIPPED 0xffff
+
+// backward branch targets inside a block, registered as cache entries
+#define MAX_BLOCK_ENTRIES 64
+
+// a patchable exit is at least 12 bytes, so a full block can't have more
+// than this
+#define MAX_BLOCK_EXITS (MAX_BLOCK_CODE / 12)
+
+// only movea.l #imm32 gets relocated, which is 6 bytes
+#define MAX_BLOCK_RELOCS (MAX_BLOCK_CODE / 6)
+
+// what a relocated address in code[] is relative to
+#define RELOC_WRAM 1 // compile_ctx wram_base
+#define RELOC_HRAM 2 // compile_ctx hram_base
+#define RELOC_VRAM 3 // compile_ctx vram_base
+
+// serialized size of the largest possible block, see block_serialize
+#define MAX_SERIALIZED_BLOCK (16 + MAX_BLOCK_CODE + MAX_BLOCK_ENTRIES * 4 \
+    + MAX_BLOCK_EXITS * 2 + MAX_BLOCK_RELOCS * 4)
+
+struct block_entry {
+    uint16_t src_address;
+    uint16_t m68k_offset;
+    // owned by the block cache, for finding the block from an entry pointer
+    struct code_block *block;
+    struct block_entry *hash_next;
+};
+
+struct block_reloc {
+    uint16_t offset; // of the 32-bit address in code[]
+    uint16_t kind;
+};
+
+struct block_link;
+struct ir_op;
 
 struct code_block {
-    uint8_t code[1024];
-    uint16_t m68k_offsets[256];
     // number of bytes populated in code[]
     size_t length;
     // number of GB instructions
@@ -83,6 +151,42 @@ struct code_block {
     uint8_t error;
     uint16_t failed_opcode;
     uint16_t failed_address;
+
+    // mid-block entry points, stored after code[] in the same allocation
+    uint16_t num_entries;
+    struct block_entry *entries;
+
+    // offset of the movea.l/jsr pair in each patchable exit, which is what
+    // patch_helper overwrites with JMP.L. stored after entries[]
+    uint16_t num_exits;
+    uint16_t *exits;
+
+    // addresses in code[] that point into the dmg, which won't be in the
+    // same place next session. stored after exits[]
+    uint16_t num_relocs;
+    struct block_reloc *relocs;
+
+    // scratch table indexed by GB offset, NULL once the block is finished
+    uint16_t *m68k_offsets;
+
+    // ROM bank at compile time, for removing banked cache entries
+    uint8_t bank;
+    // only used while compiling: set when the instruction being compiled
+    // sets flags that get overwritten before anything reads them
+    uint8_t flags_dead;
+    // only used while compiling: for an op that saves old A and N for daa,
+    // set when no daa can see them. for a daa, the op right before it to
+    // work them out from instead, or 0
+    uint8_t daa_state;
+    // only used while compiling: the IR op being compiled, NULL otherwise
+    const struct ir_op *ir;
+    // owned by the block cache
+    struct code_block *next;
+    // exits in other blocks that patch_helper pointed at this one
+    struct block_link *links;
+
+    // MAX_BLOCK_CODE bytes while compiling, length bytes afterwards
+    uint8_t code[];
 };
 
 typedef uint8_t (*dmg_read_fn)(void *dmg, uint16_t address);
@@ -103,6 +207,7 @@ struct compile_ctx {
     uint8_t current_bank;        // current ROM bank for cache_store calls
     void *wram_base;        // dmg->main_ram for compile-time WRAM SP detection
     void *hram_base;
+    void *vram_base;        // dmg->video_ram for reads from known addresses
 };
 
 void compiler_init(void);
@@ -112,6 +217,57 @@ struct code_block *compile_block(uint16_t src_address, struct compile_ctx *ctx);
 // Free a compiled block
 void block_free(struct code_block *block);
 
+// Size of the allocation backing a finished block
+size_t block_size(struct code_block *block);
+
+// Record a backward branch target so it can be registered with the cache
+// once the block has its final address
+void block_add_entry(struct code_block *block, uint16_t src_address, uint16_t m68k_offset);
+
+// If ir_follows_jump says so, skip the block ahead to target, which the
+// jump at offset goes to, and make it an entry. Returns 1 if it did
+int block_follow_jump(struct code_block *block, uint16_t *src_ptr, uint16_t offset, uint16_t target);
+
+// Record a patchable exit, offset is where the movea.l/jsr pair starts
+void block_add_exit(struct code_block *block, uint16_t offset);
+
+// Record an absolute address at offset in code[] that points into memory
+// described by kind, so the block can be loaded in another session
+void block_add_reloc(struct code_block *block, uint16_t offset, uint16_t kind);
+
+// Bank a block compiled from ROM gets saved under, 0 below 0x4000. Returns
+// 0 if it can't be saved, because it runs from one region into another or
+// isn't from ROM at all
+int block_saved_bank(struct code_block *block, uint8_t *bank);
+
+// Write a finished block to out in a form that can be loaded in another
+// session: big-endian, patched exits put back and relocated addresses made
+// relative to their base. Returns the number of bytes written, or 0 if it
+// doesn't fit or the block can't be saved
+size_t block_serialize(struct code_block *block, struct compile_ctx *ctx,
+                       uint8_t *out, size_t out_size);
+
+// Rebuild a block written by block_serialize, relocated for ctx. Allocated
+// and registered the same way as compile_block. Returns NULL if the data
+// is bad or there's no memory
+struct code_block *block_deserialize(const uint8_t *in, size_t in_size,
+                                     struct compile_ctx *ctx);
+
+// Target of a patched exit, or NULL if it still goes through patch_helper
+void *block_exit_target(struct code_block *block, int k);
+
+// Address of the k-th exit's movea.l/jsr pair
+uint8_t *block_exit_site(struct code_block *block, int k);
+
+// Put back the movea.l/jsr pair so the exit goes through patch_helper again.
+// A jp (hl) slot goes back to empty
+void block_unlink_site(uint8_t *site);
+
+// Fill the first empty one of the JP_HL_SLOTS slots at slots to jump to
+// target when D3 is pc, and bank is mapped if pc is banked. Returns the
+// slot, which is an exit for cache_link, or NULL if they're all taken
+uint8_t *block_link_jp_hl(uint8_t *slots, uint16_t pc, uint8_t bank, void *target);
+
 // Emit helpers (exposed for testing)
 void emit_byte(struct code_block *block, uint8_t byte);
 void emit_word(struct code_block *block, uint16_t word);
@@ -119,6 +275,4 @@ void emit_word(struct code_block *block, uint16_t word);
 void compile_join_bc(struct code_block *block, int dreg);
 void compile_join_de(struct code_block *block, int dreg);
 
-extern int cycles_per_exit;
-
 #endif
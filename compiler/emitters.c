@@ -6,7 +6,7 @@
 
 void emit_byte(struct code_block *block, uint8_t byte)
 {
-    if (block->length < sizeof(block->code)) {
+    if (block->length < MAX_BLOCK_CODE) {
         block->code[block->length++] = byte;
     }
 }
@@ -354,6 +354,14 @@ void emit_addi_l_dn(struct code_block *block, uint8_t dreg, uint32_t imm)
     emit_long(block, imm);
 }
 
+// subi.l #imm, Dn
+void emit_subi_l_dn(struct code_block *block, uint8_t dreg, uint32_t imm)
+{
+    // 0000 0100 10 000 rrr
+    emit_word(block, 0x0480 | dreg);
+    emit_long(block, imm);
+}
+
 // or.b Ds, Dd (result to Dd)
 void emit_or_b_dn_dn(struct code_block *block, uint8_t src, uint8_t dest)
 {
@@ -595,6 +603,13 @@ void emit_jsr_ind_an(struct code_block *block, uint8_t areg)
     emit_word(block, 0x4e90 | areg);
 }
 
+// jmp (An) - jump via address register
+void emit_jmp_ind_an(struct code_block *block, uint8_t areg)
+{
+    // 0100 1110 11 010 aaa
+    emit_word(block, 0x4ed0 | areg);
+}
+
 // addq.l #val, An - add quick to address register (long)
 void emit_addq_l_an(struct code_block *block, uint8_t areg, uint8_t val)
 {
@@ -749,6 +764,19 @@ void emit_adda_w_dn_an(struct code_block *block, uint8_t dreg, uint8_t areg)
     emit_word(block, 0xd0c0 | (areg << 9) | dreg);
 }
 
+void emit_suba_w_dn_an(struct code_block *block, uint8_t dreg, uint8_t areg)
+{
+    // 1001 aaa 011 000 ddd
+    emit_word(block, 0x90c0 | (areg << 9) | dreg);
+}
+
+// suba.l An, An - clears it without touching CCR
+void emit_suba_l_an_an(struct code_block *block, uint8_t src_areg, uint8_t dest_areg)
+{
+    // 1001 aaa 111 001 sss
+    emit_word(block, 0x91c8 | (dest_areg << 9) | src_areg);
+}
+
 // adda.l Dn, An - ADD data register to address register (full 32-bit)
 void emit_adda_l_dn_an(struct code_block *block, uint8_t dreg, uint8_t areg)
 {
@@ -813,6 +841,13 @@ void emit_tst_b_dn(struct code_block *block, uint8_t dreg)
     emit_word(block, 0x4a00 | dreg);
 }
 
+// tst.l Dn - test long in data register (sets Z and N flags)
+void emit_tst_l_dn(struct code_block *block, uint8_t dreg)
+{
+    // 0100 1010 10 000 rrr
+    emit_word(block, 0x4a80 | dreg);
+}
+
 // lsr.w #count, Dn - logical shift right word by immediate (1-8)
 void emit_lsr_w_imm_dn(struct code_block *block, uint8_t count, uint8_t dreg)
 {
@@ -889,6 +924,29 @@ void emit_move_b_dn_idx_an(
 }
 
 // move.b d(An,Dm.w), Dd - load byte from indexed address with 8-bit displacement
+// move.b (base_areg,idx_areg.w), Dn
+void emit_move_b_idx_an_an_dn(
+    struct code_block *block,
+    uint8_t base_areg,
+    uint8_t idx_areg,
+    uint8_t dest_dreg
+) {
+    // extension word: D/A=1 | idx_reg | W/L=0 | 000 | 0 (disp=0)
+    emit_word(block, 0x1030 | (dest_dreg << 9) | base_areg);
+    emit_word(block, 0x8000 | idx_areg << 12);
+}
+
+// move.b Dn, (base_areg,idx_areg.w)
+void emit_move_b_dn_idx_an_an(
+    struct code_block *block,
+    uint8_t src_dreg,
+    uint8_t base_areg,
+    uint8_t idx_areg
+) {
+    emit_word(block, 0x1180 | (base_areg << 9) | src_dreg);
+    emit_word(block, 0x8000 | idx_areg << 12);
+}
+
 void emit_move_b_disp_idx_an_dn(
     struct code_block *block,
     int8_t disp,
@@ -916,6 +974,79 @@ void emit_move_b_dn_disp_idx_an(
     emit_word(block, (idx_dreg << 12) | ((uint8_t) disp));
 }
 
+// move.w #imm16, d8(An,Dm.w)
+void emit_move_w_imm_disp_idx_an(
+    struct code_block *block,
+    uint16_t imm,
+    int8_t disp,
+    uint8_t base_areg,
+    uint8_t idx_dreg
+) {
+    // move.w #imm, ea: 00 11 aaa 110 111 100, immediate before the
+    // extension word
+    emit_word(block, 0x31bc | (base_areg << 9));
+    emit_word(block, imm);
+    emit_word(block, (idx_dreg << 12) | ((uint8_t) disp));
+}
+
+// move.l As, d8(An,Dm.w)
+void emit_move_l_an_disp_idx_an(
+    struct code_block *block,
+    uint8_t src_areg,
+    int8_t disp,
+    uint8_t base_areg,
+    uint8_t idx_dreg
+) {
+    // move.l As, ea: 00 10 aaa 110 001 sss
+    emit_word(block, 0x2188 | (base_areg << 9) | src_areg);
+    emit_word(block, (idx_dreg << 12) | ((uint8_t) disp));
+}
+
+// cmp.w d8(An,Dm.w), Dd
+void emit_cmp_w_disp_idx_an_dn(
+    struct code_block *block,
+    int8_t disp,
+    uint8_t base_areg,
+    uint8_t idx_dreg,
+    uint8_t dest_dreg
+) {
+    // cmp.w ea, Dn: 1011 ddd 001 110 aaa
+    emit_word(block, 0xb070 | (dest_dreg << 9) | base_areg);
+    emit_word(block, (idx_dreg << 12) | ((uint8_t) disp));
+}
+
+// lea d16(pc), An - disp is from the extension word, which is where
+// block->length is once the opcode is out
+void emit_lea_pc_an(struct code_block *block, int16_t disp, uint8_t dest_areg)
+{
+    emit_word(block, 0x41fa | (dest_areg << 9));
+    emit_word(block, disp);
+}
+
+// move.w d(pc,Dm.w), Dd - disp is from the extension word
+void emit_move_w_pc_idx_dn(struct code_block *block, int8_t disp, uint8_t idx_dreg, uint8_t dest_dreg)
+{
+    // 00 11 ddd 000 111 011 (mode 111 reg 011 = PC with index)
+    emit_word(block, 0x303b | (dest_dreg << 9));
+    emit_word(block, (idx_dreg << 12) | ((uint8_t) disp));
+}
+
+// jmp d(pc,Dm.w) - disp is from the extension word
+void emit_jmp_pc_idx(struct code_block *block, int8_t disp, uint8_t idx_dreg)
+{
+    // 0100 1110 11 111 011
+    emit_word(block, 0x4efb);
+    emit_word(block, (idx_dreg << 12) | ((uint8_t) disp));
+}
+
+// pea d16(pc) - disp is from the extension word, like emit_lea_pc_an
+void emit_pea_pc(struct code_block *block, int16_t disp)
+{
+    // 0100 1000 01 111 010
+    emit_word(block, 0x487a);
+    emit_word(block, disp);
+}
+
 // lea d(An), An - load effective address with 16-bit displacement
 void emit_lea_disp_an_an(
     struct code_block *block,
@@ -1056,6 +1187,19 @@ void emit_addq_b_disp_an(
 }
 
 
+// subq.b #data, d(An) - subtract quick (1-8) from memory byte
+void emit_subq_b_disp_an(
+    struct code_block *block,
+    uint8_t data,
+    int16_t disp,
+    uint8_t areg
+) {
+    // 0101 ddd 1 00 101 aaa (ddd: 1-7 = 1-7, 0 = 8)
+    uint8_t ddd = (data == 8) ? 0 : data;
+    emit_word(block, 0x5100 | (ddd << 9) | 0x28 | areg);
+    emit_word(block, disp);
+}
+
 // addi.l #imm32, d(An) - add immediate long to memory
 void emit_addi_l_disp_an(
     struct code_block *block,
@@ -1082,6 +1226,19 @@ void emit_cmpi_l_imm32_disp_an(
     emit_word(block, disp);
 }
 
+// cmpi.b #imm8, d(An) - compare immediate byte with memory
+void emit_cmpi_b_imm_disp_an(
+    struct code_block *block,
+    uint8_t imm,
+    int16_t disp,
+    uint8_t areg
+) {
+    // 0000 1100 00 101 aaa
+    emit_word(block, 0x0c28 | areg);
+    emit_word(block, imm);
+    emit_word(block, disp);
+}
+
 // cmpi.l #imm32, Dn - compare immediate long with data register
 void emit_cmpi_l_imm_dn(struct code_block *block, uint32_t imm, uint8_t dreg)
 {
@@ -1134,6 +1291,24 @@ void emit_bhi_b(struct code_block *block, int8_t disp)
     emit_word(block, 0x6200 | ((uint8_t) disp));
 }
 
+void emit_bvs_b(struct code_block *block, int8_t disp)
+{
+    // 0110 1001 dddd dddd
+    emit_word(block, 0x6900 | ((uint8_t) disp));
+}
+
+void emit_bmi_b(struct code_block *block, int8_t disp)
+{
+    // 0110 1011 dddd dddd
+    emit_word(block, 0x6b00 | ((uint8_t) disp));
+}
+
+void emit_bpl_b(struct code_block *block, int8_t disp)
+{
+    // 0110 1010 dddd dddd
+    emit_word(block, 0x6a00 | ((uint8_t) disp));
+}
+
 // subi.w #imm16, Dn - subtract immediate word from data register
 void emit_subi_w_dn(struct code_block *block, uint16_t imm, uint8_t dreg)
 {
@@ -1184,34 +1359,79 @@ void emit_cmp_l_dn_dn(struct code_block *block, uint8_t src, uint8_t dest)
     emit_word(block, 0xb080 | (dest << 9) | src);
 }
 
-// emit_add_cycles - add GB cycles to context, picks optimal instruction
+// cmp.w Dn,Dn (src - dest comparison, sets flags)
+void emit_cmp_w_dn_dn(struct code_block *block, uint8_t src, uint8_t dest)
+{
+    // CMP.W Dn,Dn: 1011 dest 001 000 src
+    emit_word(block, 0xb040 | (dest << 9) | src);
+}
+
+// move.l d16(An), Dn
+void emit_move_l_disp_an_dn(struct code_block *block, int16_t disp, uint8_t areg, uint8_t dreg)
+{
+    // 00 10 ddd 000 101 aaa
+    emit_word(block, 0x2028 | (dreg << 9) | areg);
+    emit_word(block, disp);
+}
+
+// divu.w #imm16, Dn - quotient in the low word, remainder in the high word
+void emit_divu_w_imm_dn(struct code_block *block, uint16_t imm, uint8_t dreg)
+{
+    // DIVU <ea>,Dn: 1000 ddd 011 <ea>
+    // immediate mode: <ea> = 111 100
+    emit_word(block, 0x80fc | (dreg << 9));
+    emit_word(block, imm);
+}
+
+// emit_add_cycles - take GB cycles off the budget in D2, picks optimal
+// instruction. N is set afterwards if that went past the next event.
+// negative gives them back
 void emit_add_cycles(struct code_block *block, int cycles)
 {
-    if (cycles <= 0) {
+    if (cycles < 0) {
+        if (cycles >= -8) {
+            emit_addq_l_dn(block, REG_68K_D_CYCLE_COUNT, -cycles);
+        } else {
+            emit_addi_l_dn(block, REG_68K_D_CYCLE_COUNT, -cycles);
+        }
+        return;
+    }
+    if (cycles == 0) {
         return;
     }
     if (cycles <= 8) {
-        emit_addq_l_dn(block, REG_68K_D_CYCLE_COUNT, cycles);
-        // emit_addq_l_disp_an(block, cycles, JIT_CTX_CYCLES, REG_68K_A_CTX);
+        emit_subq_l_dn(block, REG_68K_D_CYCLE_COUNT, cycles);
     } else {
-        emit_addi_l_dn(block, REG_68K_D_CYCLE_COUNT, cycles);
-        // emit_addi_l_disp_an(block, cycles, JIT_CTX_CYCLES, REG_68K_A_CTX);
+        emit_subi_l_dn(block, REG_68K_D_CYCLE_COUNT, cycles);
     }
 }
 
 // Emit inline mini-dispatcher with patchable exit
 // This sequence:
-// 1. Checks cycle count (exit if >= 456)
+// 1. Checks cycle count (exit once D2 goes past the next event)
 // 2. Calls patch_helper via JSR (first execution)
 // 3. patch_helper will patch the movea.l+jsr into jmp.l <target> for future runs
-// 16 bytes total
-void emit_patchable_exit(struct code_block *block)
+// 12 bytes total, or 26 for targets in the banked region. those get patched
+// with a guard instead, since the bank can change before the exit runs again:
+//     cmpi.b #bank, JIT_CTX_ROM_BANK(a4)
+//     bne.s +6
+//     jmp.l <target>
+//     movea.l JIT_CTX_DISPATCH(a4), a0
+//     jmp (a0)
+void emit_patchable_exit(struct code_block *block, uint16_t target)
 {
-    // cmpi.l #cycles_per_exit, d2 (6 bytes)
-    emit_cmpi_l_imm_dn(block, cycles_per_exit, REG_68K_D_CYCLE_COUNT);
+    int banked = target >= 0x4000 && target < 0x8000;
+    int k;
+
+    // tst.l d2 (2 bytes), loading d3 just before changes N
+    emit_tst_l_dn(block, REG_68K_D_CYCLE_COUNT);
 
-    // bcc.s +6 = skip over movea.l + jsr to rts (2 bytes)
-    emit_bcc_s(block, 6);
+    // bmi.s +6 = skip over movea.l + jsr to rts (2 bytes)
+    // or +20 to skip over the room for the guard
+    emit_bmi_b(block, banked ? 20 : 6);
+
+    // this is the part patch_helper replaces
+    block_add_exit(block, block->length);
 
     // movea.l JIT_CTX_PATCH_HELPER(a4), a0 (4 bytes)
     emit_movea_l_disp_an_an(block, JIT_CTX_PATCH_HELPER, REG_68K_A_CTX, REG_68K_A_SCRATCH_1);
@@ -1219,6 +1439,15 @@ void emit_patchable_exit(struct code_block *block)
     // jsr (a0) (2 bytes)
     emit_jsr_ind_an(block, REG_68K_A_SCRATCH_1);
 
+    if (banked) {
+        // patch_helper returns here when it can't patch (2 bytes)
+        emit_rts(block);
+        // rest of the guard (12 bytes)
+        for (k = 0; k < 6; k++) {
+            emit_word(block, 0x4afc);
+        }
+    }
+
     // rts (2 bytes)
     emit_rts(block);
 }
\ No newline at end of file
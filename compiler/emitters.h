@@ -47,12 +47,13 @@ void emit_ori_b_dn(struct code_block *block, uint8_t dreg, uint8_t imm);
 void emit_subi_b_dn(struct code_block *block, uint8_t dreg, uint8_t imm);
 void emit_addi_b_dn(struct code_block *block, uint8_t dreg, uint8_t imm);
 void emit_addi_l_dn(struct code_block *block, uint8_t dreg, uint32_t imm);
+void emit_subi_l_dn(struct code_block *block, uint8_t dreg, uint32_t imm);
 void emit_or_b_dn_dn(struct code_block *block, uint8_t src, uint8_t dest);
 void emit_or_l_dn_dn(struct code_block *block, uint8_t src, uint8_t dest);
 
 void emit_rts(struct code_block *block);
 void emit_dispatch_jump(struct code_block *block);
-void emit_patchable_exit(struct code_block *block);
+void emit_patchable_exit(struct code_block *block, uint16_t target);
 void emit_bra_b(struct code_block *block, int8_t disp);
 void emit_bra_w(struct code_block *block, int16_t disp);
 void emit_beq_b(struct code_block *block, int8_t disp);
@@ -81,6 +82,7 @@ void emit_push_l_disp_an(struct code_block *block, int16_t disp, uint8_t areg);
 void emit_movea_l_ind_an_an(struct code_block *block, uint8_t src_areg, uint8_t dest_areg);
 void emit_movea_l_disp_an_an(struct code_block *block, int16_t disp, uint8_t src_areg, uint8_t dest_areg);
 void emit_jsr_ind_an(struct code_block *block, uint8_t areg);
+void emit_jmp_ind_an(struct code_block *block, uint8_t areg);
 void emit_addq_l_an(struct code_block *block, uint8_t areg, uint8_t val);
 void emit_movem_l_to_predec(struct code_block *block, uint16_t mask);
 void emit_movem_l_from_postinc(struct code_block *block, uint16_t mask);
@@ -100,21 +102,33 @@ void emit_add_l_dn_dn(struct code_block *block, uint8_t src, uint8_t dest);
 void emit_sub_b_dn_dn(struct code_block *block, uint8_t src, uint8_t dest);
 void emit_sub_w_dn_dn(struct code_block *block, uint8_t src, uint8_t dest);
 void emit_adda_w_dn_an(struct code_block *block, uint8_t dreg, uint8_t areg);
+void emit_suba_w_dn_an(struct code_block *block, uint8_t dreg, uint8_t areg);
+void emit_suba_l_an_an(struct code_block *block, uint8_t src_areg, uint8_t dest_areg);
 void emit_adda_l_dn_an(struct code_block *block, uint8_t dreg, uint8_t areg);
 void emit_tst_b_disp_an(struct code_block *block, int16_t disp, uint8_t areg);
 void emit_lsl_b_imm_dn(struct code_block *block, uint8_t count, uint8_t dreg);
 void emit_lsr_b_imm_dn(struct code_block *block, uint8_t count, uint8_t dreg);
 void emit_asr_b_imm_dn(struct code_block *block, uint8_t count, uint8_t dreg);
 void emit_tst_b_dn(struct code_block *block, uint8_t dreg);
+void emit_tst_l_dn(struct code_block *block, uint8_t dreg);
 void emit_lsr_w_imm_dn(struct code_block *block, uint8_t count, uint8_t dreg);
 void emit_lsr_l_imm_dn(struct code_block *block, uint8_t count, uint8_t dreg);
 void emit_move_l_an_dn(struct code_block *block, uint8_t areg, uint8_t dreg);
 void emit_movea_l_idx_an_an(struct code_block *block, int8_t disp, uint8_t base_areg, uint8_t idx_dreg, uint8_t dest_areg);
 void emit_move_b_idx_an_dn(struct code_block *block, uint8_t base_areg, uint8_t idx_dreg, uint8_t dest_dreg);
 void emit_move_b_dn_idx_an(struct code_block *block, uint8_t src_dreg, uint8_t base_areg, uint8_t idx_dreg);
+void emit_move_b_idx_an_an_dn(struct code_block *block, uint8_t base_areg, uint8_t idx_areg, uint8_t dest_dreg);
+void emit_move_b_dn_idx_an_an(struct code_block *block, uint8_t src_dreg, uint8_t base_areg, uint8_t idx_areg);
 void emit_move_b_disp_idx_an_dn(struct code_block *block, int8_t disp, uint8_t base_areg, uint8_t idx_dreg, uint8_t dest_dreg);
 void emit_move_b_dn_disp_idx_an(struct code_block *block, uint8_t src_dreg, int8_t disp, uint8_t base_areg, uint8_t idx_dreg);
+void emit_move_w_imm_disp_idx_an(struct code_block *block, uint16_t imm, int8_t disp, uint8_t base_areg, uint8_t idx_dreg);
+void emit_move_l_an_disp_idx_an(struct code_block *block, uint8_t src_areg, int8_t disp, uint8_t base_areg, uint8_t idx_dreg);
+void emit_cmp_w_disp_idx_an_dn(struct code_block *block, int8_t disp, uint8_t base_areg, uint8_t idx_dreg, uint8_t dest_dreg);
 void emit_lea_disp_an_an(struct code_block *block, int16_t disp, uint8_t src_areg, uint8_t dest_areg);
+void emit_lea_pc_an(struct code_block *block, int16_t disp, uint8_t dest_areg);
+void emit_pea_pc(struct code_block *block, int16_t disp);
+void emit_move_w_pc_idx_dn(struct code_block *block, int8_t disp, uint8_t idx_dreg, uint8_t dest_dreg);
+void emit_jmp_pc_idx(struct code_block *block, int8_t disp, uint8_t idx_dreg);
 void emit_move_l_dn_disp_an(struct code_block *block, uint8_t dreg, int16_t disp, uint8_t areg);
 void emit_add_l_disp_an_dn(struct code_block *block, int16_t disp, uint8_t areg, uint8_t dreg);
 void emit_sub_l_disp_an_dn(struct code_block *block, int16_t disp, uint8_t areg, uint8_t dreg);
@@ -125,8 +139,10 @@ void emit_tst_l_disp_an(struct code_block *block, int16_t disp, uint8_t areg);
 void emit_addi_w_disp_an(struct code_block *block, int16_t imm, int16_t disp, uint8_t areg);
 void emit_subi_w_disp_an(struct code_block *block, int16_t imm, int16_t disp, uint8_t areg);
 void emit_addq_b_disp_an(struct code_block *block, uint8_t data, int16_t disp, uint8_t areg);
+void emit_subq_b_disp_an(struct code_block *block, uint8_t data, int16_t disp, uint8_t areg);
 void emit_addq_l_disp_an(struct code_block *block, uint8_t data, int16_t disp, uint8_t areg);
 void emit_addi_l_disp_an(struct code_block *block, uint32_t imm, int16_t disp, uint8_t areg);
+void emit_cmpi_b_imm_disp_an(struct code_block *block, uint8_t imm, int16_t disp, uint8_t areg);
 void emit_cmpi_l_imm32_disp_an(struct code_block *block, uint32_t imm, int16_t disp, uint8_t areg);
 void emit_cmpi_l_imm_dn(struct code_block *block, uint32_t imm, uint8_t dreg);
 void emit_cmpi_w_imm_dn(struct code_block *block, uint16_t imm, uint8_t dreg);
@@ -135,6 +151,9 @@ void emit_bcs_b(struct code_block *block, int8_t disp);
 void emit_bne_b(struct code_block *block, int8_t disp);
 void emit_bls_b(struct code_block *block, int8_t disp);
 void emit_bhi_b(struct code_block *block, int8_t disp);
+void emit_bvs_b(struct code_block *block, int8_t disp);
+void emit_bmi_b(struct code_block *block, int8_t disp);
+void emit_bpl_b(struct code_block *block, int8_t disp);
 void emit_subi_w_dn(struct code_block *block, uint16_t imm, uint8_t dreg);
 void emit_move_l_ind_an_dn(struct code_block *block, uint8_t areg, uint8_t dreg);
 void emit_sub_l_dn_dn(struct code_block *block, uint8_t src, uint8_t dest);
@@ -143,5 +162,8 @@ void emit_move_sr_dn(struct code_block *block, uint8_t dreg);
 void emit_move_dn_ccr(struct code_block *block, uint8_t dreg);
 void emit_mulu_w_imm_dn(struct code_block *block, uint16_t imm, uint8_t dreg);
 void emit_cmp_l_dn_dn(struct code_block *block, uint8_t src, uint8_t dest);
+void emit_cmp_w_dn_dn(struct code_block *block, uint8_t src, uint8_t dest);
+void emit_move_l_disp_an_dn(struct code_block *block, int16_t disp, uint8_t areg, uint8_t dreg);
+void emit_divu_w_imm_dn(struct code_block *block, uint16_t imm, uint8_t dreg);
 
 #endif
@@ -1,5 +1,7 @@
 #include "compiler.h"
 #include "emitters.h"
+#include "flags.h"
+#include "ir.h"
 
 // how to do the flags properly:
 // 8-bit and, or, xor -> set Z for result, set C=0
@@ -12,14 +14,323 @@
 // swap -> set Z for result, set C=0
 // bit -> set Z for result, leave C alone
 
+// how an instruction uses D7, for find_dead_flags
+#define FLAGS_NONE  0 // doesn't touch it
+#define FLAGS_WRITE 1 // overwrites it without looking at it first
+#define FLAGS_READ  2 // needs what's there, even if it also sets it
+#define FLAGS_EXIT  3 // might leave the block, so it has to be up to date
+
+static int flag_use(uint8_t op, uint8_t next)
+{
+    if (op == 0xcb) {
+        // rlc, rrc, sla, sra, swap, srl
+        if (next < 0x10 || (next >= 0x20 && next < 0x40)) {
+            return FLAGS_WRITE;
+        }
+        // rl and rr shift C in, bit leaves C alone
+        if (next < 0x80) {
+            return FLAGS_READ;
+        }
+        // res, set
+        return FLAGS_NONE;
+    }
+
+    // inc r, dec r, including (hl)
+    if ((op & 0xc6) == 0x04 && op < 0x40) {
+        return FLAGS_WRITE;
+    }
+    // adc, sbc
+    if ((op >= 0x88 && op < 0x90) || (op >= 0x98 && op < 0xa0)) {
+        return FLAGS_READ;
+    }
+    // add, sub, and, xor, or, cp
+    if (op >= 0x80 && op < 0xc0) {
+        return FLAGS_WRITE;
+    }
+    // rst
+    if ((op & 0xc7) == 0xc7) {
+        return FLAGS_EXIT;
+    }
+
+    switch (op) {
+    case 0x07: case 0x0f: // rlca, rrca
+    case 0x09: case 0x19: case 0x29: case 0x39: // add hl, rr
+    case 0xc6: case 0xd6: case 0xe6: case 0xee: case 0xf6: case 0xfe:
+    case 0xf1: // pop af
+        return FLAGS_WRITE;
+
+    case 0xce: case 0xde: // adc/sbc imm
+    case 0x17: case 0x1f: // rla, rra
+    case 0x27: case 0x37: case 0x3f: // daa, scf, ccf
+    case 0xf5: // push af
+        return FLAGS_READ;
+
+    case 0x20: case 0x28: case 0x30: case 0x38:
+    case 0xc0: case 0xc8: case 0xd0: case 0xd8:
+    case 0xc2: case 0xca: case 0xd2: case 0xda:
+    case 0xc4: case 0xcc: case 0xd4: case 0xdc:
+    case 0x18: case 0xc3: case 0xc9: case 0xcd: case 0xd9: case 0xe9:
+    case 0x10: case 0x76:
+    // unused opcodes, which compile to an exit
+    case 0xd3: case 0xdb: case 0xdd: case 0xe3: case 0xe4:
+    case 0xeb: case 0xec: case 0xed: case 0xf4: case 0xfc: case 0xfd:
+        return FLAGS_EXIT;
+
+    case 0xf0:
+        // ldh a, (LY) can turn into a wait that skips the cp after it
+        return next == 0x44 ? FLAGS_EXIT : FLAGS_NONE;
+
+    default:
+        return FLAGS_NONE;
+    }
+}
+
+void find_dead_flags(struct ir_block *ir, struct compile_ctx *ctx)
+{
+    struct ir_op *op;
+    int live = 1, k;
+
+    (void) ctx;
+
+    // backwards. past the end is an exit, but if compile_block stops
+    // early for space, the next block starts with the instruction after,
+    // which is what this already assumed comes next
+    for (k = ir->count - 1; k >= 0; k--) {
+        op = &ir->ops[k];
+        op->flags_dead = !live;
+
+        // a followed jump doesn't leave the block
+        switch (op->follows ? FLAGS_NONE : flag_use(op->op, op->operand[0])) {
+        case FLAGS_WRITE:
+            live = 0;
+            break;
+        case FLAGS_READ:
+        case FLAGS_EXIT:
+            live = 1;
+            break;
+        }
+    }
+}
+
+// the ops that call compile_daa_track_add/sub
+static int tracks_daa(uint8_t op)
+{
+    return (op >= 0x80 && op < 0xa0) || op == 0x3c || op == 0x3d
+        || op == 0xc6 || op == 0xce || op == 0xd6 || op == 0xde;
+}
+
+// the ones compile_daa can work out old A and N from afterwards, as long
+// as nothing runs in between
+static int daa_can_recompute(uint8_t op)
+{
+    return op == 0x3c || op == 0x3d || op == 0x81 || op == 0x83
+        || op == 0x91 || op == 0x93 || op == 0xc6 || op == 0xd6;
+}
+
+// writes that could land on an MBC register
+static int may_switch_bank(struct compile_ctx *ctx, uint16_t pc, uint8_t op)
+{
+    uint8_t next = ctx->read(ctx->dmg, pc + 1);
+
+    switch (op) {
+    case 0x02: case 0x12: case 0x22: case 0x32: case 0x34: case 0x35: case 0x36:
+    case 0x70: case 0x71: case 0x72: case 0x73: case 0x74: case 0x75: case 0x77:
+        return 1;
+    case 0x08: case 0xea:
+        return ctx->read(ctx->dmg, pc + 2) < 0x80;
+    case 0xcb:
+        // everything on (hl) but bit
+        return (next & 7) == 6 && (next < 0x40 || next >= 0x80);
+    default:
+        return 0;
+    }
+}
+
+#define DAA_SCAN_STEPS 64
+#define DAA_SCAN_PATHS 8
+
+struct daa_path {
+    uint16_t pc;
+    // where a ret goes, if the scan followed the call, otherwise 0
+    uint16_t ret;
+    // whether 0x4000-0x7fff still has the bank this was compiled with
+    uint8_t same_bank;
+};
+
+// Follow the code from pc, both ways at conditional branches, to see if a
+// daa could run before another op overwrites the state. Anything it can't
+// follow (jp hl, a ret it didn't see the call for, RAM, too far) counts
+// as seen
+static int daa_state_seen(struct compile_ctx *ctx, uint16_t pc, int same_bank)
+{
+    struct daa_path paths[DAA_SCAN_PATHS], path;
+    int num_paths = 1, steps = 0, taken;
+    uint16_t next, target;
+    uint8_t op;
+
+    paths[0].pc = pc;
+    paths[0].ret = 0;
+    paths[0].same_bank = same_bank;
+
+    while (num_paths) {
+        path = paths[--num_paths];
+        for (;;) {
+            if (++steps > DAA_SCAN_STEPS || path.pc >= 0x8000
+                    || (path.pc >= 0x4000 && !path.same_bank)) {
+                return 1;
+            }
+
+            op = ctx->read(ctx->dmg, path.pc);
+            if (op == 0x27) {
+                return 1;
+            }
+            if (tracks_daa(op)) {
+                // overwritten, this way is done
+                break;
+            }
+            if (may_switch_bank(ctx, path.pc, op)) {
+                path.same_bank = 0;
+            }
+
+            next = path.pc + ir_op_length(op);
+            target = ctx->read(ctx->dmg, path.pc + 1)
+                | ctx->read(ctx->dmg, path.pc + 2) << 8;
+            taken = -1;
+
+            switch (op) {
+            case 0x18:
+                path.pc = next + (int8_t) target;
+                continue;
+            case 0x20: case 0x28: case 0x30: case 0x38:
+                taken = (uint16_t) (next + (int8_t) target);
+                break;
+            case 0xc3:
+                path.pc = target;
+                continue;
+            case 0xc2: case 0xca: case 0xd2: case 0xda:
+                taken = target;
+                break;
+            case 0xc4: case 0xcc: case 0xd4: case 0xdc:
+                if (num_paths == DAA_SCAN_PATHS) {
+                    return 1;
+                }
+                paths[num_paths] = path;
+                paths[num_paths++].pc = next;
+                // fall through
+            case 0xcd:
+                if (path.ret) {
+                    return 1;
+                }
+                path.ret = next;
+                path.pc = target;
+                continue;
+            case 0xc0: case 0xc8: case 0xd0: case 0xd8:
+                if (!path.ret) {
+                    return 1;
+                }
+                taken = path.ret;
+                break;
+            case 0xc9:
+                if (!path.ret) {
+                    return 1;
+                }
+                path.pc = path.ret;
+                path.ret = 0;
+                continue;
+            // reti, jp hl, stop, halt and the unused opcodes
+            case 0xd9: case 0xe9: case 0x10: case 0x76:
+            case 0xd3: case 0xdb: case 0xdd: case 0xe3: case 0xe4:
+            case 0xeb: case 0xec: case 0xed: case 0xf4: case 0xfc: case 0xfd:
+                return 1;
+            default:
+                if ((op & 0xc7) == 0xc7) {
+                    // rst
+                    if (path.ret) {
+                        return 1;
+                    }
+                    path.ret = next;
+                    path.pc = op & 0x38;
+                    continue;
+                }
+                break;
+            }
+
+            if (taken >= 0) {
+                if (num_paths == DAA_SCAN_PATHS) {
+                    return 1;
+                }
+                paths[num_paths] = path;
+                paths[num_paths].pc = taken;
+                if ((op & 0xe7) == 0xc0) {
+                    // ret cc
+                    paths[num_paths].ret = 0;
+                }
+                num_paths++;
+            }
+            path.pc = next;
+        }
+    }
+    return 0;
+}
+
+static int is_jr_target(struct ir_block *ir, uint16_t offset)
+{
+    struct ir_op *op;
+    int k;
+
+    for (k = 0; k < ir->count; k++) {
+        op = &ir->ops[k];
+        if ((op->op == 0x18 || (op->op & 0xe7) == 0x20)
+                && op->offset + 2 + (int8_t) op->operand[0] == offset) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void find_daa_state_use(struct ir_block *ir, struct compile_ctx *ctx)
+{
+    uint16_t address, after;
+    struct ir_op *op;
+    int k;
+
+    for (k = 0; k < ir->count; k++) {
+        op = &ir->ops[k];
+        if (!tracks_daa(op->op)) {
+            continue;
+        }
+
+        // a daa straight after with no way in but this can work the state
+        // out itself, so only look past it
+        after = op->offset + op->length;
+        if (k + 1 < ir->count && daa_can_recompute(op->op)
+                && ir->ops[k + 1].op == 0x27
+                && !is_jr_target(ir, after)) {
+            ir->ops[k + 1].daa_state = op->op;
+            after++;
+        }
+
+        // banked code only runs with its own bank in
+        address = ir->src_address + op->offset;
+        if (!daa_state_seen(ctx, ir->src_address + after,
+                address >= 0x4000 && address < 0x8000)) {
+            op->daa_state = 1;
+        }
+    }
+}
+
 void compile_set_zc_flags(struct code_block *block)
 {
-    emit_move_sr_dn(block, REG_68K_D_FLAGS);
+    if (!block->flags_dead) {
+        emit_move_sr_dn(block, REG_68K_D_FLAGS);
+    }
 }
 
 void compile_set_z_flag(struct code_block *block)
 {
-    emit_move_sr_dn(block, REG_68K_D_FLAGS);
+    if (!block->flags_dead) {
+        emit_move_sr_dn(block, REG_68K_D_FLAGS);
+    }
 
     // certain instructions only set Z and leave C alone, and vice versa.
     // this version emulates that. i haven't found anything that breaks
@@ -33,7 +344,9 @@ void compile_set_z_flag(struct code_block *block)
 
 void compile_set_c_flag(struct code_block *block)
 {
-    emit_move_sr_dn(block, REG_68K_D_FLAGS);
+    if (!block->flags_dead) {
+        emit_move_sr_dn(block, REG_68K_D_FLAGS);
+    }
 
     // emit_move_sr_dn(block, REG_68K_D_NEXT_PC);
     // emit_andi_b_dn(block, REG_68K_D_NEXT_PC, 0x01);
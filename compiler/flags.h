@@ -1,6 +1,22 @@
 #ifndef _FLAGS_H
 #define _FLAGS_H
 
+#include <stdint.h>
+
+struct code_block;
+struct compile_ctx;
+struct ir_block;
+
+// IR passes. Set flags_dead for each op whose flags are overwritten before
+// anything reads them or the block can exit
+void find_dead_flags(struct ir_block *ir, struct compile_ctx *ctx);
+
+// Set daa_state for each add, adc, sub, sbc, inc a and dec a when no daa
+// can see the old A and N it would save. For a daa right after one that
+// compile_daa can work those out from instead, daa_state is that op
+void find_daa_state_use(struct ir_block *ir, struct compile_ctx *ctx);
+
+// These skip the save when block->flags_dead is set
 void compile_set_zc_flags(struct code_block *block);
 void compile_set_z_flag(struct code_block *block);
 void compile_set_c_flag(struct code_block *block);
@@ -0,0 +1,373 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "emitters.h"
+#include "idioms.h"
+#include "ir.h"
+
+// Move past op if it's code
+static int take(const struct ir_op **op, const struct ir_op *end, uint8_t code)
+{
+    if (*op < end && (*op)->op == code) {
+        (*op)++;
+        return 1;
+    }
+    return 0;
+}
+
+// dec r, or dec bc or dec de then ld a, b; or c or the like. A zero test
+// that leaves b | c in A is what you do without a 16-bit dec that sets Z
+static int take_counter(const struct ir_op **op, const struct ir_op *end, struct idiom *idiom)
+{
+    uint8_t code;
+    int hi;
+
+    if (*op >= end) {
+        return 0;
+    }
+    code = (*op)->op;
+    if ((code & 0xc7) == 0x05 && code != 0x35) {
+        (*op)++;
+        idiom->counter = code >> 3;
+        return 1;
+    }
+    if (code == 0x0b || code == 0x1b) {
+        (*op)++;
+        hi = code == 0x0b ? IR_B : IR_D;
+        if ((take(op, end, 0x78 + hi) && take(op, end, 0xb1 + hi))
+                || (take(op, end, 0x79 + hi) && take(op, end, 0xb0 + hi))) {
+            idiom->counter = hi;
+            idiom->wide = 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Whether the counter can be used with the rest of the loop
+static int counter_ok(const struct idiom *idiom)
+{
+    int c = idiom->counter;
+
+    switch (idiom->kind) {
+    case IDIOM_COPY:
+        // DE and HL are the pointers, A is the byte
+        return c == IR_B || (c == IR_C && !idiom->wide);
+    case IDIOM_FILL:
+        if (c == IR_H || c == IR_L || c == IR_A) {
+            return 0;
+        }
+        if ((c == IR_D || c == IR_E) && (idiom->fill_from == FILL_FROM_D
+                    || idiom->fill_from == FILL_FROM_E)) {
+            return 0;
+        }
+        // the test leaves b | c in A, so it has to be loaded again
+        return !idiom->wide || idiom->fill_from != FILL_FROM_A;
+    default:
+        return 1;
+    }
+}
+
+// Recognizes these, each ending in jr nz back to the first op:
+//   ld a, (hl+); ld (de), a; inc de; <counter>
+//   ld a, (de); ld (hl+), a; inc de; <counter>    (or inc de first)
+//   [<fill value>]; ld (hl+), a; <counter>        (or hl-)
+//   <counter>
+// where <counter> is one of the take_counter ones, and <fill value> is
+// ld a, u8, xor a, ld a, d or ld a, e. The last one is a delay loop, there's
+// nothing to do but move the counter and the cycles on
+int idiom_match(const struct ir_op *head, const struct ir_op *end, struct idiom *idiom)
+{
+    const struct ir_op *op = head, *k;
+
+    memset(idiom, 0, sizeof *idiom);
+    idiom->fill_from = FILL_FROM_A;
+    if (take(&op, end, 0x3e)) {
+        idiom->fill_from = FILL_FROM_IMM;
+        idiom->fill_imm = head->operand[0];
+    } else if (take(&op, end, 0xaf)) {
+        idiom->fill_from = FILL_FROM_IMM;
+    } else if (take(&op, end, 0x7a)) {
+        idiom->fill_from = FILL_FROM_D;
+    } else if (take(&op, end, 0x7b)) {
+        idiom->fill_from = FILL_FROM_E;
+    }
+
+    if (take(&op, end, 0x2a)) {
+        if (!take(&op, end, 0x12) || !take(&op, end, 0x13)) {
+            return 0;
+        }
+        idiom->kind = IDIOM_COPY;
+        idiom->src = IR_H;
+    } else if (take(&op, end, 0x1a)) {
+        if (take(&op, end, 0x22)) {
+            if (!take(&op, end, 0x13)) {
+                return 0;
+            }
+        } else if (!take(&op, end, 0x13) || !take(&op, end, 0x22)) {
+            return 0;
+        }
+        idiom->kind = IDIOM_COPY;
+        idiom->src = IR_D;
+    } else if (take(&op, end, 0x22)) {
+        idiom->kind = IDIOM_FILL;
+    } else if (take(&op, end, 0x32)) {
+        idiom->kind = IDIOM_FILL;
+        idiom->hl_step = -1;
+    } else if (op == head) {
+        idiom->kind = IDIOM_DELAY;
+    } else {
+        return 0;
+    }
+    if (idiom->kind == IDIOM_COPY && idiom->fill_from != FILL_FROM_A) {
+        return 0;
+    }
+    if (!idiom->hl_step) {
+        idiom->hl_step = 1;
+    }
+
+    if (!take_counter(&op, end, idiom) || !counter_ok(idiom)) {
+        return 0;
+    }
+
+    if (op >= end || op->op != 0x20
+            || op->offset + 2 + (int8_t) op->operand[0] != head->offset) {
+        return 0;
+    }
+
+    for (k = head; k < op; k++) {
+        idiom->cycles += k->cycles;
+    }
+    idiom->cycles += op->cycles_branch;
+
+    // compile_jr doesn't check for interrupts in loops this small
+    idiom->checked = (int8_t) op->operand[0] < -3;
+    return 1;
+}
+
+// d0 = BC or DE as a word
+static void join_pair(struct code_block *block, int pair)
+{
+    if (pair == IR_B) {
+        compile_join_bc(block, REG_68K_D_SCRATCH_0);
+    } else {
+        compile_join_de(block, REG_68K_D_SCRATCH_0);
+    }
+}
+
+// BC or DE = d0.w, back in the split format
+static void split_pair(struct code_block *block, int pair)
+{
+    int dreg = pair == IR_B ? REG_68K_D_BC : REG_68K_D_DE;
+
+    emit_move_l_dn_dn(block, REG_68K_D_SCRATCH_0, dreg); // 0x????HHLL
+    emit_lsl_l_imm_dn(block, 8, dreg);                   // 0x??HHLL00
+    emit_move_b_dn_dn(block, REG_68K_D_SCRATCH_0, dreg); // 0x??HHLLLL
+}
+
+// push d0 after setting it to the address in a pair
+static void push_pair(struct code_block *block, int pair)
+{
+    if (pair == IR_H) {
+        emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_0);
+    } else {
+        join_pair(block, pair);
+    }
+    emit_push_w_dn(block, REG_68K_D_SCRATCH_0);
+}
+
+// d3 = trips to do at once, which is one less than the counter as a word.
+// 0 in the counter means 256 or 65536, so that comes out right too
+static void compile_trips(struct code_block *block, const struct idiom *idiom)
+{
+    if (idiom->wide) {
+        if (idiom->counter == IR_B) {
+            compile_join_bc(block, REG_68K_D_NEXT_PC);
+        } else {
+            compile_join_de(block, REG_68K_D_NEXT_PC);
+        }
+        emit_subq_w_dn(block, REG_68K_D_NEXT_PC, 1);
+        return;
+    }
+
+    switch (idiom->counter) {
+    case IR_A:
+        emit_move_l_dn_dn(block, REG_68K_D_A, REG_68K_D_NEXT_PC);
+        break;
+    case IR_B:
+    case IR_C:
+        emit_move_l_dn_dn(block, REG_68K_D_BC, REG_68K_D_NEXT_PC);
+        break;
+    case IR_D:
+    case IR_E:
+        emit_move_l_dn_dn(block, REG_68K_D_DE, REG_68K_D_NEXT_PC);
+        break;
+    case IR_H:
+        emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_NEXT_PC);
+        emit_lsr_w_imm_dn(block, 8, REG_68K_D_NEXT_PC);
+        break;
+    case IR_L:
+        emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_NEXT_PC);
+        break;
+    }
+    if (idiom->counter == IR_B || idiom->counter == IR_D) {
+        emit_swap(block, REG_68K_D_NEXT_PC);
+    }
+    emit_andi_w_dn(block, REG_68K_D_NEXT_PC, 0xff);
+    emit_subq_b_dn(block, REG_68K_D_NEXT_PC, 1);
+}
+
+// counter -= d3
+static void compile_count_down(struct code_block *block, const struct idiom *idiom)
+{
+    int dreg = idiom->counter < IR_D ? REG_68K_D_BC : REG_68K_D_DE;
+
+    if (idiom->wide) {
+        join_pair(block, idiom->counter);
+        emit_sub_w_dn_dn(block, REG_68K_D_NEXT_PC, REG_68K_D_SCRATCH_0);
+        split_pair(block, idiom->counter);
+        return;
+    }
+
+    switch (idiom->counter) {
+    case IR_A:
+        emit_sub_b_dn_dn(block, REG_68K_D_NEXT_PC, REG_68K_D_A);
+        break;
+    case IR_B:
+    case IR_D:
+        emit_swap(block, dreg);
+        emit_sub_b_dn_dn(block, REG_68K_D_NEXT_PC, dreg);
+        emit_swap(block, dreg);
+        break;
+    case IR_C:
+    case IR_E:
+        emit_sub_b_dn_dn(block, REG_68K_D_NEXT_PC, dreg);
+        break;
+    case IR_H:
+        emit_move_w_dn_dn(block, REG_68K_D_NEXT_PC, REG_68K_D_SCRATCH_1);
+        emit_lsl_w_imm_dn(block, 8, REG_68K_D_SCRATCH_1);
+        emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_0);
+        emit_sub_w_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_SCRATCH_0);
+        emit_movea_w_dn_an(block, REG_68K_D_SCRATCH_0, REG_68K_A_HL);
+        break;
+    case IR_L:
+        emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_0);
+        emit_sub_b_dn_dn(block, REG_68K_D_NEXT_PC, REG_68K_D_SCRATCH_0);
+        emit_movea_w_dn_an(block, REG_68K_D_SCRATCH_0, REG_68K_A_HL);
+        break;
+    }
+}
+
+// dmg_copy or dmg_fill for d3 trips
+static void compile_bulk_call(struct code_block *block, const struct idiom *idiom)
+{
+    // same as the slow dmg calls. d3 is saved by the callee, so the trip
+    // count is still there after
+    emit_move_l_dn_disp_an(block, REG_68K_D_CYCLE_COUNT, JIT_CTX_READ_CYCLES, REG_68K_A_CTX);
+    if (idiom->kind == IDIOM_COPY) {
+        // dmg_copy(dmg, dst, src, count)
+        emit_push_w_dn(block, REG_68K_D_NEXT_PC);
+        push_pair(block, idiom->src);
+        push_pair(block, idiom->src == IR_H ? IR_D : IR_H);
+    } else {
+        // dmg_fill(dmg, dst, count, data)
+        switch (idiom->fill_from) {
+        case FILL_FROM_A:
+            emit_push_b_dn(block, REG_68K_D_A);
+            break;
+        case FILL_FROM_IMM:
+            emit_push_b_imm(block, idiom->fill_imm);
+            break;
+        case FILL_FROM_D:
+            emit_move_l_dn_dn(block, REG_68K_D_DE, REG_68K_D_SCRATCH_0);
+            emit_swap(block, REG_68K_D_SCRATCH_0);
+            emit_push_b_dn(block, REG_68K_D_SCRATCH_0);
+            break;
+        case FILL_FROM_E:
+            emit_push_b_dn(block, REG_68K_D_DE);
+            break;
+        }
+        emit_push_w_dn(block, REG_68K_D_NEXT_PC);
+        emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_0);
+        if (idiom->hl_step < 0) {
+            // same bytes going up from the last one hl- gets to
+            emit_sub_w_dn_dn(block, REG_68K_D_NEXT_PC, REG_68K_D_SCRATCH_0);
+            emit_addq_w_dn(block, REG_68K_D_SCRATCH_0, 1);
+        }
+        emit_push_w_dn(block, REG_68K_D_SCRATCH_0);
+    }
+    emit_push_l_disp_an(block, JIT_CTX_DMG, REG_68K_A_CTX);
+    emit_movea_l_disp_an_an(block,
+        idiom->kind == IDIOM_COPY ? JIT_CTX_COPY : JIT_CTX_FILL,
+        REG_68K_A_CTX, REG_68K_A_SCRATCH_1);
+    emit_jsr_ind_an(block, REG_68K_A_SCRATCH_1);
+    // lea 10(sp), sp
+    emit_lea_disp_an_an(block, 10, 7, 7);
+    emit_move_l_disp_an_dn(block, JIT_CTX_READ_CYCLES, REG_68K_A_CTX, REG_68K_D_CYCLE_COUNT);
+    emit_suba_l_an_an(block, REG_68K_A_HL_PAGE, REG_68K_A_HL_PAGE);
+
+    // move the pointers on by d3 trips
+    if (idiom->hl_step > 0) {
+        emit_adda_w_dn_an(block, REG_68K_D_NEXT_PC, REG_68K_A_HL);
+    } else {
+        emit_suba_w_dn_an(block, REG_68K_D_NEXT_PC, REG_68K_A_HL);
+    }
+    if (idiom->kind == IDIOM_COPY) {
+        join_pair(block, IR_D);
+        emit_add_w_dn_dn(block, REG_68K_D_NEXT_PC, REG_68K_D_SCRATCH_0);
+        split_pair(block, IR_D);
+    }
+}
+
+void compile_idiom(struct code_block *block, const struct idiom *idiom)
+{
+    size_t branch_done, branch_full = 0, branch_none = 0;
+
+    compile_trips(block, idiom);
+    // last trip or only trip, nothing to do
+    branch_done = block->length;
+    emit_beq_w(block, 0);
+
+    if (idiom->checked) {
+        // as many trips as fit before the next event, which is where the
+        // jr would have gone back to the dispatcher. none at all leaves
+        // it to the compiled loop. more than a word's worth is more than
+        // the counter can have
+        //   move.l d2, d0
+        //   bmi.w done
+        //   divu.w #cycles, d0
+        //   bvs.s _fits
+        //   beq.w done
+        //   cmp.w d0, d3
+        //   bls.s _fits
+        //   move.w d0, d3
+        // _fits
+        emit_move_l_dn_dn(block, REG_68K_D_CYCLE_COUNT, REG_68K_D_SCRATCH_0);
+        branch_full = block->length;
+        emit_bcc_opcode_w(block, COND_MI, 0);
+        emit_divu_w_imm_dn(block, idiom->cycles, REG_68K_D_SCRATCH_0);
+        emit_bvs_b(block, 10);
+        branch_none = block->length;
+        emit_beq_w(block, 0);
+        emit_cmp_w_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_NEXT_PC);
+        emit_bls_b(block, 2);
+        emit_move_w_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_NEXT_PC);
+    }
+
+    if (idiom->kind != IDIOM_DELAY) {
+        compile_bulk_call(block, idiom);
+    }
+    compile_count_down(block, idiom);
+    emit_mulu_w_imm_dn(block, idiom->cycles, REG_68K_D_NEXT_PC);
+    emit_sub_l_dn_dn(block, REG_68K_D_NEXT_PC, REG_68K_D_CYCLE_COUNT);
+
+    block->code[branch_done + 2] = (block->length - branch_done - 2) >> 8;
+    block->code[branch_done + 3] = block->length - branch_done - 2;
+    if (idiom->checked) {
+        block->code[branch_full + 2] = (block->length - branch_full - 2) >> 8;
+        block->code[branch_full + 3] = block->length - branch_full - 2;
+        block->code[branch_none + 2] = (block->length - branch_none - 2) >> 8;
+        block->code[branch_none + 3] = block->length - branch_none - 2;
+    }
+}
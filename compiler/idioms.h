@@ -0,0 +1,53 @@
+#ifndef _IDIOMS_H
+#define _IDIOMS_H
+
+#include <stdint.h>
+#include "compiler.h"
+
+struct ir_op;
+
+// most compile_idiom emits
+#define MAX_IDIOM_CODE 128
+
+#define IDIOM_COPY 1
+#define IDIOM_FILL 2
+#define IDIOM_DELAY 3
+
+// where a fill loop gets the byte it stores
+#define FILL_FROM_A 0   // ld (hl+), a with nothing else touching A
+#define FILL_FROM_IMM 1 // ld a, u8 or xor a at the top of the loop
+#define FILL_FROM_D 2   // ld a, d
+#define FILL_FROM_E 3   // ld a, e
+
+// A copy, fill or delay loop, from its first op to the jr nz back to it
+struct idiom {
+    int kind;
+    // copies: IR_H for ld a, (hl+) then ld (de), a, IR_D the other way
+    int src;
+    // fills: 1 for (hl+), -1 for (hl-). copies always go up
+    int hl_step;
+    // the register dec r counts with, or with wide set, IR_B or IR_D for
+    // dec bc or dec de followed by ld a, b; or c or the like
+    int counter;
+    int wide;
+    int fill_from;
+    uint8_t fill_imm;
+    // for one trip round the loop with the jr taken
+    int cycles;
+    // set when the jr checks for interrupts, so compile_idiom stops short
+    // of the next event
+    int checked;
+};
+
+// Whether the loop starting at head is one of the copy, fill or delay
+// loops, up to end. Fills in idiom if it is
+int idiom_match(const struct ir_op *head, const struct ir_op *end, struct idiom *idiom);
+
+// At the top of a matched loop, do every trip but the last and leave the
+// registers and cycle count the way those trips would have, calling
+// dmg_copy or dmg_fill for the memory. The last trip runs the compiled
+// loop so A and the flags come out right. Loops that check for
+// interrupts on the way round only go as far as the next event
+void compile_idiom(struct code_block *block, const struct idiom *idiom);
+
+#endif
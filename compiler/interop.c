@@ -1,10 +1,13 @@
 #include "compiler.h"
 #include "emitters.h"
 #include "interop.h"
+#include "ir.h"
 
-// Retro68 uses D0-D2 as scratch so I have to push cycle count before calling
+// Retro68 uses D0-D2 as scratch so I have to save cycle count before calling
 // back into C. i'm not sure if this is a mac calling convention or specific
-// to this gcc port.
+// to this gcc port. it goes in JIT_CTX_READ_CYCLES and comes back from there,
+// since a call that moves the next event moves D2 along with it (see
+// dmg_schedule)
 // also interestingly, it doesn't appear to use the "A5 world" or A6, so i can
 // use those registers while in the JIT world. calling back into C won't mess
 // them up
@@ -13,16 +16,17 @@
 void compile_slow_dmg_write(struct code_block *block, uint8_t val_reg)
 {
     // store current cycle count for lazy register evaluation
-    emit_move_l_dn_disp_an(block, REG_68K_D_CYCLE_COUNT, JIT_CTX_READ_CYCLES, REG_68K_A_CTX);
-    // and push so retro68 doesn't erase
-    emit_push_l_dn(block, REG_68K_D_CYCLE_COUNT); // 2
+    emit_move_l_dn_disp_an(block, REG_68K_D_CYCLE_COUNT, JIT_CTX_READ_CYCLES, REG_68K_A_CTX); // 4
     emit_push_b_dn(block, val_reg); // 2
     emit_push_w_dn(block, REG_68K_D_SCRATCH_1); // 2
     emit_push_l_disp_an(block, JIT_CTX_DMG, REG_68K_A_CTX); // 4
     emit_movea_l_disp_an_an(block, JIT_CTX_WRITE, REG_68K_A_CTX, REG_68K_A_SCRATCH_1); // 4
     emit_jsr_ind_an(block, REG_68K_A_SCRATCH_1); // 2
     emit_addq_l_an(block, 7, 8); // 2
-    emit_pop_l_dn(block, REG_68K_D_CYCLE_COUNT); // 2
+    emit_move_l_disp_an_dn(block, JIT_CTX_READ_CYCLES, REG_68K_A_CTX, REG_68K_D_CYCLE_COUNT); // 4
+    // the call can leave anything in A1, and a write can switch banks
+    // under the page it had
+    emit_suba_l_an_an(block, REG_68K_A_HL_PAGE, REG_68K_A_HL_PAGE); // 2
 }
 
 // inline dmg_write with page table fast path - addr in D1, value in val_reg
@@ -49,12 +53,12 @@ static void compile_inline_dmg_write(struct code_block *block, uint8_t val_reg)
     emit_andi_w_dn(block, REG_68K_D_SCRATCH_0, 0x00ff);
     // move.b val_reg, (a0,d0.w)         ; 4 bytes [22-25]
     emit_move_b_dn_idx_an(block, val_reg, REG_68K_A_SCRATCH_1, REG_68K_D_SCRATCH_0);
-    // bra.s done (+24)                  ; 2 bytes [26-27] -> offset 52
-    emit_bra_b(block, 24);
+    // bra.s done (+26)                  ; 2 bytes [26-27] -> offset 54
+    emit_bra_b(block, 26);
 
     // slow_path: (offset 28)
     compile_slow_dmg_write(block, val_reg);
-    // falls through to done (offset 52)
+    // falls through to done (offset 54)
 }
 
 // Call dmg_write(dmg, addr, val) - addr in D1, val in D4 (A register)
@@ -88,13 +92,13 @@ void compile_slow_dmg_read(struct code_block *block)
 {
     // store current cycle count for DIV/LY evaluation
     emit_move_l_dn_disp_an(block, REG_68K_D_CYCLE_COUNT, JIT_CTX_READ_CYCLES, REG_68K_A_CTX); // 4
-    emit_push_l_dn(block, REG_68K_D_CYCLE_COUNT); // 2
     emit_push_w_dn(block, REG_68K_D_SCRATCH_1); // 2
     emit_push_l_disp_an(block, JIT_CTX_DMG, REG_68K_A_CTX); // 4
     emit_movea_l_disp_an_an(block, JIT_CTX_READ, REG_68K_A_CTX, REG_68K_A_SCRATCH_1); // 4
     emit_jsr_ind_an(block, REG_68K_A_SCRATCH_1); // 2
     emit_addq_l_an(block, 7, 6); // 2
-    emit_pop_l_dn(block, REG_68K_D_CYCLE_COUNT); // 2
+    emit_move_l_disp_an_dn(block, JIT_CTX_READ_CYCLES, REG_68K_A_CTX, REG_68K_D_CYCLE_COUNT); // 4
+    emit_suba_l_an_an(block, REG_68K_A_HL_PAGE, REG_68K_A_HL_PAGE); // 2
 }
 
 // Call dmg_read(dmg, addr) - addr in D1, result stays in D0
@@ -122,12 +126,12 @@ void compile_call_dmg_read(struct code_block *block)
     emit_andi_w_dn(block, REG_68K_D_SCRATCH_0, 0x00ff);
     // move.b (a0,d0.w), d0              ; 4 bytes [22-25]
     emit_move_b_idx_an_dn(block, REG_68K_A_SCRATCH_1, REG_68K_D_SCRATCH_0, REG_68K_D_SCRATCH_0);
-    // bra.s done (+22)                  ; 2 bytes [26-27] -> offset 50
-    emit_bra_b(block, 22);
+    // bra.s done (+24)                  ; 2 bytes [26-27] -> offset 52
+    emit_bra_b(block, 24);
 
     // slow_path: (offset 28)
     compile_slow_dmg_read(block);
-    // falls through to done (offset 50)
+    // falls through to done (offset 52)
 }
 
 // Call dmg_read(dmg, addr) - addr in D1, result goes to D4 (A register)
@@ -137,8 +141,252 @@ void compile_call_dmg_read_a(struct code_block *block)
     emit_move_b_dn_dn(block, 0, REG_68K_D_A);
 }
 
+// OAM and I/O registers go through the C handlers anyway
+static int is_io(uint16_t addr)
+{
+    return addr >= 0xfe00 && addr < 0xff80;
+}
+
+// Point A0 at addr and return the displacement to use with it, or -1 if
+// it's not somewhere with a fixed host address
+static int compile_fixed_pointer(struct code_block *block, struct compile_ctx *ctx, uint16_t addr)
+{
+    if (addr >= 0xff80) {
+        // HRAM and IE are the start of the dmg struct, same as ldh
+        // movea.l (a4), a0
+        emit_movea_l_ind_an_an(block, REG_68K_A_CTX, REG_68K_A_SCRATCH_1);
+        return addr - 0xff80;
+    }
+    if (ctx->vram_base && addr >= 0x8000 && addr < 0xa000) {
+        emit_movea_l_imm32(block, REG_68K_A_SCRATCH_1, (uint32_t) ctx->vram_base + (addr - 0x8000));
+        block_add_reloc(block, block->length - 4, RELOC_VRAM);
+        return 0;
+    }
+    if (ctx->wram_base && addr >= 0xc000 && addr < 0xfe00) {
+        // 0xe000-0xfdff echoes 0xc000-0xddff
+        emit_movea_l_imm32(block, REG_68K_A_SCRATCH_1,
+            (uint32_t) ctx->wram_base + ((addr - 0xc000) & 0x1fff));
+        block_add_reloc(block, block->length - 4, RELOC_WRAM);
+        return 0;
+    }
+    return -1;
+}
+
+// Same as the inline page probes, but the page is known so there's no
+// shifting or masking. is_write picks A6 and stores reg, otherwise it's
+// A5 and the result goes in reg
+static void compile_page_probe(struct code_block *block, uint16_t addr, int is_write, uint8_t reg)
+{
+    size_t branch_slow, branch_done;
+
+    // movea.l page*4(a5 or a6), a0
+    emit_movea_l_disp_an_an(block, (addr >> 8) * 4,
+        is_write ? REG_68K_A_WRITE_PAGE : REG_68K_A_READ_PAGE, REG_68K_A_SCRATCH_1);
+    // cmpa.w #0, a0
+    emit_cmpa_w_imm_an(block, 0, REG_68K_A_SCRATCH_1);
+    branch_slow = block->length;
+    emit_beq_b(block, 0);
+
+    if (is_write) {
+        // move.b reg, offset(a0)
+        emit_move_b_dn_disp_an(block, reg, addr & 0xff, REG_68K_A_SCRATCH_1);
+    } else {
+        // move.b offset(a0), reg
+        emit_move_b_disp_an_dn(block, addr & 0xff, REG_68K_A_SCRATCH_1, reg);
+    }
+    branch_done = block->length;
+    emit_bra_b(block, 0);
+
+    // slow_path:
+    block->code[branch_slow + 1] = block->length - branch_slow - 2;
+    emit_move_w_dn(block, REG_68K_D_SCRATCH_1, addr);
+    if (is_write) {
+        compile_slow_dmg_write(block, reg);
+    } else {
+        compile_slow_dmg_read(block);
+        if (reg != REG_68K_D_SCRATCH_0) {
+            emit_move_b_dn_dn(block, REG_68K_D_SCRATCH_0, reg);
+        }
+    }
+    block->code[branch_done + 1] = block->length - branch_done - 2;
+}
+
+void compile_read_known(struct code_block *block, struct compile_ctx *ctx, uint16_t addr, uint8_t dreg)
+{
+    int disp;
+
+    if (addr < 0x4000) {
+        // bank 0 is always mapped
+        emit_moveq_dn(block, dreg, (int8_t) ctx->read(ctx->dmg, addr));
+    } else if ((disp = compile_fixed_pointer(block, ctx, addr)) >= 0) {
+        // move.b disp(a0), dreg
+        emit_move_b_disp_an_dn(block, disp, REG_68K_A_SCRATCH_1, dreg);
+    } else if (is_io(addr)) {
+        emit_move_w_dn(block, REG_68K_D_SCRATCH_1, addr);
+        compile_slow_dmg_read(block);
+        if (dreg != REG_68K_D_SCRATCH_0) {
+            emit_move_b_dn_dn(block, REG_68K_D_SCRATCH_0, dreg);
+        }
+    } else {
+        // banked ROM and cart RAM depend on what's mapped when it runs
+        compile_page_probe(block, addr, 0, dreg);
+    }
+}
+
+void compile_write_known(struct code_block *block, struct compile_ctx *ctx, uint16_t addr, uint8_t val_reg)
+{
+    if (addr >= 0xff80 && addr != 0xffff) {
+        // HRAM is never a code page
+        compile_fixed_pointer(block, ctx, addr);
+        // move.b val_reg, disp(a0)
+        emit_move_b_dn_disp_an(block, val_reg, addr - 0xff80, REG_68K_A_SCRATCH_1);
+    } else if (addr < 0x8000 || is_io(addr) || addr == 0xffff) {
+        // MBC registers, I/O and IE, which can let a pending interrupt
+        // through and has to end the budget when it does
+        emit_move_w_dn(block, REG_68K_D_SCRATCH_1, addr);
+        compile_slow_dmg_write(block, val_reg);
+    } else {
+        // VRAM and WRAM lose their write page when code is compiled from
+        // them, which is how writes to it get noticed, so keep the check
+        compile_page_probe(block, addr, 1, val_reg);
+    }
+}
+
+// D1.w = BC, DE or HL
+static void compile_pair_address(struct code_block *block, int pair)
+{
+    if (pair == IR_B) {
+        compile_join_bc(block, REG_68K_D_SCRATCH_1);
+    } else if (pair == IR_D) {
+        compile_join_de(block, REG_68K_D_SCRATCH_1);
+    } else {
+        emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_1);
+    }
+}
+
+void compile_hl_cache_load(struct code_block *block, int mode)
+{
+    // move.w a2, d0                     ; 2 bytes [0-1]
+    emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_0);
+    // lsr.w #8, d0                      ; 2 bytes [2-3]
+    emit_lsr_w_imm_dn(block, 8, REG_68K_D_SCRATCH_0);
+    // lsl.w #2, d0                      ; 2 bytes [4-5]
+    emit_lsl_w_imm_dn(block, 2, REG_68K_D_SCRATCH_0);
+    // movea.l (a5 or a6,d0.w), a1       ; 4 bytes [6-9]
+    emit_movea_l_idx_an_an(block, 0,
+        mode == HL_CACHE_READ ? REG_68K_A_READ_PAGE : REG_68K_A_WRITE_PAGE,
+        REG_68K_D_SCRATCH_0, REG_68K_A_HL_PAGE);
+    // cmpa.w #0, a1                     ; 4 bytes [10-13]
+    emit_cmpa_w_imm_an(block, 0, REG_68K_A_HL_PAGE);
+    // beq.s done (+8)                   ; 2 bytes [14-15] -> offset 24
+    emit_beq_b(block, 8);
+    // move.w a2, d0                     ; 2 bytes [16-17]
+    emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_0);
+    // andi.w #$ff00, d0                 ; 4 bytes [18-21]
+    emit_andi_w_dn(block, REG_68K_D_SCRATCH_0, 0xff00);
+    // suba.w d0, a1                     ; 2 bytes [22-23]
+    emit_suba_w_dn_an(block, REG_68K_D_SCRATCH_0, REG_68K_A_HL_PAGE);
+    // done: (offset 24)
+}
+
+void compile_hl_cache_step(struct code_block *block, int delta)
+{
+    if (!block->ir || !block->ir->hl_cache) {
+        return;
+    }
+    // move.w a2, d0
+    emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_0);
+    if (delta > 0) {
+        // tst.b d0, L wrapped to 0
+        emit_tst_b_dn(block, REG_68K_D_SCRATCH_0);
+    } else {
+        // addq.b #1, d0, L wrapped to $ff
+        emit_addq_b_dn(block, REG_68K_D_SCRATCH_0, 1);
+    }
+    // bne.s over the load
+    emit_bne_b(block, 24);
+    compile_hl_cache_load(block, block->ir->hl_cache);
+}
+
+// move.b (a1,a2.w). When A1 is 0 it gets loaded again, since a call into
+// C might be why, and only if that's still 0 does it go to C
+static void compile_hl_cached(struct code_block *block, int is_write, uint8_t reg)
+{
+    size_t branch_slow, branch_done, access;
+    int mode = is_write ? HL_CACHE_WRITE : HL_CACHE_READ;
+
+    // cmpa.w #0, a1
+    emit_cmpa_w_imm_an(block, 0, REG_68K_A_HL_PAGE);
+    branch_slow = block->length;
+    emit_beq_b(block, 0);
+    access = block->length;
+    if (is_write) {
+        // move.b reg, (a1,a2.w)
+        emit_move_b_dn_idx_an_an(block, reg, REG_68K_A_HL_PAGE, REG_68K_A_HL);
+    } else {
+        // move.b (a1,a2.w), d0
+        emit_move_b_idx_an_an_dn(block, REG_68K_A_HL_PAGE, REG_68K_A_HL, REG_68K_D_SCRATCH_0);
+    }
+    branch_done = block->length;
+    emit_bra_b(block, 0);
+
+    // slow_path:
+    block->code[branch_slow + 1] = block->length - branch_slow - 2;
+    compile_hl_cache_load(block, mode);
+    // cmpa.w #0, a1
+    emit_cmpa_w_imm_an(block, 0, REG_68K_A_HL_PAGE);
+    // bne.s access
+    emit_bne_b(block, access - (block->length + 2));
+    emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_1);
+    if (is_write) {
+        compile_slow_dmg_write(block, reg);
+    } else {
+        compile_slow_dmg_read(block);
+    }
+    block->code[branch_done + 1] = block->length - branch_done - 2;
+}
+
+void compile_read_pair(struct code_block *block, struct compile_ctx *ctx, int pair)
+{
+    uint16_t addr;
+
+    if (ir_known_pair(block->ir, pair, &addr)) {
+        compile_read_known(block, ctx, addr, REG_68K_D_SCRATCH_0);
+        return;
+    }
+    if (pair == IR_H && block->ir && block->ir->hl_cache == HL_CACHE_READ) {
+        compile_hl_cached(block, 0, REG_68K_D_SCRATCH_0);
+        return;
+    }
+    compile_pair_address(block, pair);
+    compile_call_dmg_read(block);
+}
+
+void compile_write_pair(struct code_block *block, struct compile_ctx *ctx, int pair, uint8_t val_reg)
+{
+    uint16_t addr;
+
+    if (ir_known_pair(block->ir, pair, &addr)) {
+        compile_write_known(block, ctx, addr, val_reg);
+        return;
+    }
+    if (val_reg == REG_68K_D_SCRATCH_0) {
+        // the page probe needs D0
+        emit_move_b_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_NEXT_PC);
+        val_reg = REG_68K_D_NEXT_PC;
+    }
+    if (pair == IR_H && block->ir && block->ir->hl_cache == HL_CACHE_WRITE) {
+        compile_hl_cached(block, 1, val_reg);
+        return;
+    }
+    compile_pair_address(block, pair);
+    compile_inline_dmg_write(block, val_reg);
+}
+
 void compile_call_ei_di(struct code_block *block, int enabled)
 {
+    // an interrupt this lets through ends the budget, see interrupts_changed
+    emit_move_l_dn_disp_an(block, REG_68K_D_CYCLE_COUNT, JIT_CTX_READ_CYCLES, REG_68K_A_CTX);
     // push enabled
     emit_moveq_dn(block, REG_68K_D_SCRATCH_1, (int8_t) enabled);
     // i actually have this as a 16-bit int for some reason
@@ -151,19 +399,21 @@ void compile_call_ei_di(struct code_block *block, int enabled)
     emit_jsr_ind_an(block, REG_68K_A_SCRATCH_1);
     // clean up stack
     emit_addq_l_an(block, 7, 6);
+    emit_move_l_disp_an_dn(block, JIT_CTX_READ_CYCLES, REG_68K_A_CTX, REG_68K_D_CYCLE_COUNT);
+    emit_suba_l_an_an(block, REG_68K_A_HL_PAGE, REG_68K_A_HL_PAGE);
 }
 
 // Slow path for dmg_read16 - addr in D1.w, result in D0.w
 void compile_slow_dmg_read16(struct code_block *block)
 {
     emit_move_l_dn_disp_an(block, REG_68K_D_CYCLE_COUNT, JIT_CTX_READ_CYCLES, REG_68K_A_CTX);
-    emit_push_l_dn(block, REG_68K_D_CYCLE_COUNT);
     emit_push_w_dn(block, REG_68K_D_SCRATCH_1);
     emit_push_l_disp_an(block, JIT_CTX_DMG, REG_68K_A_CTX);
     emit_movea_l_disp_an_an(block, JIT_CTX_READ16, REG_68K_A_CTX, REG_68K_A_SCRATCH_1);
     emit_jsr_ind_an(block, REG_68K_A_SCRATCH_1);
     emit_addq_l_an(block, 7, 6);
-    emit_pop_l_dn(block, REG_68K_D_CYCLE_COUNT);
+    emit_move_l_disp_an_dn(block, JIT_CTX_READ_CYCLES, REG_68K_A_CTX, REG_68K_D_CYCLE_COUNT);
+    emit_suba_l_an_an(block, REG_68K_A_HL_PAGE, REG_68K_A_HL_PAGE);
 }
 
 // Call dmg_read16(dmg, addr) - addr in D1.w, result in D0.w
@@ -210,26 +460,26 @@ void compile_call_dmg_read16(struct code_block *block)
     emit_lsl_w_imm_dn(block, 8, REG_68K_D_SCRATCH_0);
     // move.b d3, d0                     ; 2 bytes [46-47] - combine low byte
     emit_move_b_dn_dn(block, REG_68K_D_NEXT_PC, REG_68K_D_SCRATCH_0);
-    // bra.b done (+22)                  ; 2 bytes [48-49] -> offset 72
-    emit_bra_b(block, 22);
+    // bra.b done (+24)                  ; 2 bytes [48-49] -> offset 74
+    emit_bra_b(block, 24);
 
     // slow_path: (offset 50)
     compile_slow_dmg_read16(block);
-    // falls through to done (offset 72)
+    // falls through to done (offset 74)
 }
 
 // Slow path for dmg_write16 - addr in D1.w, data in D0.w
 void compile_slow_dmg_write16(struct code_block *block)
 {
     emit_move_l_dn_disp_an(block, REG_68K_D_CYCLE_COUNT, JIT_CTX_READ_CYCLES, REG_68K_A_CTX);
-    emit_push_l_dn(block, REG_68K_D_CYCLE_COUNT);
     emit_push_w_dn(block, REG_68K_D_SCRATCH_0);
     emit_push_w_dn(block, REG_68K_D_SCRATCH_1);
     emit_push_l_disp_an(block, JIT_CTX_DMG, REG_68K_A_CTX);
     emit_movea_l_disp_an_an(block, JIT_CTX_WRITE16, REG_68K_A_CTX, REG_68K_A_SCRATCH_1);
     emit_jsr_ind_an(block, REG_68K_A_SCRATCH_1);
     emit_addq_l_an(block, 7, 8);
-    emit_pop_l_dn(block, REG_68K_D_CYCLE_COUNT);
+    emit_move_l_disp_an_dn(block, JIT_CTX_READ_CYCLES, REG_68K_A_CTX, REG_68K_D_CYCLE_COUNT);
+    emit_suba_l_an_an(block, REG_68K_A_HL_PAGE, REG_68K_A_HL_PAGE);
 }
 
 // Call dmg_write16(dmg, addr, data) - addr in D1.w, data in D0.w
@@ -277,13 +527,13 @@ void compile_call_dmg_write16_d0(struct code_block *block)
     emit_addq_w_dn(block, REG_68K_D_SCRATCH_0, 1);
     // move.b d3, (a1,d0.w)              ; 4 bytes [44-47] - write high byte
     emit_move_b_dn_idx_an(block, REG_68K_D_NEXT_PC, REG_68K_A_SCRATCH_1, REG_68K_D_SCRATCH_0);
-    // bra.b done (+26)                  ; 2 bytes [48-49] -> offset 76
-    emit_bra_b(block, 26);
+    // bra.b done (+28)                  ; 2 bytes [48-49] -> offset 78
+    emit_bra_b(block, 28);
 
     // slow_path: (offset 50)
     // Restore data from D3 to D0 for slow path
     // move.w d3, d0                     ; 2 bytes [50-51]
     emit_move_w_dn_dn(block, REG_68K_D_NEXT_PC, REG_68K_D_SCRATCH_0);
     compile_slow_dmg_write16(block);
-    // falls through to done (offset 76)
+    // falls through to done (offset 78)
 }
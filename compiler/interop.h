@@ -10,6 +10,31 @@ void compile_call_dmg_read_a(struct code_block *block);
 void compile_call_dmg_read(struct code_block *block);
 void compile_call_ei_di(struct code_block *block, int enabled);
 
+struct compile_ctx;
+
+// For an address known at compile time, go straight to the region it's in:
+// a constant for bank 0 ROM, VRAM, WRAM and HRAM reads through their host
+// addresses, the C handler for I/O, and a page table check without the
+// address math for the rest. Read result in dreg
+void compile_read_known(struct code_block *block, struct compile_ctx *ctx, uint16_t addr, uint8_t dreg);
+void compile_write_known(struct code_block *block, struct compile_ctx *ctx, uint16_t addr, uint8_t val_reg);
+
+// A1 caches a pointer into the read or write page table's page for HL
+// (mode is an HL_CACHE_ value), less H << 8 so (a1,a2.w) is the byte at
+// HL. It's 0 if the page is NULL, and calls back into C set it back to 0.
+// Uses D0
+void compile_hl_cache_load(struct code_block *block, int mode);
+
+// After HL moves by delta (1 or -1), load A1 again if that changed H and
+// the IR has it cached
+void compile_hl_cache_step(struct code_block *block, int delta);
+
+// Read into D0, or write val_reg to, the address in BC, DE or HL (pair is
+// IR_B, IR_D or IR_H). Uses the _known versions when the IR knows it,
+// and A1 for HL when the IR says it has the right page in it
+void compile_read_pair(struct code_block *block, struct compile_ctx *ctx, int pair);
+void compile_write_pair(struct code_block *block, struct compile_ctx *ctx, int pair, uint8_t val_reg);
+
 void compile_slow_dmg_read(struct code_block *block);
 void compile_slow_dmg_write(struct code_block *block, uint8_t val_reg);
 
@@ -0,0 +1,789 @@
+#include <string.h>
+
+#include "compiler.h"
+#include "flags.h"
+#include "instructions.h"
+#include "ir.h"
+
+const struct ir_pass ir_passes[] = {
+    { "dead flags", find_dead_flags },
+    { "daa state", find_daa_state_use },
+    { "constants", ir_find_constants },
+    { "hl cache", ir_find_hl_cache },
+    { "idle loops", ir_find_idle_loops },
+    { "cycle runs", ir_find_cycle_runs },
+    { NULL, NULL }
+};
+
+int ir_op_length(uint8_t op)
+{
+    switch (op) {
+    case 0x01: case 0x11: case 0x21: case 0x31: case 0x08:
+    case 0xc2: case 0xc3: case 0xc4: case 0xca: case 0xcc: case 0xcd:
+    case 0xd2: case 0xd4: case 0xda: case 0xdc: case 0xea: case 0xfa:
+        return 3;
+    case 0x06: case 0x0e: case 0x16: case 0x1e:
+    case 0x26: case 0x2e: case 0x36: case 0x3e:
+    case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+    case 0xc6: case 0xce: case 0xd6: case 0xde:
+    case 0xe6: case 0xee: case 0xf6: case 0xfe:
+    case 0xe0: case 0xf0: case 0xe8: case 0xf8: case 0xcb:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+// ops that compile_block always ends the block on. it carries on past a
+// call, see compile_call_imm16
+static int ends_block(uint8_t op)
+{
+    return op == 0xc3 || op == 0xc9 || op == 0xd9 || op == 0xe9
+        || op == 0x10 || op == 0x76 || (op & 0xc7) == 0xc7;
+}
+
+int ir_follows_jump(uint16_t src_address, uint16_t offset, uint8_t length, uint16_t target)
+{
+    uint16_t from = src_address + offset;
+
+    return from < 0x8000 && target >= from + length
+        && ((target ^ from) & 0xc000) == 0
+        && (uint16_t) (target - src_address) <= MAX_BLOCK_SRC - 8;
+}
+
+void ir_decode(struct ir_block *ir, struct compile_ctx *ctx, uint16_t src_address)
+{
+    struct ir_op *op;
+    uint16_t ptr = 0, target;
+    int k, index;
+
+    ir->src_address = src_address;
+    ir->count = 0;
+
+    while (ir->count < MAX_IR_OPS && ptr <= MAX_BLOCK_SRC - 8) {
+        op = &ir->ops[ir->count++];
+        memset(op, 0, sizeof *op);
+        op->offset = ptr;
+        op->op = ctx->read(ctx->dmg, src_address + ptr);
+        op->length = ir_op_length(op->op);
+        for (k = 1; k < op->length; k++) {
+            op->operand[k - 1] = ctx->read(ctx->dmg, src_address + ptr + k);
+        }
+
+        index = op->op == 0xcb ? 0x100 + op->operand[0] : op->op;
+        op->cycles = instructions[index].cycles;
+        op->cycles_branch = instructions[index].cycles_branch;
+        op->charge = op->cycles;
+
+        if (op->op == 0xc3 || op->op == 0x18) {
+            target = op->op == 0xc3 ? op->operand[1] << 8 | op->operand[0]
+                : src_address + ptr + 2 + (int8_t) op->operand[0];
+            if (ir_follows_jump(src_address, ptr, op->length, target)) {
+                op->follows = 1;
+                ptr = target - src_address;
+                continue;
+            }
+        }
+        if (ends_block(op->op)) {
+            break;
+        }
+        ptr += op->length;
+    }
+}
+
+void ir_build(struct ir_block *ir, struct compile_ctx *ctx, uint16_t src_address)
+{
+    const struct ir_pass *pass;
+
+    ir_decode(ir, ctx, src_address);
+    for (pass = ir_passes; pass->name; pass++) {
+        pass->run(ir, ctx);
+    }
+}
+
+static void set_pair(uint8_t *known, uint8_t *values, int hi, uint16_t val)
+{
+    *known |= 3 << hi;
+    values[hi] = val >> 8;
+    values[hi + 1] = val & 0xff;
+}
+
+// inc rr/dec rr and (hl+)/(hl-)
+static void step_pair(uint8_t *known, uint8_t *values, int hi, int delta)
+{
+    if ((*known & (3 << hi)) == (3 << hi)) {
+        set_pair(known, values, hi, (values[hi] << 8 | values[hi + 1]) + delta);
+    } else {
+        *known &= ~(3 << hi);
+    }
+}
+
+// Update known and values for what op does. Anything not listed here
+// forgets everything
+static void step_constants(const struct ir_op *op, uint8_t *known, uint8_t *values)
+{
+    int dst = (op->op >> 3) & 7, src = op->op & 7;
+
+    // ld r, r
+    if (op->op >= 0x40 && op->op < 0x80 && op->op != 0x76) {
+        if (dst == 6) {
+            return;
+        }
+        if (src != 6 && (*known & 1 << src)) {
+            *known |= 1 << dst;
+            values[dst] = values[src];
+        } else {
+            *known &= ~(1 << dst);
+        }
+        return;
+    }
+
+    // ld r, n
+    if ((op->op & 0xc7) == 0x06 && op->op < 0x40) {
+        if (dst != 6) {
+            *known |= 1 << dst;
+            values[dst] = op->operand[0];
+        }
+        return;
+    }
+
+    // inc r, dec r
+    if ((op->op & 0xc6) == 0x04 && op->op < 0x40) {
+        if (dst != 6 && (*known & 1 << dst)) {
+            values[dst] += (op->op & 1) ? -1 : 1;
+        }
+        return;
+    }
+
+    // add, adc, sub, sbc, and, xor, or
+    if ((op->op >= 0x80 && op->op < 0xb8) || op->op == 0xc6 || op->op == 0xce
+            || op->op == 0xd6 || op->op == 0xde || op->op == 0xe6
+            || op->op == 0xee || op->op == 0xf6) {
+        if (op->op == 0xaf) {
+            *known |= 1 << IR_A;
+            values[IR_A] = 0;
+        } else {
+            *known &= ~(1 << IR_A);
+        }
+        return;
+    }
+
+    switch (op->op) {
+    case 0x01: set_pair(known, values, IR_B, op->operand[1] << 8 | op->operand[0]); return;
+    case 0x11: set_pair(known, values, IR_D, op->operand[1] << 8 | op->operand[0]); return;
+    case 0x21: set_pair(known, values, IR_H, op->operand[1] << 8 | op->operand[0]); return;
+    case 0x03: step_pair(known, values, IR_B, 1); return;
+    case 0x13: step_pair(known, values, IR_D, 1); return;
+    case 0x23: step_pair(known, values, IR_H, 1); return;
+    case 0x0b: step_pair(known, values, IR_B, -1); return;
+    case 0x1b: step_pair(known, values, IR_D, -1); return;
+    case 0x2b: step_pair(known, values, IR_H, -1); return;
+
+    case 0x22: // ld (hl+), a
+        step_pair(known, values, IR_H, 1);
+        return;
+    case 0x32: // ld (hl-), a
+        step_pair(known, values, IR_H, -1);
+        return;
+    case 0x2a: // ld a, (hl+)
+        step_pair(known, values, IR_H, 1);
+        *known &= ~(1 << IR_A);
+        return;
+    case 0x3a: // ld a, (hl-)
+        step_pair(known, values, IR_H, -1);
+        *known &= ~(1 << IR_A);
+        return;
+
+    case 0x2f: // cpl
+        values[IR_A] = ~values[IR_A];
+        return;
+
+    case 0x0a: case 0x1a: case 0xf0: case 0xf2: case 0xfa:
+    case 0x07: case 0x0f: case 0x17: case 0x1f: case 0x27:
+        *known &= ~(1 << IR_A);
+        return;
+
+    case 0x09: case 0x19: case 0x29: case 0x39: case 0xf8: case 0xe1:
+        *known &= ~(3 << IR_H);
+        return;
+    case 0xc1:
+        *known &= ~(3 << IR_B);
+        return;
+    case 0xd1:
+        *known &= ~(3 << IR_D);
+        return;
+    case 0xf1:
+        *known &= ~(1 << IR_A);
+        return;
+
+    case 0xcb:
+        // everything but bit writes back to its register
+        if ((op->operand[0] < 0x40 || op->operand[0] >= 0x80)
+                && (op->operand[0] & 7) != 6) {
+            *known &= ~(1 << (op->operand[0] & 7));
+        }
+        return;
+
+    // leave the registers alone
+    case 0x00: case 0x02: case 0x12: case 0x08: case 0x10: case 0x76:
+    case 0x31: case 0x33: case 0x3b: case 0x34: case 0x35: case 0x36:
+    case 0x37: case 0x3f: case 0xb8: case 0xb9: case 0xba: case 0xbb:
+    case 0xbc: case 0xbd: case 0xbe: case 0xbf: case 0xfe:
+    case 0xe0: case 0xe2: case 0xea: case 0xe8: case 0xf9:
+    case 0xc5: case 0xd5: case 0xe5: case 0xf5: case 0xf3: case 0xfb:
+    // branches, whichever way they go
+    case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+    case 0xc2: case 0xca: case 0xd2: case 0xda:
+    case 0xc0: case 0xc8: case 0xd0: case 0xd8:
+    case 0xc4: case 0xcc: case 0xd4: case 0xdc:
+        return;
+
+    default:
+        *known = 0;
+        return;
+    }
+}
+
+// only backward jrs stay in the block, see compile_jr. the target of a
+// followed jump is an entry as well
+static void find_jr_targets(const struct ir_block *ir, uint8_t *jr_target)
+{
+    const struct ir_op *op;
+    int k, target;
+
+    memset(jr_target, 0, MAX_BLOCK_SRC);
+    for (k = 0; k < ir->count; k++) {
+        op = &ir->ops[k];
+        if (op->follows && k + 1 < ir->count) {
+            jr_target[ir->ops[k + 1].offset] = 1;
+        } else if (op->op == 0x18 || (op->op & 0xe7) == 0x20) {
+            target = op->offset + 2 + (int8_t) op->operand[0];
+            if (target >= 0 && target < op->offset) {
+                jr_target[target] = 1;
+            }
+        }
+    }
+}
+
+// Registers op can change, whatever they held: the ones step_constants
+// forgets or gives a new value, from two different starting points so an
+// op that happens to write what was there still counts
+static uint8_t constant_writes(const struct ir_op *op)
+{
+    uint8_t known, values[8], writes = 0;
+    int seed, r;
+
+    for (seed = 0; seed < 0x100; seed += 0x80) {
+        known = 0xff;
+        for (r = 0; r < 8; r++) {
+            values[r] = seed + r;
+        }
+        step_constants(op, &known, values);
+        for (r = 0; r < 8; r++) {
+            if (!(known & 1 << r) || values[r] != seed + r) {
+                writes |= 1 << r;
+            }
+        }
+    }
+    return writes;
+}
+
+// For each jr target, the registers something on the way back round to it
+// can change, which is everything in the loops it's part of. A followed
+// jump's target is an entry from the dispatcher, so it could be anything
+static void find_loop_writes(const struct ir_block *ir, uint8_t *loop_writes)
+{
+    const struct ir_op *op;
+    uint8_t writes;
+    int j, head, k, target;
+
+    memset(loop_writes, 0, MAX_IR_OPS);
+    for (j = 0; j < ir->count; j++) {
+        op = &ir->ops[j];
+        if (op->follows && j + 1 < ir->count) {
+            loop_writes[j + 1] = 0xff;
+            continue;
+        }
+        if (op->op != 0x18 && (op->op & 0xe7) != 0x20) {
+            continue;
+        }
+        target = op->offset + 2 + (int8_t) op->operand[0];
+        if (target < 0 || target >= op->offset) {
+            continue;
+        }
+        for (head = 0; head < ir->count && ir->ops[head].offset != target; head++)
+            ;
+        if (head >= j) {
+            // not compiled yet when the jr is, so it leaves the block.
+            // forget everything wherever the target is
+            if (head < ir->count) {
+                loop_writes[head] = 0xff;
+            }
+            continue;
+        }
+
+        writes = 0;
+        for (k = head; k <= j; k++) {
+            writes |= constant_writes(&ir->ops[k]);
+        }
+        for (k = head; k <= j; k++) {
+            loop_writes[k] |= writes;
+        }
+    }
+}
+
+void ir_find_constants(struct ir_block *ir, struct compile_ctx *ctx)
+{
+    static uint8_t jr_target[MAX_BLOCK_SRC];
+    static uint8_t loop_writes[MAX_IR_OPS];
+    uint8_t known = 0, values[8] = { 0 };
+    struct ir_op *op;
+    int k;
+
+    (void) ctx;
+
+    find_jr_targets(ir, jr_target);
+    find_loop_writes(ir, loop_writes);
+    for (k = 0; k < ir->count; k++) {
+        op = &ir->ops[k];
+        if (jr_target[op->offset]) {
+            // what the loop leaves alone is the same every time round
+            known &= ~loop_writes[k];
+        }
+        op->known = known;
+        memcpy(op->values, values, sizeof values);
+        step_constants(op, &known, values);
+    }
+}
+
+// Which page table a (hl) access would want cached, 0 for none. inc (hl),
+// dec (hl) and the cb ops are both a read and a write so they don't ask
+// for either, and known addresses don't go through A1 at all
+static int hl_access(const struct ir_op *op)
+{
+    uint16_t addr;
+
+    if (ir_known_pair(op, IR_H, &addr)) {
+        return 0;
+    }
+    if (op->op == 0x2a || op->op == 0x3a || (op->op >= 0x40 && op->op < 0xc0
+            && op->op != 0x76 && (op->op & 7) == 6)) {
+        return HL_CACHE_READ;
+    }
+    if (op->op == 0x22 || op->op == 0x32 || op->op == 0x36
+            || (op->op >= 0x70 && op->op < 0x78 && op->op != 0x76)) {
+        return HL_CACHE_WRITE;
+    }
+    return 0;
+}
+
+// inc hl, dec hl and (hl+)/(hl-) fix A1 up themselves when L wraps. the
+// code after a call could come back with anything in H and A1, and the
+// dispatcher can come into a followed jump's target the same way
+static int changes_h(const struct ir_op *op)
+{
+    if (op->follows) {
+        return 1;
+    }
+    switch (op->op) {
+    case 0x21: case 0x24: case 0x25: case 0x26:
+    case 0x09: case 0x19: case 0x29: case 0x39:
+    case 0xe1: case 0xf8: case 0xcd:
+        return 1;
+    case 0xcb:
+        return (op->operand[0] & 7) == 4
+            && (op->operand[0] < 0x40 || op->operand[0] >= 0x80);
+    default:
+        return op->op >= 0x60 && op->op < 0x68;
+    }
+}
+
+static int is_branch(uint8_t op)
+{
+    return op == 0x18 || (op & 0xe7) == 0x20 || (op & 0xe7) == 0xc0
+        || (op & 0xe7) == 0xc2 || (op & 0xe7) == 0xc4;
+}
+
+// the index of the k-th backward jr to ops[head] after it, or -1
+static int back_edge(const struct ir_block *ir, int head, int k)
+{
+    const struct ir_op *op;
+    int j;
+
+    for (j = head; j < ir->count; j++) {
+        op = &ir->ops[j];
+        if ((op->op == 0x18 || (op->op & 0xe7) == 0x20)
+                && op->offset + 2 + (int8_t) op->operand[0] == ir->ops[head].offset
+                && k-- == 0) {
+            return j;
+        }
+    }
+    return -1;
+}
+
+// set by ir_find_hl_cache for ops that some jr later in the block goes
+// back to
+static uint8_t loop_head[MAX_IR_OPS];
+
+// Whether another access of the same kind comes before A1 would be lost
+static int hl_reused(const struct ir_block *ir, int from, int mode)
+{
+    const struct ir_op *op;
+    int k, access;
+
+    for (k = from + 1; k < ir->count; k++) {
+        op = &ir->ops[k];
+        if (loop_head[k]) {
+            return 0;
+        }
+        access = hl_access(op);
+        if (access) {
+            return access == mode;
+        }
+        if (changes_h(op)) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static int hl_cache_run(struct ir_block *ir, int from, int to, int state, int skip_head, int apply);
+
+// What A1 can hold at the top of the loop at head: whatever its first
+// access wants, as long as every way back around leaves it that way
+static int hl_loop_state(struct ir_block *ir, int head)
+{
+    int k, j, mode = 0;
+
+    // the branch might get fused into the op before it, which would skip
+    // the load
+    if (is_branch(ir->ops[head].op)) {
+        return 0;
+    }
+    for (k = head; k < ir->count && !mode; k++) {
+        mode = hl_access(&ir->ops[k]);
+        if (changes_h(&ir->ops[k])) {
+            break;
+        }
+    }
+    if (!mode) {
+        return 0;
+    }
+    for (k = 0; (j = back_edge(ir, head, k)) >= 0; k++) {
+        if (hl_cache_run(ir, head, j, mode, head, 0) != mode) {
+            return 0;
+        }
+    }
+    return mode;
+}
+
+// Go over from..to with A1 starting out as state and return what it is
+// after to. Only fills in the ops if apply is set
+static int hl_cache_run(struct ir_block *ir, int from, int to, int state, int skip_head, int apply)
+{
+    struct ir_op *op;
+    int k, mode, reload;
+
+    for (k = from; k <= to; k++) {
+        op = &ir->ops[k];
+        reload = 0;
+        if (k != skip_head && loop_head[k]) {
+            // the dispatcher can come in here with anything in A1
+            state = hl_loop_state(ir, k);
+            reload = state ? HL_RELOAD_ENTRY : 0;
+        } else if ((mode = hl_access(op)) && mode != state && hl_reused(ir, k, mode)) {
+            state = mode;
+            reload = HL_RELOAD;
+        }
+        if (apply) {
+            op->hl_cache = state;
+            op->hl_reload = reload;
+        }
+        if (changes_h(op)) {
+            state = 0;
+        }
+    }
+    return state;
+}
+
+void ir_find_hl_cache(struct ir_block *ir, struct compile_ctx *ctx)
+{
+    int k;
+
+    (void) ctx;
+    for (k = 0; k < ir->count; k++) {
+        loop_head[k] = back_edge(ir, k, 0) >= 0;
+    }
+    hl_cache_run(ir, 0, ir->count - 1, 0, -1, 1);
+}
+
+// longest loop ir_find_idle_loops looks at
+#define MAX_IDLE_OPS 8
+
+// the flags, for idle_op. the registers are 1 << IR_B and so on
+#define IDLE_F (1 << 8)
+
+// Registers that change with time or by being read, so a loop waiting on
+// one isn't idle. LY and STAT have their own waits in compile_block
+static int clock_register(uint16_t addr)
+{
+    return addr == 0xff04 || addr == 0xff05 || addr == 0xff41
+        || addr == 0xff44 || (addr >= 0xff10 && addr < 0xff40);
+}
+
+// Whether reading r (0-7, 6 for (hl)) is fine in an idle loop, adding the
+// registers it needs to reads
+static int idle_source(const struct ir_op *op, int r, int *reads)
+{
+    uint16_t addr;
+
+    if (r != 6) {
+        *reads |= 1 << r;
+        return 1;
+    }
+    *reads |= 1 << IR_H | 1 << IR_L;
+    return ir_known_pair(op, IR_H, &addr) && !clock_register(addr);
+}
+
+// Whether op can be in an idle loop, and if so the registers and flags it
+// reads and writes. Nothing here writes memory or jumps anywhere
+static int idle_op(const struct ir_op *op, int *reads, int *writes)
+{
+    uint8_t code = op->op, cb;
+    uint16_t addr;
+    int pair;
+
+    *reads = 0;
+    *writes = 0;
+    switch (code) {
+    case 0x00: // nop
+        return 1;
+    case 0xf0: // ld a, ($ff00 + u8)
+        *writes = 1 << IR_A;
+        return !clock_register(0xff00 + op->operand[0]);
+    case 0xfa: // ld a, (u16)
+        *writes = 1 << IR_A;
+        return !clock_register(op->operand[1] << 8 | op->operand[0]);
+    case 0x0a: // ld a, (bc)
+    case 0x1a: // ld a, (de)
+        pair = code == 0x0a ? IR_B : IR_D;
+        *reads = 3 << pair;
+        *writes = 1 << IR_A;
+        return ir_known_pair(op, pair, &addr) && !clock_register(addr);
+    case 0xe6: case 0xee: case 0xf6: // and/xor/or u8
+        *reads = 1 << IR_A;
+        *writes = 1 << IR_A | IDLE_F;
+        return 1;
+    case 0xfe: // cp u8
+        *reads = 1 << IR_A;
+        *writes = IDLE_F;
+        return 1;
+    case 0xcb:
+        // bit n, r
+        cb = op->operand[0];
+        *writes = IDLE_F;
+        return cb >= 0x40 && cb < 0x80 && idle_source(op, cb & 7, reads);
+    }
+
+    if ((code & 0xc7) == 0x06 && code != 0x36) {
+        // ld r, u8
+        *writes = 1 << (code >> 3);
+        return 1;
+    }
+    if (code >= 0x40 && code < 0x80 && code != 0x76 && (code & 0x38) != 0x30) {
+        // ld r, r
+        *writes = 1 << (code >> 3 & 7);
+        return idle_source(op, code & 7, reads);
+    }
+    if (code >= 0xa0 && code < 0xc0) {
+        // and/xor/or/cp r
+        *reads = 1 << IR_A;
+        *writes = code < 0xb8 ? 1 << IR_A | IDLE_F : IDLE_F;
+        return idle_source(op, code & 7, reads);
+    }
+    return 0;
+}
+
+void ir_find_idle_loops(struct ir_block *ir, struct compile_ctx *ctx)
+{
+    struct ir_op *jr;
+    int j, head, k, target, reads, writes, loop_writes, written;
+
+    (void) ctx;
+    for (j = 1; j < ir->count; j++) {
+        jr = &ir->ops[j];
+        if ((jr->op & 0xe7) != 0x20) {
+            continue;
+        }
+        target = jr->offset + 2 + (int8_t) jr->operand[0];
+        for (head = j - 1; head > 0 && ir->ops[head].offset > target; head--)
+            ;
+        if (ir->ops[head].offset != target || j - head > MAX_IDLE_OPS) {
+            continue;
+        }
+
+        loop_writes = 0;
+        for (k = head; k < j; k++) {
+            if (!idle_op(&ir->ops[k], &reads, &writes)) {
+                break;
+            }
+            loop_writes |= writes;
+        }
+        if (k < j) {
+            continue;
+        }
+
+        // anything read before it's written has to be the same every
+        // time round, which means nothing in the loop writes it
+        written = 0;
+        for (k = head; k < j; k++) {
+            idle_op(&ir->ops[k], &reads, &writes);
+            if (reads & ~written & loop_writes) {
+                break;
+            }
+            written |= writes;
+        }
+        jr->idle = k == j;
+    }
+}
+
+// how an op gets at D2, for ir_find_cycle_runs
+#define BUDGET_NONE 0 // never, and never leaves the block
+#define BUDGET_CALL 1 // only in a call to read or write memory
+#define BUDGET_OWN 2  // branches, exits and everything else
+
+static int budget_use(const struct ir_op *op)
+{
+    uint8_t code = op->op;
+
+    if (op->follows) {
+        return BUDGET_NONE;
+    }
+
+    if (code == 0xcb) {
+        return (op->operand[0] & 7) == 6 ? BUDGET_CALL : BUDGET_NONE;
+    }
+    if (code >= 0x40 && code < 0xc0 && code != 0x76) {
+        // ld r, r' and the alu ops, which only use memory for (hl)
+        return (code & 7) == 6 || (code >= 0x70 && code < 0x78)
+            ? BUDGET_CALL : BUDGET_NONE;
+    }
+    if ((code & 0xc7) == 0xc6) {
+        return BUDGET_NONE; // alu imm
+    }
+
+    switch (code) {
+    case 0x00: // nop
+    case 0x01: case 0x11: case 0x21: case 0x31: // ld rr, u16
+    case 0x03: case 0x13: case 0x23: case 0x33: // inc rr
+    case 0x0b: case 0x1b: case 0x2b: case 0x3b: // dec rr
+    case 0x09: case 0x19: case 0x29: case 0x39: // add hl, rr
+    case 0x04: case 0x0c: case 0x14: case 0x1c: case 0x24: case 0x2c: case 0x3c:
+    case 0x05: case 0x0d: case 0x15: case 0x1d: case 0x25: case 0x2d: case 0x3d:
+    case 0x06: case 0x0e: case 0x16: case 0x1e: case 0x26: case 0x2e: case 0x3e:
+    case 0x07: case 0x0f: case 0x17: case 0x1f: // rlca, rrca, rla, rra
+    case 0x27: case 0x2f: case 0x37: case 0x3f: // daa, cpl, scf, ccf
+        return BUDGET_NONE;
+
+    case 0x02: case 0x0a: case 0x12: case 0x1a: // (bc), (de)
+    case 0x22: case 0x2a: case 0x32: case 0x3a: // (hl+), (hl-)
+    case 0x34: case 0x35: case 0x36: // inc (hl), dec (hl), ld (hl), u8
+    case 0x08: case 0xea: case 0xfa: // ld (u16), sp and a to and from (u16)
+    case 0xe0: case 0xf0: case 0xe2: case 0xf2: // ldh
+    case 0xc1: case 0xd1: case 0xe1: case 0xf1: // pop
+    case 0xc5: case 0xd5: case 0xe5: case 0xf5: // push
+        return BUDGET_CALL;
+
+    default:
+        return BUDGET_OWN;
+    }
+}
+
+void ir_find_cycle_runs(struct ir_block *ir, struct compile_ctx *ctx)
+{
+    static uint8_t jr_target[MAX_BLOCK_SRC];
+    struct ir_op *op, *head = NULL;
+    int k, use;
+
+    (void) ctx;
+
+    find_jr_targets(ir, jr_target);
+    for (k = 0; k < ir->count; k++) {
+        op = &ir->ops[k];
+        use = budget_use(op);
+        if (!head || use == BUDGET_OWN || jr_target[op->offset]) {
+            head = op;
+        } else {
+            head->charge += op->charge;
+            op->charge = 0;
+        }
+        if (use != BUDGET_NONE) {
+            head = NULL;
+        }
+    }
+}
+
+int ir_known_pair(const struct ir_op *op, int hi, uint16_t *value)
+{
+    if (!op || (op->known & (3 << hi)) != (3 << hi)) {
+        return 0;
+    }
+    *value = op->values[hi] << 8 | op->values[hi + 1];
+    return 1;
+}
+
+void ir_dump(const struct ir_block *ir, FILE *fp)
+{
+    static const char names[] = "bcdehl-a";
+    const struct ir_op *op;
+    int k, r;
+
+    for (k = 0; k < ir->count; k++) {
+        op = &ir->ops[k];
+        fprintf(fp, "  %04x  %02x", ir->src_address + op->offset, op->op);
+        for (r = 0; r < 2; r++) {
+            if (r + 1 < op->length) {
+                fprintf(fp, " %02x", op->operand[r]);
+            } else {
+                fprintf(fp, "   ");
+            }
+        }
+        fprintf(fp, "  %-12s %2d", instructions[op->op == 0xcb
+                ? 0x100 + op->operand[0] : op->op].format, op->cycles);
+        if (op->cycles_branch != op->cycles) {
+            fprintf(fp, "/%-2d", op->cycles_branch);
+        } else {
+            fprintf(fp, "   ");
+        }
+
+        if (op->flags_dead) {
+            fprintf(fp, " flags-dead");
+        }
+        if (op->daa_state && op->op == 0x27) {
+            fprintf(fp, " daa-from-%02x", op->daa_state);
+        } else if (op->daa_state) {
+            fprintf(fp, " daa-untracked");
+        }
+        if (op->hl_reload) {
+            fprintf(fp, " hl-load");
+        }
+        if (op->hl_cache) {
+            fprintf(fp, op->hl_cache == HL_CACHE_READ ? " hl-read" : " hl-write");
+        }
+        if (op->idle) {
+            fprintf(fp, " idle");
+        }
+        if (op->follows) {
+            fprintf(fp, " follows");
+        }
+        if (op->charge != op->cycles) {
+            fprintf(fp, " charge-%d", op->charge);
+        }
+        for (r = 0; r < 8; r++) {
+            if (op->known & 1 << r) {
+                fprintf(fp, " %c=%02x", names[r], op->values[r]);
+            }
+        }
+        fprintf(fp, "\n");
+    }
+}
@@ -0,0 +1,124 @@
+#ifndef _IR_H
+#define _IR_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct compile_ctx;
+
+// at most as many as compile_block takes
+#define MAX_IR_OPS 256
+
+// bits in ir_op.known, in the order GB opcodes number registers.
+// 6 is (hl), which is never known
+#define IR_B 0
+#define IR_C 1
+#define IR_D 2
+#define IR_E 3
+#define IR_H 4
+#define IR_L 5
+#define IR_A 7
+
+// One decoded GB instruction. The passes fill in everything after cycles,
+// compile_block reads them while it emits the op
+struct ir_op {
+    uint16_t offset; // from src_address
+    uint8_t op;
+    // the bytes after op, 0 past length. cb ops have theirs in operand[0]
+    uint8_t operand[2];
+    uint8_t length;
+    // from instructions[], cb ops from the second half
+    uint8_t cycles;
+    uint8_t cycles_branch;
+    // what compile_block takes off D2 just before the op. the first op of
+    // a run pays for the whole run and the rest pay nothing
+    uint16_t charge;
+    // see code_block.flags_dead and code_block.daa_state
+    uint8_t flags_dead;
+    uint8_t daa_state;
+    // registers whose value is known before this op runs, and what it is
+    uint8_t known;
+    uint8_t values[8];
+    // which page table A1 caches HL's page from before this op, and
+    // whether to load it first
+    uint8_t hl_cache;
+    uint8_t hl_reload;
+    // set on the jr of a loop that only waits for memory to change, see
+    // ir_find_idle_loops
+    uint8_t idle;
+    // set on a jp or jr the block carries on at the target of, which is
+    // the next op, see ir_follows_jump
+    uint8_t follows;
+};
+
+// ir_op.hl_cache
+#define HL_CACHE_READ 1
+#define HL_CACHE_WRITE 2
+
+// ir_op.hl_reload. A loop head also gets a block entry at the load, since
+// the dispatcher can come back in there
+#define HL_RELOAD 1
+#define HL_RELOAD_ENTRY 2
+
+struct ir_block {
+    uint16_t src_address;
+    int count;
+    struct ir_op ops[MAX_IR_OPS];
+};
+
+struct ir_pass {
+    const char *name;
+    void (*run)(struct ir_block *ir, struct compile_ctx *ctx);
+};
+
+// in the order compile_block runs them, ending with a NULL name
+extern const struct ir_pass ir_passes[];
+
+// GB instruction length from the first byte
+int ir_op_length(uint8_t op);
+
+// Whether compile_block carries on at the target of the jp or jr at
+// offset instead of ending the block. Only forward, as far as a block
+// reaches, and within the same part of ROM so nothing can change it
+int ir_follows_jump(uint16_t src_address, uint16_t offset, uint8_t length, uint16_t target);
+
+// Decode from src_address up to where compile_block would stop at the
+// latest, going on at the target of jumps it follows. Every field the passes fill in is left 0, except charge, which
+// is the op's own cycles
+void ir_decode(struct ir_block *ir, struct compile_ctx *ctx, uint16_t src_address);
+
+// ir_decode then every pass
+void ir_build(struct ir_block *ir, struct compile_ctx *ctx, uint16_t src_address);
+
+// Fill in known and values. The top of a loop keeps what's known about the
+// registers nothing in the loop writes, and a followed jump's target starts
+// over knowing nothing
+void ir_find_constants(struct ir_block *ir, struct compile_ctx *ctx);
+
+// Fill in hl_cache and hl_reload. Loads happen where the same kind of
+// (hl) access comes at least twice before H changes, and at the top of
+// loops that leave A1 the way they found it
+void ir_find_hl_cache(struct ir_block *ir, struct compile_ctx *ctx);
+
+// Set idle on backward jr cc ops whose loop only reads memory nothing in
+// it writes, and works out the same thing from it every time round. Only
+// an interrupt or the hardware can end those, so there's no point running
+// them until the next event
+void ir_find_idle_loops(struct ir_block *ir, struct compile_ctx *ctx);
+
+// Fill in charge. A run is ops that never look at D2, then at most one
+// that only does in a call to read or write memory. Branches, exits and
+// anything a jr from later in the block or a followed jump goes to start
+// a new one,
+// so every place that sees D2 sees it the same as if each op paid for
+// itself
+void ir_find_cycle_runs(struct ir_block *ir, struct compile_ctx *ctx);
+
+// Whether the pair starting at hi (IR_B, IR_D or IR_H) is known before
+// op, and if so its value. op can be NULL
+int ir_known_pair(const struct ir_op *op, int hi, uint16_t *value);
+
+// One line per op
+void ir_dump(const struct ir_block *ir, FILE *fp);
+
+#endif
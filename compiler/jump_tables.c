@@ -0,0 +1,579 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "branches.h"
+#include "emitters.h"
+#include "instructions.h"
+#include "ir.h"
+#include "jump_tables.h"
+
+// most ops followed from the vector to the jump
+#define MAX_HELPER_OPS 24
+
+// what compile_jump_table needs before the entries at most, what one entry
+// needs at most (every register, the cycles, D3 and a banked exit), and
+// room for the rst the slow way after them
+#define MAX_PREFIX_CODE 96
+#define MAX_ENTRY_CODE 68
+#define MAX_FALLBACK_CODE 128
+
+// how a register comes out of the helper over all the indexes
+#define FROM_CONST 0  // the same every time
+#define FROM_INDEX 1  // A going in
+#define FROM_INDEX2 2 // twice that, which add a leaves
+#define FROM_EACH 3   // something else, so each entry sets it
+
+#define REG_BIT(r) (1 << (r))
+#define HL_BITS (REG_BIT(IR_H) | REG_BIT(IR_L))
+
+// The helper while it's followed for one index
+struct helper {
+    struct compile_ctx *ctx;
+    struct jump_table_entry *entry;
+    uint8_t known;   // bit per register that has a value, A is the only one going in
+    uint8_t writes;
+    int flags_known;
+    int sets_daa;
+    uint16_t stack[4];
+    int depth;
+    int popped_return;
+    uint16_t table;
+    uint16_t limit;  // reads from here on aren't table anymore
+};
+
+// CCR a 68k add of this size leaves, with X the same as C
+static uint8_t add_ccr(uint32_t a, uint32_t b, int bits)
+{
+    uint32_t mask = (1ul << bits) - 1, sign = 1ul << (bits - 1);
+    uint32_t res = (a & mask) + (b & mask);
+    uint8_t ccr = 0;
+
+    if (res > mask) {
+        ccr |= 0x11;
+    }
+    if (!(res & mask)) {
+        ccr |= 0x04;
+    }
+    if (res & sign) {
+        ccr |= 0x08;
+    }
+    if (~(a ^ b) & (a ^ res) & sign) {
+        ccr |= 0x02;
+    }
+    return ccr;
+}
+
+static int get_reg(struct helper *h, int r, uint8_t *val)
+{
+    if (r == 6 || !(h->known & REG_BIT(r))) {
+        return 0;
+    }
+    *val = h->entry->regs[r];
+    return 1;
+}
+
+static void set_reg(struct helper *h, int r, uint8_t val)
+{
+    h->entry->regs[r] = val;
+    h->known |= REG_BIT(r);
+    h->writes |= REG_BIT(r);
+}
+
+// pair 0 is BC, 1 DE, 2 HL
+static int get_pair(struct helper *h, int pair, uint16_t *val)
+{
+    uint8_t hi, lo;
+
+    if (pair > 2 || !get_reg(h, pair * 2, &hi) || !get_reg(h, pair * 2 + 1, &lo)) {
+        return 0;
+    }
+    *val = hi << 8 | lo;
+    return 1;
+}
+
+static void set_pair(struct helper *h, int pair, uint16_t val)
+{
+    set_reg(h, pair * 2, val >> 8);
+    set_reg(h, pair * 2 + 1, val);
+}
+
+// Read from the table, which has to be in ROM in the same region
+static int read_table(struct helper *h, uint16_t addr, uint8_t *val)
+{
+    if (addr < h->table || addr >= h->limit) {
+        return 0;
+    }
+    *val = h->ctx->read(h->ctx->dmg, addr);
+    return 1;
+}
+
+// Follow the helper at pc for the index in A. Returns 0 if it does
+// something a jump table helper doesn't, or reads past the table
+static int follow(struct helper *h, uint16_t pc)
+{
+    struct jump_table_entry *e = h->entry;
+    uint8_t op, imm, val, src;
+    uint16_t pair;
+    int k;
+
+    for (k = 0; k < MAX_HELPER_OPS; k++) {
+        op = h->ctx->read(h->ctx->dmg, pc);
+        imm = h->ctx->read(h->ctx->dmg, pc + 1);
+        e->cycles += instructions[op].cycles;
+        pc++;
+
+        if ((op & 0xf8) == 0x80 || op == 0xc6) {
+            // add a, r or add a, u8, which saves the old A for daa
+            if (op == 0xc6) {
+                src = imm;
+                pc++;
+            } else if (!get_reg(h, op & 7, &src)) {
+                return 0;
+            }
+            if (!get_reg(h, IR_A, &val)) {
+                return 0;
+            }
+            e->ccr = add_ccr(val, src, 8);
+            e->daa_a = val;
+            h->flags_known = 1;
+            h->sets_daa = 1;
+            set_reg(h, IR_A, val + src);
+            continue;
+        }
+        if (op >= 0x40 && op < 0x80 && op != 0x76) {
+            // ld r, r' or ld r, (hl)
+            if ((op & 7) == 6) {
+                if (!get_pair(h, 2, &pair) || !read_table(h, pair, &val)) {
+                    return 0;
+                }
+            } else if (!get_reg(h, op & 7, &val)) {
+                return 0;
+            }
+            if (((op >> 3) & 7) == 6) {
+                return 0;
+            }
+            set_reg(h, (op >> 3) & 7, val);
+            continue;
+        }
+        if ((op & 0xc7) == 0x06 && op != 0x36) {
+            // ld r, u8
+            set_reg(h, op >> 3, imm);
+            pc++;
+            continue;
+        }
+        if ((op & 0xc7) == 0x04 && op != 0x34 && op != 0x3c) {
+            // inc r, compiled as an addq.b that sets the flags
+            if (!get_reg(h, op >> 3, &val)) {
+                return 0;
+            }
+            e->ccr = add_ccr(val, 1, 8);
+            h->flags_known = 1;
+            set_reg(h, op >> 3, val + 1);
+            continue;
+        }
+
+        switch (op) {
+        case 0x03: // inc bc
+        case 0x13: // inc de
+        case 0x23: // inc hl
+            if (!get_pair(h, op >> 4, &pair)) {
+                return 0;
+            }
+            set_pair(h, op >> 4, pair + 1);
+            break;
+
+        case 0x09: // add hl, bc
+        case 0x19: // add hl, de
+        case 0x29: // add hl, hl
+        {
+            uint16_t hl;
+
+            if (!get_pair(h, 2, &hl) || !get_pair(h, op >> 4, &pair)) {
+                return 0;
+            }
+            e->ccr = add_ccr(hl, pair, 16);
+            h->flags_known = 1;
+            set_pair(h, 2, hl + pair);
+            break;
+        }
+
+        case 0x2a: // ld a, (hl+)
+            if (!get_pair(h, 2, &pair) || !read_table(h, pair, &val)) {
+                return 0;
+            }
+            set_reg(h, IR_A, val);
+            set_pair(h, 2, pair + 1);
+            break;
+
+        case 0x20: // jr nz
+        case 0x28: // jr z
+        case 0x30: // jr nc
+        case 0x38: // jr c
+        {
+            int flag = op < 0x30 ? e->ccr & 0x04 : e->ccr & 0x01;
+            int taken = (op & 0x08) ? flag : !flag;
+
+            if (!h->flags_known || (int8_t) imm < 0) {
+                return 0;
+            }
+            pc++;
+            if (taken) {
+                e->cycles += instructions[op].cycles_branch - instructions[op].cycles;
+                pc += imm;
+            }
+            break;
+        }
+
+        case 0x18: // jr
+            if ((int8_t) imm < 0) {
+                return 0;
+            }
+            pc += 1 + imm;
+            break;
+
+        case 0xc3: // jp, from the vector on to the rest of the helper
+            pc = imm | h->ctx->read(h->ctx->dmg, pc + 1) << 8;
+            if (pc >= 0x4000) {
+                return 0;
+            }
+            break;
+
+        case 0xc1: // pop bc
+        case 0xd1: // pop de
+        case 0xe1: // pop hl
+            if (h->depth) {
+                pair = h->stack[--h->depth];
+            } else if (!h->popped_return) {
+                // the rst's return address, which is where the table is
+                pair = h->table;
+                h->popped_return = 1;
+            } else {
+                return 0;
+            }
+            set_pair(h, (op >> 4) & 3, pair);
+            break;
+
+        case 0xc5: // push bc
+        case 0xd5: // push de
+        case 0xe5: // push hl
+            if (h->depth == 4 || !get_pair(h, (op >> 4) & 3, &pair)) {
+                return 0;
+            }
+            h->stack[h->depth++] = pair;
+            break;
+
+        case 0xe9: // jp (hl)
+            if (!get_pair(h, 2, &e->target)) {
+                return 0;
+            }
+            return h->popped_return && !h->depth;
+
+        case 0xc9: // ret, to what it pushed
+            if (!h->depth) {
+                return 0;
+            }
+            e->target = h->stack[--h->depth];
+            return h->popped_return && !h->depth;
+
+        default:
+            return 0;
+        }
+    }
+    return 0;
+}
+
+int jump_table_match(struct compile_ctx *ctx, uint8_t vector, uint16_t table,
+                     struct jump_table *jt)
+{
+    struct helper h;
+    struct jump_table_entry *e;
+    int k;
+
+    if (table >= 0x8000) {
+        return 0;
+    }
+
+    memset(jt, 0, sizeof *jt);
+    jt->table = table;
+    // the table ends by the end of its region, or where a handler after
+    // it starts
+    h.limit = (table & 0xc000) + 0x4000;
+    for (k = 0; k < MAX_JUMP_TABLE; k++) {
+        e = &jt->entry[k];
+        h.ctx = ctx;
+        h.entry = e;
+        h.known = REG_BIT(IR_A);
+        h.writes = 0;
+        h.flags_known = 0;
+        h.sets_daa = 0;
+        h.depth = 0;
+        h.popped_return = 0;
+        h.table = table;
+        e->regs[IR_A] = k;
+
+        if (!follow(&h, vector) || e->target >= 0x8000) {
+            break;
+        }
+        // HL is set whole or not at all
+        if ((h.writes & HL_BITS) && (h.writes & HL_BITS) != HL_BITS) {
+            break;
+        }
+        // every index has to set the same things, anything it leaves alone
+        // is whatever it was going in
+        if (k == 0) {
+            jt->writes = h.writes;
+            jt->sets_flags = h.flags_known;
+            jt->sets_daa = h.sets_daa;
+        } else if (h.writes != jt->writes || h.flags_known != jt->sets_flags
+                || h.sets_daa != jt->sets_daa) {
+            break;
+        }
+        if (e->target > table && e->target < h.limit) {
+            h.limit = e->target;
+        }
+        jt->entries++;
+    }
+    return jt->entries > 0;
+}
+
+// How one register comes out of the helper, vals has one for each entry
+static int value_from(const uint8_t *vals, int count)
+{
+    int same = 1, index = 1, index2 = 1;
+    int k;
+
+    for (k = 0; k < count; k++) {
+        same &= vals[k] == vals[0];
+        index &= vals[k] == k;
+        index2 &= vals[k] == (uint8_t) (k * 2);
+    }
+    if (same) {
+        return FROM_CONST;
+    }
+    if (index) {
+        return FROM_INDEX;
+    }
+    if (index2) {
+        return FROM_INDEX2;
+    }
+    return FROM_EACH;
+}
+
+// 68k register a GB register other than H or L lives in, and whether
+// it's the byte in the high word
+static uint8_t reg_dn(int r, int *high)
+{
+    *high = r == IR_B || r == IR_D;
+    switch (r) {
+    case IR_B:
+    case IR_C:
+        return REG_68K_D_BC;
+    case IR_D:
+    case IR_E:
+        return REG_68K_D_DE;
+    default:
+        return REG_68K_D_A;
+    }
+}
+
+// move.b Dn or #imm into GB register r, other than H or L
+static void set_reg_from(struct code_block *block, int r, int from_dn, uint8_t dn, uint8_t imm)
+{
+    int high;
+    uint8_t dreg = reg_dn(r, &high);
+
+    if (high) {
+        emit_swap(block, dreg);
+    }
+    if (from_dn) {
+        emit_move_b_dn_dn(block, dn, dreg);
+    } else {
+        emit_move_b_dn(block, dreg, imm);
+    }
+    if (high) {
+        emit_swap(block, dreg);
+    }
+}
+
+static void put_word(struct code_block *block, size_t at, uint16_t val)
+{
+    block->code[at] = val >> 8;
+    block->code[at + 1] = val;
+}
+
+int compile_jump_table(struct code_block *block, struct compile_ctx *ctx,
+                       uint8_t vector, uint16_t ret_addr)
+{
+    // too big for the stack on a Mac
+    static struct jump_table jt;
+    uint8_t vals[MAX_JUMP_TABLE];
+    int from[8], from_flags, from_daa;
+    uint16_t at[MAX_JUMP_TABLE];
+    size_t count_imm, skip, table, base, fallback;
+    int count, emitted, min_cycles, index2, r, k;
+    struct jump_table_entry *e;
+
+    if (ctx->single_instruction || !jump_table_match(ctx, vector, ret_addr, &jt)) {
+        return 0;
+    }
+    count = (MAX_BLOCK_CODE - (int) block->length - MAX_PREFIX_CODE - MAX_FALLBACK_CODE)
+        / (MAX_ENTRY_CODE + 2);
+    if (count > jt.entries) {
+        count = jt.entries;
+    }
+    if (count <= 0) {
+        return 0;
+    }
+
+    min_cycles = jt.entry[0].cycles;
+    for (k = 1; k < count; k++) {
+        if (jt.entry[k].cycles < min_cycles) {
+            min_cycles = jt.entry[k].cycles;
+        }
+    }
+    index2 = 0;
+    for (r = 0; r < 8; r++) {
+        from[r] = -1;
+        if (r == 6 || !(jt.writes & REG_BIT(r))) {
+            continue;
+        }
+        for (k = 0; k < count; k++) {
+            vals[k] = jt.entry[k].regs[r];
+        }
+        from[r] = value_from(vals, count);
+        // HL is set with a movea.w, so it's both halves or neither
+        if ((r == IR_H || r == IR_L) && from[r] != FROM_CONST) {
+            from[r] = FROM_EACH;
+        }
+        index2 |= from[r] == FROM_INDEX2;
+    }
+    if (from[IR_H] == FROM_EACH || from[IR_L] == FROM_EACH) {
+        from[IR_H] = from[IR_L] = FROM_EACH;
+    }
+    from_flags = -1;
+    if (jt.sets_flags) {
+        for (k = 0; k < count; k++) {
+            vals[k] = jt.entry[k].ccr;
+        }
+        from_flags = value_from(vals, count) == FROM_CONST ? FROM_CONST : FROM_EACH;
+    }
+    from_daa = -1;
+    if (jt.sets_daa) {
+        for (k = 0; k < count; k++) {
+            vals[k] = jt.entry[k].daa_a;
+        }
+        from_daa = value_from(vals, count);
+        index2 |= from_daa == FROM_INDEX2;
+    }
+
+    // cmp.b #entries, d4, patched once it's known how many fit
+    count_imm = block->length + 2;
+    emit_cmp_b_imm_dn(block, REG_68K_D_A, count);
+    // bcc.w fallback = A is past the ones compiled
+    skip = block->length;
+    emit_bcc_w(block, 0);
+    emit_add_cycles(block, min_cycles);
+
+    // D1 = index
+    emit_moveq_dn(block, REG_68K_D_SCRATCH_1, 0);
+    emit_move_b_dn_dn(block, REG_68K_D_A, REG_68K_D_SCRATCH_1);
+
+    if (jt.sets_daa) {
+        // N = 0, the helper's last add
+        emit_moveq_dn(block, REG_68K_D_SCRATCH_0, 0);
+        emit_move_b_dn_disp_an(block, REG_68K_D_SCRATCH_0, JIT_CTX_DAA_STATE + 1, REG_68K_A_CTX);
+        if (from_daa == FROM_CONST) {
+            emit_move_b_dn(block, REG_68K_D_SCRATCH_0, jt.entry[0].daa_a);
+            emit_move_b_dn_disp_an(block, REG_68K_D_SCRATCH_0, JIT_CTX_DAA_STATE, REG_68K_A_CTX);
+        } else if (from_daa == FROM_INDEX) {
+            emit_move_b_dn_disp_an(block, REG_68K_D_SCRATCH_1, JIT_CTX_DAA_STATE, REG_68K_A_CTX);
+        }
+    }
+    if (index2) {
+        // D0 = index * 2
+        emit_move_b_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_SCRATCH_0);
+        emit_add_b_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_SCRATCH_0);
+        if (from_daa == FROM_INDEX2) {
+            emit_move_b_dn_disp_an(block, REG_68K_D_SCRATCH_0, JIT_CTX_DAA_STATE, REG_68K_A_CTX);
+        }
+    }
+    for (r = 0; r < 8; r++) {
+        if (r == IR_H || r == IR_L) {
+            continue;
+        }
+        if (from[r] == FROM_CONST) {
+            set_reg_from(block, r, 0, 0, jt.entry[0].regs[r]);
+        } else if (from[r] == FROM_INDEX) {
+            set_reg_from(block, r, 1, REG_68K_D_SCRATCH_1, 0);
+        } else if (from[r] == FROM_INDEX2) {
+            set_reg_from(block, r, 1, REG_68K_D_SCRATCH_0, 0);
+        }
+    }
+    if (from[IR_H] == FROM_CONST) {
+        emit_movea_w_imm16(block, REG_68K_A_HL,
+            jt.entry[0].regs[IR_H] << 8 | jt.entry[0].regs[IR_L]);
+    }
+    if (from_flags == FROM_CONST) {
+        emit_move_b_dn(block, REG_68K_D_FLAGS, jt.entry[0].ccr);
+    }
+
+    // D0 = index * 2, into a table of words from base to each entry
+    emit_moveq_dn(block, REG_68K_D_SCRATCH_0, 0);
+    emit_move_b_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_SCRATCH_0);
+    emit_add_w_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_SCRATCH_0);
+    // move.w table(pc, d0.w), d0 = over the jmp
+    emit_move_w_pc_idx_dn(block, 6, REG_68K_D_SCRATCH_0, REG_68K_D_SCRATCH_0);
+    // jmp base(pc, d0.w)
+    emit_jmp_pc_idx(block, 0, REG_68K_D_SCRATCH_0);
+    base = block->length - 2;
+    table = block->length;
+    for (k = 0; k < count; k++) {
+        emit_word(block, 0);
+    }
+
+    for (emitted = 0; emitted < count; emitted++) {
+        if (block->length + MAX_ENTRY_CODE + MAX_FALLBACK_CODE > MAX_BLOCK_CODE) {
+            break;
+        }
+        e = &jt.entry[emitted];
+        at[emitted] = block->length;
+
+        for (r = 0; r < 8; r++) {
+            if (from[r] != FROM_EACH || r == IR_H || r == IR_L) {
+                continue;
+            }
+            if ((r == IR_B || r == IR_D) && from[r + 1] == FROM_EACH) {
+                // both halves, in the 0x00HH00LL form
+                emit_move_l_dn(block, r == IR_B ? REG_68K_D_BC : REG_68K_D_DE,
+                    (uint32_t) e->regs[r] << 16 | e->regs[r + 1]);
+                r++;
+                continue;
+            }
+            set_reg_from(block, r, 0, 0, e->regs[r]);
+        }
+        if (from[IR_H] == FROM_EACH) {
+            emit_movea_w_imm16(block, REG_68K_A_HL, e->regs[IR_H] << 8 | e->regs[IR_L]);
+        }
+        if (from_flags == FROM_EACH) {
+            emit_move_b_dn(block, REG_68K_D_FLAGS, e->ccr);
+        }
+        if (from_daa == FROM_EACH) {
+            emit_move_b_dn(block, REG_68K_D_SCRATCH_0, e->daa_a);
+            emit_move_b_dn_disp_an(block, REG_68K_D_SCRATCH_0, JIT_CTX_DAA_STATE, REG_68K_A_CTX);
+        }
+        emit_add_cycles(block, e->cycles - min_cycles);
+        emit_moveq_dn(block, REG_68K_D_NEXT_PC, 0);
+        emit_move_w_dn(block, REG_68K_D_NEXT_PC, e->target);
+        emit_patchable_exit(block, e->target);
+    }
+
+    block->code[count_imm + 1] = emitted;
+    put_word(block, skip + 2, block->length - skip - 2);
+    fallback = block->length;
+    for (k = 0; k < count; k++) {
+        put_word(block, table + k * 2, (k < emitted ? at[k] : fallback) - base);
+    }
+    compile_rst_n(block, vector, ret_addr);
+    return 1;
+}
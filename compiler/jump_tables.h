@@ -0,0 +1,49 @@
+#ifndef _JUMP_TABLES_H
+#define _JUMP_TABLES_H
+
+#include <stdint.h>
+#include "compiler.h"
+
+// most entries a jump table gets compiled with. A is the index and the
+// helper doubles it, so anything past 128 wouldn't be a table anyway
+#define MAX_JUMP_TABLE 64
+
+// What the helper leaves behind when A is one index
+struct jump_table_entry {
+    uint16_t target;
+    uint8_t regs[8];  // by IR_B to IR_A, 6 is unused
+    uint8_t ccr;      // D7 as the op that last set the flags leaves it
+    uint8_t daa_a;    // old A its last add saves for daa
+    int cycles;       // for the helper, not counting the rst
+};
+
+// An rst to a helper that pops its return address and jumps through the
+// dw list there, indexed by A
+struct jump_table {
+    uint16_t table;   // the rst's return address
+    int entries;
+    uint8_t writes;   // bit per IR_ register the helper sets
+    int sets_flags;
+    int sets_daa;
+    struct jump_table_entry entry[MAX_JUMP_TABLE];
+};
+
+// Whether the helper at vector is one of the jump table ones, like
+//   add a; pop hl; add l; ld l, a; jr nc, +1; inc h; ld a, (hl+); ld h, (hl)
+//   ld l, a; jp (hl)
+// or
+//   add a; pop hl; ld e, a; ld d, 0; add hl, de; ld e, (hl); inc hl
+//   ld d, (hl); push de; pop hl; jp (hl)
+// run for every index the table at table looks long enough for. Tables
+// outside ROM aren't, since they can change. Fills in jt if it is
+int jump_table_match(struct compile_ctx *ctx, uint8_t vector, uint16_t table,
+                     struct jump_table *jt);
+
+// For an rst to vector that jump_table_match matched, go straight to the
+// handler A picks with the registers the helper would have left, through
+// a table of exits. An index past the end takes the rst as usual.
+// Returns 0 without emitting anything if it didn't match
+int compile_jump_table(struct code_block *block, struct compile_ctx *ctx,
+                       uint8_t vector, uint16_t ret_addr);
+
+#endif
@@ -5,7 +5,8 @@
 #include "compiler.h"
 
 // Compile a register-to-register load (opcodes 0x40-0x7f)
+// Loads through (hl) use what the IR knows about HL
 // Returns 1 if successfully compiled, 0 if unknown opcode (e.g., 0x76 HALT)
-int compile_reg_load(struct code_block *block, uint8_t op);
+int compile_reg_load(struct code_block *block, struct compile_ctx *ctx, uint8_t op);
 
 #endif
@@ -23,12 +23,14 @@ void compile_ld_sp_imm16(
         // WRAM: A3 = wram_base + (gb_sp - 0xC000)
         uint32_t addr = (uint32_t) ctx->wram_base + (gb_sp - 0xc000);
         emit_movea_l_imm32(block, REG_68K_A_SP, addr);
+        block_add_reloc(block, block->length - 4, RELOC_WRAM);
         emit_moveq_dn(block, REG_68K_D_SCRATCH_1, 1);
         emit_move_l_dn_disp_an(block, REG_68K_D_SCRATCH_1, JIT_CTX_STACK_IN_RAM, REG_68K_A_CTX);
     } else if (ctx && ctx->hram_base && gb_sp >= 0xff80 && gb_sp <= 0xfffe) {
         // HRAM: A3 = hram_base + (gb_sp - 0xFF80)
         uint32_t addr = (uint32_t) ctx->hram_base + (gb_sp - 0xff80);
         emit_movea_l_imm32(block, REG_68K_A_SP, addr);
+        block_add_reloc(block, block->length - 4, RELOC_HRAM);
         emit_moveq_dn(block, REG_68K_D_SCRATCH_1, 1);
         emit_move_l_dn_disp_an(block, REG_68K_D_SCRATCH_1, JIT_CTX_STACK_IN_RAM, REG_68K_A_CTX);
     } else {
@@ -40,7 +42,7 @@ void compile_ld_sp_imm16(
 }
 
 // Slow path for pop: read 16-bit value via dmg_read16, result in D1.w
-// Increments gb_sp by 2 in context. Clobbers D0, D1.
+// Increments gb_sp by 2 in context, and A3 to stay in step. Clobbers D0, D1.
 static void compile_slow_pop_to_d1(struct code_block *block)
 {
     // D1 = gb_sp
@@ -48,16 +50,20 @@ static void compile_slow_pop_to_d1(struct code_block *block)
     // call dmg_read16 - result in D0.w
     compile_call_dmg_read16(block);
     // increment gb_sp by 2
+    emit_addq_w_an(block, REG_68K_A_SP, 2);
     emit_addi_w_disp_an(block, 2, JIT_CTX_GB_SP, REG_68K_A_CTX);
     // move result to D1
     emit_move_w_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_SCRATCH_1);
 }
 
 // Slow path for push: write D0.w to stack via dmg_write16
-// Decrements gb_sp by 2 in context first. Clobbers D0, D1.
+// Decrements gb_sp by 2 in context first, and A3 to stay in step, since A3
+// is still a native pointer when the stack is only slow for being over
+// compiled code. Clobbers D0, D1.
 static void compile_slow_push_d0(struct code_block *block)
 {
     // decrement gb_sp by 2 first
+    emit_subq_w_an(block, REG_68K_A_SP, 2);
     emit_subi_w_disp_an(block, 2, JIT_CTX_GB_SP, REG_68K_A_CTX);
     // D1 = gb_sp (new value)
     emit_move_w_disp_an_dn(block, JIT_CTX_GB_SP, REG_68K_A_CTX, REG_68K_D_SCRATCH_1);
@@ -400,6 +406,7 @@ int compile_stack_op(
                 emit_moveq_dn(block, REG_68K_D_SCRATCH_1, 0);
                 emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_1);
                 emit_movea_l_imm32(block, REG_68K_A_SP, (uint32_t) ctx->wram_base - 0xc000);
+                block_add_reloc(block, block->length - 4, RELOC_WRAM);
                 emit_adda_l_dn_an(block, REG_68K_D_SCRATCH_1, REG_68K_A_SP);
                 emit_moveq_dn(block, REG_68K_D_SCRATCH_1, 1);
                 emit_move_l_dn_disp_an(block, REG_68K_D_SCRATCH_1, JIT_CTX_STACK_IN_RAM, REG_68K_A_CTX);
@@ -422,6 +429,7 @@ int compile_stack_op(
                     emit_moveq_dn(block, REG_68K_D_SCRATCH_1, 0);
                     emit_move_w_an_dn(block, REG_68K_A_HL, REG_68K_D_SCRATCH_1);
                     emit_movea_l_imm32(block, REG_68K_A_SP, (uint32_t) ctx->hram_base - 0xff80);
+                    block_add_reloc(block, block->length - 4, RELOC_HRAM);
                     emit_adda_l_dn_an(block, REG_68K_D_SCRATCH_1, REG_68K_A_SP);
                     emit_moveq_dn(block, REG_68K_D_SCRATCH_1, 1);
                     emit_move_l_dn_disp_an(block, REG_68K_D_SCRATCH_1, JIT_CTX_STACK_IN_RAM, REG_68K_A_CTX);
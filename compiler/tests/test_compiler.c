@@ -7,10 +7,13 @@
 #include "tests.h"
 #include "../musashi/m68k.h"
 
-#define MEM_SIZE 0x10000
+#define MEM_SIZE 0x30000
 static uint8_t mem[MEM_SIZE];
 
 #define CODE_BASE 0x1000
+// run_program puts each block it keeps at its own address from here, so a
+// shadow return entry still points at the right code when it's used
+#define BLOCK_CODE_BASE 0x10000
 #define STUB_BASE 0x2000   // Where stub functions live
 #define JIT_CTX_ADDR 0x3000 // jit_runtime context structure
 #define STACK_BASE 0x8000
@@ -23,6 +26,9 @@ static uint8_t mem[MEM_SIZE];
 uint8_t *test_gb_rom;
 static struct compile_ctx test_ctx;
 struct compile_ctx *test_compile_ctx = &test_ctx;
+int test_map_ram_pages;
+uint32_t test_event_cycles;
+int test_interrupt_waiting;
 
 // Read function for test compiler context
 static uint8_t test_read(void *dmg, uint16_t address)
@@ -103,12 +109,20 @@ static void setup_runtime_stubs(void)
     // movea.l d0, a0      ; a0 = address
     // move.b 10(sp), (a0) ; write value to memory
     // rts
+    // with INTERRUPT_WAITING_ADDR set, a write to IE sets READ_CYCLES to -1
+    // the way interrupts_changed would
     static const uint8_t stub_write[] = {
         0x70, 0x00,              // moveq #0, d0
         0x30, 0x2f, 0x00, 0x08,  // move.w 8(sp), d0
         0x20, 0x40,              // movea.l d0, a0
         0x10, 0xaf, 0x00, 0x0a,  // move.b 10(sp), (a0)
-        0x4e, 0x75               // rts
+        0x0c, 0x40, 0xff, 0xff,  // cmpi.w #0xffff, d0
+        0x66, 0x0c,              // bne.s done
+        0x4a, 0x38, 0x40, 0x0a,  // tst.b (INTERRUPT_WAITING_ADDR).w
+        0x67, 0x06,              // beq.s done
+        0x70, 0xff,              // moveq #-1, d0
+        0x21, 0xc0, 0x30, 0x34,  // move.l d0, (JIT_CTX_ADDR + JIT_CTX_READ_CYCLES).w
+        0x4e, 0x75               // done: rts
     };
 
     // stub_read: reads byte from address, returns in d0
@@ -127,9 +141,16 @@ static void setup_runtime_stubs(void)
         0x4e, 0x75               // rts
     };
 
+    // with INTERRUPT_WAITING_ADDR set, enabling sets READ_CYCLES to -1 the
+    // way interrupts_changed would
     static const uint8_t stub_ei_di[] = {
         0x31, 0xef, 0x00, 0x08, 0x40, 0x00, // move.w 8(sp), (U16_INTERRUPTS_ENABLED)
-        0x4e, 0x75                          // rts
+        0x67, 0x0c,                         // beq.s done
+        0x4a, 0x38, 0x40, 0x0a,             // tst.b (INTERRUPT_WAITING_ADDR).w
+        0x67, 0x06,                         // beq.s done
+        0x70, 0xff,                         // moveq #-1, d0
+        0x21, 0xc0, 0x30, 0x34,             // move.l d0, (JIT_CTX_ADDR + JIT_CTX_READ_CYCLES).w
+        0x4e, 0x75                          // done: rts
     };
 
     // stub_read16: reads 16-bit word from address (little-endian), returns in d0.w
@@ -159,12 +180,46 @@ static void setup_runtime_stubs(void)
         0x4e, 0x75               // rts
     };
 
+    // stub_copy: copies count bytes going up, adds count to BULK_TRIPS_ADDR
+    // Stack layout after jsr: ret(4), dmg(4), dst(2), src(2), count(2)
+    static const uint8_t stub_copy[] = {
+        0x70, 0x00,              // moveq #0, d0
+        0x30, 0x2f, 0x00, 0x08,  // move.w 8(sp), d0 (dst)
+        0x20, 0x40,              // movea.l d0, a0
+        0x30, 0x2f, 0x00, 0x0a,  // move.w 10(sp), d0 (src)
+        0x22, 0x40,              // movea.l d0, a1
+        0x32, 0x2f, 0x00, 0x0c,  // move.w 12(sp), d1 (count)
+        0xd3, 0x78, 0x40, 0x08,  // add.w d1, (BULK_TRIPS_ADDR).w
+        0x53, 0x41,              // subq.w #1, d1
+        0x10, 0xd9,              // loop: move.b (a1)+, (a0)+
+        0x51, 0xc9, 0xff, 0xfc,  // dbra d1, loop
+        0x4e, 0x75               // rts
+    };
+
+    // stub_fill: stores data in count bytes going up, adds count to
+    // BULK_TRIPS_ADDR
+    // Stack layout after jsr: ret(4), dmg(4), dst(2), count(2), data(1)
+    static const uint8_t stub_fill[] = {
+        0x70, 0x00,              // moveq #0, d0
+        0x30, 0x2f, 0x00, 0x08,  // move.w 8(sp), d0 (dst)
+        0x20, 0x40,              // movea.l d0, a0
+        0x32, 0x2f, 0x00, 0x0a,  // move.w 10(sp), d1 (count)
+        0xd3, 0x78, 0x40, 0x08,  // add.w d1, (BULK_TRIPS_ADDR).w
+        0x53, 0x41,              // subq.w #1, d1
+        0x10, 0x2f, 0x00, 0x0c,  // move.b 12(sp), d0 (data)
+        0x10, 0xc0,              // loop: move.b d0, (a0)+
+        0x51, 0xc9, 0xff, 0xfc,  // dbra d1, loop
+        0x4e, 0x75               // rts
+    };
+
     // Copy stubs to memory
     memcpy(mem + STUB_BASE, stub_read, sizeof(stub_read));
     memcpy(mem + STUB_BASE + 0x20, stub_write, sizeof(stub_write));
     memcpy(mem + STUB_BASE + 0x40, stub_ei_di, sizeof(stub_ei_di));
     memcpy(mem + STUB_BASE + 0x60, stub_read16, sizeof(stub_read16));
     memcpy(mem + STUB_BASE + 0x80, stub_write16, sizeof(stub_write16));
+    memcpy(mem + STUB_BASE + 0xa0, stub_copy, sizeof(stub_copy));
+    memcpy(mem + STUB_BASE + 0xc0, stub_fill, sizeof(stub_fill));
 
     // Set up jit_runtime context structure at JIT_CTX_ADDR
     // See compiler.h for JIT_CTX_* offset definitions
@@ -177,11 +232,25 @@ static void setup_runtime_stubs(void)
     m68k_write_memory_32(JIT_CTX_ADDR + JIT_CTX_DISPATCH, 0); // infinite loop at 0
     m68k_write_memory_32(JIT_CTX_ADDR + JIT_CTX_READ16, STUB_BASE + 0x60);
     m68k_write_memory_32(JIT_CTX_ADDR + JIT_CTX_WRITE16, STUB_BASE + 0x80);
+    m68k_write_memory_32(JIT_CTX_ADDR + JIT_CTX_COPY, STUB_BASE + 0xa0);
+    m68k_write_memory_32(JIT_CTX_ADDR + JIT_CTX_FILL, STUB_BASE + 0xc0);
+    m68k_write_memory_32(JIT_CTX_ADDR + JIT_CTX_EVENT_CYCLES, test_event_cycles);
     m68k_write_memory_32(JIT_CTX_ADDR + JIT_CTX_PATCH_HELPER, 0);
     m68k_write_memory_32(JIT_CTX_ADDR + JIT_CTX_READ_CYCLES, 0);
+    // matches A3, so pushes land in the same place on either stack path
+    m68k_write_memory_16(JIT_CTX_ADDR + JIT_CTX_GB_SP, DEFAULT_GB_SP);
     // frame_cycles pointer for HALT/LY wait tests
     m68k_write_memory_32(JIT_CTX_ADDR + JIT_CTX_FRAME_CYCLES_PTR, FRAME_CYCLES_ADDR);
     m68k_write_memory_32(FRAME_CYCLES_ADDR, 0);
+    m68k_write_memory_8(INTERRUPT_WAITING_ADDR, test_interrupt_waiting);
+
+    // A5 and A6 both start at 0, so this is both page tables
+    if (test_map_ram_pages) {
+        int page;
+        for (page = 0x80; page < 0xe0; page++) {
+            m68k_write_memory_32(page * 4, page << 8);
+        }
+    }
 }
 
 // Initialize Musashi, copy code to memory, set up stack, run
@@ -210,6 +279,8 @@ void run_code(struct code_block *block)
     for (k = 0; k < 8; k++) {
         m68k_set_reg(M68K_REG_D0 + k, 0);
     }
+    // the whole budget to the event is left
+    m68k_set_reg(M68K_REG_D0 + REG_68K_D_CYCLE_COUNT, test_event_cycles);
     // Clear A0-A6, but not A7 (stack pointer)
     for (k = 0; k < 7; k++) {
         m68k_set_reg(M68K_REG_A0 + k, 0);
@@ -228,7 +299,8 @@ void run_code(struct code_block *block)
 void run_program(uint8_t *gb_rom, uint16_t start_pc)
 {
     struct code_block *cache[MAX_CACHED_BLOCKS] = {0};
-    uint32_t pc = start_pc;
+    uint32_t code_at[MAX_CACHED_BLOCKS] = {0};
+    uint32_t pc = start_pc, cycles, event, code, next_code = BLOCK_CODE_BASE;
     int k;
 
     memset(mem, 0, MEM_SIZE);
@@ -245,6 +317,8 @@ void run_program(uint8_t *gb_rom, uint16_t start_pc)
     for (k = 0; k < 8; k++) {
         m68k_set_reg(M68K_REG_D0 + k, 0);
     }
+    // the whole budget to the event is left
+    m68k_set_reg(M68K_REG_D0 + REG_68K_D_CYCLE_COUNT, test_event_cycles);
     for (k = 0; k < 7; k++) {
         m68k_set_reg(M68K_REG_A0 + k, 0);
     }
@@ -264,18 +338,28 @@ void run_program(uint8_t *gb_rom, uint16_t start_pc)
         if (!block) {
             test_gb_rom = gb_rom;
             block = compile_block(pc, test_compile_ctx);
-            if (pc < MAX_CACHED_BLOCKS) {
+            if (pc < MAX_CACHED_BLOCKS && next_code + block->length <= MEM_SIZE) {
                 cache[pc] = block;
+                code_at[pc] = next_code;
+                memcpy(mem + next_code, block->code, block->length);
+                next_code = (next_code + block->length + 3) & ~3;
             }
         }
 
-        // Copy block code to execution area
-        memcpy(mem + CODE_BASE, block->code, block->length);
+        if (pc < MAX_CACHED_BLOCKS && code_at[pc]) {
+            code = code_at[pc];
+        } else {
+            // Copy block code to execution area, over whatever ran there
+            // last, so nothing can return into it
+            memcpy(mem + CODE_BASE, block->code, block->length);
+            memset(mem + JIT_CTX_ADDR + JIT_CTX_RET_STACK, 0, RET_STACK_SIZE * RET_ENTRY_SIZE);
+            code = CODE_BASE;
+        }
 
         // Set up return address to trap
         m68k_write_memory_32(STACK_BASE - 4, 0);
         m68k_set_reg(M68K_REG_SP, STACK_BASE - 4);
-        m68k_set_reg(M68K_REG_PC, CODE_BASE);
+        m68k_set_reg(M68K_REG_PC, code);
 
         m68k_execute(5000);
 
@@ -284,6 +368,16 @@ void run_program(uint8_t *gb_rom, uint16_t start_pc)
         if (pc == HALT_SENTINEL) {
             break;
         }
+
+        // nothing syncs here, so move the event on past the cycles so far
+        // the way dmg_schedule would for one every test_event_cycles, and
+        // D2 with it
+        if (test_event_cycles) {
+            cycles = get_cycle_count();
+            event = (cycles / test_event_cycles + 1) * test_event_cycles;
+            m68k_write_memory_32(JIT_CTX_ADDR + JIT_CTX_EVENT_CYCLES, event);
+            m68k_set_reg(M68K_REG_D0 + REG_68K_D_CYCLE_COUNT, event - cycles);
+        }
     }
 
     // Clean up cached blocks
@@ -321,7 +415,34 @@ void set_frame_cycles(uint32_t cycles)
 
 uint32_t get_cycle_count(void)
 {
-    return m68k_get_reg(NULL, M68K_REG_D0 + REG_68K_D_CYCLE_COUNT);
+    return m68k_read_memory_32(JIT_CTX_ADDR + JIT_CTX_EVENT_CYCLES)
+        - m68k_get_reg(NULL, M68K_REG_D0 + REG_68K_D_CYCLE_COUNT);
+}
+
+uint32_t get_read_cycle_count(void)
+{
+    return m68k_read_memory_32(JIT_CTX_ADDR + JIT_CTX_EVENT_CYCLES)
+        - m68k_read_memory_32(JIT_CTX_ADDR + JIT_CTX_READ_CYCLES);
+}
+
+uint8_t get_ret_top(void)
+{
+    return m68k_read_memory_8(JIT_CTX_ADDR + JIT_CTX_RET_TOP);
+}
+
+uint16_t get_ret_entry_pc(uint8_t offset)
+{
+    return m68k_read_memory_16(JIT_CTX_ADDR + JIT_CTX_RET_STACK + offset);
+}
+
+uint32_t get_ret_entry_code(uint8_t offset)
+{
+    return m68k_read_memory_32(JIT_CTX_ADDR + JIT_CTX_RET_STACK + offset + 4);
+}
+
+uint32_t get_jp_hl_runs(void)
+{
+    return m68k_read_memory_32(JIT_CTX_ADDR + JIT_CTX_JP_HL_RUNS);
 }
 
 // Run a single block with specified frame_cycles value
@@ -356,6 +477,8 @@ void run_block_with_frame_cycles(uint8_t *gb_rom, uint32_t frame_cycles)
     for (k = 0; k < 8; k++) {
         m68k_set_reg(M68K_REG_D0 + k, 0);
     }
+    // the whole budget to the event is left
+    m68k_set_reg(M68K_REG_D0 + REG_68K_D_CYCLE_COUNT, test_event_cycles);
     for (k = 0; k < 7; k++) {
         m68k_set_reg(M68K_REG_A0 + k, 0);
     }
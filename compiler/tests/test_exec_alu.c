@@ -320,6 +320,143 @@ TEST(test_daa_no_adjustment)
     ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x46);
 }
 
+TEST(test_daa_after_register_ops)
+{
+    // daa works these out from the op right before it
+    uint8_t rom[] = {
+        0x3e, 0x38,       // ld a, $38
+        0x1e, 0x45,       // ld e, $45
+        0x83,             // add a, e -> A = $7D
+        0x27,             // daa -> A = $83
+        0x47,             // ld b, a
+        0x0e, 0x05,       // ld c, $05
+        0x3e, 0x10,       // ld a, $10
+        0x91,             // sub a, c -> A = $0B
+        0x27,             // daa -> A = $05
+        0x57,             // ld d, a
+        0x3e, 0x09,       // ld a, $09
+        0x3c,             // inc a -> A = $0A
+        0x27,             // daa -> A = $10
+        0x10              // stop
+    };
+    run_program(rom, 0);
+    ASSERT_EQ((get_dreg(REG_68K_D_BC) >> 16) & 0xff, 0x83);
+    ASSERT_EQ((get_dreg(REG_68K_D_DE) >> 16) & 0xff, 0x05);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x10);
+}
+
+TEST(test_daa_state_through_jump)
+{
+    // the daa is somewhere else, so add has to save its state
+    uint8_t rom[] = {
+        0x3e, 0x08,       // ld a, $08
+        0xc6, 0x09,       // add a, $09 -> A = $11, H = 1
+        0xc3, 0x08, 0x00, // jp $0008
+        0x00,             // nop
+        0x27,             // $0008: daa -> A = $17
+        0x10              // stop
+    };
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x17);
+}
+
+// move.b d4, JIT_CTX_DAA_STATE(a4)
+static int count_daa_saves(struct code_block *block)
+{
+    size_t k;
+    int count = 0;
+
+    for (k = 0; k + 3 < block->length; k += 2) {
+        if (block->code[k] == 0x19 && block->code[k + 1] == 0x44
+                && block->code[k + 2] == 0 && block->code[k + 3] == JIT_CTX_DAA_STATE) {
+            count++;
+        }
+    }
+    return count;
+}
+
+TEST(test_unseen_daa_state_dropped)
+{
+    // each op is overwritten by the next, and the daa works out the state
+    // itself. only the last one, which reaches the exit, is saved
+    uint8_t rom[] = {
+        0xc6, 0x02,       // add a, $02
+        0xd6, 0x03,       // sub a, $03
+        0x06, 0x01,       // ld b, $01
+        0xc6, 0x04,       // add a, $04
+        0x27,             // daa
+        0x3c,             // inc a
+        0x10              // stop
+    };
+    struct code_block *block;
+
+    test_gb_rom = rom;
+    block = compile_block(0, test_compile_ctx);
+    ASSERT_EQ(count_daa_saves(block), 1);
+    block_free(block);
+}
+
+// Flag liveness
+static int count_flag_saves(struct code_block *block)
+{
+    size_t k;
+    int count = 0;
+
+    // move sr, d7
+    for (k = 0; k + 1 < block->length; k += 2) {
+        if (block->code[k] == 0x40 && block->code[k + 1] == 0xc7) {
+            count++;
+        }
+    }
+    return count;
+}
+
+TEST(test_dead_flag_saves_dropped)
+{
+    // only the last inc/dec's flags can be seen
+    uint8_t rom[] = {
+        0x3c,             // inc a
+        0x05,             // dec b
+        0x0c,             // inc c
+        0x10              // stop
+    };
+    struct code_block *block;
+
+    test_gb_rom = rom;
+    block = compile_block(0, test_compile_ctx);
+    ASSERT_EQ(count_flag_saves(block), 1);
+    block_free(block);
+}
+
+TEST(test_flags_kept_for_reader)
+{
+    // dec b's flags are dead, add's carry is needed by adc
+    uint8_t rom[] = {
+        0x3e, 0xff,       // ld a, $ff
+        0x06, 0x02,       // ld b, $02
+        0x05,             // dec b
+        0xc6, 0x01,       // add a, $01 -> A = $00, C = 1
+        0xce, 0x00,       // adc a, $00 -> A = $01
+        0x10              // stop
+    };
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x01);
+}
+
+TEST(test_flags_kept_at_exit)
+{
+    // dec b is overwritten by dec a, which is what's left at the exit
+    uint8_t rom[] = {
+        0x3e, 0x01,       // ld a, $01
+        0x06, 0x02,       // ld b, $02
+        0x05,             // dec b -> Z = 0
+        0x3d,             // dec a -> Z = 1
+        0x10              // stop
+    };
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_FLAGS) & 0x04, 0x04);
+}
+
 void register_alu_tests(void)
 {
     printf("\n8-bit inc/dec:\n");
@@ -381,4 +518,12 @@ void register_alu_tests(void)
     RUN_TEST(test_daa_add_both_nibbles);
     RUN_TEST(test_daa_sub_lower_nibble);
     RUN_TEST(test_daa_no_adjustment);
+    RUN_TEST(test_daa_after_register_ops);
+    RUN_TEST(test_daa_state_through_jump);
+    RUN_TEST(test_unseen_daa_state_dropped);
+
+    printf("\nFlag liveness:\n");
+    RUN_TEST(test_dead_flag_saves_dropped);
+    RUN_TEST(test_flags_kept_for_reader);
+    RUN_TEST(test_flags_kept_at_exit);
 }
@@ -1,4 +1,8 @@
+#include <string.h>
+
 #include "tests.h"
+#include "../ir.h"
+#include "../jump_tables.h"
 
 // JP instruction
 TEST(test_exec_jp_skip)
@@ -16,6 +20,50 @@ TEST(test_exec_jp_skip)
     ASSERT_EQ(get_dreg(REG_68K_D_BC) & 0x00ff00ff, 0x03);
 }
 
+TEST(test_jp_forward_same_block)
+{
+    // the block carries on at a close enough jp target, which can be
+    // entered from anywhere, and never compiles what it jumped over
+    uint8_t rom[] = {
+        0x3e, 0x01,       // 0x0000: ld a, 1
+        0xc3, 0x08, 0x00, // 0x0002: jp 0x0008
+        0xd3, 0xdb, 0xdd, // 0x0005: not code
+        0x06, 0x02,       // 0x0008: ld b, 2
+        0x10              // 0x000a: stop
+    };
+    struct code_block *block;
+
+    test_gb_rom = rom;
+    block = compile_block(0, test_compile_ctx);
+    ASSERT_EQ(block->error, 0);
+    ASSERT_EQ(block->num_exits, 0);
+    ASSERT_EQ(block->num_entries, 1);
+    ASSERT_EQ(block->entries[0].src_address, 0x0008);
+    ASSERT_EQ(block->end_address, 0x000b);
+    block_free(block);
+
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 1);
+    ASSERT_EQ((get_dreg(REG_68K_D_BC) >> 16) & 0xff, 2);
+}
+
+TEST(test_exec_jr_back_into_skipped)
+{
+    // a jr back to bytes a followed jr skipped has nowhere in the block to
+    // go, so it leaves it
+    uint8_t rom[] = {
+        0x3e, 0x03,       // 0x0000: ld a, 3
+        0x18, 0x01,       // 0x0002: jr 0x0005
+        0x04,             // 0x0004: inc b
+        0x3d,             // 0x0005: dec a
+        0x20, 0xfc,       // 0x0006: jr nz, 0x0004
+        0x10              // 0x0008: stop
+    };
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0);
+    ASSERT_EQ((get_dreg(REG_68K_D_BC) >> 16) & 0xff, 2);
+}
+
 // JR instructions
 TEST(test_exec_jr_forward)
 {
@@ -60,6 +108,107 @@ TEST(test_exec_dec_a_loop)
     ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x00);
 }
 
+TEST(test_block_trimmed_with_loop_entry)
+{
+    // finished block only holds the emitted code plus the loop entry point
+    uint8_t rom[] = {
+        0x3e, 0x05,       // 0x0000: ld a, 5
+        0x3d,             // 0x0002: dec a (loop start)
+        0x20, 0xfd,       // 0x0003: jr nz, -3 (back to 0x0002)
+        0x10              // 0x0005: stop
+    };
+    struct code_block *block;
+
+    test_gb_rom = rom;
+    block = compile_block(0, test_compile_ctx);
+    ASSERT_EQ(block->num_entries, 1);
+    ASSERT_EQ(block->entries[0].src_address, 0x0002);
+    // ld a, 5 is addq.l #8,d2 + moveq
+    ASSERT_EQ(block->entries[0].m68k_offset, 4);
+    ASSERT_EQ(block->m68k_offsets == NULL, 1);
+    ASSERT_EQ(block_size(block) < sizeof(struct code_block) + block->length + 64, 1);
+    block_free(block);
+}
+
+TEST(test_banked_exit_has_guard_room)
+{
+    // exits into 0x4000-0x7fff leave room for patch_helper's bank guard
+    uint8_t rom[] = {
+        0xc3, 0x00, 0x40  // 0x0000: jp 0x4000
+    };
+    uint8_t rom2[] = {
+        0xc3, 0x00, 0x20  // 0x0000: jp 0x2000
+    };
+    struct code_block *block;
+    uint8_t *site;
+
+    test_gb_rom = rom;
+    block = compile_block(0, test_compile_ctx);
+    ASSERT_EQ(block->num_exits, 1);
+    site = block_exit_site(block, 0);
+    // bcc.s over the site and the guard
+    ASSERT_EQ(site[-1], 20);
+    ASSERT_EQ(site[6], 0x4e);
+    ASSERT_EQ(site[7], 0x75);
+    ASSERT_EQ(block->length, block->exits[0] + 22);
+    ASSERT_EQ(block_exit_target(block, 0) == NULL, 1);
+    block_free(block);
+
+    test_gb_rom = rom2;
+    block = compile_block(0, test_compile_ctx);
+    ASSERT_EQ(block->num_exits, 1);
+    site = block_exit_site(block, 0);
+    ASSERT_EQ(site[-1], 6);
+    ASSERT_EQ(block->length, block->exits[0] + 8);
+    block_free(block);
+}
+
+TEST(test_serialized_block_drops_links)
+{
+    // saved blocks go through patch_helper again once loaded
+    uint8_t rom[] = {
+        0x3e, 0x05,       // 0x0000: ld a, 5
+        0x3d,             // 0x0002: dec a (loop start)
+        0x20, 0xfd,       // 0x0003: jr nz, -3 (back to 0x0002)
+        0xc3, 0x00, 0x40  // 0x0005: jp 0x4000
+    };
+    uint8_t guard[] = {
+        0x0c, 0x2c, 0x00, 0x03, 0x00, 0x11, // cmpi.b #3, 17(a4)
+        0x66, 0x06,                         // bne.s +6
+        0x4e, 0xf9, 0x00, 0x12, 0x34, 0x56, // jmp.l 0x123456
+        0x20, 0x6c, 0x00, 0x20,             // movea.l 32(a4), a0
+        0x4e, 0xd0                          // jmp (a0)
+    };
+    uint8_t buf[MAX_SERIALIZED_BLOCK];
+    uint8_t fresh[MAX_BLOCK_CODE];
+    struct code_block *block, *loaded;
+    size_t size, k;
+
+    test_gb_rom = rom;
+    block = compile_block(0, test_compile_ctx);
+    memcpy(fresh, block->code, block->length);
+    ASSERT_EQ(block->num_exits, 1);
+    memcpy(block_exit_site(block, 0), guard, sizeof guard);
+    ASSERT_EQ((uintptr_t) block_exit_target(block, 0), 0x123456);
+
+    size = block_serialize(block, test_compile_ctx, buf, sizeof buf);
+    ASSERT_EQ(size != 0, 1);
+    loaded = block_deserialize(buf, size, test_compile_ctx);
+    ASSERT_EQ(loaded->length, block->length);
+    for (k = 0; k < loaded->length; k++) {
+        ASSERT_EQ(loaded->code[k], fresh[k]);
+    }
+    ASSERT_EQ(loaded->num_entries, 1);
+    ASSERT_EQ(loaded->entries[0].src_address, 0x0002);
+    ASSERT_EQ(loaded->entries[0].m68k_offset, block->entries[0].m68k_offset);
+    ASSERT_EQ(loaded->num_exits, 1);
+    ASSERT_EQ(loaded->exits[0], block->exits[0]);
+    ASSERT_EQ(loaded->src_address, 0);
+    ASSERT_EQ(loaded->end_address, 8);
+    block_free(block);
+    block_free(loaded);
+}
+
 // CP tests (comparison - sets flags)
 TEST(test_exec_cp_equal)
 {
@@ -391,6 +540,65 @@ TEST(test_jp_hl)
     };
     run_program(rom, 0);
     ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x22);
+    ASSERT_EQ(get_jp_hl_runs(), 1);
+}
+
+TEST(test_jp_hl_slots)
+{
+    // jp (hl) fills its slots as it sees targets, and they go back to
+    // empty when unlinked
+    uint8_t rom[] = {
+        0xe9              // 0x0000: jp (hl)
+    };
+    uint8_t unbanked[] = {
+        0x0c, 0x43, 0x12, 0x34,             // cmpi.w #0x1234, d3
+        0x66, 0x0e,                         // bne.s +14
+        0x60, 0x06                          // bra.s +6
+    };
+    uint8_t banked[] = {
+        0x0c, 0x43, 0x45, 0x67,             // cmpi.w #0x4567, d3
+        0x66, 0x0e,                         // bne.s +14
+        0x0c, 0x2c, 0x00, 0x03, 0x00, 0x11, // cmpi.b #3, 17(a4)
+        0x66, 0x06,                         // bne.s +6
+        0x4e, 0xf9, 0x00, 0x65, 0x43, 0x21  // jmp.l 0x654321
+    };
+    struct code_block *block;
+    uint8_t *slots;
+    size_t k;
+
+    test_gb_rom = rom;
+    block = compile_block(0, test_compile_ctx);
+    ASSERT_EQ(block->num_exits, JP_HL_SLOTS);
+    slots = block_exit_site(block, 0);
+    for (k = 0; k < JP_HL_SLOTS; k++) {
+        ASSERT_EQ(block_exit_site(block, k) == slots + k * JP_HL_SLOT_SIZE, 1);
+        ASSERT_EQ(block_exit_target(block, k) == NULL, 1);
+    }
+
+    ASSERT_EQ(block_link_jp_hl(slots, 0x1234, 3, (void *) 0x123456) == slots, 1);
+    for (k = 0; k < sizeof unbanked; k++) {
+        ASSERT_EQ(slots[k], unbanked[k]);
+    }
+    ASSERT_EQ((uintptr_t) block_exit_target(block, 0), 0x123456);
+
+    ASSERT_EQ(block_link_jp_hl(slots, 0x4567, 3, (void *) 0x654321)
+        == slots + JP_HL_SLOT_SIZE, 1);
+    for (k = 0; k < sizeof banked; k++) {
+        ASSERT_EQ(slots[JP_HL_SLOT_SIZE + k], banked[k]);
+    }
+
+    for (k = 2; k < JP_HL_SLOTS; k++) {
+        ASSERT_EQ(block_link_jp_hl(slots, k, 0, (void *) 0x123456) != NULL, 1);
+    }
+    ASSERT_EQ(block_link_jp_hl(slots, 0x2000, 0, (void *) 0x123456) == NULL, 1);
+
+    // the first target went away, so the next one can have its slot
+    block_unlink_site(slots);
+    ASSERT_EQ(slots[0], 0x60);
+    ASSERT_EQ(slots[1], JP_HL_SLOT_SIZE - 2);
+    ASSERT_EQ(block_exit_target(block, 0) == NULL, 1);
+    ASSERT_EQ(block_link_jp_hl(slots, 0x2000, 0, (void *) 0x123456) == slots, 1);
+    block_free(block);
 }
 
 // Call/ret tests
@@ -451,6 +659,127 @@ TEST(test_exec_call_preserves_regs)
     ASSERT_EQ(get_dreg(REG_68K_D_BC) & 0xff, 0xcc);
 }
 
+TEST(test_exec_call_ret_shadow)
+{
+    // each call leaves its return address and the code for it on the
+    // shadow stack, and each ret takes its entry back off
+    uint8_t rom[] = {
+        0x3e, 0x01,       // 0x0000: ld a, 1
+        0xcd, 0x08, 0x00, // 0x0002: call sub1 (0x0008)
+        0x3e, 0x04,       // 0x0005: ld a, 4
+        0x10,             // 0x0007: stop
+        // sub1 at 0x0008:
+        0x3e, 0x02,       // 0x0008: ld a, 2
+        0xcd, 0x10, 0x00, // 0x000a: call sub2 (0x0010)
+        0x3e, 0x03,       // 0x000d: ld a, 3
+        0xc9,             // 0x000f: ret from sub1
+        // sub2 at 0x0010:
+        0x0e, 0x99,       // 0x0010: ld c, 0x99
+        0xc9              // 0x0012: ret from sub2
+    };
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x04);
+    ASSERT_EQ(get_ret_top(), 0);
+    ASSERT_EQ(get_ret_entry_pc(RET_ENTRY_SIZE), 0x0005);
+    ASSERT_EQ(get_ret_entry_pc(2 * RET_ENTRY_SIZE), 0x000d);
+    ASSERT_EQ(get_ret_entry_code(RET_ENTRY_SIZE) != 0, 1);
+    ASSERT_EQ(get_ret_entry_code(2 * RET_ENTRY_SIZE) != 0, 1);
+}
+
+TEST(test_exec_ret_shadow_miss)
+{
+    // sub2 drops its return address, so its ret goes back to main
+    // instead, which isn't what the newest shadow entry says
+    uint8_t rom[] = {
+        0x3e, 0x11,       // 0x0000: ld a, 0x11
+        0xcd, 0x08, 0x00, // 0x0002: call sub1 (0x0008)
+        0x3e, 0x44,       // 0x0005: ld a, 0x44
+        0x10,             // 0x0007: stop
+        // sub1 at 0x0008:
+        0xcd, 0x0e, 0x00, // 0x0008: call sub2 (0x000e)
+        0x3e, 0x33,       // 0x000b: ld a, 0x33 (skipped)
+        0x10,             // 0x000d: stop
+        // sub2 at 0x000e:
+        0xe8, 0x02,       // 0x000e: add sp, 2
+        0xc9              // 0x0010: ret to main
+    };
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x44);
+    // the missed entry is gone, sub1's is still there
+    ASSERT_EQ(get_ret_top(), RET_ENTRY_SIZE);
+}
+
+TEST(test_call_return_site_entry)
+{
+    // the code after a call is in the same block, and the dispatcher can
+    // come into it there
+    uint8_t rom[] = {
+        0xcd, 0x06, 0x00, // 0x0000: call 0x0006
+        0x3e, 0x33,       // 0x0003: ld a, 0x33
+        0x10,             // 0x0005: stop
+        0xc9              // 0x0006: ret
+    };
+    struct code_block *block;
+
+    test_gb_rom = rom;
+    block = compile_block(0, test_compile_ctx);
+    ASSERT_EQ(block->end_address, 0x0006);
+    ASSERT_EQ(block->num_entries, 1);
+    ASSERT_EQ(block->entries[0].src_address, 0x0003);
+    block_free(block);
+}
+
+TEST(test_call_return_site_bank_guard)
+{
+    // the callee could leave another bank in, so a return into banked code
+    // checks it's still the one the block was compiled from
+    static uint8_t rom[0x4004];
+    uint8_t guard[] = {
+        0x0c, 0x2c, 0x00, 0x03, 0x00, 0x11, // cmpi.b #3, 17(a4)
+        0x67, 0x06,                         // beq.s +6
+        0x20, 0x6c, 0x00, 0x20,             // movea.l 32(a4), a0
+        0x4e, 0xd0                          // jmp (a0)
+    };
+    struct code_block *block;
+    int k;
+
+    rom[0x4000] = 0xcd; // 0x4000: call 0x0000
+    rom[0x4003] = 0x10; // 0x4003: stop
+    test_gb_rom = rom;
+    test_compile_ctx->current_bank = 3;
+    block = compile_block(0x4000, test_compile_ctx);
+    test_compile_ctx->current_bank = 0;
+    ASSERT_EQ(block->num_entries, 1);
+    ASSERT_EQ(block->entries[0].src_address, 0x4003);
+    for (k = 0; k < (int) sizeof guard; k++) {
+        ASSERT_EQ(block->code[block->entries[0].m68k_offset - sizeof guard + k], guard[k]);
+    }
+    block_free(block);
+}
+
+TEST(test_exec_call_then_data)
+{
+    // bytes after a call that aren't code only matter if something runs them
+    uint8_t rom[] = {
+        0x3e, 0x11,       // 0x0000: ld a, 0x11
+        0xcd, 0x07, 0x00, // 0x0002: call 0x0007
+        0xd3, 0xdd,       // 0x0005: not code
+        // subroutine at 0x0007, drops the return address
+        0xe8, 0x02,       // 0x0007: add sp, 2
+        0x3e, 0x44,       // 0x0009: ld a, 0x44
+        0x10              // 0x000b: stop
+    };
+    struct code_block *block;
+
+    test_gb_rom = rom;
+    block = compile_block(0, test_compile_ctx);
+    ASSERT_EQ(block->error, 0);
+    block_free(block);
+
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x44);
+}
+
 // Conditional ret tests
 TEST(test_exec_ret_nz_taken)
 {
@@ -779,6 +1108,141 @@ TEST(test_rst_28)
     ASSERT_EQ((get_dreg(REG_68K_D_BC) >> 16) & 0xff, 0x22);
 }
 
+// rst jump tables. The helper only runs at compile time, so these run the
+// rst's block by itself and check where it exits and what it leaves.
+// The table ends where the first handler starts
+static uint8_t jump_table_rom[0x100];
+
+static void setup_jump_table_rom(const uint8_t *helper, size_t len, uint8_t index)
+{
+    static const uint8_t code[] = {
+        0x31, 0xfe, 0x0f, // 0x0000: ld sp, 0x0ffe
+        0x3e, 0x00,       // 0x0003: ld a, index
+        0xef,             // 0x0005: rst 28h
+        0x0c, 0x00,       // 0x0006: dw 0x000c
+        0x10, 0x00,       // 0x0008: dw 0x0010
+        0x14, 0x00,       // 0x000a: dw 0x0014
+        0x06, 0x11,       // 0x000c: ld b, 0x11
+        0x27,             // 0x000e: daa
+        0x10,             // 0x000f: stop
+        0x06, 0x22,       // 0x0010: ld b, 0x22
+        0x27,             // 0x0012: daa
+        0x10,             // 0x0013: stop
+        0x06, 0x33,       // 0x0014: ld b, 0x33
+        0x27,             // 0x0016: daa
+        0x10              // 0x0017: stop
+    };
+
+    memset(jump_table_rom, 0, sizeof jump_table_rom);
+    memcpy(jump_table_rom, code, sizeof code);
+    memcpy(jump_table_rom + 0x28, helper, len);
+    jump_table_rom[0x04] = index;
+}
+
+static struct code_block *run_jump_table(const uint8_t *helper, size_t len, uint8_t index)
+{
+    struct code_block *block;
+
+    setup_jump_table_rom(helper, len, index);
+    test_gb_rom = jump_table_rom;
+    block = compile_block(0, test_compile_ctx);
+    run_code(block);
+    return block;
+}
+
+static const uint8_t jump_table_add_hl[] = {
+    0x87,             // add a
+    0xe1,             // pop hl
+    0x5f,             // ld e, a
+    0x16, 0x00,       // ld d, 0
+    0x19,             // add hl, de
+    0x5e,             // ld e, (hl)
+    0x23,             // inc hl
+    0x56,             // ld d, (hl)
+    0xd5,             // push de
+    0xe1,             // pop hl
+    0xe9              // jp (hl)
+};
+
+static const uint8_t jump_table_add_l[] = {
+    0x87,             // add a
+    0xe1,             // pop hl
+    0x85,             // add l
+    0x6f,             // ld l, a
+    0x30, 0x01,       // jr nc, +1
+    0x24,             // inc h
+    0x2a,             // ld a, (hl+)
+    0x66,             // ld h, (hl)
+    0x6f,             // ld l, a
+    0xe9              // jp (hl)
+};
+
+TEST(test_rst_jump_table_add_hl)
+{
+    struct code_block *block = run_jump_table(jump_table_add_hl, sizeof jump_table_add_hl, 1);
+
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0x0010);
+    // A doubled, DE and HL the target, flags from add hl, de
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x02);
+    ASSERT_EQ(get_dreg(REG_68K_D_DE) & 0x00ff00ff, 0x00000010);
+    ASSERT_EQ(get_areg(REG_68K_A_HL) & 0xffff, 0x0010);
+    ASSERT_EQ(get_dreg(REG_68K_D_FLAGS) & 0x1f, 0x00);
+    // ld sp, nn; ld a, n; rst; then the helper
+    ASSERT_EQ(get_cycle_count(), 12 + 8 + 16 + 4 + 12 + 4 + 8 + 8 + 8 + 8 + 8 + 16 + 12 + 4);
+    // the helper's jp (hl) never runs
+    ASSERT_EQ(get_jp_hl_runs(), 0);
+    block_free(block);
+}
+
+TEST(test_rst_jump_table_add_l)
+{
+    struct code_block *block = run_jump_table(jump_table_add_l, sizeof jump_table_add_l, 2);
+
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0x0014);
+    // A and HL from the table, flags from add l and DE left alone
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x14);
+    ASSERT_EQ(get_dreg(REG_68K_D_DE) & 0x00ff00ff, 0);
+    ASSERT_EQ(get_areg(REG_68K_A_HL) & 0xffff, 0x0014);
+    ASSERT_EQ(get_dreg(REG_68K_D_FLAGS) & 0x1f, 0x00);
+    // jr nc taken is the same as not taken and inc h
+    ASSERT_EQ(get_cycle_count(), 12 + 8 + 16 + 4 + 12 + 4 + 4 + 12 + 8 + 8 + 4 + 4);
+    block_free(block);
+}
+
+TEST(test_rst_jump_table_past_end)
+{
+    // index 3 would read the first handler as the table, so it goes to the
+    // helper with the return address pushed like any rst
+    struct code_block *block = run_jump_table(jump_table_add_l, sizeof jump_table_add_l, 3);
+
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0x0028);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x03);
+    ASSERT_EQ(get_mem_byte(0x0ffc), 0x06);
+    ASSERT_EQ(get_mem_byte(0x0ffd), 0x00);
+    ASSERT_EQ(get_cycle_count(), 12 + 8 + 16);
+    block_free(block);
+}
+
+TEST(test_rst_jump_table_match)
+{
+    static struct jump_table jt;
+
+    setup_jump_table_rom(jump_table_add_hl, sizeof jump_table_add_hl, 0);
+    test_gb_rom = jump_table_rom;
+    ASSERT_EQ(jump_table_match(test_compile_ctx, 0x28, 0x0006, &jt), 1);
+    ASSERT_EQ(jt.entries, 3);
+    ASSERT_EQ(jt.entry[0].target, 0x000c);
+    ASSERT_EQ(jt.entry[2].target, 0x0014);
+    ASSERT_EQ(jt.writes, (1 << IR_A) | (1 << IR_D) | (1 << IR_E) | (1 << IR_H) | (1 << IR_L));
+    // add a leaves the index for daa
+    ASSERT_EQ(jt.sets_daa, 1);
+    ASSERT_EQ(jt.entry[2].daa_a, 2);
+    // a table in RAM can change after it's compiled
+    ASSERT_EQ(jump_table_match(test_compile_ctx, 0x28, 0xc000, &jt), 0);
+    // and an rst to a helper that doesn't pop its return address isn't one
+    ASSERT_EQ(jump_table_match(test_compile_ctx, 0x08, 0x0006, &jt), 0);
+}
+
 // Chained ret tests (Pokemon TryDoWildEncounter pattern)
 TEST(test_chained_ret_nz_both_return)
 {
@@ -885,6 +1349,60 @@ TEST(test_ei)
     ASSERT_EQ(get_mem_byte(U16_INTERRUPTS_ENABLED + 1), 1);
 }
 
+TEST(test_ei_interrupt_waiting)
+{
+    uint8_t rom[] = {
+        0xfb,             // 0x0000: ei
+        0x06, 0x03,       // 0x0001: ld b, 3
+        0x0c,             // 0x0003: inc c
+        0x0c,             // 0x0004: inc c
+        0x05,             // 0x0005: dec b
+        0x20, 0xfb,       // 0x0006: jr nz, $0003
+        0x10              // 0x0008: stop
+    };
+
+    // the call moves D2 past the event, so the loop only goes round once
+    // before it comes back out for the interrupt
+    test_event_cycles = 10000;
+    test_interrupt_waiting = 1;
+    test_gb_rom = rom;
+    struct code_block *block = compile_block(0, test_compile_ctx);
+    run_code(block);
+    test_interrupt_waiting = 0;
+    test_event_cycles = 0;
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 3);
+    ASSERT_EQ(get_dreg(REG_68K_D_BC), 0x00020002);
+    block_free(block);
+}
+
+TEST(test_ie_interrupt_waiting)
+{
+    uint8_t rom[] = {
+        0x3e, 0x01,       // 0x0000: ld a, 1
+        0xe0, 0xff,       // 0x0002: ldh (0xff), a
+        0x06, 0x03,       // 0x0004: ld b, 3
+        0x0c,             // 0x0006: inc c
+        0x0c,             // 0x0007: inc c
+        0x05,             // 0x0008: dec b
+        0x20, 0xfb,       // 0x0009: jr nz, $0006
+        0x10              // 0x000b: stop
+    };
+
+    // enabling an interrupt that's already requested goes through
+    // dmg_write like ei does, so the loop comes back out after one trip
+    test_event_cycles = 10000;
+    test_interrupt_waiting = 1;
+    test_gb_rom = rom;
+    struct code_block *block = compile_block(0, test_compile_ctx);
+    run_code(block);
+    test_interrupt_waiting = 0;
+    test_event_cycles = 0;
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 6);
+    ASSERT_EQ(get_dreg(REG_68K_D_BC), 0x00020002);
+    ASSERT_EQ(get_mem_byte(0xffff), 1);
+    block_free(block);
+}
+
 TEST(test_di)
 {
     // di - disable interrupts
@@ -898,15 +1416,159 @@ TEST(test_di)
     ASSERT_EQ(get_mem_byte(U16_INTERRUPTS_ENABLED + 1), 0);
 }
 
+// Delay loops
+struct delay_result {
+    uint32_t a, bc, de, hl, f, cycles;
+};
+
+static void run_delay_rom(uint8_t *rom, struct delay_result *result)
+{
+    run_program(rom, 0);
+    result->a = get_dreg(REG_68K_D_A) & 0xff;
+    result->bc = get_dreg(REG_68K_D_BC) & 0x00ff00ff;
+    result->de = get_dreg(REG_68K_D_DE) & 0x00ff00ff;
+    result->hl = get_areg(REG_68K_A_HL) & 0xffff;
+    result->f = get_dreg(REG_68K_D_FLAGS) & 0xff;
+    result->cycles = get_cycle_count();
+}
+
+// Run setup then body in a loop until it's done, once as it is and once
+// with a nop at the top so it isn't collapsed, and check they end up the
+// same. The collapsed trips have to take cycles each, and the last one
+// whatever the compiled loop counts for going through the body once
+static void check_delay_loop(
+    const uint8_t *setup, int setup_len,
+    const uint8_t *body, int body_len,
+    int trips, int cycles
+) {
+    uint8_t rom[16];
+    struct delay_result base, once, loop, collapsed;
+    int len, nop;
+
+    memcpy(rom, setup, setup_len);
+    rom[setup_len] = 0x10; // stop
+    run_delay_rom(rom, &base);
+
+    // jr nz to the stop either way
+    memcpy(rom + setup_len, body, body_len);
+    len = setup_len + body_len;
+    rom[len] = 0x20;
+    rom[len + 1] = 0;
+    rom[len + 2] = 0x10;
+    run_delay_rom(rom, &once);
+
+    for (nop = 1; nop >= 0; nop--) {
+        len = setup_len;
+        if (nop) {
+            rom[len++] = 0x00;
+        }
+        memcpy(rom + len, body, body_len);
+        len += body_len;
+        rom[len] = 0x20; // jr nz back to the top
+        rom[len + 1] = setup_len - (len + 2);
+        rom[len + 2] = 0x10;
+        run_delay_rom(rom, nop ? &loop : &collapsed);
+    }
+
+    ASSERT_EQ(collapsed.a, loop.a);
+    ASSERT_EQ(collapsed.bc, loop.bc);
+    ASSERT_EQ(collapsed.de, loop.de);
+    ASSERT_EQ(collapsed.hl, loop.hl);
+    ASSERT_EQ(collapsed.f, loop.f);
+    ASSERT_EQ(collapsed.cycles, once.cycles + (trips - 1) * cycles);
+}
+
+TEST(test_delay_loop_8bit)
+{
+    static const uint8_t dec_a[] = { 0x3d };
+    static const uint8_t dec_b[] = { 0x05 };
+    static const uint8_t dec_c[] = { 0x0d };
+    static const uint8_t dec_d[] = { 0x15 };
+    static const uint8_t dec_e[] = { 0x1d };
+    static const uint8_t dec_h[] = { 0x25 };
+    static const uint8_t dec_l[] = { 0x2d };
+    // scf first, dec leaves C alone
+    static const uint8_t a_5[] = { 0x37, 0x3e, 0x05 };
+    static const uint8_t b_0[] = { 0x37, 0x06, 0x00 };
+    static const uint8_t bc_0111[] = { 0x01, 0x11, 0x01 };
+    static const uint8_t de_8040[] = { 0x11, 0x40, 0x80 };
+    static const uint8_t d_3[] = { 0x16, 0x03 };
+    static const uint8_t hl_1230[] = { 0x21, 0x30, 0x12 };
+
+    check_delay_loop(a_5, sizeof a_5, dec_a, 1, 5, 16);
+    // 0 goes round 256 times
+    check_delay_loop(b_0, sizeof b_0, dec_b, 1, 256, 16);
+    // 1 has nothing to collapse, B stays put
+    check_delay_loop(bc_0111, sizeof bc_0111, dec_c, 1, 0x11, 16);
+    check_delay_loop(bc_0111, sizeof bc_0111, dec_b, 1, 1, 16);
+    check_delay_loop(de_8040, sizeof de_8040, dec_d, 1, 0x80, 16);
+    check_delay_loop(de_8040, sizeof de_8040, dec_e, 1, 0x40, 16);
+    check_delay_loop(d_3, sizeof d_3, dec_d, 1, 3, 16);
+    check_delay_loop(hl_1230, sizeof hl_1230, dec_h, 1, 0x12, 16);
+    check_delay_loop(hl_1230, sizeof hl_1230, dec_l, 1, 0x30, 16);
+}
+
+TEST(test_delay_loop_16bit)
+{
+    // dec bc; ld a, b; or c and dec de; ld a, e; or d
+    static const uint8_t dec_bc[] = { 0x0b, 0x78, 0xb1 };
+    static const uint8_t dec_de[] = { 0x1b, 0x7b, 0xb2 };
+    static const uint8_t bc_1234[] = { 0x37, 0x01, 0x34, 0x12 };
+    static const uint8_t bc_0100[] = { 0x01, 0x00, 0x01 };
+    static const uint8_t de_0[] = { 0x11, 0x00, 0x00 };
+    static const uint8_t de_2[] = { 0x11, 0x02, 0x00 };
+
+    // these check for interrupts on the way round, so they only collapse
+    // up to the next event. put that past the end of the longest one
+    test_event_cycles = 0x10000 * 28 * 2;
+    check_delay_loop(bc_1234, sizeof bc_1234, dec_bc, 3, 0x1234, 28);
+    check_delay_loop(bc_0100, sizeof bc_0100, dec_bc, 3, 0x100, 28);
+    check_delay_loop(de_0, sizeof de_0, dec_de, 3, 0x10000, 28);
+    check_delay_loop(de_2, sizeof de_2, dec_de, 3, 2, 28);
+    test_event_cycles = 0;
+}
+
+TEST(test_delay_loop_stops_at_event)
+{
+    // ld bc, $1234 then dec bc; ld a, b; or c; jr nz
+    uint8_t rom[] = {
+        0x01, 0x34, 0x12,
+        0x0b, 0x78, 0xb1, 0x20, 0xfb,
+        0x10
+    };
+
+    // as many trips as fit, then the compiled loop goes round until it
+    // gets to the event and exits at the jr
+    test_event_cycles = 1000;
+    test_gb_rom = rom;
+    struct code_block *block = compile_block(0, test_compile_ctx);
+    run_code(block);
+    test_event_cycles = 0;
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 3);
+    ASSERT_EQ(get_cycle_count() >= 1000 && get_cycle_count() < 1000 + 28, 1);
+    ASSERT_EQ(get_dreg(REG_68K_D_BC) & 0x00ff00ff, 0x00120010);
+    block_free(block);
+}
+
 void register_branch_tests(void)
 {
     printf("\nJP instruction:\n");
     RUN_TEST(test_exec_jp_skip);
+    RUN_TEST(test_jp_forward_same_block);
+    RUN_TEST(test_exec_jr_back_into_skipped);
 
     printf("\nJR instructions:\n");
     RUN_TEST(test_exec_jr_forward);
     RUN_TEST(test_exec_jr_zero);
     RUN_TEST(test_exec_dec_a_loop);
+    RUN_TEST(test_block_trimmed_with_loop_entry);
+    RUN_TEST(test_banked_exit_has_guard_room);
+    RUN_TEST(test_serialized_block_drops_links);
+
+    printf("\nDelay loops:\n");
+    RUN_TEST(test_delay_loop_8bit);
+    RUN_TEST(test_delay_loop_16bit);
+    RUN_TEST(test_delay_loop_stops_at_event);
 
     printf("\nCP (comparison) tests:\n");
     RUN_TEST(test_exec_cp_equal);
@@ -937,11 +1599,17 @@ void register_branch_tests(void)
 
     printf("\nJP (HL):\n");
     RUN_TEST(test_jp_hl);
+    RUN_TEST(test_jp_hl_slots);
 
     printf("\nCall/ret tests:\n");
     RUN_TEST(test_exec_call_ret_simple);
     RUN_TEST(test_exec_call_ret_nested);
     RUN_TEST(test_exec_call_preserves_regs);
+    RUN_TEST(test_exec_call_ret_shadow);
+    RUN_TEST(test_exec_ret_shadow_miss);
+    RUN_TEST(test_call_return_site_entry);
+    RUN_TEST(test_call_return_site_bank_guard);
+    RUN_TEST(test_exec_call_then_data);
 
     printf("\nConditional ret tests:\n");
     RUN_TEST(test_exec_ret_nz_taken);
@@ -965,6 +1633,10 @@ void register_branch_tests(void)
 
     printf("\nRST tests:\n");
     RUN_TEST(test_rst_28);
+    RUN_TEST(test_rst_jump_table_add_hl);
+    RUN_TEST(test_rst_jump_table_add_l);
+    RUN_TEST(test_rst_jump_table_past_end);
+    RUN_TEST(test_rst_jump_table_match);
 
     printf("\nChained ret preserves flags:\n");
     RUN_TEST(test_chained_ret_nz_both_return);
@@ -973,5 +1645,7 @@ void register_branch_tests(void)
 
     printf("\nInterrupt enable/disable:\n");
     RUN_TEST(test_ei);
+    RUN_TEST(test_ei_interrupt_waiting);
+    RUN_TEST(test_ie_interrupt_waiting);
     RUN_TEST(test_di);
 }
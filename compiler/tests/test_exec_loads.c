@@ -1,4 +1,6 @@
 #include "tests.h"
+#include "../ir.h"
+#include "../idioms.h"
 
 // 8-bit immediate loads
 TEST_EXEC(test_exec_ld_a_imm8,      REG_A, 0x55,  0x3e, 0x55, 0x10)
@@ -277,6 +279,375 @@ TEST(test_ldh_dec_preserves_value)
     ASSERT_EQ(get_mem_byte(0x4011), 0x04);
 }
 
+// Known addresses
+TEST(test_known_hl_wram)
+{
+    // HL is known from ld hl, so the read goes straight to wram_base
+    uint8_t rom[] = {
+        0x21, 0x23, 0xc1, // ld hl, $c123
+        0x36, 0x5a,       // ld (hl), $5a
+        0x21, 0x23, 0xe1, // ld hl, $e123 (echo)
+        0x7e,             // ld a, (hl)
+        0x10              // stop
+    };
+    struct code_block *block;
+
+    test_gb_rom = rom;
+    test_compile_ctx->wram_base = (void *) 0xc000;
+    block = compile_block(0, test_compile_ctx);
+    test_compile_ctx->wram_base = NULL;
+    // the write still checks for a code page, the read doesn't
+    ASSERT_EQ(block->num_relocs, 1);
+    ASSERT_EQ(block->relocs[0].kind, RELOC_WRAM);
+
+    run_code(block);
+    ASSERT_EQ(get_mem_byte(0xc123), 0x5a);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x5a);
+    block_free(block);
+}
+
+TEST(test_known_de_bank0_folded)
+{
+    uint8_t rom[] = {
+        0x11, 0x06, 0x00, // ld de, $0006
+        0x1a,             // ld a, (de)
+        0x10,             // stop
+        0x00,
+        0x77              // $0006
+    };
+    run_program(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x77);
+}
+
+TEST(test_known_hl_after_inc)
+{
+    // (hl+) keeps HL known, the alu op reads through the page table
+    uint8_t rom[] = {
+        0x21, 0x00, 0x90, // ld hl, $9000
+        0x3e, 0x11,       // ld a, $11
+        0x22,             // ld (hl+), a
+        0x3e, 0x22,       // ld a, $22
+        0x77,             // ld (hl), a
+        0x2b,             // dec hl
+        0x86,             // add a, (hl)
+        0x10              // stop
+    };
+    run_program(rom, 0);
+    ASSERT_EQ(get_mem_byte(0x9000), 0x11);
+    ASSERT_EQ(get_mem_byte(0x9001), 0x22);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x33);
+}
+
+TEST(test_absolute_by_region)
+{
+    uint8_t rom[] = {
+        0x3e, 0x12,       // ld a, $12
+        0xea, 0x10, 0x80, // ld ($8010), a
+        0x3e, 0x34,       // ld a, $34
+        0xea, 0x20, 0xc0, // ld ($c020), a
+        0xfa, 0x10, 0x80, // ld a, ($8010)
+        0x47,             // ld b, a
+        0xfa, 0x20, 0xe0, // ld a, ($e020)
+        0x10              // stop
+    };
+    struct code_block *block;
+
+    test_gb_rom = rom;
+    test_compile_ctx->vram_base = (void *) 0x8000;
+    test_compile_ctx->wram_base = (void *) 0xc000;
+    block = compile_block(0, test_compile_ctx);
+    test_compile_ctx->vram_base = NULL;
+    test_compile_ctx->wram_base = NULL;
+    ASSERT_EQ(block->num_relocs, 2);
+    ASSERT_EQ(block->relocs[0].kind, RELOC_VRAM);
+    ASSERT_EQ(block->relocs[1].kind, RELOC_WRAM);
+
+    run_code(block);
+    ASSERT_EQ(get_mem_byte(0x8010), 0x12);
+    ASSERT_EQ(get_mem_byte(0xc020), 0x34);
+    ASSERT_EQ(get_dreg(REG_68K_D_BC) >> 16, 0x12);
+    ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0x34);
+    block_free(block);
+}
+
+// HL page cache
+static struct ir_block test_ir;
+
+static uint8_t hl_walk_rom[] = {
+    0x21, 0xfc, 0xc0, // 0x0000: ld hl, $c0fc
+    0x3e, 0x10,       // 0x0003: ld a, $10
+    0x06, 0x08,       // 0x0005: ld b, 8
+    0x22,             // 0x0007: ld (hl+), a
+    0x3c,             // 0x0008: inc a
+    0x05,             // 0x0009: dec b
+    0x20, 0xfb,       // 0x000a: jr nz, $0007
+    0x21, 0x03, 0xc1, // 0x000c: ld hl, $c103
+    0x11, 0x00, 0xd0, // 0x000f: ld de, $d000
+    0x06, 0x08,       // 0x0012: ld b, 8
+    0x3a,             // 0x0014: ld a, (hl-)
+    0x12,             // 0x0015: ld (de), a
+    0x13,             // 0x0016: inc de
+    0x05,             // 0x0017: dec b
+    0x20, 0xfa,       // 0x0018: jr nz, $0014
+    0x10              // 0x001a: stop
+};
+
+static void check_hl_walk(void)
+{
+    int k;
+
+    for (k = 0; k < 8; k++) {
+        ASSERT_EQ(get_mem_byte(0xc0fc + k), 0x10 + k);
+        ASSERT_EQ(get_mem_byte(0xd000 + k), 0x17 - k);
+    }
+}
+
+TEST(test_hl_cache_walk)
+{
+    // both loops cross a page
+    test_map_ram_pages = 1;
+    run_program(hl_walk_rom, 0);
+    test_map_ram_pages = 0;
+    check_hl_walk();
+}
+
+TEST(test_hl_cache_null_page)
+{
+    // A1 is 0 the whole time and everything goes the slow way
+    run_program(hl_walk_rom, 0);
+    check_hl_walk();
+}
+
+TEST(test_hl_cache_across_call)
+{
+    // the write to $2000 goes through C, which leaves A1 at 0
+    uint8_t rom[] = {
+        0xfa, 0x00, 0xc0, // 0x0000: ld a, ($c000)
+        0x21, 0x00, 0xc0, // 0x0003: ld hl, $c000
+        0x6f,             // 0x0006: ld l, a
+        0x01, 0x00, 0x20, // 0x0007: ld bc, $2000
+        0x3e, 0x5a,       // 0x000a: ld a, $5a
+        0x77,             // 0x000c: ld (hl), a
+        0x02,             // 0x000d: ld (bc), a
+        0x2c,             // 0x000e: inc l
+        0x77,             // 0x000f: ld (hl), a
+        0x10              // 0x0010: stop
+    };
+
+    test_gb_rom = rom;
+    ir_build(&test_ir, test_compile_ctx, 0);
+    ASSERT_EQ(test_ir.ops[5].hl_reload, HL_RELOAD);
+    ASSERT_EQ(test_ir.ops[5].hl_cache, HL_CACHE_WRITE);
+    ASSERT_EQ(test_ir.ops[8].hl_reload, 0);
+    ASSERT_EQ(test_ir.ops[8].hl_cache, HL_CACHE_WRITE);
+
+    test_map_ram_pages = 1;
+    run_program(rom, 0);
+    test_map_ram_pages = 0;
+    ASSERT_EQ(get_mem_byte(0xc000), 0x5a);
+    ASSERT_EQ(get_mem_byte(0xc001), 0x5a);
+    ASSERT_EQ(get_mem_byte(0x2000), 0x5a);
+}
+
+TEST(test_hl_cache_loop_heads)
+{
+    test_gb_rom = hl_walk_rom;
+    ir_build(&test_ir, test_compile_ctx, 0);
+    ASSERT_EQ(test_ir.ops[3].hl_reload, HL_RELOAD_ENTRY);
+    ASSERT_EQ(test_ir.ops[3].hl_cache, HL_CACHE_WRITE);
+    ASSERT_EQ(test_ir.ops[10].hl_reload, HL_RELOAD_ENTRY);
+    ASSERT_EQ(test_ir.ops[10].hl_cache, HL_CACHE_READ);
+}
+
+// Copy and fill loops
+static uint8_t bulk_rom[] = {
+    0x21, 0x00, 0x20, // 0x0000: ld hl, $2000
+    0x11, 0xf0, 0xd0, // 0x0003: ld de, $d0f0
+    0x01, 0x23, 0x01, // 0x0006: ld bc, $0123
+    0x2a,             // 0x0009: ld a, (hl+)
+    0x12,             // 0x000a: ld (de), a
+    0x13,             // 0x000b: inc de
+    0x0b,             // 0x000c: dec bc
+    0x78,             // 0x000d: ld a, b
+    0xb1,             // 0x000e: or c
+    0x20, 0xf8,       // 0x000f: jr nz, $0009
+    0x21, 0x80, 0xd3, // 0x0011: ld hl, $d380
+    0x06, 0x00,       // 0x0014: ld b, 0
+    0x3e, 0x77,       // 0x0016: ld a, $77
+    0x32,             // 0x0018: ld (hl-), a
+    0x05,             // 0x0019: dec b
+    0x20, 0xfc,       // 0x001a: jr nz, $0018
+    0x21, 0xf8, 0xd3, // 0x001c: ld hl, $d3f8
+    0x01, 0x40, 0x00, // 0x001f: ld bc, $0040
+    0x3e, 0x5c,       // 0x0022: ld a, $5c
+    0x22,             // 0x0024: ld (hl+), a
+    0x0b,             // 0x0025: dec bc
+    0x79,             // 0x0026: ld a, c
+    0xb0,             // 0x0027: or b
+    0x20, 0xf8,       // 0x0028: jr nz, $0022
+    0x10              // 0x002a: stop
+};
+
+// Registers, cycles and memory after running bulk_rom
+struct bulk_result {
+    uint32_t hl, bc, de, a, f, cycles;
+    uint8_t ram[0x500];
+    int trips;
+};
+
+static void run_bulk_rom(struct bulk_result *result)
+{
+    int k;
+
+    run_program(bulk_rom, 0);
+    result->hl = get_areg(REG_68K_A_HL) & 0xffff;
+    result->bc = get_dreg(REG_68K_D_BC) & 0x00ff00ff;
+    result->de = get_dreg(REG_68K_D_DE) & 0x00ff00ff;
+    result->a = get_dreg(REG_68K_D_A) & 0xff;
+    result->f = get_dreg(REG_68K_D_FLAGS) & 0xff;
+    result->cycles = get_cycle_count();
+    for (k = 0; k < 0x500; k++) {
+        result->ram[k] = get_mem_byte(0xd000 + k);
+    }
+    result->trips = get_mem_byte(BULK_TRIPS_ADDR) << 8 | get_mem_byte(BULK_TRIPS_ADDR + 1);
+}
+
+TEST(test_idiom_match)
+{
+    struct idiom idiom;
+
+    test_gb_rom = bulk_rom;
+    ir_build(&test_ir, test_compile_ctx, 0);
+
+    ASSERT_EQ(idiom_match(&test_ir.ops[3], test_ir.ops + test_ir.count, &idiom), 1);
+    ASSERT_EQ(idiom.kind, IDIOM_COPY);
+    ASSERT_EQ(idiom.src, IR_H);
+    ASSERT_EQ(idiom.counter, IR_B);
+    ASSERT_EQ(idiom.wide, 1);
+    ASSERT_EQ(idiom.cycles, 52);
+    ASSERT_EQ(idiom.checked, 1);
+
+    // ld a, $77 is before the loop, so A is what gets stored
+    ASSERT_EQ(idiom_match(&test_ir.ops[13], test_ir.ops + test_ir.count, &idiom), 1);
+    ASSERT_EQ(idiom.kind, IDIOM_FILL);
+    ASSERT_EQ(idiom.hl_step, -1);
+    ASSERT_EQ(idiom.counter, IR_B);
+    ASSERT_EQ(idiom.fill_from, FILL_FROM_A);
+    ASSERT_EQ(idiom.cycles, 24);
+
+    ASSERT_EQ(idiom_match(&test_ir.ops[18], test_ir.ops + test_ir.count, &idiom), 1);
+    ASSERT_EQ(idiom.kind, IDIOM_FILL);
+    ASSERT_EQ(idiom.fill_from, FILL_FROM_IMM);
+    ASSERT_EQ(idiom.fill_imm, 0x5c);
+    ASSERT_EQ(idiom.cycles, 44);
+
+    // not the top of the loop
+    ASSERT_EQ(idiom_match(&test_ir.ops[4], test_ir.ops + test_ir.count, &idiom), 0);
+}
+
+TEST(test_idiom_same_as_loop)
+{
+    static struct bulk_result loop, bulk;
+    int k;
+
+    // every back edge exits, so the loops that check never get a call
+    run_bulk_rom(&loop);
+
+    // short enough that every loop takes more than one call, and each call
+    // fits in the time run_program gives a block
+    test_event_cycles = 2400;
+    run_bulk_rom(&bulk);
+    test_event_cycles = 0;
+    // all but one trip per call. 290 + 255 + 63 if it was one call each
+    ASSERT_EQ(bulk.trips > 500 && bulk.trips < 608, 1);
+
+    ASSERT_EQ(bulk.hl, 0xd438);
+    ASSERT_EQ(bulk.hl, loop.hl);
+    ASSERT_EQ(bulk.bc, loop.bc);
+    ASSERT_EQ(bulk.de, 0x00d20013);
+    ASSERT_EQ(bulk.de, loop.de);
+    ASSERT_EQ(bulk.a, loop.a);
+    ASSERT_EQ(bulk.f, loop.f);
+    // the compiled jr nz only counts 8 of the 12 cycles when it's taken,
+    // the calls count all of them
+    ASSERT_EQ(bulk.cycles, loop.cycles + 4 * bulk.trips);
+    for (k = 0; k < 0x500; k++) {
+        ASSERT_EQ(bulk.ram[k], loop.ram[k]);
+    }
+    for (k = 0; k < 0x123; k++) {
+        ASSERT_EQ(bulk.ram[0xf0 + k], get_mem_byte(0x2000 + k));
+    }
+    for (k = 0; k < 0x100; k++) {
+        ASSERT_EQ(bulk.ram[0x281 + k], 0x77);
+    }
+    for (k = 0; k < 0x40; k++) {
+        ASSERT_EQ(bulk.ram[0x3f8 + k], 0x5c);
+    }
+}
+
+// IR
+
+TEST(test_ir_decode)
+{
+    uint8_t rom[] = {
+        0x21, 0xa0, 0xc0, // ld hl, $c0a0
+        0xcb, 0x7c,       // bit 7, h
+        0x20, 0xfb,       // jr nz, $0000
+        0xc9              // ret
+    };
+
+    test_gb_rom = rom;
+    ir_decode(&test_ir, test_compile_ctx, 0);
+    ASSERT_EQ(test_ir.count, 4);
+    ASSERT_EQ(test_ir.ops[1].offset, 3);
+    ASSERT_EQ(test_ir.ops[1].operand[0], 0x7c);
+    ASSERT_EQ(test_ir.ops[1].cycles, 8);
+    ASSERT_EQ(test_ir.ops[2].cycles, 8);
+    ASSERT_EQ(test_ir.ops[2].cycles_branch, 12);
+}
+
+TEST(test_ir_constants)
+{
+    uint8_t rom[] = {
+        0x21, 0xff, 0xc0, // ld hl, $c0ff
+        0x23,             // inc hl
+        0xaf,             // xor a
+        0x47,             // ld b, a
+        0x2a,             // ld a, (hl+)
+        0x10              // stop
+    };
+
+    test_gb_rom = rom;
+    ir_build(&test_ir, test_compile_ctx, 0);
+    ASSERT_EQ(test_ir.ops[0].known, 0);
+    ASSERT_EQ(test_ir.ops[2].known, 1 << IR_H | 1 << IR_L);
+    ASSERT_EQ(test_ir.ops[2].values[IR_H], 0xc1);
+    ASSERT_EQ(test_ir.ops[2].values[IR_L], 0x00);
+    ASSERT_EQ(test_ir.ops[4].known, 1 << IR_A | 1 << IR_B | 1 << IR_H | 1 << IR_L);
+    ASSERT_EQ(test_ir.ops[4].values[IR_B], 0);
+    ASSERT_EQ(test_ir.ops[5].known, 1 << IR_B | 1 << IR_H | 1 << IR_L);
+    ASSERT_EQ(test_ir.ops[5].values[IR_L], 0x01);
+}
+
+TEST(test_ir_constants_at_loop)
+{
+    // the loop comes back around with whatever dec c left, but B is the
+    // same every time
+    uint8_t rom[] = {
+        0x0e, 0x04,       // ld c, $04
+        0x06, 0x01,       // ld b, $01
+        0x0d,             // $0004: dec c
+        0x20, 0xfd,       // jr nz, $0004
+        0x10              // stop
+    };
+
+    test_gb_rom = rom;
+    ir_build(&test_ir, test_compile_ctx, 0);
+    ASSERT_EQ(test_ir.ops[2].known, 1 << IR_B);
+    ASSERT_EQ(test_ir.ops[2].values[IR_B], 0x01);
+    ASSERT_EQ(test_ir.ops[3].known, 1 << IR_B);
+}
+
 void register_load_tests(void)
 {
     printf("\n8-bit immediate loads:\n");
@@ -333,4 +704,25 @@ void register_load_tests(void)
     printf("\nLDH counter patterns:\n");
     RUN_TEST(test_ldh_dec_ldh_loop);
     RUN_TEST(test_ldh_dec_preserves_value);
+
+    printf("\nKnown addresses:\n");
+    RUN_TEST(test_known_hl_wram);
+    RUN_TEST(test_known_de_bank0_folded);
+    RUN_TEST(test_known_hl_after_inc);
+    RUN_TEST(test_absolute_by_region);
+
+    printf("\nHL page cache:\n");
+    RUN_TEST(test_hl_cache_walk);
+    RUN_TEST(test_hl_cache_null_page);
+    RUN_TEST(test_hl_cache_across_call);
+    RUN_TEST(test_hl_cache_loop_heads);
+
+    printf("\nCopy and fill loops:\n");
+    RUN_TEST(test_idiom_match);
+    RUN_TEST(test_idiom_same_as_loop);
+
+    printf("\nIR:\n");
+    RUN_TEST(test_ir_decode);
+    RUN_TEST(test_ir_constants);
+    RUN_TEST(test_ir_constants_at_loop);
 }
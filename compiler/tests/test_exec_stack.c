@@ -14,6 +14,48 @@ TEST(test_push_bc)
     ASSERT_EQ(get_areg(REG_68K_A_HL), 0x1234);
 }
 
+// Saved block with a WRAM stack pointer, loaded with WRAM somewhere else
+TEST(test_serialized_block_relocates_sp)
+{
+    uint8_t rom[] = {
+        0x31, 0x10, 0xc0, // 0x0000: ld sp, 0xc010
+        0x01, 0x34, 0x12, // 0x0003: ld bc, 0x1234
+        0xc5,             // 0x0006: push bc
+        0x10              // 0x0007: stop
+    };
+    uint8_t buf[MAX_SERIALIZED_BLOCK];
+    struct code_block *block, *loaded;
+    uint8_t *addr;
+    size_t size;
+
+    test_gb_rom = rom;
+    test_compile_ctx->wram_base = (void *) 0x5000;
+    block = compile_block(0, test_compile_ctx);
+    ASSERT_EQ(block->num_relocs, 1);
+    ASSERT_EQ(block->relocs[0].kind, RELOC_WRAM);
+
+    size = block_serialize(block, test_compile_ctx, buf, sizeof buf);
+    ASSERT_EQ(size != 0, 1);
+    // stored as an offset from wram_base
+    addr = buf + 16 + block->relocs[0].offset;
+    ASSERT_EQ(addr[0] << 24 | addr[1] << 16 | addr[2] << 8 | addr[3], 0x10);
+    // too short to be a block
+    ASSERT_EQ(block_deserialize(buf, size - 1, test_compile_ctx) == NULL, 1);
+
+    test_compile_ctx->wram_base = (void *) 0x6000;
+    loaded = block_deserialize(buf, size, test_compile_ctx);
+    test_compile_ctx->wram_base = NULL;
+    ASSERT_EQ(loaded->length, block->length);
+    ASSERT_EQ(loaded->num_relocs, 1);
+
+    run_code(loaded);
+    ASSERT_EQ(get_areg(REG_68K_A_SP), 0x600e);
+    ASSERT_EQ(get_mem_byte(0x600e), 0x34);
+    ASSERT_EQ(get_mem_byte(0x600f), 0x12);
+    block_free(block);
+    block_free(loaded);
+}
+
 // Push/pop DE
 TEST(test_push_de)
 {
@@ -60,6 +102,26 @@ TEST(test_pop_de)
 
 }
 
+// A stack that isn't native goes through dmg_write16 and dmg_read16, and A3
+// has to follow it so native pushes and rets carry on from the right place
+TEST(test_slow_stack_keeps_a3_in_step)
+{
+    uint8_t rom[] = {
+        0x01, 0x34, 0x12, // 0x0000: ld bc, 0x1234
+        0xc5,             // 0x0003: push bc
+        0xcd, 0x08, 0x00, // 0x0004: call 0x0008
+        0x10,             // 0x0007: stop
+        0xe1,             // 0x0008: pop hl
+        0xd1,             // 0x0009: pop de
+        0x10              // 0x000a: stop
+    };
+    run_program(rom, 0);
+    ASSERT_EQ(get_areg(REG_68K_A_HL), 0x0007);
+    ASSERT_EQ(get_dreg(REG_68K_D_DE), 0x00120034);
+    // back where the harness started it
+    ASSERT_EQ(get_areg(REG_68K_A_SP), 0x0fff);
+}
+
 // Push/pop AF
 TEST(test_push_af)
 {
@@ -72,7 +134,11 @@ TEST(test_push_af)
         0xe1,             // 0x0006: pop hl
         0x10              // 0x0007: stop
     };
+    // F is D7's low byte, and a budget that runs out on the way sets X in
+    // it along with the flags
+    test_event_cycles = 1000;
     run_program(rom, 0);
+    test_event_cycles = 0;
     // H = A = 0xab, L = F = 0x04
     ASSERT_EQ(get_dreg(REG_68K_D_A) & 0xff, 0xab);
     ASSERT_EQ(get_areg(REG_68K_A_HL) & 0xffff, 0xab04);
@@ -163,6 +229,7 @@ void register_stack_tests(void)
 
     printf("\nPop DE:\n");
     RUN_TEST(test_pop_de);
+    RUN_TEST(test_slow_stack_keeps_a3_in_step);
 
     printf("\nPush/pop AF:\n");
     RUN_TEST(test_push_af);
@@ -175,4 +242,7 @@ void register_stack_tests(void)
 
     printf("\nLD SP, HL roundtrip:\n");
     RUN_TEST(test_ld_sp_hl_roundtrip);
+
+    printf("\nSaved blocks:\n");
+    RUN_TEST(test_serialized_block_relocates_sp);
 }
@@ -1,4 +1,7 @@
+#include <string.h>
+
 #include "tests.h"
+#include "../ir.h"
 
 // ============================================================================
 // HALT instruction tests
@@ -376,6 +379,253 @@ TEST(test_ly_wait_reg_past_target)
     ASSERT_EQ(get_cycle_count(), 70224 + 50 * 456 - 30000);
 }
 
+// ============================================================================
+// Idle loop tests
+// Loops that only read memory nothing in them writes exit with D2 moved on
+// to the next event, wherever test_event_cycles puts it
+// ============================================================================
+
+TEST(test_idle_loop_waits_for_event)
+{
+    uint8_t rom[] = {
+        0xf0, 0x85,       // ldh a, ($ff85)
+        0xa7,             // and a
+        0x28, 0xfb,       // jr z, -5
+        0x10              // stop
+    };
+    test_event_cycles = IDLE_EVENT_CYCLES;
+    run_block_with_frame_cycles(rom, 3000);
+    test_event_cycles = 0;
+    // back to the top of the loop once the event has happened
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0);
+    ASSERT_EQ(get_cycle_count(), IDLE_EVENT_CYCLES);
+}
+
+TEST(test_idle_loop_event_due)
+{
+    // nothing left to skip, so D2 is just the one time round
+    uint8_t rom[] = {
+        0xf0, 0x85,       // ldh a, ($ff85)
+        0xa7,             // and a
+        0x28, 0xfb,       // jr z, -5
+        0x10              // stop
+    };
+    test_event_cycles = 10;
+    run_block_with_frame_cycles(rom, 0);
+    test_event_cycles = 0;
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 0);
+    ASSERT_EQ(get_cycle_count(), 12 + 4);
+}
+
+TEST(test_idle_loop_cp_reg)
+{
+    uint8_t rom[] = {
+        0x06, 0x03,       // ld b, 3
+        0xfa, 0x00, 0xc0, // ld a, ($c000)
+        0xb8,             // cp b
+        0x20, 0xfa,       // jr nz, -6
+        0x10              // stop
+    };
+    test_event_cycles = IDLE_EVENT_CYCLES;
+    run_block_with_frame_cycles(rom, 0);
+    test_event_cycles = 0;
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 2);
+    ASSERT_EQ(get_cycle_count(), IDLE_EVENT_CYCLES);
+}
+
+TEST(test_idle_loop_known_hl)
+{
+    // nothing in the loop changes HL, so (hl) is the same address every
+    // time round
+    uint8_t rom[] = {
+        0x21, 0x00, 0xc0, // ld hl, $c000
+        0x7e,             // ld a, (hl)
+        0xa7,             // and a
+        0x28, 0xfc,       // jr z, -4
+        0x10              // stop
+    };
+    test_event_cycles = IDLE_EVENT_CYCLES;
+    run_block_with_frame_cycles(rom, 0);
+    test_event_cycles = 0;
+    ASSERT_EQ(get_dreg(REG_68K_D_NEXT_PC), 3);
+    ASSERT_EQ(get_cycle_count(), IDLE_EVENT_CYCLES);
+}
+
+TEST(test_idle_loop_done)
+{
+    uint8_t rom[] = {
+        0x3e, 0x01,       // ld a, 1
+        0xe0, 0x85,       // ldh ($ff85), a
+        0xf0, 0x85,       // ldh a, ($ff85)
+        0xa7,             // and a
+        0x28, 0xfb,       // jr z, -5
+        0x06, 0x42,       // ld b, $42
+        0x10              // stop
+    };
+    run_block_with_frame_cycles(rom, 0);
+    ASSERT_EQ(get_dreg(REG_68K_D_BC) & 0x00ff00ff, 0x00420000);
+}
+
+TEST(test_idle_loop_find)
+{
+    static struct ir_block ir;
+    uint8_t rom[] = {
+        0xf0, 0x85,       // ldh a, ($ff85)
+        0xa7,             // and a
+        0x28, 0xfb,       // jr z, -5          idle
+        0xf0, 0x44,       // ldh a, ($ff44)
+        0xa7,             // and a
+        0x28, 0xfb,       // jr z, -5          LY changes on its own
+        0x04,             // inc b
+        0xf0, 0x85,       // ldh a, ($ff85)
+        0xa7,             // and a
+        0x28, 0xfa,       // jr z, -6          B is different every time
+        0xf0, 0x85,       // ldh a, ($ff85)
+        0xe0, 0x86,       // ldh ($ff86), a
+        0xa7,             // and a
+        0x28, 0xf9,       // jr z, -7          writes memory
+        0xfa, 0x00, 0xc0, // ld a, ($c000)
+        0xfe, 0x05,       // cp 5
+        0x20, 0xf9,       // jr nz, -7         idle
+        0x10              // stop
+    };
+
+    test_gb_rom = rom;
+    ir_build(&ir, test_compile_ctx, 0);
+    ASSERT_EQ(ir.ops[2].idle, 1);
+    ASSERT_EQ(ir.ops[5].idle, 0);
+    ASSERT_EQ(ir.ops[9].idle, 0);
+    ASSERT_EQ(ir.ops[13].idle, 0);
+    ASSERT_EQ(ir.ops[16].idle, 1);
+}
+
+TEST(test_idle_loop_find_pairs)
+{
+    static struct ir_block ir;
+    uint8_t rom[] = {
+        0x11, 0x00, 0xc0, // ld de, $c000
+        0x1a,             // ld a, (de)
+        0xa7,             // and a
+        0x28, 0xfc,       // jr z, -4          idle
+        0x0a,             // ld a, (bc)
+        0xa7,             // and a
+        0x28, 0xfc,       // jr z, -4          BC could be anything
+        0x10              // stop
+    };
+
+    test_gb_rom = rom;
+    ir_build(&ir, test_compile_ctx, 0);
+    ASSERT_EQ(ir.ops[3].idle, 1);
+    ASSERT_EQ(ir.ops[6].idle, 0);
+}
+
+// ============================================================================
+// I/O read tests
+// A run of ops pays for all of them at the top, but a read at the end of
+// it still has to see exactly the cycles up to and including itself
+// ============================================================================
+
+TEST(test_io_read_div)
+{
+    uint8_t rom[] = {
+        0x00,             // nop
+        0x06, 0x05,       // ld b, 5
+        0x0c,             // inc c
+        0xf0, 0x04,       // ldh a, ($ff04)
+        0x0c,             // inc c
+        0x16, 0x12,       // ld d, $12
+        0x10              // stop
+    };
+    test_event_cycles = IDLE_EVENT_CYCLES;
+    run_block_with_frame_cycles(rom, 0);
+    test_event_cycles = 0;
+    ASSERT_EQ(get_read_cycle_count(), 4 + 8 + 4 + 12);
+    ASSERT_EQ(get_cycle_count(), 4 + 8 + 4 + 12 + 4 + 8 + 4);
+}
+
+TEST(test_io_read_ly_hl)
+{
+    uint8_t rom[] = {
+        0x21, 0x44, 0xff, // ld hl, $ff44
+        0x04,             // inc b
+        0x7e,             // ld a, (hl)
+        0x05,             // dec b
+        0x10              // stop
+    };
+    test_event_cycles = IDLE_EVENT_CYCLES;
+    run_block_with_frame_cycles(rom, 0);
+    test_event_cycles = 0;
+    ASSERT_EQ(get_read_cycle_count(), 12 + 4 + 8);
+    ASSERT_EQ(get_cycle_count(), 12 + 4 + 8 + 4 + 4);
+}
+
+TEST(test_io_read_in_loop)
+{
+    // the jr comes back to the inc c, so that starts a run of its own
+    uint8_t rom[] = {
+        0x06, 0x03,       // ld b, 3
+        0x0c,             // inc c
+        0xfa, 0x04, 0xff, // ld a, ($ff04)
+        0x05,             // dec b
+        0x20, 0xf9,       // jr nz, -7
+        0x10              // stop
+    };
+    test_event_cycles = IDLE_EVENT_CYCLES;
+    run_block_with_frame_cycles(rom, 0);
+    test_event_cycles = 0;
+    ASSERT_EQ(get_dreg(REG_68K_D_BC) & 0x00ff00ff, 0x00000003);
+    // the jr counts 8 whether it's taken or not
+    ASSERT_EQ(get_read_cycle_count(), 8 + 3 * (4 + 16) + 2 * (4 + 8));
+}
+
+TEST(test_cycle_run_split)
+{
+    // one long run, but the block fills up partway through it, so the
+    // ones the next block does get given back
+    static uint8_t rom[301];
+    struct code_block *block;
+
+    memset(rom, 0, 300);
+    rom[300] = 0x10;
+    test_event_cycles = IDLE_EVENT_CYCLES;
+    test_gb_rom = rom;
+    block = compile_block(0, test_compile_ctx);
+    run_code(block);
+    test_event_cycles = 0;
+    ASSERT_EQ(get_cycle_count(), get_dreg(REG_68K_D_NEXT_PC) * 4);
+    block_free(block);
+}
+
+TEST(test_cycle_runs_find)
+{
+    static struct ir_block ir;
+    uint8_t rom[] = {
+        0x00,             // nop               4
+        0x06, 0x05,       // ld b, 5           8+4+12, the jr comes back here
+        0x0c,             // inc c
+        0xf0, 0x04,       // ldh a, ($ff04)
+        0x0c,             // inc c             4+4
+        0xb9,             // cp c
+        0x20, 0xf7,       // jr nz, -9         on its own
+        0x04,             // inc b             4+8
+        0x7e,             // ld a, (hl)
+        0x10              // stop
+    };
+
+    test_gb_rom = rom;
+    ir_build(&ir, test_compile_ctx, 0);
+    ASSERT_EQ(ir.ops[0].charge, 4);
+    ASSERT_EQ(ir.ops[1].charge, 24);
+    ASSERT_EQ(ir.ops[2].charge, 0);
+    ASSERT_EQ(ir.ops[3].charge, 0);
+    ASSERT_EQ(ir.ops[4].charge, 8);
+    ASSERT_EQ(ir.ops[5].charge, 0);
+    ASSERT_EQ(ir.ops[6].charge, 8);
+    ASSERT_EQ(ir.ops[7].charge, 12);
+    ASSERT_EQ(ir.ops[8].charge, 0);
+    ASSERT_EQ(ir.ops[9].charge, 4);
+}
+
 void register_timing_tests(void)
 {
     printf("\nHALT instruction tests:\n");
@@ -407,4 +657,20 @@ void register_timing_tests(void)
     RUN_TEST(test_ly_wait_reg_jr_c);
     RUN_TEST(test_ly_wait_reg_mid_frame);
     RUN_TEST(test_ly_wait_reg_past_target);
+
+    printf("\nIdle loop tests:\n");
+    RUN_TEST(test_idle_loop_waits_for_event);
+    RUN_TEST(test_idle_loop_event_due);
+    RUN_TEST(test_idle_loop_cp_reg);
+    RUN_TEST(test_idle_loop_known_hl);
+    RUN_TEST(test_idle_loop_done);
+    RUN_TEST(test_idle_loop_find);
+    RUN_TEST(test_idle_loop_find_pairs);
+
+    printf("\nI/O read tests:\n");
+    RUN_TEST(test_io_read_div);
+    RUN_TEST(test_io_read_ly_hl);
+    RUN_TEST(test_io_read_in_loop);
+    RUN_TEST(test_cycle_run_split);
+    RUN_TEST(test_cycle_runs_find);
 }
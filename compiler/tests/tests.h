@@ -53,6 +53,18 @@
 extern struct compile_ctx *test_compile_ctx;
 extern uint8_t *test_gb_rom;
 
+// Set to give VRAM and WRAM pages in the page tables, so accesses there
+// take the fast paths. Everything is NULL otherwise
+extern int test_map_ram_pages;
+
+// Cycles to the next event, what dmg_schedule puts in jit_ctx and D2
+// starts at. 0 sends compiled code back at every exit and backward jr
+// that checks
+extern uint32_t test_event_cycles;
+
+// Set to have ei let an interrupt through, which ends the budget in D2
+extern int test_interrupt_waiting;
+
 #define TEST_EXEC(name, reg, expected, ...) \
     TEST(name) { \
         uint8_t gb_code[] = { __VA_ARGS__ }; \
@@ -90,13 +102,31 @@ void register_timing_tests(void);
 #define GLOBALS_BASE 0x4000 // random variables
 #define U16_INTERRUPTS_ENABLED 0x4000
 #define FRAME_CYCLES_ADDR 0x4004  // u32 frame_cycles value
+#define BULK_TRIPS_ADDR 0x4008    // u16 bytes done by dmg_copy/dmg_fill
+#define INTERRUPT_WAITING_ADDR 0x400a // u8 copy of test_interrupt_waiting
+
+// test_event_cycles for the idle loop tests
+#define IDLE_EVENT_CYCLES 10000
 
 // Set frame_cycles for HALT/LY wait tests
 void set_frame_cycles(uint32_t cycles);
 
-// Get the accumulated cycle count (D2)
+// Get the cycles run so far, which D2 counted down from the event
 uint32_t get_cycle_count(void);
 
+// Get the cycles run as of the last call into C, which is what a DIV or
+// LY read works out the time from
+uint32_t get_read_cycle_count(void);
+
+// The shadow return stack's top offset, and the GB address and code of
+// the entry at a given offset
+uint8_t get_ret_top(void);
+uint16_t get_ret_entry_pc(uint8_t offset);
+uint32_t get_ret_entry_code(uint8_t offset);
+
+// How many jp (hl)s have run
+uint32_t get_jp_hl_runs(void);
+
 // Run a single block with specified frame_cycles value (for HALT/LY wait tests)
 void run_block_with_frame_cycles(uint8_t *gb_rom, uint32_t frame_cycles);
 
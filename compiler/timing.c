@@ -30,18 +30,15 @@ void compile_ly_wait(
     // load frame_cycles into d0
     emit_move_l_ind_an_dn(block, REG_68K_A_SCRATCH_1, REG_68K_D_SCRATCH_0);
 
-    // compare frame_cycles to target
-    emit_cmpi_l_imm_dn(block, target_cycles, REG_68K_D_SCRATCH_0);
-    emit_bcc_s(block, 10);  // if frame_cycles >= target, wait until next frame
+    // d0 = frame_cycles - target, or a frame further back if that's
+    // already gone by
+    emit_subi_l_dn(block, REG_68K_D_SCRATCH_0, target_cycles);
+    emit_bcs_b(block, 6);
+    emit_subi_l_dn(block, REG_68K_D_SCRATCH_0, 70224);
 
-    // same frame: d2 = target - frame_cycles
-    emit_move_l_dn(block, REG_68K_D_CYCLE_COUNT, target_cycles);
-    emit_sub_l_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_CYCLE_COUNT);
-    emit_bra_b(block, 8);
-
-    // next frame: d2 = (70224 + target) - frame_cycles
-    emit_move_l_dn(block, REG_68K_D_CYCLE_COUNT, 70224 + target_cycles);
-    emit_sub_l_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_CYCLE_COUNT);
+    // d2 = event_cycles + d0, which is the budget left once it gets there
+    emit_move_l_disp_an_dn(block, JIT_CTX_EVENT_CYCLES, REG_68K_A_CTX, REG_68K_D_CYCLE_COUNT);
+    emit_add_l_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_CYCLE_COUNT);
 
     // set A to the LY value we waited for
     emit_moveq_dn(block, REG_68K_D_A, wait_ly);
@@ -121,19 +118,15 @@ void compile_ly_wait_reg(
     // load frame_cycles into D1
     emit_move_l_ind_an_dn(block, REG_68K_A_SCRATCH_1, REG_68K_D_SCRATCH_1);
 
-    // compare frame_cycles (D1) to target_cycles (D0)
-    emit_cmp_l_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_SCRATCH_1);
-    emit_bcc_s(block, 6);  // if frame_cycles >= target_cycles, skip to next_frame
-
-    // same frame: d2 = target_cycles - frame_cycles = d0 - d1
-    emit_move_l_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_CYCLE_COUNT);
-    emit_sub_l_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_CYCLE_COUNT);
-    emit_bra_b(block, 10);
+    // D1 = frame_cycles - target_cycles, or a frame further back if
+    // that's already gone by
+    emit_sub_l_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_SCRATCH_1);
+    emit_bcs_b(block, 6);
+    emit_subi_l_dn(block, REG_68K_D_SCRATCH_1, 70224);
 
-    // next frame: d2 = (70224 + target_cycles) - frame_cycles
-    emit_move_l_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_CYCLE_COUNT);
-    emit_addi_l_dn(block, REG_68K_D_CYCLE_COUNT, 70224);
-    emit_sub_l_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_CYCLE_COUNT);
+    // d2 = event_cycles + D1, the budget left once it gets there
+    emit_move_l_disp_an_dn(block, JIT_CTX_EVENT_CYCLES, REG_68K_A_CTX, REG_68K_D_CYCLE_COUNT);
+    emit_add_l_dn_dn(block, REG_68K_D_SCRATCH_1, REG_68K_D_CYCLE_COUNT);
 
     // restore wait_ly from stack into A register
     emit_pop_l_dn(block, REG_68K_D_A);
@@ -148,15 +141,12 @@ void compile_halt(struct code_block *block, int next_pc)
 {
     //   movea.l JIT_CTX_FRAME_CYCLES_PTR(a4), a0 ; 4 bytes
     //   move.l (a0), d0                          ; 2 bytes
-    //   cmpi.l #65664, d0                        ; 6 bytes
-    //   bcc.s _frame_end                         ; 2 bytes
-    //   move.l #65664, d2                        ; 6 bytes
-    //   sub.l d0, d2                             ; 2 bytes
-    //   bra.s _exit                              ; 2 bytes
-    // _frame_end
-    //   move.l #70224, d2                        ; 6 bytes
-    //   sub.l d0, d2                             ; 2 bytes
-    // _exit
+    //   subi.l #65664, d0                        ; 6 bytes
+    //   bcs.s _before                            ; 2 bytes
+    //   subi.l #70224, d0                        ; 6 bytes
+    // _before
+    //   move.l JIT_CTX_EVENT_CYCLES(a4), d2      ; 4 bytes
+    //   add.l d0, d2                             ; 2 bytes
     //   move.l #next_pc, d3                      ; 6 bytes
     //   rts                                      ; 2 bytes
 
@@ -164,20 +154,36 @@ void compile_halt(struct code_block *block, int next_pc)
     emit_movea_l_disp_an_an(block, JIT_CTX_FRAME_CYCLES_PTR, REG_68K_A_CTX, REG_68K_A_SCRATCH_1);
     emit_move_l_ind_an_dn(block, REG_68K_A_SCRATCH_1, REG_68K_D_SCRATCH_0);
 
-    // see if already in vblank
-    emit_cmpi_l_imm_dn(block, 65664, REG_68K_D_SCRATCH_0);
-    emit_bcc_s(block, 10);
+    // d0 = frame_cycles - 65664, or a frame further back if already in
+    // vblank
+    emit_subi_l_dn(block, REG_68K_D_SCRATCH_0, 65664);
+    emit_bcs_b(block, 6);
+    emit_subi_l_dn(block, REG_68K_D_SCRATCH_0, 70224);
 
-    // before vblank: d2 = 65664 - frame_cycles
-    emit_move_l_dn(block, REG_68K_D_CYCLE_COUNT, 65664);
-    emit_sub_l_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_CYCLE_COUNT);
-    emit_bra_b(block, 8);
-
-    // in vblank: d2 = (70224 - frame_cycles) + 65664
-    emit_move_l_dn(block, REG_68K_D_CYCLE_COUNT, 70224 + 65664);
-    emit_sub_l_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_CYCLE_COUNT);
+    // d2 counts down to the next event from there
+    emit_move_l_disp_an_dn(block, JIT_CTX_EVENT_CYCLES, REG_68K_A_CTX, REG_68K_D_CYCLE_COUNT);
+    emit_add_l_dn_dn(block, REG_68K_D_SCRATCH_0, REG_68K_D_CYCLE_COUNT);
 
     // exit to C
     emit_move_l_dn(block, REG_68K_D_NEXT_PC, next_pc);
     emit_rts(block);
 }
+
+// for idle loops: skip ahead to whatever the hardware does next, which is
+// the first thing that could end the wait, then come back in at the top
+// of the loop. d2 stays as it is if it's already past that
+void compile_idle_wait(struct code_block *block, uint16_t loop_pc)
+{
+    //   tst.l d2
+    //   bmi.s _exit
+    //   moveq #0, d2
+    // _exit
+    //   move.l #loop_pc, d3
+    //   rts
+    emit_tst_l_dn(block, REG_68K_D_CYCLE_COUNT);
+    emit_bmi_b(block, 2);
+    emit_moveq_dn(block, REG_68K_D_CYCLE_COUNT, 0);
+
+    emit_move_l_dn(block, REG_68K_D_NEXT_PC, loop_pc);
+    emit_rts(block);
+}
@@ -30,4 +30,8 @@ void compile_ly_wait_reg(
 
 void compile_halt(struct code_block *block, int next_pc);
 
+// exit from an idle loop found by ir_find_idle_loops, with d2 moved on to
+// the next event
+void compile_idle_wait(struct code_block *block, uint16_t loop_pc);
+
 #endif
\ No newline at end of file
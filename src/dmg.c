@@ -101,17 +101,79 @@ void dmg_update_rom_bank(struct dmg *dmg, int bank)
 
 void dmg_update_ram_bank(struct dmg *dmg, u8 *ram_base)
 {
-    int k;
+    int k, had_code = 0;
     for (k = 0xa0; k <= 0xbf; k++) {
+        had_code |= dmg_is_code_page(dmg, k);
         if (ram_base) {
             int offset = (k - 0xa0) << 8;
             dmg->read_page[k] = &ram_base[offset];
-            dmg->write_page[k] = &ram_base[offset];
+            dmg->write_page[k] = dmg_is_code_page(dmg, k) ? NULL : &ram_base[offset];
         } else {
             dmg->read_page[k] = NULL;
             dmg->write_page[k] = NULL;
         }
     }
+
+    // code compiled from the old bank doesn't match what's there now
+    if (had_code && dmg->code_write_hook) {
+        dmg->code_write_hook(0xa000, 0x2000);
+    }
+}
+
+int dmg_is_code_page(struct dmg *dmg, int page)
+{
+    return dmg->code_pages[page >> 3] & (1 << (page & 7));
+}
+
+static void set_code_page(struct dmg *dmg, int page, int has_code)
+{
+    if (has_code) {
+        dmg->code_pages[page >> 3] |= 1 << (page & 7);
+        dmg->write_page[page] = NULL;
+    } else {
+        dmg->code_pages[page >> 3] &= ~(1 << (page & 7));
+        // RAM pages are mapped the same way for reads and writes, and the
+        // 0xfe/0xff pages are always slow
+        if (page < 0xfe) {
+            dmg->write_page[page] = dmg->read_page[page];
+        }
+    }
+}
+
+// Only for pages 0x80 and up. Echo RAM mirrors WRAM, so both get marked
+void dmg_set_code_page(struct dmg *dmg, int page, int has_code)
+{
+    set_code_page(dmg, page, has_code);
+    if (page >= 0xc0 && page <= 0xdd) {
+        set_code_page(dmg, page + 0x20, has_code);
+    } else if (page >= 0xe0 && page <= 0xfd) {
+        set_code_page(dmg, page - 0x20, has_code);
+    }
+}
+
+// Let the JIT drop code at the address and its echo, then do the write the
+// page table would have done
+static int dmg_write_code_page(struct dmg *dmg, u16 address, u8 data)
+{
+    // OAM and I/O registers share the pages but can't hold code
+    if (address >= 0xfe00 && address < 0xff80) {
+        return 0;
+    }
+
+    dmg->code_write_hook(address, 1);
+    if (address >= 0xc000 && address < 0xde00) {
+        dmg->code_write_hook(address + 0x2000, 1);
+    } else if (address >= 0xe000 && address < 0xfe00) {
+        dmg->code_write_hook(address - 0x2000, 1);
+    }
+
+    if (address < 0xfe00 && dmg->read_page[address >> 8]) {
+        dmg->read_page[address >> 8][address & 0xff] = data;
+        return 1;
+    }
+
+    // HRAM and disabled cartridge RAM carry on through the slow path
+    return 0;
 }
 
 static void dmg_request_interrupt(struct dmg *dmg, int nr)
@@ -119,6 +181,42 @@ static void dmg_request_interrupt(struct dmg *dmg, int nr)
     dmg->interrupt_request_mask |= nr;
 }
 
+static int interrupt_pending(struct dmg *dmg)
+{
+    return dmg->interrupt_enable
+        && (dmg->zero_page[0x7f] & dmg->interrupt_request_mask & 0x1f);
+}
+
+// Cycles since the last sync, as of the call into C that got here.
+// jit_ctx.read_cycles has D2 from then, which counted down from event_cycles
+static u32 jit_cycles(void)
+{
+    return jit_ctx.event_cycles - jit_ctx.read_cycles;
+}
+
+// Move the next event to cycles since the last sync. D2 comes back from
+// read_cycles after the call, so it moves with it
+static void set_event_cycles(u32 cycles)
+{
+    jit_ctx.read_cycles += cycles - jit_ctx.event_cycles;
+    jit_ctx.event_cycles = cycles;
+}
+
+// Make D2 negative, so compiled code comes back out at its next check
+static void event_now(void)
+{
+    set_event_cycles(jit_cycles() - 1);
+}
+
+// IE, IF or IME changed. Compiled code has to come back out for an
+// interrupt it can take now, the rest of the schedule is the same
+static void interrupts_changed(struct dmg *dmg)
+{
+    if (interrupt_pending(dmg)) {
+        event_now();
+    }
+}
+
 void dmg_set_button(struct dmg *dmg, int field, int button, int pressed)
 {
     u8 *mod;
@@ -157,7 +255,7 @@ u8 dmg_read_slow(struct dmg *dmg, u16 address)
         // common case, and skips to that line, so this actually doesn't run
         // that much
     
-        u32 current = dmg->frame_cycles + jit_ctx.read_cycles;
+        u32 current = dmg->frame_cycles + jit_cycles();
         if (current >= 70224) {
             current -= 70224;
         }
@@ -204,7 +302,7 @@ u8 dmg_read_slow(struct dmg *dmg, u16 address)
     }
     if (address == REG_TIMER_DIV) {
         // compute based on total cycles + in-flight cycles from JIT
-        u32 current = dmg->total_cycles + jit_ctx.read_cycles;
+        u32 current = dmg->total_cycles + jit_cycles();
         u32 div_val = current - dmg->div_reset_cycle;
         return (div_val >> 8) & 0xff;
     }
@@ -252,6 +350,10 @@ u8 dmg_read(void *_dmg, u16 address)
 
 void dmg_write_slow(struct dmg *dmg, u16 address, u8 data)
 {
+    if (dmg_is_code_page(dmg, address >> 8) && dmg_write_code_page(dmg, address, data)) {
+        return;
+    }
+
     // ROM region writes go to MBC for bank switching
     if (address < 0x8000) {
         mbc_write(dmg->rom->mbc, dmg, address, data);
@@ -284,12 +386,18 @@ void dmg_write_slow(struct dmg *dmg, u16 address, u8 data)
     // OAM and LCD registers
     if (lcd_is_valid_addr(address)) {
         lcd_write(dmg->lcd, address, data);
+        if (address == REG_LCDC || address == REG_LYC) {
+            dmg_schedule(dmg);
+        }
         return;
     }
 
     // high RAM
     if (address >= 0xff80) {
         dmg->zero_page[address - 0xff80] = data;
+        if (address == 0xffff) {
+            interrupts_changed(dmg);
+        }
         return;
     }
 
@@ -301,11 +409,12 @@ void dmg_write_slow(struct dmg *dmg, u16 address, u8 data)
     }
     if (address == REG_TIMER_DIV) {
         // writing any value resets DIV to 0 at this cycle
-        dmg->div_reset_cycle = dmg->total_cycles + jit_ctx.read_cycles;
+        dmg->div_reset_cycle = dmg->total_cycles + jit_cycles();
         return;
     }
     if (address == REG_TIMER_COUNT) {
         dmg->timer_count = data;
+        dmg_schedule(dmg);
         return;
     }
     if (address == REG_TIMER_MOD) {
@@ -314,6 +423,7 @@ void dmg_write_slow(struct dmg *dmg, u16 address, u8 data)
     }
     if (address == REG_TIMER_CONTROL) {
         dmg->timer_control = data;
+        dmg_schedule(dmg);
         return;
     }
     if (address >= 0xff10 && address <= 0xff3f) {
@@ -322,6 +432,7 @@ void dmg_write_slow(struct dmg *dmg, u16 address, u8 data)
     }
     if (address == 0xff0f) {
         dmg->interrupt_request_mask = data;
+        interrupts_changed(dmg);
         return;
     }
 }
@@ -349,6 +460,71 @@ void dmg_write16(void *_dmg, u16 address, u16 data)
     dmg_write(_dmg, address + 1, (data >> 8) & 0xff);
 }
 
+// Bytes left in the page addr is on, up to count
+static u16 page_run(u16 addr, u16 count)
+{
+    u16 left = 0x100 - (addr & 0xff);
+    return count < left ? count : left;
+}
+
+// Same as count dmg_write(dst + k, dmg_read(src + k)) going up, for copy
+// loops the JIT found. Runs where both pages are mapped are copied
+// directly, everything else goes through the handlers so VRAM, OAM, code
+// pages and I/O all behave the way they would for the loop
+void dmg_copy(void *_dmg, u16 dst, u16 src, u16 count)
+{
+    struct dmg *dmg = (struct dmg *) _dmg;
+
+    while (count) {
+        u8 *from = dmg->read_page[src >> 8];
+        u8 *to = dmg->write_page[dst >> 8];
+        u16 run = page_run(dst, page_run(src, count));
+        u16 k;
+
+        if (from && to) {
+            from += src & 0xff;
+            to += dst & 0xff;
+            if (to > from && to < from + run) {
+                // overlapping forward copies repeat, memmove wouldn't
+                for (k = 0; k < run; k++) {
+                    to[k] = from[k];
+                }
+            } else {
+                memmove(to, from, run);
+            }
+        } else {
+            for (k = 0; k < run; k++) {
+                dmg_write(dmg, dst + k, dmg_read(dmg, src + k));
+            }
+        }
+        dst += run;
+        src += run;
+        count -= run;
+    }
+}
+
+// Same as count dmg_write(dst + k, data) going up, for fill loops
+void dmg_fill(void *_dmg, u16 dst, u16 count, u8 data)
+{
+    struct dmg *dmg = (struct dmg *) _dmg;
+
+    while (count) {
+        u8 *to = dmg->write_page[dst >> 8];
+        u16 run = page_run(dst, count);
+        u16 k;
+
+        if (to) {
+            memset(to + (dst & 0xff), data, run);
+        } else {
+            for (k = 0; k < run; k++) {
+                dmg_write(dmg, dst + k, data);
+            }
+        }
+        dst += run;
+        count -= run;
+    }
+}
+
 static void lcd_sync(struct dmg *dmg)
 {
     int lcdc = lcd_read(dmg->lcd, REG_LCDC);
@@ -413,10 +589,9 @@ static void timer_sync(struct dmg *dmg, int cycles)
 }
 
 // not accurate at all, but not going for accuracy. i'm FINALLY happy with the
-// logic here. supports arbitrary cycles_per_exit, currently user configurable
-// between every line, every 16 lines, and every 1 frame
-// note that the user configurable setting is less relevant for games that use
-// HALT, because HALT will skip directly to line 144
+// logic here. called whenever compiled code gets to an event from
+// dmg_schedule, or HALT skips ahead to line 144, so any number of cycles
+// can have gone by
 void dmg_sync_hw(struct dmg *dmg, int cycles)
 {
     dmg->total_cycles += cycles;
@@ -441,8 +616,63 @@ void dmg_sync_hw(struct dmg *dmg, int cycles)
     }
 }
 
+// Add an event at cycles into the frame, keeping the list soonest first
+static void schedule_event(struct dmg *dmg, u32 cycles)
+{
+    int k = dmg->num_events++;
+
+    while (k > 0 && dmg->events[k - 1] > cycles) {
+        dmg->events[k] = dmg->events[k - 1];
+        k--;
+    }
+    dmg->events[k] = cycles;
+}
+
+// The LYC match, the render in the middle of the frame, vblank, the timer
+// overflowing, the "check for interrupts" preference and the end of the
+// frame. D2 starts at jit_ctx.event_cycles and counts down, and compiled
+// code checks its sign wherever it could go back to the dispatcher, so it
+// only comes out when one of these is due. An interrupt that can be taken
+// makes that right away. Also called when the game writes a register that
+// moves one, D2 moves with it then
+void dmg_schedule(struct dmg *dmg)
+{
+    u32 now = dmg->frame_cycles;
+
+    dmg->num_events = 0;
+    if (lcd_read(dmg->lcd, REG_LCDC) & LCDC_ENABLE) {
+        if (!dmg->sent_ly_interrupt) {
+            schedule_event(dmg, lcd_read(dmg->lcd, REG_LYC) * CYCLES_PER_LINE);
+        }
+        if (!dmg->rendered_this_frame) {
+            schedule_event(dmg, CYCLES_MIDDLE);
+        }
+        if (!dmg->sent_vblank_start) {
+            schedule_event(dmg, CYCLES_LINE_144);
+        }
+    }
+    if (dmg->timer_control & TIMER_CONTROL_ENABLED) {
+        u32 divisor = timer_divisors[dmg->timer_control & 3];
+        u32 overflow = (256 - dmg->timer_count) * divisor;
+        // timer_cycles can be past the divisor if TAC just changed
+        schedule_event(dmg, now + (overflow > dmg->timer_cycles
+                                   ? overflow - dmg->timer_cycles : 0));
+    }
+    if (cycles_per_exit) {
+        schedule_event(dmg, (now / cycles_per_exit + 1) * cycles_per_exit);
+    }
+    schedule_event(dmg, CYCLES_PER_FRAME);
+
+    if (interrupt_pending(dmg) || dmg->events[0] <= now) {
+        event_now();
+    } else {
+        set_event_cycles(dmg->events[0] - now);
+    }
+}
+
 void dmg_ei_di(void *_dmg, u16 enabled)
 {
     struct dmg *dmg = (struct dmg *) _dmg;
     dmg->interrupt_enable = enabled ? 1 : 0;
+    interrupts_changed(dmg);
 }
\ No newline at end of file
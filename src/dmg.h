@@ -22,6 +22,9 @@
 
 #define TIMER_CONTROL_ENABLED (1 << 2)
 
+// LYC, middle of the frame, vblank, timer, preference, end of the frame
+#define MAX_EVENTS 6
+
 struct rom;
 struct lcd;
 struct audio;
@@ -45,6 +48,11 @@ struct dmg {
     u8 interrupt_request_mask;
     void (*rom_bank_switch_hook)(int new_bank);
 
+    // one bit per page that has compiled code on it. writes to these pages
+    // take the slow path, which calls the hook so the JIT can drop the code
+    u8 code_pages[32];
+    void (*code_write_hook)(u16 start, u16 length);
+
     u8 joypad;
     u8 action_buttons;
     u16 timer_div;
@@ -65,6 +73,11 @@ struct dmg {
 
     // for TIMA timer
     u32 timer_cycles;
+
+    // frame_cycles at each of the next things dmg_sync_hw has to do,
+    // soonest first. see dmg_schedule
+    u32 events[MAX_EVENTS];
+    int num_events;
 };
 
 void dmg_new(struct dmg *dmg, struct rom *rom, struct lcd *lcd);
@@ -75,15 +88,25 @@ void dmg_write(void *dmg, u16 address, u8 data);
 u16 dmg_read16(void *_dmg, u16 address);
 void dmg_write16(void *_dmg, u16 address, u16 data);
 
+// for loops the JIT turns into one call, see compile_idiom
+void dmg_copy(void *_dmg, u16 dst, u16 src, u16 count);
+void dmg_fill(void *_dmg, u16 dst, u16 count, u8 data);
+
 u8 dmg_read_slow(struct dmg *dmg, u16 address);
 void dmg_write_slow(struct dmg *dmg, u16 address, u8 data);
 
 void dmg_sync_hw(struct dmg *dmg, int cycles);
 
+// Rebuild the event list after a sync and set jit_ctx.event_cycles from
+// it, which is how far compiled code runs before coming back
+void dmg_schedule(struct dmg *dmg);
+
 // page table management
 void dmg_init_pages(struct dmg *dmg);
 void dmg_update_rom_bank(struct dmg *dmg, int bank);
 void dmg_update_ram_bank(struct dmg *dmg, u8 *ram_base);
+void dmg_set_code_page(struct dmg *dmg, int page, int has_code);
+int dmg_is_code_page(struct dmg *dmg, int page);
 
 void dmg_ei_di(void *dmg, u16 enabled);
 
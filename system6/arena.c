@@ -11,6 +11,22 @@ static unsigned char *arena_base;
 static unsigned char *arena_ptr;
 static unsigned char *arena_end;
 
+// chunks given back with arena_free, sorted by address so neighbors can be
+// merged. the header lives in the freed memory itself
+struct free_chunk {
+    size_t size;
+    struct free_chunk *next;
+};
+
+static struct free_chunk *free_list;
+static size_t free_bytes;
+
+// round up so every piece split off a free chunk can hold a chunk header
+static size_t chunk_size(size_t size)
+{
+    return (size + sizeof(struct free_chunk) - 1) & ~(sizeof(struct free_chunk) - 1);
+}
+
 int arena_init(void)
 {
     Size grow_bytes;
@@ -38,9 +54,28 @@ int arena_init(void)
 void *arena_alloc(size_t size)
 {
     unsigned char *p;
-
-    // align to 4 bytes for 68k, could probably be 2?
-    size = (size + 3) & ~3;
+    struct free_chunk **link, *chunk;
+
+    // 68k only needs 2 or 4 byte alignment, but freed pieces need to fit a
+    // free_chunk header
+    size = chunk_size(size);
+
+    // first fit from freed chunks before growing into the untouched part
+    for (link = &free_list; (chunk = *link); link = &chunk->next) {
+        if (chunk->size < size) {
+            continue;
+        }
+        if (chunk->size > size) {
+            struct free_chunk *rest = (struct free_chunk *) ((unsigned char *) chunk + size);
+            rest->size = chunk->size - size;
+            rest->next = chunk->next;
+            *link = rest;
+        } else {
+            *link = chunk->next;
+        }
+        free_bytes -= size;
+        return chunk;
+    }
 
     if (arena_ptr + size > arena_end) {
         return NULL;
@@ -51,14 +86,55 @@ void *arena_alloc(size_t size)
     return p;
 }
 
+void arena_free(void *ptr, size_t size)
+{
+    struct free_chunk **link = &free_list, **prev_link = NULL;
+    struct free_chunk *chunk = ptr;
+
+    size = chunk_size(size);
+    free_bytes += size;
+
+    while (*link && *link < chunk) {
+        prev_link = link;
+        link = &(*link)->next;
+    }
+
+    chunk->size = size;
+    chunk->next = *link;
+    *link = chunk;
+
+    // merge with the following chunk
+    if (chunk->next && (unsigned char *) chunk + chunk->size == (unsigned char *) chunk->next) {
+        chunk->size += chunk->next->size;
+        chunk->next = chunk->next->next;
+    }
+
+    // and the previous one
+    if (prev_link && (unsigned char *) *prev_link + (*prev_link)->size == (unsigned char *) chunk) {
+        (*prev_link)->size += chunk->size;
+        (*prev_link)->next = chunk->next;
+        link = prev_link;
+        chunk = *link;
+    }
+
+    // last chunk touches the untouched part, give it back to the bump pointer
+    if (!chunk->next && (unsigned char *) chunk + chunk->size == arena_ptr) {
+        arena_ptr = (unsigned char *) chunk;
+        free_bytes -= chunk->size;
+        *link = NULL;
+    }
+}
+
 void arena_reset(void)
 {
     arena_ptr = arena_base;
+    free_list = NULL;
+    free_bytes = 0;
 }
 
 size_t arena_remaining(void)
 {
-    return arena_end - arena_ptr;
+    return arena_end - arena_ptr + free_bytes;
 }
 
 size_t arena_size(void)
@@ -10,10 +10,13 @@ int arena_init(void);
 // bump-allocate from the arena, returns NULL if no space
 void *arena_alloc(size_t size);
 
+// give memory from arena_alloc back, size must be what was asked for
+void arena_free(void *ptr, size_t size);
+
 // reset arena pointer to base for instant "free all"
 void arena_reset(void);
 
-// return bytes remaining in arena
+// return bytes remaining in arena, including freed chunks
 size_t arena_remaining(void);
 
 // return total size of arena
@@ -5,11 +5,53 @@
 #include "types.h"
 #include "cache.h"
 #include "arena.h"
+#include "compiler.h"
 
 static void **bank0_cache;
 static void **upper_cache;
 static void ***banked_cache;
 
+// compiled blocks, oldest first
+static struct code_block *blocks_head;
+static struct code_block *blocks_tail;
+static size_t block_bytes;
+
+// blocks compiled from RAM (0x8000 and up) are kept separately, newest
+// first, so writes to RAM only have to look through these
+static struct code_block *ram_blocks;
+
+// number of RAM blocks covering each page from 0x80 to 0xff
+static u16 ram_page_blocks[0x80];
+
+// blocks taken out by a RAM write, which might be the one doing the write,
+// so they can't be freed until we're back in C
+static struct code_block *zombie_blocks;
+
+// the dispatcher sets a byte here for each GB page it jumps into, and they
+// all get cleared when blocks are evicted. blocks on pages nobody entered
+// since then are the cold ones. the banked region shares pages between
+// banks, so a hot bank keeps the other banks' blocks at that page alive too.
+// linked exits go around the dispatcher, so cache_link sets the byte for
+// the block it links to, and eviction unlinks everything so each link has
+// to be made again (and counted) before the next one
+static u8 page_use[256];
+
+// an exit somewhere that was patched with JMP.L to the block it hangs off of
+struct block_link {
+    u8 *site;
+    struct block_link *next;
+};
+
+// mid-block entry points by code pointer. anything else the cache points
+// to is the start of a block
+#define ENTRY_HASH_SIZE 256
+static struct block_entry *entry_hash[ENTRY_HASH_SIZE];
+
+static int entry_hash_index(void *code)
+{
+    return ((uintptr_t) code >> 1) & (ENTRY_HASH_SIZE - 1);
+}
+
 // Look up cached code pointer for given PC and bank
 void *cache_lookup(u16 pc, u8 bank)
 {
@@ -55,6 +97,10 @@ int cache_store(u16 pc, u8 bank, void *code)
 // Returns 1 on success, 0 on failure
 int cache_init(void)
 {
+    // blocks were in the arena too
+    blocks_head = NULL;
+    blocks_tail = NULL;
+
     bank0_cache = arena_alloc(BANK0_CACHE_SIZE * sizeof(void *));
     if (!bank0_cache) {
         return 0;
@@ -74,9 +120,311 @@ int cache_init(void)
     }
     memset(banked_cache, 0, MAX_ROM_BANKS * sizeof(void **));
 
+    block_bytes = 0;
+    ram_blocks = NULL;
+    zombie_blocks = NULL;
+    memset(ram_page_blocks, 0, sizeof ram_page_blocks);
+    memset(page_use, 0, sizeof page_use);
+    memset(entry_hash, 0, sizeof entry_hash);
+
     return 1;
 }
 
+// end_address wraps to 0 for a block that runs up to 0xffff
+static u32 block_end(struct code_block *block)
+{
+    return block->end_address > block->src_address ? block->end_address : 0x10000;
+}
+
+static void count_ram_pages(struct code_block *block, int delta)
+{
+    u32 page;
+
+    for (page = block->src_address >> 8; page <= (block_end(block) - 1) >> 8; page++) {
+        ram_page_blocks[page - 0x80] += delta;
+    }
+}
+
+void cache_add_block(struct code_block *block)
+{
+    struct block_entry *entry;
+    int k, index;
+
+    for (k = 0; k < block->num_entries; k++) {
+        entry = &block->entries[k];
+        index = entry_hash_index(block->code + entry->m68k_offset);
+        entry->block = block;
+        entry->hash_next = entry_hash[index];
+        entry_hash[index] = entry;
+    }
+
+    block->links = NULL;
+    block_bytes += block_size(block);
+
+    if (block->src_address >= 0x8000) {
+        count_ram_pages(block, 1);
+        block->next = ram_blocks;
+        ram_blocks = block;
+        return;
+    }
+
+    block->next = NULL;
+    if (blocks_tail) {
+        blocks_tail->next = block;
+    } else {
+        blocks_head = block;
+    }
+    blocks_tail = block;
+}
+
+struct code_block *cache_rom_blocks(void)
+{
+    return blocks_head;
+}
+
+int cache_page_has_code(u8 page)
+{
+    return page >= 0x80 && ram_page_blocks[page - 0x80];
+}
+
+void cache_mark_used(u16 pc)
+{
+    page_use[pc >> 8] = 1;
+}
+
+u8 *cache_get_page_use(void)
+{
+    return page_use;
+}
+
+// Find the block a cache entry points into
+static struct code_block *entry_owner(u8 *code)
+{
+    struct block_entry *entry;
+
+    for (entry = entry_hash[entry_hash_index(code)]; entry; entry = entry->hash_next) {
+        if (entry->block->code + entry->m68k_offset == code) {
+            return entry->block;
+        }
+    }
+    return (struct code_block *) (code - offsetof(struct code_block, code));
+}
+
+void cache_link(u8 *site, u8 *target)
+{
+    struct code_block *block = entry_owner(target);
+    struct block_link *link = arena_alloc(sizeof *link);
+
+    if (!link) {
+        // can't track it, so it can't stay patched
+        block_unlink_site(site);
+        return;
+    }
+
+    link->site = site;
+    link->next = block->links;
+    block->links = link;
+    page_use[block->src_address >> 8] = 1;
+}
+
+// Forget the link from one of this block's exits, it's going away
+static void drop_outgoing_link(u8 *site, u8 *target)
+{
+    struct code_block *block = entry_owner(target);
+    struct block_link **prev, *link;
+
+    for (prev = &block->links; (link = *prev); prev = &link->next) {
+        if (link->site == site) {
+            *prev = link->next;
+            arena_free(link, sizeof *link);
+            return;
+        }
+    }
+}
+
+static void remove_entry_hash(struct block_entry *entry)
+{
+    struct block_entry **prev;
+
+    prev = &entry_hash[entry_hash_index(entry->block->code + entry->m68k_offset)];
+    for (; *prev; prev = &(*prev)->hash_next) {
+        if (*prev == entry) {
+            *prev = entry->hash_next;
+            return;
+        }
+    }
+}
+
+static void cache_remove(u16 pc, u8 bank, void *code)
+{
+    if (cache_lookup(pc, bank) == code) {
+        cache_store(pc, bank, NULL);
+    }
+}
+
+// Put back the exits patched to jump into the block
+static void unlink_incoming(struct code_block *block)
+{
+    struct block_link *link, *next;
+
+    for (link = block->links; link; link = next) {
+        next = link->next;
+        block_unlink_site(link->site);
+        arena_free(link, sizeof *link);
+    }
+    block->links = NULL;
+}
+
+// Detach the block from everything that can reach it: its own links to
+// other blocks, cache entries, and exits patched to jump into it
+static void kill_block(struct code_block *block)
+{
+    u8 *target;
+    int k;
+
+    for (k = 0; k < block->num_exits; k++) {
+        target = block_exit_target(block, k);
+        if (target) {
+            drop_outgoing_link(block_exit_site(block, k), target);
+        }
+    }
+
+    cache_remove(block->src_address, block->bank, block->code);
+    for (k = 0; k < block->num_entries; k++) {
+        cache_remove(block->entries[k].src_address, block->bank,
+                     block->code + block->entries[k].m68k_offset);
+        remove_entry_hash(&block->entries[k]);
+    }
+
+    unlink_incoming(block);
+}
+
+// Move blocks on pages that haven't run since the last eviction from the
+// list to killed, returning how many bytes that was
+static size_t take_cold_blocks(struct code_block **link, struct code_block **killed)
+{
+    struct code_block *block;
+    size_t taken = 0;
+
+    while ((block = *link)) {
+        if (page_use[block->src_address >> 8]) {
+            link = &block->next;
+            continue;
+        }
+        *link = block->next;
+        block->next = *killed;
+        *killed = block;
+        taken += block_size(block);
+    }
+    return taken;
+}
+
+size_t cache_evict_cold(void)
+{
+    struct code_block *block, *killed = NULL;
+    size_t freed, quota;
+    int k;
+
+    freed = take_cold_blocks(&blocks_head, &killed);
+    freed += take_cold_blocks(&ram_blocks, &killed);
+
+    // everything ran recently, so age out the oldest quarter instead
+    if (!killed) {
+        quota = block_bytes / 4;
+        while (blocks_head && freed < quota) {
+            block = blocks_head;
+            blocks_head = block->next;
+            block->next = killed;
+            killed = block;
+            freed += block_size(block);
+        }
+    }
+
+    blocks_tail = NULL;
+    for (block = blocks_head; block; block = block->next) {
+        blocks_tail = block;
+    }
+
+    // all of them have to be detached before any memory is reused
+    for (block = killed; block; block = block->next) {
+        if (block->src_address >= 0x8000) {
+            count_ram_pages(block, -1);
+        }
+        kill_block(block);
+        // so anything that still jumps here is obvious
+        for (k = 0; k < block->length; k += 2) {
+            block->code[k] = 0x4a;
+            block->code[k + 1] = 0xfc;
+        }
+    }
+
+    while (killed) {
+        block = killed;
+        killed = block->next;
+        arena_free(block, block_size(block));
+    }
+
+    // the blocks that stay get entered through the dispatcher or
+    // patch_helper again, which is what marks them for next time
+    for (block = blocks_head; block; block = block->next) {
+        unlink_incoming(block);
+    }
+    for (block = ram_blocks; block; block = block->next) {
+        unlink_incoming(block);
+    }
+
+    block_bytes -= freed;
+    memset(page_use, 0, sizeof page_use);
+    return freed;
+}
+
+int cache_invalidate_ram(u16 start, u16 length)
+{
+    struct code_block **link, *block;
+    u32 end = (u32) start + length;
+    int count = 0;
+
+    link = &ram_blocks;
+    while ((block = *link)) {
+        if (block->src_address >= end || block_end(block) <= start) {
+            link = &block->next;
+            continue;
+        }
+        *link = block->next;
+        count_ram_pages(block, -1);
+        block_bytes -= block_size(block);
+        kill_block(block);
+        block->next = zombie_blocks;
+        zombie_blocks = block;
+        count++;
+    }
+    return count;
+}
+
+int cache_reap(void)
+{
+    struct code_block *block;
+    u8 *target;
+    int k, freed = 0;
+
+    while (zombie_blocks) {
+        block = zombie_blocks;
+        zombie_blocks = block->next;
+
+        // it may have been running when it was killed, and patch_helper
+        // could have linked its exits again since then
+        for (k = 0; k < block->num_exits; k++) {
+            target = block_exit_target(block, k);
+            if (target) {
+                drop_outgoing_link(block_exit_site(block, k), target);
+            }
+        }
+        arena_free(block, block_size(block));
+        freed++;
+    }
+    return freed;
+}
+
 // Get current cache array pointers for dispatcher
 void cache_get_arrays(void ***out_bank0, void ****out_banked, void ***out_upper)
 {
@@ -17,6 +17,42 @@ void *cache_lookup(u16 pc, u8 bank);
 // Store code pointer in cache
 int cache_store(u16 pc, u8 bank, void *code);
 
+struct code_block;
+
+// Track a compiled block so it can be evicted later
+void cache_add_block(struct code_block *block);
+
+// Note that code at this PC ran, for choosing what to evict
+void cache_mark_used(u16 pc);
+
+// Per-page use flags set by the dispatcher, indexed by PC >> 8
+u8 *cache_get_page_use(void);
+
+// Called by patch_helper after it patches the exit at site to JMP.L target,
+// so the exit can be restored if the target block goes away. Counts as the
+// target running, since the dispatcher won't see it from then on
+void cache_link(u8 *site, u8 *target);
+
+// Free blocks on pages that haven't run since the last eviction, or the
+// oldest ones if everything has. Linked exits, to these and to the blocks
+// that stay, are restored to go through patch_helper, and the code cache
+// needs flushing after. Returns the number of bytes freed
+size_t cache_evict_cold(void);
+
+// Oldest block compiled from ROM, the rest follow through next
+struct code_block *cache_rom_blocks(void);
+
+// Whether any block compiled from RAM covers this page
+int cache_page_has_code(u8 page);
+
+// Take out RAM blocks overlapping the range. They may still be running,
+// so they're only freed by cache_reap. Returns the number of blocks
+int cache_invalidate_ram(u16 start, u16 length);
+
+// Free blocks taken out by cache_invalidate_ram, call only from C.
+// Returns the number of blocks freed
+int cache_reap(void);
+
 // Get current cache array pointers for dispatcher
 // this is the first time i've ever used a ****
 void cache_get_arrays(void ***out_bank0, void ****out_banked, void ***out_upper);
@@ -17,9 +17,7 @@ static unsigned char defaultMappings[8] = { 0x0d, 0x01, 0x00, 0x02, 0x25, 0x28,
 static short gSelectedSlot = -1;
 int keyMappings[8];
 
-// compiler needs this so it's defined in there...
-// int cycles_per_exit;
-
+int cycles_per_exit;
 int frame_skip;
 int video_mode;
 int screen_scale;
@@ -0,0 +1,229 @@
+#include <Files.h>
+#include <Memory.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "compiler.h"
+#include "cache.h"
+#include "disk_cache.h"
+
+static char cache_filename[40];
+static struct disk_cache_header expected;
+
+static FILE *cache_fp;
+static struct disk_cache_entry *index_entries;
+static u32 index_count;
+
+static u8 record_buf[MAX_SERIALIZED_BLOCK];
+
+static int compare_entries(const void *a, const void *b)
+{
+    const struct disk_cache_entry *x = a, *y = b;
+    u32 kx = (u32) x->bank << 16 | x->pc;
+    u32 ky = (u32) y->bank << 16 | y->pc;
+
+    return kx < ky ? -1 : kx > ky;
+}
+
+static struct disk_cache_entry *find_entry(
+    struct disk_cache_entry *entries, u32 count, u8 bank, u16 pc
+) {
+    struct disk_cache_entry key;
+
+    key.pc = pc;
+    key.bank = bank;
+    return bsearch(&key, entries, count, sizeof *entries, compare_entries);
+}
+
+static void to_pstr(const char *str, Str63 out)
+{
+    out[0] = strlen(str);
+    memcpy(&out[1], str, out[0]);
+}
+
+void disk_cache_open(const char *filename, const u8 *rom)
+{
+    struct disk_cache_header header;
+    size_t index_size;
+
+    disk_cache_close();
+
+    strncpy(cache_filename, filename, sizeof cache_filename - 2);
+    cache_filename[sizeof cache_filename - 2] = '\0';
+
+    memset(&expected, 0, sizeof expected);
+    memcpy(expected.magic, "GBJC", 4);
+    expected.version = DISK_CACHE_VERSION;
+    expected.compiler_version = COMPILER_VERSION;
+    expected.header_checksum = rom[0x14d];
+    expected.global_checksum = rom[0x14e] << 8 | rom[0x14f];
+
+    cache_fp = fopen(cache_filename, "rb");
+    if (!cache_fp) {
+        return;
+    }
+
+    if (fread(&header, sizeof header, 1, cache_fp) != 1
+            || memcmp(&header, &expected, offsetof(struct disk_cache_header, count))
+            || !header.count) {
+        disk_cache_close();
+        return;
+    }
+
+    index_size = header.count * sizeof *index_entries;
+    index_entries = (struct disk_cache_entry *) NewPtr(index_size);
+    if (!index_entries
+            || fseek(cache_fp, header.index_offset, SEEK_SET)
+            || fread(index_entries, index_size, 1, cache_fp) != 1) {
+        disk_cache_close();
+        return;
+    }
+    index_count = header.count;
+}
+
+struct code_block *disk_cache_load(u16 pc, u8 bank, struct compile_ctx *ctx)
+{
+    struct disk_cache_entry *entry;
+
+    if (!index_count) {
+        return NULL;
+    }
+    if (pc >= 0x8000) {
+        return NULL;
+    }
+    if (pc < 0x4000) {
+        bank = 0;
+    }
+
+    entry = find_entry(index_entries, index_count, bank, pc);
+    if (!entry || entry->size > sizeof record_buf) {
+        return NULL;
+    }
+    if (fseek(cache_fp, entry->offset, SEEK_SET)
+            || fread(record_buf, entry->size, 1, cache_fp) != 1) {
+        return NULL;
+    }
+
+    // block_deserialize registers entry points, so check before that
+    if ((record_buf[0] << 8 | record_buf[1]) != pc) {
+        return NULL;
+    }
+    return block_deserialize(record_buf, entry->size, ctx);
+}
+
+int disk_cache_save(struct compile_ctx *ctx)
+{
+    struct disk_cache_header header;
+    struct disk_cache_entry *entries, *old;
+    struct code_block *block;
+    u32 capacity = index_count, count = 0, compiled, k;
+    size_t size;
+    char tmp_filename[sizeof cache_filename];
+    Str63 name_p, tmp_p;
+    FILE *fp;
+    u8 bank;
+    int ok;
+
+    if (!cache_filename[0]) {
+        return 0;
+    }
+
+    for (block = cache_rom_blocks(); block; block = block->next) {
+        capacity++;
+    }
+    if (!capacity) {
+        disk_cache_close();
+        return 0;
+    }
+
+    entries = (struct disk_cache_entry *) NewPtr(capacity * sizeof *entries);
+    if (!entries) {
+        disk_cache_close();
+        return 0;
+    }
+
+    // the old file still has to be read from, so write next to it
+    sprintf(tmp_filename, "%s~", cache_filename);
+    fp = fopen(tmp_filename, "wb");
+    if (!fp) {
+        DisposePtr((Ptr) entries);
+        disk_cache_close();
+        return 0;
+    }
+
+    header = expected;
+    ok = fwrite(&header, sizeof header, 1, fp) == 1;
+
+    for (block = cache_rom_blocks(); ok && block; block = block->next) {
+        if (!block_saved_bank(block, &bank)) {
+            continue;
+        }
+        size = block_serialize(block, ctx, record_buf, sizeof record_buf);
+        if (!size) {
+            continue;
+        }
+        entries[count].pc = block->src_address;
+        entries[count].bank = bank;
+        entries[count]._pad = 0;
+        entries[count].offset = ftell(fp);
+        entries[count].size = size;
+        ok = fwrite(record_buf, size, 1, fp) == 1;
+        count++;
+    }
+    qsort(entries, count, sizeof *entries, compare_entries);
+
+    // keep blocks from last time that weren't needed this time
+    if (index_count) {
+        compiled = count;
+        for (k = 0; ok && k < index_count; k++) {
+            old = &index_entries[k];
+            if (find_entry(entries, compiled, old->bank, old->pc)) {
+                continue;
+            }
+            if (old->size > sizeof record_buf
+                    || fseek(cache_fp, old->offset, SEEK_SET)
+                    || fread(record_buf, old->size, 1, cache_fp) != 1) {
+                continue;
+            }
+            entries[count] = *old;
+            entries[count].offset = ftell(fp);
+            ok = fwrite(record_buf, old->size, 1, fp) == 1;
+            count++;
+        }
+        qsort(entries, count, sizeof *entries, compare_entries);
+    }
+
+    header.count = count;
+    header.index_offset = ftell(fp);
+    ok = ok && fwrite(entries, sizeof *entries, count, fp) == count;
+    ok = ok && !fseek(fp, 0, SEEK_SET) && fwrite(&header, sizeof header, 1, fp) == 1;
+    ok = !fclose(fp) && ok;
+    DisposePtr((Ptr) entries);
+    disk_cache_close();
+
+    to_pstr(cache_filename, name_p);
+    to_pstr(tmp_filename, tmp_p);
+    if (!ok || !count) {
+        FSDelete(tmp_p, 0);
+        return 0;
+    }
+    FSDelete(name_p, 0);
+    return Rename(tmp_p, 0, name_p) == noErr;
+}
+
+void disk_cache_close(void)
+{
+    if (cache_fp) {
+        fclose(cache_fp);
+        cache_fp = NULL;
+    }
+    if (index_entries) {
+        DisposePtr((Ptr) index_entries);
+        index_entries = NULL;
+    }
+    index_count = 0;
+}
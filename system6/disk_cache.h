@@ -0,0 +1,50 @@
+#ifndef _DISK_CACHE_H
+#define _DISK_CACHE_H
+
+#include "types.h"
+
+#define DISK_CACHE_VERSION 2
+
+// Big-endian, which is how the Mac writes these straight from memory.
+// tools/precompile.c writes the same thing on other machines
+struct disk_cache_header {
+    char magic[4]; // "GBJC"
+    u32 version;
+    u32 compiler_version;
+    u8 header_checksum; // ROM 0x14d
+    u8 _pad;
+    u16 global_checksum; // ROM 0x14e-0x14f
+    // everything above has to match
+    u32 count;
+    u32 index_offset;
+};
+
+// index is sorted by bank then pc, blocks below 0x4000 are saved as bank 0.
+// offset and size locate a block_serialize record
+struct disk_cache_entry {
+    u16 pc;
+    u8 bank;
+    u8 _pad;
+    u32 offset;
+    u32 size;
+};
+
+struct code_block;
+struct compile_ctx;
+
+// Read the index of blocks saved by the last session with this ROM. The
+// file is thrown away if it was written for another ROM or another
+// COMPILER_VERSION
+void disk_cache_open(const char *filename, const u8 *rom);
+
+// Load the block saved at pc in bank, relocated for ctx and registered the
+// same way compile_block would. NULL if there isn't one
+struct code_block *disk_cache_load(u16 pc, u8 bank, struct compile_ctx *ctx);
+
+// Write the ROM blocks that are still compiled, plus the ones from the
+// file that weren't used this time, then close the cache
+int disk_cache_save(struct compile_ctx *ctx);
+
+void disk_cache_close(void);
+
+#endif
@@ -1,22 +1,22 @@
 #include "cpu_cache.h"
 #include "dispatcher_asm.h"
-#include "settings.h"
 
-// Offset of the FlushCodeCache trap in patch_helper code
-#define CACHEFLUSH_OFFSET 102
+// The FlushCodeCache trap in patch_helper code, labeled in the asm
+extern unsigned char patch_helper_cache_flush[];
 
 // compiled blocks JMP here instead of RTS. This routine:
-// 1. Checks if accumulated cycles in D2 >= cycles_per_exit, if so, RTS to C
+// 1. Checks if D2 has counted down past the next event, if so, RTS to C
 // 2. Determines which cache to use based on PC in D3
-// 3. Looks up block in appropriate cache, if found -> JMP to it
+// 3. Looks up block in appropriate cache, if found -> marks the page as
+//    used for eviction and JMPs to it
 // 4. Otherwise -> RTS to C to compile the block
 // context offsets in jit.h
 static void dispatcher_code_asm(void)
 {
     asm volatile(
         "\t"
-        "cmp.l %[cycles], %%d2\n\t"
-        "bcc.s .Ldisp_exit\n\t"
+        "tst.l %%d2\n\t"                   // cycles left
+        "bmi.s .Ldisp_exit\n\t"
 
         "cmpi.w #0x4000, %%d3\n\t"
         "bcs.s .Ldisp_bank0\n\t"
@@ -34,7 +34,7 @@ static void dispatcher_code_asm(void)
         "movea.l (%%a0,%%d0.l), %%a0\n\t"
         "cmpa.w #0, %%a0\n\t"
         "beq.s .Ldisp_exit\n\t"
-        "jmp (%%a0)\n\t"
+        "bra.s .Ldisp_hit\n\t"
         "\n"
 
     ".Ldisp_bank0:\n\t"
@@ -45,7 +45,7 @@ static void dispatcher_code_asm(void)
         "movea.l (%%a0,%%d0.l), %%a0\n\t"
         "cmpa.w #0, %%a0\n\t"
         "beq.s .Ldisp_exit\n\t"
-        "jmp (%%a0)\n\t"
+        "bra.s .Ldisp_hit\n\t"
         "\n"
 
     ".Ldisp_banked:\n\t"
@@ -63,16 +63,20 @@ static void dispatcher_code_asm(void)
         "movea.l (%%a0,%%d0.l), %%a0\n\t"
         "cmpa.w #0, %%a0\n\t"
         "beq.s .Ldisp_exit\n\t"
+        "\n"
 
+    ".Ldisp_hit:\n\t"
+        "movea.l 64(%%a4), %%a1\n\t"       // page_use
+        "move.w %%d3, %%d0\n\t"
+        "lsr.w #8, %%d0\n\t"
+        "st (%%a1,%%d0.w)\n\t"
         "jmp (%%a0)\n\t"
         "\n"
 
     ".Ldisp_exit:\n\t"
         "rts\n\t"
 
-        : // no outputs
-        : [cycles] "m" (cycles_per_exit)
-        : "d0", "a0", "cc", "memory"
+        ::: "d0", "a0", "a1", "cc", "memory"
     );
 }
 
@@ -82,10 +86,11 @@ static void dispatcher_code_asm(void)
 // A4 = context pointer
 //
 // This routine:
-// 1. Checks if target is in banked region (skip patching if so)
-// 2. Looks up target in cache
-// 3. If found: patches the JSR into JMP.L and jumps to target
-// 4. If not found: jumps to exit which RTSs to C
+// 1. Looks up target in cache
+// 2. If found: patches the JSR into JMP.L, records the link and jumps to target.
+//    targets in the banked region get the bank guard from emit_patchable_exit
+//    so the link is only taken while the same bank is mapped
+// 3. If not found: jumps to exit which RTSs to C
 static void patch_helper_code_asm(void)
 {
     asm volatile(
@@ -100,32 +105,19 @@ static void patch_helper_code_asm(void)
         "bcc.s .Lpatch_upper\n\t"
 
         // .banked: - lookup banked_cache[current_bank][d3 - 0x4000]
-
-        // TODO: this scenario can occur, but i think it's saved by the fact that
-        // 'jp hl' always goes through the dispatcher, and bank0 code with a
-        // hardcoded jp/call $5xxx where the intended target varies by bank is very rare:
-
-        // 1. block A is at address 0x1000 (bank 0, always visible)
-        // 2. block A has a patchable exit to address 0x5000 (banked region)
-        // 3. with bank 1 active, block A runs, patch_helper finds bank 1's code
-        //      at 0x5000, patches block A with JMP.L bank1_code
-        // 4. later, bank 2 is switched in
-        // 5. some other code jumps to 0x1000 - block A is found in bank0_cache and runs
-        // 6. block A's patched JMP goes directly to bank 1's code
-        // "bra.s .Lpatch_no_patch\n\t" // cacheflush_offset is 66 if using this and commenting out below
         "movea.l 24(%%a4), %%a0\n\t"         // banked_cache
         "moveq #0, %%d0\n\t"
         "move.b 17(%%a4), %%d0\n\t"          // current_rom_bank
         "lsl.l #2, %%d0\n\t"
         "movea.l (%%a0,%%d0.l), %%a0\n\t"    // banked_cache[bank]
         "cmpa.w #0, %%a0\n\t"
-        "beq.s .Lpatch_no_patch\n\t"
+        "beq.w .Lpatch_no_patch\n\t"       // past the guard fill, too far for .s
         "moveq #0, %%d0\n\t"
         "move.w %%d3, %%d0\n\t"
         "subi.w #0x4000, %%d0\n\t"
         "lsl.l #2, %%d0\n\t"
         "movea.l (%%a0,%%d0.l), %%a0\n\t"
-        "bra.s .Lpatch_check_found\n\t"
+        "bra.s .Lpatch_banked_found\n\t"
         "\n"
 
     ".Lpatch_bank0:\n\t"
@@ -152,8 +144,41 @@ static void patch_helper_code_asm(void)
 
         // .do_patch:
         "lea -6(%%a1), %%a1\n\t"
-        "move.w #0x4ef9, (%%a1)+\n\t"        // JMP.L opcode
-        "move.l %%a0, (%%a1)\n\t"
+        "move.w #0x4ef9, (%%a1)\n\t"        // JMP.L opcode
+        "move.l %%a0, 2(%%a1)\n\t"
+        "bra.s .Lpatch_link\n\t"
+        "\n"
+
+    ".Lpatch_banked_found:\n\t"
+        "cmpa.w #0, %%a0\n\t"
+        "beq.s .Lpatch_no_patch\n\t"
+
+        // fill in the guard, the exit left 20 bytes for it
+        "lea -6(%%a1), %%a1\n\t"
+        "move.w #0x0c2c, (%%a1)\n\t"        // cmpi.b #bank, 17(a4)
+        "moveq #0, %%d0\n\t"
+        "move.b 17(%%a4), %%d0\n\t"
+        "move.w %%d0, 2(%%a1)\n\t"
+        "move.w #17, 4(%%a1)\n\t"
+        "move.w #0x6606, 6(%%a1)\n\t"       // bne.s +6
+        "move.w #0x4ef9, 8(%%a1)\n\t"       // jmp.l target
+        "move.l %%a0, 10(%%a1)\n\t"
+        "move.l #0x206c0020, 14(%%a1)\n\t"  // movea.l 32(a4), a0
+        "move.w #0x4ed0, 18(%%a1)\n\t"      // jmp (a0)
+        "\n"
+
+    ".Lpatch_link:\n\t"
+        // cache_link(site, target) so the exit can be put back if the
+        // target gets evicted. C can trash a0/a1/d0-d2, keep the target
+        // and the cycles left
+        "move.l %%d2, -(%%sp)\n\t"
+        "move.l %%a0, -(%%sp)\n\t"
+        "move.l %%a1, -(%%sp)\n\t"
+        "movea.l 68(%%a4), %%a1\n\t"       // link_func
+        "jsr (%%a1)\n\t"
+        "addq.l #4, %%sp\n\t"
+        "movea.l (%%sp)+, %%a0\n\t"
+        "move.l (%%sp)+, %%d2\n\t"
 
         // don't need to worry about A0 and A1 here (from Inside Macintosh):
         // The trap dispatcher first saves registers D0, D1, D2, A1, and, if bit 8 is 0, A0.
@@ -165,6 +190,7 @@ static void patch_helper_code_asm(void)
         // When the trap dispatcher resumes control, first it restores the value of registers
         // D1, D2, A1, A2, and, if bit 8 is 0, A0. The values in registers D0 and,
         // if bit 8 is 1, in A0 are not restored.
+    "patch_helper_cache_flush:\n\t"
         ".short 0xa0bd\n\t" // patched to NOP on 68000
         "jmp (%%a0)\n\t"
         "\n"
@@ -172,7 +198,7 @@ static void patch_helper_code_asm(void)
     ".Lpatch_no_patch:\n\t"
         "jmp (%%a1)\n\t"
 
-        ::: "d0", "a0", "a1", "cc", "memory"
+        ::: "d0", "d1", "a0", "a1", "cc", "memory"
     );
 }
 
@@ -183,12 +209,10 @@ void *get_dispatcher_code(void)
 
 void *get_patch_helper_code(void)
 {
-    unsigned char *code = (unsigned char *)patch_helper_code_asm;
-
     if (!TrapAvailable(_CacheFlush)) {
         // replace _CacheFlush with a nop
-        code[CACHEFLUSH_OFFSET + 0] = 0x4e;
-        code[CACHEFLUSH_OFFSET + 1] = 0x71;
+        patch_helper_cache_flush[0] = 0x4e;
+        patch_helper_cache_flush[1] = 0x71;
     }
-    return code;
+    return patch_helper_code_asm;
 }
@@ -35,6 +35,7 @@
 #include "dispatcher_asm.h"
 #include "arena.h"
 #include "cache.h"
+#include "disk_cache.h"
 #include "jit.h"
 #include "settings.h"
 #include "audio_mac.h"
@@ -76,6 +77,8 @@ static unsigned long soft_reset_release_tick;
 
 
 static char save_filename[32];
+// compiled blocks saved for the next session
+static char code_filename[32];
 // for GetFInfo/SetFInfo
 static Str63 save_filename_p;
 
@@ -102,6 +105,8 @@ static void build_save_filename(void)
   // build Pascal string
   save_filename_p[0] = len;
   memcpy(&save_filename_p[1], save_filename, len);
+
+  sprintf(code_filename, "%s.jit", save_filename);
 }
 
 static pascal void VBLHandler(void)
@@ -345,6 +350,7 @@ void StartEmulation(void)
   }
 
   jit_init(&dmg);
+  disk_cache_open(code_filename, rom.data);
 
   if (audio_mac_init(&audio) && sound_enabled) {
     audio_mac_start();
@@ -616,14 +622,7 @@ void OnMenuAction(long action)
     } else if (item == EDIT_KEY_MAPPINGS) {
       ShowKeyMappingsDialog();
     } else if (item == EDIT_PREFERENCES) {
-      int old_cycles_per_exit = cycles_per_exit;
       ShowPreferencesDialog();
-      if (cycles_per_exit != old_cycles_per_exit && g_wp) {
-        if (!jit_clear_all_blocks()) {
-          // no-op. failure here causes the JIT to stop with a 
-          // status bar message, so no special error handling needed
-        }
-      }
     }
   }
 }
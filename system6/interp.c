@@ -0,0 +1,555 @@
+#include "types.h"
+#include "jit.h"
+#include "dmg.h"
+#include "instructions.h"
+#include "interp.h"
+
+// compiled code keeps F as the 68k CCR, so these are the CCR bits, not the
+// GB ones. H and N only matter for DAA, which gets them from daa_state
+#define FLAG_C 0x01
+#define FLAG_Z 0x04
+
+// same limit compile_block has on instructions per block
+#define MAX_RUN_LENGTH 255
+
+#define HIGH(x) (((x) >> 8) & 0xff)
+#define LOW(x) ((x) & 0xff)
+
+static u8 read8(struct jit_regs *regs, u16 address)
+{
+  u8 value;
+
+  // for DIV and LY, same as compile_slow_dmg_read
+  jit_ctx.read_cycles = regs->d2;
+  value = dmg_read(jit_ctx.dmg, address);
+  regs->d2 = jit_ctx.read_cycles;
+  return value;
+}
+
+static void write8(struct jit_regs *regs, u16 address, u8 value)
+{
+  // same as compile_slow_dmg_write, a write can move the next event
+  jit_ctx.read_cycles = regs->d2;
+  dmg_write(jit_ctx.dmg, address, value);
+  regs->d2 = jit_ctx.read_cycles;
+}
+
+static void ei_di(struct jit_regs *regs, int enabled)
+{
+  jit_ctx.read_cycles = regs->d2;
+  dmg_ei_di(jit_ctx.dmg, enabled);
+  regs->d2 = jit_ctx.read_cycles;
+}
+
+static u8 fetch8(struct jit_regs *regs, u16 *pc)
+{
+  return dmg_read(jit_ctx.dmg, (*pc)++);
+}
+
+static u16 fetch16(struct jit_regs *regs, u16 *pc)
+{
+  u8 lo = fetch8(regs, pc);
+  return fetch8(regs, pc) << 8 | lo;
+}
+
+static u16 get_bc(struct jit_regs *regs)
+{
+  return LOW(regs->d5 >> 16) << 8 | LOW(regs->d5);
+}
+
+static u16 get_de(struct jit_regs *regs)
+{
+  return LOW(regs->d6 >> 16) << 8 | LOW(regs->d6);
+}
+
+// BC and DE are split as 0x00HH00LL
+static void set_bc(struct jit_regs *regs, u16 value)
+{
+  regs->d5 = (u32) HIGH(value) << 16 | LOW(value);
+}
+
+static void set_de(struct jit_regs *regs, u16 value)
+{
+  regs->d6 = (u32) HIGH(value) << 16 | LOW(value);
+}
+
+static u16 get_hl(struct jit_regs *regs)
+{
+  return regs->a2 & 0xffff;
+}
+
+static void set_hl(struct jit_regs *regs, u16 value)
+{
+  regs->a2 = value;
+}
+
+// registers in opcode order: b, c, d, e, h, l, (hl), a
+static u8 get_r8(struct jit_regs *regs, int r)
+{
+  switch (r) {
+  case 0: return LOW(regs->d5 >> 16);
+  case 1: return LOW(regs->d5);
+  case 2: return LOW(regs->d6 >> 16);
+  case 3: return LOW(regs->d6);
+  case 4: return HIGH(regs->a2);
+  case 5: return LOW(regs->a2);
+  case 6: return read8(regs, get_hl(regs));
+  default: return LOW(regs->d4);
+  }
+}
+
+static void set_r8(struct jit_regs *regs, int r, u8 value)
+{
+  switch (r) {
+  case 0: regs->d5 = (regs->d5 & 0xff00ffff) | (u32) value << 16; break;
+  case 1: regs->d5 = (regs->d5 & 0xffffff00) | value; break;
+  case 2: regs->d6 = (regs->d6 & 0xff00ffff) | (u32) value << 16; break;
+  case 3: regs->d6 = (regs->d6 & 0xffffff00) | value; break;
+  case 4: set_hl(regs, value << 8 | LOW(regs->a2)); break;
+  case 5: set_hl(regs, (regs->a2 & 0xff00) | value); break;
+  case 6: write8(regs, get_hl(regs), value); break;
+  default: regs->d4 = (regs->d4 & 0xffffff00) | value; break;
+  }
+}
+
+static void set_flags(struct jit_regs *regs, int z, int c)
+{
+  regs->d7 = (z ? FLAG_Z : 0) | (c ? FLAG_C : 0);
+}
+
+// for instructions that leave C alone
+static void set_z_flag(struct jit_regs *regs, int z)
+{
+  set_flags(regs, z, regs->d7 & FLAG_C);
+}
+
+// same as compile_daa_track_add/sub
+static void track_daa(struct jit_regs *regs, int subtract)
+{
+  jit_ctx.daa_state[0] = LOW(regs->d4);
+  jit_ctx.daa_state[1] = subtract;
+}
+
+// same adjustment compile_daa makes, H comes from comparing nibbles with
+// the A saved before the last add or subtract
+static void daa(struct jit_regs *regs)
+{
+  u8 a = LOW(regs->d4);
+  u8 low = a & 0x0f, old_low = jit_ctx.daa_state[0] & 0x0f;
+  int carry = regs->d7 & FLAG_C;
+
+  if (!jit_ctx.daa_state[1]) {
+    if (carry || a > 0x99) {
+      a += 0x60;
+      carry = 1;
+    }
+    if (low < old_low || low > 9) {
+      a += 0x06;
+    }
+  } else {
+    if (carry) {
+      a -= 0x60;
+    }
+    if (low > old_low) {
+      a -= 0x06;
+    }
+  }
+
+  set_r8(regs, 7, a);
+  set_flags(regs, !a, carry);
+}
+
+// add, adc, sub, sbc, and, xor, or, cp in opcode order
+static void alu_op(struct jit_regs *regs, int op, u8 value)
+{
+  u8 a = LOW(regs->d4);
+  int carry = regs->d7 & FLAG_C;
+  int result;
+
+  switch (op) {
+  case 0: track_daa(regs, 0); result = a + value; break;
+  case 1: track_daa(regs, 0); result = a + value + carry; break;
+  case 2: track_daa(regs, 1); result = a - value; break;
+  case 3: track_daa(regs, 1); result = a - value - carry; break;
+  case 4: result = a & value; break;
+  case 5: result = a ^ value; break;
+  case 6: result = a | value; break;
+  default:
+    result = a - value;
+    set_flags(regs, !LOW(result), result & 0x100);
+    return;
+  }
+
+  set_r8(regs, 7, LOW(result));
+  set_flags(regs, !LOW(result), result & 0x100);
+}
+
+// rlc, rrc, rl, rr, sla, sra, swap, srl in opcode order
+static u8 shift_op(struct jit_regs *regs, int op, u8 value)
+{
+  int carry = regs->d7 & FLAG_C;
+  int out;
+  u8 result;
+
+  switch (op) {
+  case 0: out = value >> 7; result = value << 1 | out; break;
+  case 1: out = value & 1; result = value >> 1 | out << 7; break;
+  case 2: out = value >> 7; result = value << 1 | carry; break;
+  case 3: out = value & 1; result = value >> 1 | carry << 7; break;
+  case 4: out = value >> 7; result = value << 1; break;
+  case 5: out = value & 1; result = (value >> 1) | (value & 0x80); break;
+  case 6: out = 0; result = value << 4 | value >> 4; break;
+  default: out = value & 1; result = value >> 1; break;
+  }
+
+  set_flags(regs, !result, out);
+  return result;
+}
+
+static void cb_op(struct jit_regs *regs, u8 op)
+{
+  int r = op & 7, bit = (op >> 3) & 7;
+  u8 value = get_r8(regs, r);
+
+  switch (op >> 6) {
+  case 0:
+    set_r8(regs, r, shift_op(regs, bit, value));
+    break;
+  case 1: // bit
+    set_z_flag(regs, !(value & (1 << bit)));
+    break;
+  case 2: // res
+    set_r8(regs, r, value & ~(1 << bit));
+    break;
+  default: // set
+    set_r8(regs, r, value | (1 << bit));
+    break;
+  }
+}
+
+static void push16(struct jit_regs *regs, u16 value)
+{
+  jit_ctx.gb_sp -= 2;
+  write8(regs, jit_ctx.gb_sp, LOW(value));
+  write8(regs, jit_ctx.gb_sp + 1, HIGH(value));
+}
+
+static u16 pop16(struct jit_regs *regs)
+{
+  u8 lo = read8(regs, jit_ctx.gb_sp);
+  u8 hi = read8(regs, jit_ctx.gb_sp + 1);
+
+  jit_ctx.gb_sp += 2;
+  return hi << 8 | lo;
+}
+
+// Native pushes through A3 skip the code page checks, so a WRAM stack on or
+// just above a page with compiled code has to take the slow path
+static int stack_over_code(struct dmg *dmg, u16 sp)
+{
+  int page = (u16) (sp - 1) >> 8;
+
+  return dmg_is_code_page(dmg, page) || dmg_is_code_page(dmg, page - 1);
+}
+
+void interp_sync_sp(struct jit_regs *regs)
+{
+  struct dmg *dmg = jit_ctx.dmg;
+  u16 sp = jit_ctx.gb_sp;
+
+  if (sp >= 0xc000 && sp <= 0xe000) {
+    regs->a3 = (unsigned long) dmg->main_ram + (sp - 0xc000);
+    jit_ctx.stack_in_ram = !stack_over_code(dmg, sp);
+  } else if (sp >= 0xff80 && sp <= 0xfffe) {
+    regs->a3 = (unsigned long) dmg->zero_page + (sp - 0xff80);
+    jit_ctx.stack_in_ram = 1;
+  } else {
+    regs->a3 = sp;
+    jit_ctx.stack_in_ram = 0;
+  }
+}
+
+// add sp, i8 and ld hl, sp+i8, C comes from the low byte
+static u16 sp_plus_offset(struct jit_regs *regs, s8 offset)
+{
+  u16 sp = jit_ctx.gb_sp;
+
+  set_flags(regs, 0, LOW(sp) + (u8) offset > 0xff);
+  return sp + offset;
+}
+
+static int condition(struct jit_regs *regs, u8 op)
+{
+  switch ((op >> 3) & 3) {
+  case 0: return !(regs->d7 & FLAG_Z);
+  case 1: return regs->d7 & FLAG_Z;
+  case 2: return !(regs->d7 & FLAG_C);
+  default: return regs->d7 & FLAG_C;
+  }
+}
+
+int interp_run(struct jit_regs *regs)
+{
+  u16 pc = regs->d3, target, value;
+  int count, done = 0, ok = 1;
+  u32 frame_cycles;
+  u8 op;
+
+  for (count = 0; !done && count < MAX_RUN_LENGTH; count++) {
+    u16 op_pc = pc;
+
+    op = fetch8(regs, &pc);
+    if (op != 0xcb) {
+      regs->d2 -= instructions[op].cycles;
+    }
+
+    switch (op) {
+    case 0x00: // nop
+      break;
+
+    case 0x01: set_bc(regs, fetch16(regs, &pc)); break;
+    case 0x11: set_de(regs, fetch16(regs, &pc)); break;
+    case 0x21: set_hl(regs, fetch16(regs, &pc)); break;
+    case 0x31: jit_ctx.gb_sp = fetch16(regs, &pc); break;
+
+    case 0x02: write8(regs, get_bc(regs), LOW(regs->d4)); break;
+    case 0x12: write8(regs, get_de(regs), LOW(regs->d4)); break;
+    case 0x0a: set_r8(regs, 7, read8(regs, get_bc(regs))); break;
+    case 0x1a: set_r8(regs, 7, read8(regs, get_de(regs))); break;
+
+    case 0x22: // ld (hl+), a
+      write8(regs, get_hl(regs), LOW(regs->d4));
+      set_hl(regs, get_hl(regs) + 1);
+      break;
+    case 0x32: // ld (hl-), a
+      write8(regs, get_hl(regs), LOW(regs->d4));
+      set_hl(regs, get_hl(regs) - 1);
+      break;
+    case 0x2a: // ld a, (hl+)
+      set_r8(regs, 7, read8(regs, get_hl(regs)));
+      set_hl(regs, get_hl(regs) + 1);
+      break;
+    case 0x3a: // ld a, (hl-)
+      set_r8(regs, 7, read8(regs, get_hl(regs)));
+      set_hl(regs, get_hl(regs) - 1);
+      break;
+
+    case 0x03: set_bc(regs, get_bc(regs) + 1); break;
+    case 0x13: set_de(regs, get_de(regs) + 1); break;
+    case 0x23: set_hl(regs, get_hl(regs) + 1); break;
+    case 0x33: jit_ctx.gb_sp++; break;
+    case 0x0b: set_bc(regs, get_bc(regs) - 1); break;
+    case 0x1b: set_de(regs, get_de(regs) - 1); break;
+    case 0x2b: set_hl(regs, get_hl(regs) - 1); break;
+    case 0x3b: jit_ctx.gb_sp--; break;
+
+    case 0x04: case 0x0c: case 0x14: case 0x1c:
+    case 0x24: case 0x2c: case 0x34: case 0x3c: // inc r
+      if (op == 0x3c) {
+        track_daa(regs, 0);
+      }
+      value = LOW(get_r8(regs, op >> 3) + 1);
+      set_r8(regs, op >> 3, value);
+      set_z_flag(regs, !value);
+      break;
+
+    case 0x05: case 0x0d: case 0x15: case 0x1d:
+    case 0x25: case 0x2d: case 0x35: case 0x3d: // dec r
+      if (op == 0x3d) {
+        track_daa(regs, 1);
+      }
+      value = LOW(get_r8(regs, op >> 3) - 1);
+      set_r8(regs, op >> 3, value);
+      set_z_flag(regs, !value);
+      break;
+
+    case 0x06: case 0x0e: case 0x16: case 0x1e:
+    case 0x26: case 0x2e: case 0x36: case 0x3e: // ld r, u8
+      set_r8(regs, op >> 3, fetch8(regs, &pc));
+      break;
+
+    case 0x07: case 0x0f: case 0x17: case 0x1f: // rlca, rrca, rla, rra
+      set_r8(regs, 7, shift_op(regs, op >> 3, LOW(regs->d4)));
+      set_z_flag(regs, 0);
+      break;
+
+    case 0x08: // ld (u16), sp
+      target = fetch16(regs, &pc);
+      write8(regs, target, LOW(jit_ctx.gb_sp));
+      write8(regs, target + 1, HIGH(jit_ctx.gb_sp));
+      break;
+
+    case 0x09: case 0x19: case 0x29: case 0x39: // add hl, rr
+      {
+        u32 sum = get_hl(regs);
+
+        switch (op) {
+        case 0x09: sum += get_bc(regs); break;
+        case 0x19: sum += get_de(regs); break;
+        case 0x29: sum += get_hl(regs); break;
+        default: sum += jit_ctx.gb_sp; break;
+        }
+        set_hl(regs, sum);
+        set_flags(regs, regs->d7 & FLAG_Z, sum > 0xffff);
+      }
+      break;
+
+    case 0x10: // stop
+      regs->d3 = HALT_SENTINEL;
+      interp_sync_sp(regs);
+      return 1;
+
+    case 0x18: // jr i8
+      target = pc + (s8) fetch8(regs, &pc);
+      pc = target;
+      done = 1;
+      break;
+
+    case 0x20: case 0x28: case 0x30: case 0x38: // jr cc, i8
+      target = pc + (s8) fetch8(regs, &pc);
+      if (condition(regs, op)) {
+        regs->d2 -= instructions[op].cycles_branch - instructions[op].cycles;
+        pc = target;
+        done = 1;
+      }
+      break;
+
+    case 0x27: daa(regs); break;
+    case 0x2f: set_r8(regs, 7, ~regs->d4); break; // cpl
+    case 0x37: regs->d7 |= FLAG_C; break; // scf
+    case 0x3f: regs->d7 ^= FLAG_C; break; // ccf
+
+    case 0x76: // halt, skips ahead to vblank the same way compile_halt does
+      frame_cycles = *jit_ctx.frame_cycles_ptr;
+      if (frame_cycles < 65664) {
+        regs->d2 = jit_ctx.event_cycles - (65664 - frame_cycles);
+      } else {
+        regs->d2 = jit_ctx.event_cycles - (70224 + 65664 - frame_cycles);
+      }
+      done = 1;
+      break;
+
+    case 0xc0: case 0xc8: case 0xd0: case 0xd8: // ret cc
+      if (condition(regs, op)) {
+        regs->d2 -= instructions[op].cycles_branch - instructions[op].cycles;
+        pc = pop16(regs);
+        done = 1;
+      }
+      break;
+
+    case 0xd9: // reti
+      ei_di(regs, 1);
+      // fall through
+    case 0xc9: // ret
+      pc = pop16(regs);
+      done = 1;
+      break;
+
+    case 0xc2: case 0xca: case 0xd2: case 0xda: // jp cc, u16
+      target = fetch16(regs, &pc);
+      if (condition(regs, op)) {
+        regs->d2 -= instructions[op].cycles_branch - instructions[op].cycles;
+        pc = target;
+        done = 1;
+      }
+      break;
+
+    case 0xc3: // jp u16
+      pc = fetch16(regs, &pc);
+      done = 1;
+      break;
+
+    case 0xe9: // jp (hl)
+      pc = get_hl(regs);
+      done = 1;
+      break;
+
+    case 0xc4: case 0xcc: case 0xd4: case 0xdc: // call cc, u16
+      target = fetch16(regs, &pc);
+      if (condition(regs, op)) {
+        regs->d2 -= instructions[op].cycles_branch - instructions[op].cycles;
+        push16(regs, pc);
+        pc = target;
+        done = 1;
+      }
+      break;
+
+    case 0xcd: // call u16
+      target = fetch16(regs, &pc);
+      push16(regs, pc);
+      pc = target;
+      done = 1;
+      break;
+
+    case 0xc7: case 0xcf: case 0xd7: case 0xdf:
+    case 0xe7: case 0xef: case 0xf7: case 0xff: // rst
+      push16(regs, pc);
+      pc = op & 0x38;
+      done = 1;
+      break;
+
+    case 0xc1: set_bc(regs, pop16(regs)); break;
+    case 0xd1: set_de(regs, pop16(regs)); break;
+    case 0xe1: set_hl(regs, pop16(regs)); break;
+    case 0xf1: // pop af
+      value = pop16(regs);
+      set_r8(regs, 7, HIGH(value));
+      regs->d7 = LOW(value);
+      break;
+
+    case 0xc5: push16(regs, get_bc(regs)); break;
+    case 0xd5: push16(regs, get_de(regs)); break;
+    case 0xe5: push16(regs, get_hl(regs)); break;
+    case 0xf5: push16(regs, LOW(regs->d4) << 8 | LOW(regs->d7)); break;
+
+    case 0xc6: case 0xce: case 0xd6: case 0xde:
+    case 0xe6: case 0xee: case 0xf6: case 0xfe: // alu a, u8
+      alu_op(regs, (op >> 3) & 7, fetch8(regs, &pc));
+      break;
+
+    case 0xcb:
+      op = fetch8(regs, &pc);
+      regs->d2 -= instructions[0x100 + op].cycles;
+      cb_op(regs, op);
+      break;
+
+    case 0xe0: write8(regs, 0xff00 | fetch8(regs, &pc), LOW(regs->d4)); break;
+    case 0xf0: set_r8(regs, 7, read8(regs, 0xff00 | fetch8(regs, &pc))); break;
+    case 0xe2: write8(regs, 0xff00 | LOW(regs->d5), LOW(regs->d4)); break;
+    case 0xf2: set_r8(regs, 7, read8(regs, 0xff00 | LOW(regs->d5))); break;
+    case 0xea: write8(regs, fetch16(regs, &pc), LOW(regs->d4)); break;
+    case 0xfa: set_r8(regs, 7, read8(regs, fetch16(regs, &pc))); break;
+
+    case 0xe8: // add sp, i8
+      jit_ctx.gb_sp = sp_plus_offset(regs, fetch8(regs, &pc));
+      break;
+    case 0xf8: // ld hl, sp+i8
+      set_hl(regs, sp_plus_offset(regs, fetch8(regs, &pc)));
+      break;
+    case 0xf9: // ld sp, hl
+      jit_ctx.gb_sp = get_hl(regs);
+      break;
+
+    case 0xf3: ei_di(regs, 0); break; // di
+    case 0xfb: ei_di(regs, 1); break; // ei
+
+    default:
+      if (op >= 0x40 && op < 0x80) {
+        // ld r, r (halt was handled above)
+        set_r8(regs, (op >> 3) & 7, get_r8(regs, op & 7));
+      } else if (op >= 0x80 && op < 0xc0) {
+        alu_op(regs, (op >> 3) & 7, get_r8(regs, op & 7));
+      } else {
+        // the 11 unused opcodes
+        pc = op_pc;
+        done = 1;
+        ok = 0;
+      }
+      break;
+    }
+  }
+
+  regs->d3 = pc;
+  interp_sync_sp(regs);
+  return ok;
+}
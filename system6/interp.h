@@ -0,0 +1,20 @@
+#ifndef _INTERP_H
+#define _INTERP_H
+
+#include "types.h"
+
+struct jit_regs;
+
+// Run the GB code at regs->d3 until it branches somewhere, keeping state in
+// the same registers and jit_ctx fields compiled code uses, so either one
+// can pick up where the other left off. regs->d3 is the next PC after, or
+// HALT_SENTINEL for STOP. Returns 0 on an illegal opcode, with regs->d3
+// pointing at it
+int interp_run(struct jit_regs *regs);
+
+// Point A3 at the stack the same way compile_ld_sp_imm16 would for SP, so
+// compiled code can push and pop natively again. Stays on the slow path
+// while the stack is over compiled RAM code, so pushes can invalidate it
+void interp_sync_sp(struct jit_regs *regs);
+
+#endif
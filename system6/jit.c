@@ -16,6 +16,8 @@
 #include "debug.h"
 #include "arena.h"
 #include "cpu_cache.h"
+#include "disk_cache.h"
+#include "interp.h"
 
 static u32 time_in_jit = 0;
 static u32 time_in_sync = 0;
@@ -24,14 +26,23 @@ static u32 last_report_tick = 0;
 
 int dmg_reads, dmg_writes;
 
-// register state that persists between block executions
-struct {
-  u32 d2; // accumulated cycles, output
-  u32 d3; // next pc, output only
-  u32 d4, d5, d6, d7; // a, bc, de, f
-  u32 a2, a3, a4; // hl, sp, ctx
-  u32 a5, a6; // read_page, write_page
-} jit_regs;
+// what each block cost before blocks were trimmed to their emitted size
+#define FIXED_BLOCK_SIZE \
+  (sizeof(struct code_block) + MAX_BLOCK_CODE + 256 * sizeof(u16))
+
+// arena bytes saved by variable-length blocks since the last reset
+static u32 bytes_saved = 0;
+
+struct jit_regs jit_regs;
+
+// code is interpreted until it has started this many runs, so things that
+// only happen once, like intros and decompression, don't take up the arena
+#define COMPILE_THRESHOLD 8
+
+// runs started at each PC, hashed with the bank. a collision just means
+// something gets compiled a bit early
+#define EXEC_COUNT_SIZE 4096
+static u8 exec_counts[EXEC_COUNT_SIZE];
 
 // exposed to main emulator.c
 jit_context jit_ctx;
@@ -80,6 +91,90 @@ static void sync_cache_pointers(void)
   cache_get_arrays(&jit_ctx.bank0_cache, &jit_ctx.banked_cache, &jit_ctx.upper_cache);
 }
 
+// Make the dmg's code page bits match the RAM blocks that are still
+// compiled, so pages without code go back to fast writes
+static void sync_code_pages(void)
+{
+  struct dmg *dmg = jit_ctx.dmg;
+  int page;
+
+  for (page = 0x80; page <= 0xff; page++) {
+    if (dmg_is_code_page(dmg, page) && !cache_page_has_code(page)) {
+      dmg_set_code_page(dmg, page, 0);
+    }
+  }
+}
+
+// Route writes to the pages a RAM block was compiled from to the slow path
+static void mark_code_pages(struct dmg *dmg, struct code_block *block)
+{
+  u32 page, last = (u32) (block->end_address - 1) >> 8;
+
+  // end_address wraps to 0 for a block that runs up to 0xffff
+  if (block->end_address <= block->src_address) {
+    last = 0xff;
+  }
+  for (page = block->src_address >> 8; page <= last; page++) {
+    dmg_set_code_page(dmg, page, 1);
+  }
+}
+
+// Code that already ran was rewritten, by compiling over freed memory or
+// putting linked exits back, so the I-cache can't keep the old version
+static void flush_code_cache(void)
+{
+  if (TrapAvailable(_CacheFlush)) {
+    FlushCodeCache();
+  }
+}
+
+// Point every shadow return entry back at the dispatcher. Entries hold
+// code inside other blocks, so this has to happen whenever one is freed
+static void forget_returns(void)
+{
+  int k;
+
+  for (k = 0; k < RET_STACK_SIZE; k++) {
+    jit_ctx.ret_stack[k].gb_pc = 0;
+    jit_ctx.ret_stack[k].code = jit_ctx.dispatcher_return;
+  }
+  jit_ctx.ret_top = 0;
+}
+
+// Called from a jp (hl) none of whose slots matched, see compile_jp_hl.
+// Returns the code for pc after giving it a slot if there's one free, or
+// NULL if it isn't compiled so the dispatcher sends it back to C
+static void *jp_hl_miss(u8 *slots, u16 pc)
+{
+  void *code = cache_lookup(pc, jit_ctx.current_rom_bank);
+  u8 *slot;
+
+  jit_ctx.jp_hl_misses++;
+  if (!code) {
+    return NULL;
+  }
+  cache_mark_used(pc);
+
+  slot = block_link_jp_hl(slots, pc, jit_ctx.current_rom_bank, code);
+  if (slot) {
+    cache_link(slot, code);
+    flush_code_cache();
+  }
+  return code;
+}
+
+// called from dmg_write_slow when a page with compiled code is written
+static void on_code_write(u16 start, u16 length)
+{
+  if (cache_invalidate_ram(start, length)) {
+    sync_code_pages();
+    forget_returns();
+    // this goes straight back into compiled code, which may have been
+    // linked to the blocks that were just taken out
+    flush_code_cache();
+  }
+}
+
 // Initialize JIT state for a new emulation session
 void jit_init(struct dmg *dmg)
 {
@@ -107,6 +202,7 @@ void jit_init(struct dmg *dmg)
   compile_ctx.alloc = arena_alloc;
   compile_ctx.wram_base = dmg->main_ram;
   compile_ctx.hram_base = dmg->zero_page;
+  compile_ctx.vram_base = dmg->video_ram;
 
   jit_ctx.dmg = dmg;
   jit_ctx.read_func = dmg_read;
@@ -114,14 +210,26 @@ void jit_init(struct dmg *dmg)
   jit_ctx.read16_func = dmg_read16;
   jit_ctx.write16_func = dmg_write16;
   jit_ctx.ei_di_func = dmg_ei_di;
+  jit_ctx.copy_func = dmg_copy;
+  jit_ctx.fill_func = dmg_fill;
   jit_ctx.current_rom_bank = 1; // bank 1 is default after boot
   jit_ctx.dispatcher_return = get_dispatcher_code();
   jit_ctx.patch_helper = get_patch_helper_code();
   jit_ctx.frame_cycles_ptr = &dmg->frame_cycles;
+  jit_ctx.page_use = cache_get_page_use();
+  jit_ctx.link_func = cache_link;
+  jit_ctx.jp_hl_func = jp_hl_miss;
+  jit_ctx.jp_hl_runs = 0;
+  jit_ctx.jp_hl_misses = 0;
+  dmg->code_write_hook = on_code_write;
   jit_ctx.gb_sp = 0xfffe;  // initial SP (HRAM, slow mode)
   jit_ctx.stack_in_ram = 0;   // slow mode - A3 holds GB SP
+  jit_ctx.read_cycles = jit_ctx.event_cycles; // nothing in flight
+  dmg_schedule(dmg);          // event_cycles
   sync_cache_pointers();
+  forget_returns();
 
+  jit_regs.d2 = jit_ctx.read_cycles; // budget to the first event
   jit_regs.d3 = 0x100; // initial PC
   jit_regs.a3 = 0xfffe; // initial SP
   jit_regs.a4 = (unsigned long) &jit_ctx;
@@ -134,12 +242,17 @@ void jit_init(struct dmg *dmg)
 int jit_clear_all_blocks(void)
 {
   arena_reset();
+  bytes_saved = 0;
+  // everything has to prove it's hot again
+  memset(exec_counts, 0, sizeof exec_counts);
   if (!cache_init()) {
     set_status_bar("Cache alloc fail");
     jit_halted = 1;
     return 0;
   }
   sync_cache_pointers();
+  sync_code_pages();
+  forget_returns();
   return 1;
 }
 
@@ -171,10 +284,35 @@ static void check_interrupts(struct dmg *dmg)
   }
 }
 
+// Count a run starting at pc, returns 1 once it's been run enough times to
+// be worth compiling
+static int count_run(u16 pc, u8 bank)
+{
+  u8 *count;
+
+  // HRAM is written by ldh, fixed-address stores and pushes with SP in
+  // HRAM, none of which look at the code page map, so a compiled copy
+  // could go stale. Code there (the OAM DMA routine) is short and stays
+  // interpreted
+  if (pc >= 0xff80) {
+    return 0;
+  }
+  if (pc < 0x4000 || pc >= 0x8000) {
+    bank = 0;
+  }
+  count = &exec_counts[(pc ^ bank << 6) & (EXEC_COUNT_SIZE - 1)];
+  if (*count >= COMPILE_THRESHOLD) {
+    return 1;
+  }
+  (*count)++;
+  return 0;
+}
+
 static void update_profiling_status_bar(u32 frames_now)
 {
   char buf[64];
   static u32 last_jit = 0, last_sync = 0, last_frames_rendered = 0;
+  static u32 last_jp_hl_runs = 0, last_jp_hl_misses = 0;
 
   u32 now = TickCount();
   u32 elapsed = now - last_report_tick;
@@ -186,15 +324,22 @@ static void update_profiling_status_bar(u32 frames_now)
   u32 pct_jit = elapsed > 0 ? (d_jit * 100) / elapsed : 0;
   u32 pct_sync = elapsed > 0 ? (d_sync * 100) / elapsed : 0;
 
+  // share of jp (hl)s that found their target in one of the inline slots
+  u32 d_runs = jit_ctx.jp_hl_runs - last_jp_hl_runs;
+  u32 d_misses = jit_ctx.jp_hl_misses - last_jp_hl_misses;
+  u32 pct_ic = d_runs > 0 ? ((d_runs - d_misses) * 100) / d_runs : 100;
+
   u32 frames_delta = frames_now - last_frames_rendered;
   u32 fps = elapsed > 0 ? (frames_delta * 60) / elapsed : 0;
   last_frames_rendered = frames_now;
 
   last_jit = time_in_jit;
   last_sync = time_in_sync;
+  last_jp_hl_runs = jit_ctx.jp_hl_runs;
+  last_jp_hl_misses = jit_ctx.jp_hl_misses;
   last_report_tick = now;
 
-  sprintf(buf, "%lu FPS (J: %lu, S: %lu)", fps, pct_jit, pct_sync);
+  sprintf(buf, "%lu FPS (J: %lu, S: %lu, IC: %lu)", fps, pct_jit, pct_sync, pct_ic);
   set_status_bar(buf);
 }
 
@@ -209,24 +354,51 @@ int jit_run(struct dmg *dmg)
       return 0;
   }
 
+  // blocks dropped by RAM writes during the last run. a call made since
+  // on_code_write could have pushed a return into one of them
+  if (cache_reap()) {
+    forget_returns();
+    flush_code_cache();
+  }
+
   // look up or compile block
   t0 = TickCount();
   code = cache_lookup(jit_regs.d3, jit_ctx.current_rom_bank);
 
+  block = NULL;
   if (!code) {
-    sprintf(buf, "$%02x:%04x %luk/%luk",
+    compile_ctx.current_bank = jit_ctx.current_rom_bank;
+    // compiled by an earlier session
+    block = disk_cache_load(jit_regs.d3, jit_ctx.current_rom_bank, &compile_ctx);
+  }
+
+  // otherwise it's interpreted until it has run enough to be worth compiling
+  if (!code && (block || count_run(jit_regs.d3, jit_ctx.current_rom_bank))) {
+    sprintf(buf, "$%02x:%04x %luk/%luk (%luk saved)",
       jit_ctx.current_rom_bank, 
       jit_regs.d3, 
       arena_remaining() / 1024, 
-      arena_size() / 1024
+      arena_size() / 1024,
+      bytes_saved / 1024
     );
     set_status_bar(buf);
 
-    compile_ctx.current_bank = jit_ctx.current_rom_bank;
-    block = compile_block(jit_regs.d3, &compile_ctx);
+    if (!block) {
+      block = compile_block(jit_regs.d3, &compile_ctx);
+    }
+
+    if (!block) {
+      // arena full, evict blocks that haven't run lately and retry
+      if (cache_evict_cold()) {
+        sync_code_pages();
+        forget_returns();
+        flush_code_cache();
+        block = compile_block(jit_regs.d3, &compile_ctx);
+      }
+    }
 
     if (!block) {
-      // arena full, reset and retry once
+      // still full, reset and retry once
       if (!jit_clear_all_blocks()) {
         return 0;
       }
@@ -251,37 +423,69 @@ int jit_run(struct dmg *dmg)
     if (!cache_store(jit_regs.d3, jit_ctx.current_rom_bank, block->code)) {
       // this means this was the first block to be stored for a given bank, 
       // and the bank cache array couldn't be allocated. unrecoverable OOM?
-      // i'm not actually sure...
-      if (!jit_clear_all_blocks()) {
-        return 0;
-      }
+      // i'm not actually sure... try freeing cold blocks first. the new
+      // block isn't tracked yet so it can't be evicted
+      cache_evict_cold();
+      sync_code_pages();
+      forget_returns();
+      flush_code_cache();
 
-      // try again
       if (!cache_store(jit_regs.d3, jit_ctx.current_rom_bank, block->code)) {
-        // something is really wrong
-        sprintf(buf, "JIT: bank array fail pc=%04x", jit_regs.d3);
-        set_status_bar(buf);
-        jit_halted = 1;
-        return 0;
+        // the block lives in the arena too, so it has to be compiled again
+        if (!jit_clear_all_blocks()) {
+          return 0;
+        }
+
+        block = compile_block(jit_regs.d3, &compile_ctx);
+        if (!block || !cache_store(jit_regs.d3, jit_ctx.current_rom_bank, block->code)) {
+          // something is really wrong
+          sprintf(buf, "JIT: bank array fail pc=%04x", jit_regs.d3);
+          set_status_bar(buf);
+          jit_halted = 1;
+          return 0;
+        }
       }
 
       // recovered
     }
 
-    if (TrapAvailable(_CacheFlush)) {
-      // for 68040. 68030 needed a cache flush when blocks were patched, but
-      // 040 needs it here too because the caches are copy-back, so the code that
-      // was just compiled isn't necessarily in main memory yet, and it won't
-      // look in the data cache for instructions, just the instruction cache.
-      // see Apple Technical Note HW06: Cache As Cache Can
-      FlushCodeCache();
+    cache_add_block(block);
+    if (block->src_address >= 0x8000) {
+      mark_code_pages(dmg, block);
     }
+    bytes_saved += FIXED_BLOCK_SIZE - block_size(block);
+#ifdef DEBUG_COMPILE
+    sprintf(buf, "block $%02x:%04x %lu bytes, %lu saved", 
+      jit_ctx.current_rom_bank, jit_regs.d3, 
+      (u32) block_size(block), (u32) (FIXED_BLOCK_SIZE - block_size(block)));
+    debug_log_string(buf);
+#endif
+
+    // for 68040. 68030 needed a cache flush when blocks were patched, but
+    // 040 needs it here too because the caches are copy-back, so the code that
+    // was just compiled isn't necessarily in main memory yet, and it won't
+    // look in the data cache for instructions, just the instruction cache.
+    // see Apple Technical Note HW06: Cache As Cache Can
+    flush_code_cache();
 
     code = block->code;
   }
 
+  // a block that was just compiled under the stack, or an ld sp in the
+  // code that ran last, can leave native pushes writing over RAM code
+  interp_sync_sp(&jit_regs);
+
   t1 = TickCount();
-  enter_asm_world(code);
+  if (code) {
+    cache_mark_used(jit_regs.d3);
+    enter_asm_world(code);
+  } else if (!interp_run(&jit_regs)) {
+    sprintf(buf, "Error pc=%02x:%04x op=%02x", jit_ctx.current_rom_bank,
+              (u16) jit_regs.d3, dmg_read(dmg, jit_regs.d3));
+    set_status_bar(buf);
+    jit_halted = 1;
+    return 0;
+  }
   t2 = TickCount();
 
   // Get next PC from D3
@@ -291,12 +495,18 @@ int jit_run(struct dmg *dmg)
       return 0;
   }
 
-  // sync hardware with cycles accumulated by compiled code
-  dmg_sync_hw(dmg, jit_regs.d2);
+  // sync hardware with cycles used by compiled or interpreted code, which
+  // counted D2 down from event_cycles
+  dmg_sync_hw(dmg, jit_ctx.event_cycles - jit_regs.d2);
+  // none in flight from here
+  jit_ctx.read_cycles = jit_ctx.event_cycles;
   if (dmg->interrupt_enable) {
     check_interrupts(dmg);
   }
-  jit_regs.d2 = 0;
+  // after the interrupt is taken, so compiled code doesn't come straight
+  // back out for it
+  dmg_schedule(dmg);
+  jit_regs.d2 = jit_ctx.read_cycles;
 
   t3 = TickCount();
   time_in_jit += t2 - t1;
@@ -312,6 +522,13 @@ int jit_run(struct dmg *dmg)
 
 void jit_cleanup(void)
 {
+  // blocks live in the arena, so they have to be saved first
+  if (arena_size()) {
+    disk_cache_save(&compile_ctx);
+  } else {
+    disk_cache_close();
+  }
+
   // we need this memory back to load the next ROM
   arena_destroy();
 }
\ No newline at end of file
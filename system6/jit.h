@@ -3,6 +3,7 @@
 
 #include "types.h"
 #include "dmg.h"
+#include "compiler.h"
 
 #define HALT_SENTINEL 0xffffffff
 
@@ -23,16 +24,40 @@ typedef struct {
     /* 28 */ void *write16_func;
     /* 2c */ u32 cycles_accumulated;  // GB cycles accumulated by compiled code
     /* 30 */ void *patch_helper;  // patch_helper routine for lazy block patching
-    /* 34 */ u32 read_cycles; // in-flight cycles at time of dmg_read call
-    /* 38 */ u32 _pad2;
+    /* 34 */ u32 read_cycles; // D2 at a call into C, and what it goes back to
+    /* 38 */ u8 daa_state[2]; // old A and N flag from the last add/sub, for DAA
+    /* 3a */ u8 _pad2[2];
     /* 3c */ u32 *frame_cycles_ptr; // pointer to dmg->frame_cycles for HALT
-    /* 40 */ u32 temp1;
-    /* 44 */ u32 temp2;
+    /* 40 */ u8 *page_use; // set by dispatcher, see cache_evict_cold
+    /* 44 */ void *link_func; // cache_link, called by patch_helper
     /* 48 */ u16 gb_sp; // GB stack pointer value (always valid)
     /* 4a */ u16 _pad3;
     /* 4c */ long stack_in_ram; // non-zero if A3 points to native WRAM/HRAM
+    /* 50 */ void *copy_func;
+    /* 54 */ void *fill_func;
+    /* 58 */ volatile u32 event_cycles; // cycles from the last sync to the next event, D2 counts down from here
+    /* 5c */ u8 ret_top; // offset of the newest ret_stack entry, wraps as a byte
+    /* 5d */ u8 _pad4[3];
+    /* 60 */ struct {
+        u16 gb_pc; // address the call pushed
+        u16 _pad;
+        void *code; // exits to gb_pc, or dispatcher_return
+    } ret_stack[RET_STACK_SIZE]; // shadow of the GB stack, see compile_push_return
+    /* 160 */ void *jp_hl_func; // jp_hl_miss, called when no jp (hl) slot matches
+    /* 164 */ u32 jp_hl_runs; // jp (hl)s run
+    /* 168 */ u32 jp_hl_misses; // and how many of them missed the slots
 } jit_context;
 
+// register state that persists between block executions, loaded and saved
+// with movem by enter_asm_world so the order matters
+struct jit_regs {
+    u32 d2; // cycles left before the next event
+    u32 d3; // next pc, output only
+    u32 d4, d5, d6, d7; // a, bc, de, f
+    u32 a2, a3, a4; // hl, sp, ctx
+    u32 a5, a6; // read_page, write_page
+};
+
 extern jit_context jit_ctx;
 extern int jit_halted;
 extern int dmg_reads, dmg_writes;
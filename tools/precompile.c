@@ -0,0 +1,553 @@
+/* Game Boy emulator for 68k Macs
+   precompile.c - crawls a ROM from its entry points and compiles every
+   block it can find into a .jit file, the same kind the emulator writes
+   in disk_cache.c. Put it next to the ROM's save and the emulator won't
+   have to compile that code while the game is running. */
+
+// Runs on the machine you build on, not the Mac:
+//
+//   gcc -O2 -I../compiler -I../src -I../system6 -o precompile precompile.c ../compiler/*.c
+//   ./precompile game.gb [out.jit]
+//   ./precompile -d [bank:]address game.gb
+//
+// -d prints the IR for the block at address (hex) before and after each
+// pass instead of writing anything. bank is the one mapped at 0x4000,
+// 1 if it's left out
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "compiler.h"
+#include "disk_cache.h"
+#include "instructions.h"
+#include "ir.h"
+#include "jump_tables.h"
+
+// only the offset from these ends up in the file, but ld sp needs a
+// nonzero base to compile the fast WRAM/HRAM stack like the Mac does
+#define FAKE_WRAM_BASE ((void *) 0x100000)
+#define FAKE_HRAM_BASE ((void *) 0x200000)
+#define FAKE_VRAM_BASE ((void *) 0x300000)
+
+#define MAX_BANKS 256
+#define MAX_UNRESOLVED 64
+
+struct rom_image {
+    u8 *data;
+    u32 length;
+    int num_banks;
+    // bank mapped at 0x4000-0x7fff
+    int bank;
+};
+
+// somewhere to compile, and the bank that was mapped when we got there
+struct work_item {
+    u16 pc;
+    u8 bank;
+};
+
+struct saved_block {
+    struct disk_cache_entry entry;
+    u8 *data;
+};
+
+static struct rom_image rom;
+
+static struct work_item *queue;
+static u32 queue_len, queue_cap;
+
+// by bank * 0x8000 + pc. crawled is per bank for bank 0 code too, since
+// what it jumps to in the banked region depends on the caller's bank
+static u8 *crawled;
+static u8 *compiled;
+
+static struct saved_block *blocks;
+static u32 num_blocks, blocks_cap;
+
+static u32 bank_blocks[MAX_BANKS];
+static u32 bank_gb_bytes[MAX_BANKS];
+static u32 bank_m68k_bytes[MAX_BANKS];
+static u32 failed_blocks, unsaved_blocks;
+
+static struct work_item unresolved[MAX_UNRESOLVED];
+static u32 num_unresolved, num_ram_targets;
+
+static void *checked_realloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if (!ptr) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+static u8 rom_read(void *dmg, u16 address)
+{
+    u32 offset;
+
+    (void) dmg;
+    if (address < 0x4000) {
+        offset = address;
+    } else if (address < 0x8000) {
+        offset = (u32) rom.bank * 0x4000 + (address - 0x4000);
+    } else {
+        // not ROM, compile_block will run into garbage and stop
+        return 0xd3;
+    }
+    return offset < rom.length ? rom.data[offset] : 0xff;
+}
+
+static u32 crawl_key(u8 bank, u16 pc)
+{
+    return (u32) bank * 0x8000 + pc;
+}
+
+// bank a target is saved under, 0 for anything below 0x4000
+static u8 code_bank(u8 bank, u16 pc)
+{
+    return pc < 0x4000 ? 0 : bank;
+}
+
+// what an MBC does with a write to 0x2000-0x3fff
+static u8 select_bank(int value)
+{
+    value %= rom.num_banks;
+    return value ? value : 1;
+}
+
+static void add_target(u16 pc, u8 bank)
+{
+    if (pc >= 0x8000) {
+        num_ram_targets++;
+        return;
+    }
+    if (crawled[crawl_key(bank, pc)]) {
+        return;
+    }
+    crawled[crawl_key(bank, pc)] = 1;
+
+    if (queue_len == queue_cap) {
+        queue_cap = queue_cap ? queue_cap * 2 : 1024;
+        queue = checked_realloc(queue, queue_cap * sizeof *queue);
+    }
+    queue[queue_len].pc = pc;
+    queue[queue_len].bank = bank;
+    queue_len++;
+}
+
+static void add_unresolved(u16 pc, u8 bank)
+{
+    if (num_unresolved < MAX_UNRESOLVED) {
+        unresolved[num_unresolved].pc = pc;
+        unresolved[num_unresolved].bank = bank;
+    }
+    num_unresolved++;
+}
+
+// whether an instruction leaves A alone, for following ld a,n to a bank
+// select write a few instructions later
+static int keeps_a(u8 op)
+{
+    switch (op) {
+    case 0x00: case 0x01: case 0x02: case 0x06: case 0x0e: case 0x11:
+    case 0x12: case 0x16: case 0x1e: case 0x21: case 0x22: case 0x26:
+    case 0x2e: case 0x31: case 0x32: case 0x47: case 0x4f: case 0x57:
+    case 0x5f: case 0x67: case 0x6f: case 0x77: case 0xe0: case 0xe2:
+    case 0xea:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Walk the GB instructions a block was compiled from and queue everything
+// they can go to
+static void follow_block(struct code_block *block, struct compile_ctx *ctx, u8 bank)
+{
+    static struct jump_table jt;
+    u32 pc = block->src_address;
+    // end_address wraps to 0 for a block that runs up to 0xffff
+    u32 end = block->end_address > pc ? block->end_address : 0x10000;
+    int a = -1;
+    u16 target;
+    u8 op = 0;
+    int len, k;
+
+    while (pc < end) {
+        op = rom_read(NULL, pc);
+        // the opcodes that don't exist are the ones that take no cycles
+        if (!instructions[op].cycles) {
+            return;
+        }
+        len = ir_op_length(op);
+        target = rom_read(NULL, pc + 1) | rom_read(NULL, pc + 2) << 8;
+
+        if (op == 0x18) {
+            target = pc + 2 + (s8) rom_read(NULL, pc + 1);
+        }
+        // the block carries on at the target of a jump it follows, and
+        // what it skipped over might not be code
+        if ((op == 0xc3 || op == 0x18) && target < end
+                && ir_follows_jump(block->src_address, pc - block->src_address, len, target)) {
+            pc = target;
+            continue;
+        }
+
+        switch (op) {
+        case 0xc3: // jp nn
+        case 0xc2: case 0xca: case 0xd2: case 0xda:
+            add_target(target, bank);
+            break;
+        case 0xcd: // call nn
+            // the block carries on with the code the call returns to,
+            // unless this is where it stopped
+            add_target(target, bank);
+            if (pc + 3 >= end) {
+                add_target(pc + 3, bank);
+            }
+            break;
+        case 0xc4: case 0xcc: case 0xd4: case 0xdc:
+            add_target(target, bank);
+            add_target(pc + 3, bank);
+            break;
+        case 0x18: // jr e
+        case 0x20: case 0x28: case 0x30: case 0x38:
+            add_target(pc + 2 + (s8) rom_read(NULL, pc + 1), bank);
+            break;
+        case 0xc7: case 0xcf: case 0xd7: case 0xdf: // rst
+        case 0xe7: case 0xef: case 0xf7: case 0xff:
+            add_target(op & 0x38, bank);
+            // after a jump table helper's rst is the table, not code
+            if (jump_table_match(ctx, op & 0x38, pc + 1, &jt)) {
+                for (k = 0; k < jt.entries; k++) {
+                    add_target(jt.entry[k].target, bank);
+                }
+            } else {
+                add_target(pc + 1, bank);
+            }
+            break;
+        case 0xe9: // jp hl
+            add_unresolved(pc, bank);
+            break;
+        case 0xea: // ld (nn), a
+            if (a >= 0 && target >= 0x2000 && target < 0x4000) {
+                bank = select_bank(a);
+            }
+            break;
+        }
+
+        if (op == 0x3e) {
+            a = rom_read(NULL, pc + 1);
+        } else if (op == 0xaf) {
+            a = 0;
+        } else if (!keeps_a(op)) {
+            a = -1;
+        }
+        pc += len;
+    }
+
+    // blocks that ran out of room chain to the next one
+    if (op != 0xc3 && op != 0x18 && op != 0xc9 && op != 0xd9 && op != 0xe9) {
+        add_target(end, bank);
+    }
+}
+
+static void save_block(struct code_block *block, struct compile_ctx *ctx)
+{
+    static u8 buf[MAX_SERIALIZED_BLOCK];
+    struct saved_block *saved;
+    size_t size;
+    u8 bank;
+
+    if (!block_saved_bank(block, &bank)) {
+        unsaved_blocks++;
+        return;
+    }
+    size = block_serialize(block, ctx, buf, sizeof buf);
+    if (!size) {
+        unsaved_blocks++;
+        return;
+    }
+
+    if (num_blocks == blocks_cap) {
+        blocks_cap = blocks_cap ? blocks_cap * 2 : 1024;
+        blocks = checked_realloc(blocks, blocks_cap * sizeof *blocks);
+    }
+    saved = &blocks[num_blocks++];
+    saved->entry.pc = block->src_address;
+    saved->entry.bank = bank;
+    saved->entry._pad = 0;
+    saved->entry.size = size;
+    saved->data = checked_realloc(NULL, size);
+    memcpy(saved->data, buf, size);
+
+    bank_blocks[bank]++;
+    bank_gb_bytes[bank] += block->end_address - block->src_address;
+    bank_m68k_bytes[bank] += block->length;
+}
+
+static void crawl(struct compile_ctx *ctx)
+{
+    struct code_block *block;
+    struct work_item item;
+    u32 head, key;
+    int k;
+
+    for (head = 0; head < queue_len; head++) {
+        item = queue[head];
+        key = crawl_key(code_bank(item.bank, item.pc), item.pc);
+
+        rom.bank = item.bank;
+        ctx->current_bank = item.bank;
+        block = compile_block(item.pc, ctx);
+        if (!block) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        if (block->error) {
+            failed_blocks++;
+            block_free(block);
+            continue;
+        }
+
+        // bank 0 code is compiled once but followed for every bank
+        if (!compiled[key]) {
+            compiled[key] = 1;
+            save_block(block, ctx);
+            for (k = 0; k < block->num_entries; k++) {
+                compiled[crawl_key(code_bank(item.bank, block->entries[k].src_address),
+                                   block->entries[k].src_address)] = 1;
+            }
+        }
+
+        follow_block(block, ctx, item.bank);
+        block_free(block);
+    }
+}
+
+static int compare_blocks(const void *a, const void *b)
+{
+    const struct saved_block *x = a, *y = b;
+    u32 kx = (u32) x->entry.bank << 16 | x->entry.pc;
+    u32 ky = (u32) y->entry.bank << 16 | y->entry.pc;
+
+    return kx < ky ? -1 : kx > ky;
+}
+
+static void put16(FILE *fp, u16 val)
+{
+    fputc(val >> 8, fp);
+    fputc(val & 0xff, fp);
+}
+
+static void put32(FILE *fp, u32 val)
+{
+    put16(fp, val >> 16);
+    put16(fp, val & 0xffff);
+}
+
+static void write_header(FILE *fp, struct disk_cache_header *header)
+{
+    fwrite(header->magic, 1, 4, fp);
+    put32(fp, header->version);
+    put32(fp, header->compiler_version);
+    fputc(header->header_checksum, fp);
+    fputc(0, fp);
+    put16(fp, header->global_checksum);
+    put32(fp, header->count);
+    put32(fp, header->index_offset);
+}
+
+static int write_image(const char *filename)
+{
+    struct disk_cache_header header;
+    FILE *fp;
+    u32 k;
+
+    fp = fopen(filename, "wb");
+    if (!fp) {
+        perror(filename);
+        return 0;
+    }
+
+    qsort(blocks, num_blocks, sizeof *blocks, compare_blocks);
+
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, "GBJC", 4);
+    header.version = DISK_CACHE_VERSION;
+    header.compiler_version = COMPILER_VERSION;
+    header.header_checksum = rom.data[0x14d];
+    header.global_checksum = rom.data[0x14e] << 8 | rom.data[0x14f];
+    header.count = num_blocks;
+    write_header(fp, &header);
+
+    for (k = 0; k < num_blocks; k++) {
+        blocks[k].entry.offset = ftell(fp);
+        fwrite(blocks[k].data, 1, blocks[k].entry.size, fp);
+    }
+
+    header.index_offset = ftell(fp);
+    for (k = 0; k < num_blocks; k++) {
+        put16(fp, blocks[k].entry.pc);
+        fputc(blocks[k].entry.bank, fp);
+        fputc(0, fp);
+        put32(fp, blocks[k].entry.offset);
+        put32(fp, blocks[k].entry.size);
+    }
+
+    fseek(fp, 0, SEEK_SET);
+    write_header(fp, &header);
+    return !ferror(fp) & !fclose(fp);
+}
+
+static void print_stats(void)
+{
+    u32 total_gb = 0, total_m68k = 0, k;
+
+    printf("%lu blocks saved, %lu failed to compile, %lu cross a bank boundary\n",
+           (unsigned long) num_blocks, (unsigned long) failed_blocks,
+           (unsigned long) unsaved_blocks);
+    printf("bank  blocks  GB bytes  68k bytes\n");
+    for (k = 0; k < MAX_BANKS; k++) {
+        if (!bank_blocks[k]) {
+            continue;
+        }
+        printf("  %02lx  %6lu  %8lu  %9lu\n", (unsigned long) k,
+               (unsigned long) bank_blocks[k], (unsigned long) bank_gb_bytes[k],
+               (unsigned long) bank_m68k_bytes[k]);
+        total_gb += bank_gb_bytes[k];
+        total_m68k += bank_m68k_bytes[k];
+    }
+    printf("total       %8lu  %9lu\n", (unsigned long) total_gb, (unsigned long) total_m68k);
+
+    printf("%lu jumps into RAM not followed\n", (unsigned long) num_ram_targets);
+    printf("%lu unresolved jp (hl)\n", (unsigned long) num_unresolved);
+    for (k = 0; k < num_unresolved && k < MAX_UNRESOLVED; k++) {
+        printf("  %02x:%04x\n", unresolved[k].bank, unresolved[k].pc);
+    }
+}
+
+static void dump_ir(struct compile_ctx *ctx, u16 pc, u8 bank)
+{
+    static struct ir_block ir;
+    const struct ir_pass *pass;
+
+    rom.bank = bank;
+    ctx->current_bank = bank;
+
+    ir_decode(&ir, ctx, pc);
+    printf("%02x:%04x decoded:\n", bank, pc);
+    ir_dump(&ir, stdout);
+    for (pass = ir_passes; pass->name; pass++) {
+        pass->run(&ir, ctx);
+        printf("after %s:\n", pass->name);
+        ir_dump(&ir, stdout);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static const u16 vectors[] = {
+        0x100, // entry point
+        0x00, 0x08, 0x10, 0x18, 0x20, 0x28, 0x30, 0x38, // rst
+        0x40, 0x48, 0x50, 0x58, 0x60 // interrupts
+    };
+    struct compile_ctx ctx;
+    char out_filename[64];
+    char title[17];
+    FILE *fp;
+    char *colon;
+    int arg = 1, dump = 0;
+    unsigned long dump_pc = 0, dump_bank = 1;
+    u32 k;
+
+    if (arg + 1 < argc && !strcmp(argv[arg], "-d")) {
+        colon = strchr(argv[arg + 1], ':');
+        if (colon) {
+            dump_bank = strtoul(argv[arg + 1], NULL, 16);
+            dump_pc = strtoul(colon + 1, NULL, 16);
+        } else {
+            dump_pc = strtoul(argv[arg + 1], NULL, 16);
+        }
+        dump = 1;
+        arg += 2;
+    }
+    if (arg >= argc) {
+        fprintf(stderr, "usage: %s rom.gb [out.jit]\n"
+                        "       %s -d [bank:]address rom.gb\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    fp = fopen(argv[arg], "rb");
+    if (!fp) {
+        perror(argv[arg]);
+        return 1;
+    }
+    fseek(fp, 0, SEEK_END);
+    rom.length = ftell(fp);
+    rewind(fp);
+    if (rom.length < 0x8000) {
+        fprintf(stderr, "%s: too small to be a ROM\n", argv[arg]);
+        return 1;
+    }
+    rom.data = checked_realloc(NULL, rom.length);
+    if (fread(rom.data, 1, rom.length, fp) != rom.length) {
+        perror(argv[arg]);
+        return 1;
+    }
+    fclose(fp);
+
+    rom.num_banks = rom.length / 0x4000;
+    if (rom.num_banks > MAX_BANKS) {
+        rom.num_banks = MAX_BANKS;
+    }
+
+    if (arg + 1 < argc) {
+        snprintf(out_filename, sizeof out_filename, "%s", argv[arg + 1]);
+    } else {
+        // same name the emulator uses, see build_save_filename
+        memcpy(title, &rom.data[0x134], 16);
+        title[16] = '\0';
+        if ((u8) title[15] == 0x80 || (u8) title[15] == 0xc0) {
+            title[11] = '\0';
+        }
+        for (k = strlen(title); k > 0 && title[k - 1] == ' '; k--) {
+            title[k - 1] = '\0';
+        }
+        snprintf(out_filename, sizeof out_filename, "%s.jit", title);
+    }
+
+    crawled = checked_realloc(NULL, MAX_BANKS * 0x8000);
+    compiled = checked_realloc(NULL, MAX_BANKS * 0x8000);
+    memset(crawled, 0, MAX_BANKS * 0x8000);
+    memset(compiled, 0, MAX_BANKS * 0x8000);
+
+    memset(&ctx, 0, sizeof ctx);
+    ctx.read = rom_read;
+    ctx.wram_base = FAKE_WRAM_BASE;
+    ctx.hram_base = FAKE_HRAM_BASE;
+    ctx.vram_base = FAKE_VRAM_BASE;
+    compiler_init();
+
+    if (dump) {
+        dump_ir(&ctx, dump_pc, select_bank(dump_bank));
+        return 0;
+    }
+
+    // bank 1 is mapped after boot
+    for (k = 0; k < sizeof vectors / sizeof vectors[0]; k++) {
+        add_target(vectors[k], 1);
+    }
+    crawl(&ctx);
+
+    print_stats();
+    if (!write_image(out_filename)) {
+        perror(out_filename);
+        return 1;
+    }
+    printf("wrote %s\n", out_filename);
+    return 0;
+}